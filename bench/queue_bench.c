@@ -0,0 +1,450 @@
+//
+// Contention benchmark of the request queue. Producer threads stand in for
+// the I/O threads: each sends a request to one consumer, the database
+// thread, and waits for the answer on a response queue of its own. Reports
+// round trips per second and their p50 and p99 for every mix of queue and
+// producer count asked for.
+//
+// Three queues are compared:
+//   poll    The original two-lock queue, with the consumer and producers
+//           checking it every 10 ms as the server did before queue_get_wait()
+//   locked  The same queue with the condition variable waits that replaced polling
+//   mpsc    The current lock-free queue of inventoryserver/queue.c
+//
+
+#define _GNU_SOURCE
+#include <argp.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include "../inventoryserver/queue.h"
+
+#define DEFAULT_PRODUCERS   "1,4,16"
+#define DEFAULT_QUEUES      "poll,locked,mpsc"
+#define DEFAULT_DURATION    2       // s per run
+#define MAX_RUNS            16
+#define POLL_INTERVAL       10000   // us, how long the server slept between polls
+#define REQUEST             "GET 1"
+#define ANSWER              "SUCCESS\n1\nBoots of Striding\n17\n91\n57\n87\n55\n0.420000\n18\nDESCRIPTION"
+
+/**
+ * The two-lock queue the server used before the MPSC queue, from
+ * https://github.com/majek/dump/blob/master/msqueue/queue_lock_mutex.c,
+ * with the condition variable that queue_get_wait() added to it.
+ * Messages are allocated and their operation copied every time.
+ */
+struct locked_head {
+    struct locked_head *next;
+    char *operation;
+    struct locked_root *response_queue;
+};
+
+struct locked_root {
+    struct locked_head *head;
+    pthread_mutex_t head_lock;
+
+    struct locked_head *tail;
+    pthread_mutex_t tail_lock;
+
+    struct locked_head divider;
+
+    pthread_mutex_t wait_lock;
+    pthread_cond_t not_empty;
+};
+
+/**
+ * One of the queues compared, seen from the consumer and the producers.
+ */
+struct bench_queue {
+    const char *name;
+    void *(*create)();
+    void (*send)(void *queue, const char *operation, void *reply);      // reply NULL stops the consumer
+    int (*serve)(void *queue);      // Answers one request, 0 once asked to stop
+    void (*receive)(void *queue);   // Waits for an answer and frees it
+};
+
+struct producer {
+    const struct bench_queue *queue;
+    void *requests;
+    void *responses;
+    atomic_int *stop;
+    uint64_t *latencies;            // ns
+    size_t count;
+    size_t size;
+};
+
+struct Arguments {
+    char *queues;
+    char *producers;
+    double duration;
+};
+
+static error_t parse_args(int key, char *arg, struct argp_state *state);
+static int parse_list(const char *list, int *values, int max);
+static void run(const struct bench_queue *queue, int producers, double duration);
+static void *consumer_thread(void *data);
+static void *producer_thread(void *data);
+static int compare_latencies(const void *a, const void *b);
+static uint64_t now_ns();
+
+static struct locked_root *locked_create();
+static void locked_append(struct locked_head *new, struct locked_root *root);
+static void locked_put(struct locked_head *new, struct locked_root *root);
+static struct locked_head *locked_get(struct locked_root *root);
+static struct locked_head *locked_get_wait(struct locked_root *root);
+static void locked_free(struct locked_head *msg);
+
+static void *locked_queue_create();
+static void locked_queue_send(void *queue, const char *operation, void *reply);
+static int poll_serve(void *queue);
+static void poll_receive(void *queue);
+static int locked_serve(void *queue);
+static void locked_receive(void *queue);
+static void *mpsc_create();
+static void mpsc_send(void *queue, const char *operation, void *reply);
+static int mpsc_serve(void *queue);
+static void mpsc_receive(void *queue);
+
+static const struct bench_queue bench_queues[] = {
+        {"poll", locked_queue_create, locked_queue_send, poll_serve, poll_receive},
+        {"locked", locked_queue_create, locked_queue_send, locked_serve, locked_receive},
+        {"mpsc", mpsc_create, mpsc_send, mpsc_serve, mpsc_receive},
+};
+#define BENCH_QUEUE_COUNT (sizeof(bench_queues) / sizeof(bench_queues[0]))
+
+static struct argp_option options[] = {
+        {"queues", 'q', "<name,...>", 0, "Queues to compare, of poll, locked and mpsc. Default: " DEFAULT_QUEUES},
+        {"producers", 'p', "<n,...>", 0, "Producer thread counts to run each queue with. Default: " DEFAULT_PRODUCERS},
+        {"duration", 'd', "<s>", 0, "Seconds each run lasts. Default: 2"},
+        {0}
+};
+
+static struct argp argp = {options, parse_args, 0, "Measures round trips through the request queue under contention."};
+
+int main(int argc, char *argv[]){
+    struct Arguments arguments = {DEFAULT_QUEUES, DEFAULT_PRODUCERS, DEFAULT_DURATION};
+    int producers[MAX_RUNS];
+
+    argp_parse(&argp, argc, argv, 0, 0, &arguments);
+
+    int producer_runs = parse_list(arguments.producers, producers, MAX_RUNS);
+    if(producer_runs <= 0){
+        fprintf(stderr, "Queue bench: Invalid producer counts %s\n", arguments.producers);
+        return 1;
+    }
+
+    printf("%-8s %10s %15s %12s %12s\n", "queue", "producers", "round trips/s", "p50 us", "p99 us");
+    char *queues = strdup(arguments.queues);
+    for(char *name = strtok(queues, ","); name != NULL; name = strtok(NULL, ",")){
+        const struct bench_queue *queue = NULL;
+        for(size_t i = 0; i < BENCH_QUEUE_COUNT; i++)
+            if(strcmp(bench_queues[i].name, name) == 0)
+                queue = &bench_queues[i];
+        if(queue == NULL){
+            fprintf(stderr, "Queue bench: Unknown queue %s\n", name);
+            free(queues);
+            return 1;
+        }
+
+        for(int i = 0; i < producer_runs; i++)
+            run(queue, producers[i], arguments.duration);
+    }
+    free(queues);
+    return 0;
+}
+
+static error_t parse_args(int key, char *arg, struct argp_state *state){
+    struct Arguments *arguments = state->input;
+    char *end;
+
+    switch(key){
+        case 'q':
+            arguments->queues = arg;
+            break;
+        case 'p':
+            arguments->producers = arg;
+            break;
+        case 'd':
+            arguments->duration = strtod(arg, &end);
+            if(*end != '\0' || arguments->duration <= 0)
+                argp_error(state, "Invalid duration %s", arg);
+            break;
+        default:
+            return ARGP_ERR_UNKNOWN;
+    }
+    return 0;
+}
+
+/**
+ * Parses a comma separated list of positive numbers.
+ * @param list
+ * @param values Receives the numbers
+ * @param max Most numbers kept
+ * @return How many numbers were parsed, -1 on error
+ */
+static int parse_list(const char *list, int *values, int max){
+    int count = 0;
+    const char *cursor = list;
+
+    while(*cursor != '\0'){
+        char *end;
+        long value = strtol(cursor, &end, 10);
+        if(end == cursor || value <= 0 || value > 1024 || count == max || (*end != ',' && *end != '\0'))
+            return -1;
+        values[count++] = (int)value;
+        cursor = *end == ',' ? end + 1 : end;
+    }
+    return count;
+}
+
+/**
+ * Runs one queue with a number of producers for a duration and prints its line.
+ * @param queue
+ * @param producers
+ * @param duration s
+ */
+static void run(const struct bench_queue *queue, int producers, double duration){
+    atomic_int stop = 0;
+    void *requests = queue->create();
+    struct producer *states = calloc(producers, sizeof(struct producer));
+    pthread_t *threads = calloc(producers, sizeof(pthread_t));
+    struct producer server = {queue, requests};
+    pthread_t consumer;
+
+    pthread_create(&consumer, NULL, consumer_thread, &server);
+
+    uint64_t started = now_ns();
+    for(int i = 0; i < producers; i++){
+        states[i].queue = queue;
+        states[i].requests = requests;
+        states[i].responses = queue->create();
+        states[i].stop = &stop;
+        pthread_create(&threads[i], NULL, producer_thread, &states[i]);
+    }
+
+    struct timespec wait = {(time_t)duration, (long)((duration - (double)(time_t)duration) * 1e9)};
+    while(nanosleep(&wait, &wait) != 0 && errno == EINTR);
+    atomic_store(&stop, 1);
+
+    size_t total = 0;
+    for(int i = 0; i < producers; i++){
+        pthread_join(threads[i], NULL);
+        total += states[i].count;
+    }
+    double elapsed = (double)(now_ns() - started) / 1e9;
+
+    // Every producer is done, so nothing else is waiting for the consumer
+    queue->send(requests, "TERM", NULL);
+    pthread_join(consumer, NULL);
+
+    uint64_t *latencies = malloc((total > 0 ? total : 1) * sizeof(uint64_t));
+    size_t merged = 0;
+    for(int i = 0; i < producers; i++){
+        memcpy(latencies + merged, states[i].latencies, states[i].count * sizeof(uint64_t));
+        merged += states[i].count;
+        free(states[i].latencies);
+    }
+    qsort(latencies, total, sizeof(uint64_t), compare_latencies);
+
+    double p50 = total > 0 ? (double)latencies[total / 2] / 1e3 : 0;
+    double p99 = total > 0 ? (double)latencies[total * 99 / 100] / 1e3 : 0;
+    printf("%-8s %10d %15.0f %12.1f %12.1f\n", queue->name, producers, (double)total / elapsed, p50, p99);
+    fflush(stdout);
+
+    free(latencies);
+    free(states);
+    free(threads);
+}
+
+/**
+ * The database thread, answering every request until it is asked to stop.
+ * @param data struct producer, only its queue and requests are used
+ * @return NULL
+ */
+static void *consumer_thread(void *data){
+    const struct producer *state = data;
+
+    while(state->queue->serve(state->requests));
+    return NULL;
+}
+
+/**
+ * An I/O thread, sending one request at a time until told to stop.
+ * @param data struct producer
+ * @return NULL
+ */
+static void *producer_thread(void *data){
+    struct producer *state = data;
+
+    while(!atomic_load_explicit(state->stop, memory_order_relaxed)){
+        uint64_t sent = now_ns();
+        state->queue->send(state->requests, REQUEST, state->responses);
+        state->queue->receive(state->responses);
+
+        if(state->count == state->size){
+            state->size = state->size > 0 ? state->size * 2 : 4096;
+            state->latencies = realloc(state->latencies, state->size * sizeof(uint64_t));
+        }
+        state->latencies[state->count++] = now_ns() - sent;
+    }
+    return NULL;
+}
+
+static int compare_latencies(const void *a, const void *b){
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+static uint64_t now_ns(){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
+
+static struct locked_root *locked_create(){
+    struct locked_root *root = malloc(sizeof(struct locked_root));
+    pthread_mutex_init(&root->head_lock, NULL);
+    pthread_mutex_init(&root->tail_lock, NULL);
+    pthread_mutex_init(&root->wait_lock, NULL);
+    pthread_cond_init(&root->not_empty, NULL);
+
+    root->divider.next = NULL;
+    root->head = &root->divider;
+    root->tail = &root->divider;
+    return root;
+}
+
+static void locked_append(struct locked_head *new, struct locked_root *root){
+    new->next = NULL;
+
+    pthread_mutex_lock(&root->tail_lock);
+    root->tail->next = new;
+    root->tail = new;
+    pthread_mutex_unlock(&root->tail_lock);
+}
+
+static void locked_put(struct locked_head *new, struct locked_root *root){
+    locked_append(new, root);
+
+    pthread_mutex_lock(&root->wait_lock);
+    pthread_cond_signal(&root->not_empty);
+    pthread_mutex_unlock(&root->wait_lock);
+}
+
+static struct locked_head *locked_get(struct locked_root *root){
+    struct locked_head *head, *next;
+
+    while(1){
+        pthread_mutex_lock(&root->head_lock);
+        head = root->head;
+        next = head->next;
+        if(next == NULL){
+            pthread_mutex_unlock(&root->head_lock);
+            return NULL;
+        }
+        root->head = next;
+        pthread_mutex_unlock(&root->head_lock);
+
+        if(head == &root->divider){
+            locked_append(head, root);
+            continue;
+        }
+        return head;
+    }
+}
+
+static struct locked_head *locked_get_wait(struct locked_root *root){
+    struct locked_head *head;
+
+    pthread_mutex_lock(&root->wait_lock);
+    while((head = locked_get(root)) == NULL)
+        pthread_cond_wait(&root->not_empty, &root->wait_lock);
+    pthread_mutex_unlock(&root->wait_lock);
+    return head;
+}
+
+static void locked_free(struct locked_head *msg){
+    free(msg->operation);
+    free(msg);
+}
+
+static void *locked_queue_create(){
+    return locked_create();
+}
+
+static void locked_queue_send(void *queue, const char *operation, void *reply){
+    struct locked_head *msg = malloc(sizeof(struct locked_head));
+    msg->operation = strdup(operation);
+    msg->response_queue = reply;
+    locked_put(msg, queue);
+}
+
+/**
+ * Answers a request on the locked queue's reply queue.
+ * @param msg
+ * @return 0 if it was the stop request
+ */
+static int locked_answer(struct locked_head *msg){
+    int more = msg->response_queue != NULL;
+
+    if(more)
+        locked_queue_send(msg->response_queue, ANSWER, NULL);
+    locked_free(msg);
+    return more;
+}
+
+static int poll_serve(void *queue){
+    // The database thread slept after every poll, whether it found a request or not
+    struct locked_head *msg = locked_get(queue);
+    int more = msg == NULL || locked_answer(msg);
+
+    usleep(POLL_INTERVAL);
+    return more;
+}
+
+static void poll_receive(void *queue){
+    struct locked_head *msg;
+
+    while((msg = locked_get(queue)) == NULL)
+        usleep(POLL_INTERVAL);
+    locked_free(msg);
+}
+
+static int locked_serve(void *queue){
+    return locked_answer(locked_get_wait(queue));
+}
+
+static void locked_receive(void *queue){
+    locked_free(locked_get_wait(queue));
+}
+
+static void *mpsc_create(){
+    return ALLOC_QUEUE_ROOT();
+}
+
+static void mpsc_send(void *queue, const char *operation, void *reply){
+    struct queue_head *msg = alloc_queue_message();
+    INIT_QUEUE_HEAD(msg, (char*)operation, reply);
+    queue_put(msg, queue);
+}
+
+static int mpsc_serve(void *queue){
+    struct queue_head *msg = queue_get_wait(queue);
+    int more = msg->response_queue != NULL;
+    struct queue_head *response = alloc_queue_message();
+
+    INIT_QUEUE_HEAD(response, ANSWER, NULL);
+    send_response(msg, response);
+    return more;
+}
+
+static void mpsc_receive(void *queue){
+    free_queue_message(queue_get_wait(queue));
+}
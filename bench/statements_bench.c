@@ -0,0 +1,245 @@
+//
+// CRUD microbenchmark of the database thread's statements. Every statement is
+// run the way the server used to, prepared, stepped and finalized per call,
+// and the way it does now, taken from the db_statements cache and reset.
+// Both use the same SQL, read back from the cached statements.
+//
+// Everything runs in one transaction that is rolled back at the end, so the
+// database is left as it was and the numbers aren't dominated by fsync.
+//
+
+#define _GNU_SOURCE
+#include <argp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <sqlite3.h>
+
+#include "../inventoryserver/statements.h"
+
+#define DEFAULT_DATABASE    "items.db"
+#define DEFAULT_CALLS       20000
+
+struct bench_state {
+    int *items;             // Ids of the items in the database
+    int item_count;
+    sqlite3_int64 *inserted;    // Ids of the items inserted, deleted again by the delete bench
+    int inserted_count;
+    int deleted_count;
+    char user[BUFFER_SIZE];
+};
+
+/**
+ * One statement of the benchmark and how to bind its parameters for a call.
+ */
+struct bench_op {
+    const char *name;
+    int which;              // STMT_ constant
+    void (*bind)(sqlite3_stmt *stmt, struct bench_state *state, int call);
+};
+
+struct Arguments {
+    char *database;
+    int calls;
+};
+
+static error_t parse_args(int key, char *arg, struct argp_state *state);
+static int load_state(sqlite3 *db, struct bench_state *state, int calls);
+static double run(struct db_statements *cache, const struct bench_op *op, struct bench_state *state,
+                  int calls, int cached);
+static void bind_get(sqlite3_stmt *stmt, struct bench_state *state, int call);
+static void bind_item(sqlite3_stmt *stmt, struct bench_state *state, int call);
+static void bind_update(sqlite3_stmt *stmt, struct bench_state *state, int call);
+static void bind_delete(sqlite3_stmt *stmt, struct bench_state *state, int call);
+static void bind_user(sqlite3_stmt *stmt, struct bench_state *state, int call);
+static uint64_t now_ns();
+
+// Inserts run before deletes, which remove what they added
+static const struct bench_op bench_ops[] = {
+        {"get", STMT_GET_ITEM, bind_get},
+        {"update", STMT_UPDATE_ITEM, bind_update},
+        {"insert", STMT_INSERT_ITEM, bind_item},
+        {"delete", STMT_DELETE_ITEM, bind_delete},
+        {"user lookup", STMT_USER_PASSWORD, bind_user},
+};
+#define BENCH_OP_COUNT (sizeof(bench_ops) / sizeof(bench_ops[0]))
+
+static struct argp_option options[] = {
+        {"database", 'd', "<filename>", 0, "Database to run against, left unchanged. Default: " DEFAULT_DATABASE},
+        {"calls", 'n', "<n>", 0, "Calls of each statement, each way. Default: 20000"},
+        {0}
+};
+
+static struct argp argp = {options, parse_args, 0, "Times the server's statements prepared per call and cached."};
+
+int main(int argc, char *argv[]){
+    struct Arguments arguments = {DEFAULT_DATABASE, DEFAULT_CALLS};
+    struct db_statements cache;
+    struct bench_state state = {0};
+    sqlite3 *db = NULL;
+
+    argp_parse(&argp, argc, argv, 0, 0, &arguments);
+
+    if(sqlite3_open_v2(arguments.database, &db, SQLITE_OPEN_READWRITE, NULL) != SQLITE_OK){
+        fprintf(stderr, "Statements bench: Cannot open %s: %s\n", arguments.database, sqlite3_errmsg(db));
+        sqlite3_close(db);
+        return 1;
+    }
+    sqlite3_busy_timeout(db, DB_BUSY_TIMEOUT);
+
+    // Run the server on an older database once first, it adds the version column and tombstones
+    if(db_statements_init(&cache, db) != SQLITE_OK || load_state(db, &state, arguments.calls) != 0
+       || sqlite3_exec(db, "BEGIN IMMEDIATE", NULL, NULL, NULL) != SQLITE_OK){
+        fprintf(stderr, "Statements bench: Cannot use %s: %s\n", arguments.database, sqlite3_errmsg(db));
+        db_statements_finalize(&cache);
+        sqlite3_close(db);
+        return 1;
+    }
+
+    printf("%-12s %8s %14s %12s %8s\n", "statement", "calls", "prepared us", "cached us", "speedup");
+    for(size_t i = 0; i < BENCH_OP_COUNT; i++){
+        double prepared = run(&cache, &bench_ops[i], &state, arguments.calls, 0);
+        double cached = run(&cache, &bench_ops[i], &state, arguments.calls, 1);
+        printf("%-12s %8d %14.2f %12.2f %7.1fx\n", bench_ops[i].name, arguments.calls, prepared, cached,
+               cached > 0 ? prepared / cached : 0);
+    }
+
+    sqlite3_exec(db, "ROLLBACK", NULL, NULL, NULL);
+    db_statements_finalize(&cache);
+    sqlite3_close(db);
+    free(state.items);
+    free(state.inserted);
+    return 0;
+}
+
+static error_t parse_args(int key, char *arg, struct argp_state *state){
+    struct Arguments *arguments = state->input;
+    char *end;
+
+    switch(key){
+        case 'd':
+            arguments->database = arg;
+            break;
+        case 'n':
+            arguments->calls = (int)strtol(arg, &end, 10);
+            if(*end != '\0' || arguments->calls <= 0 || arguments->calls > 10000000)
+                argp_error(state, "Invalid number of calls %s", arg);
+            break;
+        default:
+            return ARGP_ERR_UNKNOWN;
+    }
+    return 0;
+}
+
+/**
+ * Reads the item ids and a user name the statements are run with.
+ * @param db
+ * @param state
+ * @param calls Inserts to make room for, both ways
+ * @return 0 on success, -1 if the database has no items
+ */
+static int load_state(sqlite3 *db, struct bench_state *state, int calls){
+    sqlite3_stmt *stmt = NULL;
+    int size = 0;
+
+    if(sqlite3_prepare_v2(db, "SELECT id FROM items", -1, &stmt, NULL) != SQLITE_OK)
+        return -1;
+    while(sqlite3_step(stmt) == SQLITE_ROW){
+        if(state->item_count == size){
+            size = size > 0 ? size * 2 : 1024;
+            state->items = realloc(state->items, size * sizeof(int));
+        }
+        state->items[state->item_count++] = sqlite3_column_int(stmt, 0);
+    }
+    sqlite3_finalize(stmt);
+
+    // An unknown user costs the same lookup
+    strcpy(state->user, "nobody");
+    if(sqlite3_prepare_v2(db, "SELECT username FROM users LIMIT 1", -1, &stmt, NULL) == SQLITE_OK
+       && sqlite3_step(stmt) == SQLITE_ROW)
+        snprintf(state->user, sizeof(state->user), "%s", (const char*)sqlite3_column_text(stmt, 0));
+    sqlite3_finalize(stmt);
+
+    state->inserted = malloc(2 * (size_t)calls * sizeof(sqlite3_int64));
+    return state->item_count > 0 && state->inserted != NULL ? 0 : -1;
+}
+
+/**
+ * Times calls of one statement.
+ * @param cache
+ * @param op
+ * @param state
+ * @param calls
+ * @param cached Take the statement from the cache rather than preparing it every call
+ * @return us per call
+ */
+static double run(struct db_statements *cache, const struct bench_op *op, struct bench_state *state,
+                  int calls, int cached){
+    const char *sql = sqlite3_sql(db_statement(cache, op->which));
+    uint64_t started = now_ns();
+
+    for(int call = 0; call < calls; call++){
+        sqlite3_stmt *stmt;
+        if(cached)
+            stmt = db_statement(cache, op->which);
+        else if(sqlite3_prepare_v2(cache->db, sql, -1, &stmt, NULL) != SQLITE_OK)
+            stmt = NULL;
+        if(stmt == NULL){
+            fprintf(stderr, "Statements bench: Cannot prepare %s: %s\n", op->name, sqlite3_errmsg(cache->db));
+            exit(1);
+        }
+
+        op->bind(stmt, state, call);
+        while(sqlite3_step(stmt) == SQLITE_ROW);
+        if(op->which == STMT_INSERT_ITEM)
+            state->inserted[state->inserted_count++] = sqlite3_last_insert_rowid(cache->db);
+
+        if(cached)
+            sqlite3_reset(stmt);
+        else
+            sqlite3_finalize(stmt);
+    }
+    return (double)(now_ns() - started) / 1e3 / calls;
+}
+
+static void bind_get(sqlite3_stmt *stmt, struct bench_state *state, int call){
+    sqlite3_bind_int(stmt, 1, state->items[(call * 7919) % state->item_count]);
+}
+
+/**
+ * Binds the fields of an item, in the order of the INSERT and UPDATE statements.
+ */
+static void bind_item(sqlite3_stmt *stmt, struct bench_state *state, int call){
+    sqlite3_bind_text(stmt, 1, "Boots of Striding", -1, NULL);
+    sqlite3_bind_int(stmt, 2, call % 100);
+    sqlite3_bind_int(stmt, 3, 91);
+    sqlite3_bind_int(stmt, 4, 57);
+    sqlite3_bind_int(stmt, 5, 87);
+    sqlite3_bind_int(stmt, 6, 55);
+    sqlite3_bind_double(stmt, 7, 0.42);
+    sqlite3_bind_int(stmt, 8, 18);
+    sqlite3_bind_text(stmt, 9, "DESCRIPTION", -1, NULL);
+    sqlite3_bind_int64(stmt, 10, 1);
+}
+
+static void bind_update(sqlite3_stmt *stmt, struct bench_state *state, int call){
+    bind_item(stmt, state, call);
+    sqlite3_bind_int(stmt, 11, state->items[(call * 7919) % state->item_count]);
+}
+
+static void bind_delete(sqlite3_stmt *stmt, struct bench_state *state, int call){
+    // The prepared run deletes the first half of what was inserted, the cached run the second
+    sqlite3_bind_int64(stmt, 1, state->inserted[state->deleted_count++]);
+}
+
+static void bind_user(sqlite3_stmt *stmt, struct bench_state *state, int call){
+    sqlite3_bind_text(stmt, 1, state->user, -1, NULL);
+}
+
+static uint64_t now_ns(){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
@@ -0,0 +1,41 @@
+/**
+ * Documentation for the below functions is available in "buckets.h"
+ */
+#include "buckets.h"
+
+int bucket_index(uint64_t value){
+    if(value >= (1ull << BUCKET_MAX_BITS))
+        value = (1ull << BUCKET_MAX_BITS) - 1;
+    if(value < (1ull << BUCKET_SUB_BITS))
+        return (int)value;
+
+    int shift = 63 - __builtin_clzll(value) - BUCKET_SUB_BITS;
+    return (shift << BUCKET_SUB_BITS) + (int)(value >> shift);
+}
+
+uint64_t bucket_end(int index){
+    if(index < (1 << BUCKET_SUB_BITS))
+        return (uint64_t)index + 1;
+
+    int shift = (index >> BUCKET_SUB_BITS) - 1;
+    uint64_t sub = (uint64_t)(index & ((1 << BUCKET_SUB_BITS) - 1)) + (1 << BUCKET_SUB_BITS);
+    return (sub + 1) << shift;
+}
+
+uint64_t bucket_percentile(const uint64_t *buckets, uint64_t total, uint64_t max, double quantile){
+    uint64_t rank = (uint64_t)(quantile * (double)total + 0.5);
+    uint64_t seen = 0;
+
+    if(total == 0)
+        return 0;
+    if(rank == 0)
+        rank = 1;
+    for(int i = 0; i < BUCKET_COUNT; i++){
+        seen += buckets[i];
+        if(seen >= rank){
+            uint64_t value = bucket_end(i) - 1;
+            return value < max ? value : max;
+        }
+    }
+    return max;
+}
@@ -0,0 +1,46 @@
+#ifndef CS469_PROJECT_BUCKETS_H
+#define CS469_PROJECT_BUCKETS_H
+
+#include <stdint.h>
+
+/**
+ * Log-linear, HDR style latency buckets shared by the server's metrics and the
+ * load generator, so their percentiles can be compared one for one.
+ *
+ * Values below 2^BUCKET_SUB_BITS get a bucket each, above that every power of
+ * two is split into 2^BUCKET_SUB_BITS buckets, so any value is kept within 1/16
+ * of its size, from 1 us up to about 19 hours.
+ */
+
+#define BUCKET_SUB_BITS   4
+#define BUCKET_MAX_BITS   36     // Values are clamped below 2^36 us
+#define BUCKET_COUNT      ((BUCKET_MAX_BITS - BUCKET_SUB_BITS + 1) << BUCKET_SUB_BITS)
+
+/**
+ * Finds the bucket of a value.
+ *
+ * @param value us
+ * @return index into BUCKET_COUNT buckets
+ */
+int bucket_index(uint64_t value);
+
+/**
+ * The smallest value above a bucket.
+ *
+ * @param index
+ * @return us
+ */
+uint64_t bucket_end(int index);
+
+/**
+ * The value below which a share of the values fall, to the resolution of the buckets.
+ *
+ * @param buckets BUCKET_COUNT counts
+ * @param total Sum of the counts
+ * @param max Largest value recorded, the answer never exceeds it
+ * @param quantile Between 0 and 1
+ * @return us, 0 if there are no values
+ */
+uint64_t bucket_percentile(const uint64_t *buckets, uint64_t total, uint64_t max, double quantile);
+
+#endif //CS469_PROJECT_BUCKETS_H
@@ -40,7 +40,10 @@ G_MODULE_EXPORT void login(GtkWidget *widget, gpointer arg){
     bzero(serverAddress, BUFFER_SIZE);
     sprintf(serverAddress, "AUTH %s %s", usernameBuffer, passwordBuffer);
 
-    if(SSL_write(ssl, serverAddress, strlen(serverAddress)) <= 0){
+    // Offer the newest protocol version we speak, the server answers with the one to use
+    protocol_version = PROTOCOL_VERSION;
+    int request_id = send_frame(ssl, serverAddress, strlen(serverAddress));
+    if(request_id < 0){
         fprintf(stderr, "Error writing to server: %s\n", strerror(errno));
         // need to create popup dialog here
         GtkWidget *dialog = gtk_message_dialog_new(GTK_WINDOW(loginWindow), GTK_DIALOG_DESTROY_WITH_PARENT,
@@ -51,14 +54,16 @@ G_MODULE_EXPORT void login(GtkWidget *widget, gpointer arg){
         return;
     }
 
-    bzero(serverAddress, BUFFER_SIZE);
-    if(SSL_read(ssl, serverAddress, BUFFER_SIZE) <= 0){
+    FrameHeader header;
+    char *response = recv_response(ssl, request_id, &header);
+    if(response == NULL){
         fprintf(stderr, "Error reading from server: %s\n", strerror(errno));
         disconnect();
         exit(-1);
     }
 
-    if(strcmp("FAILURE", serverAddress) == 0){
+    if(strcmp("FAILURE", response) == 0){
+        free(response);
         GtkWidget *dialog = gtk_message_dialog_new(GTK_WINDOW(loginWindow),
                                                    GTK_DIALOG_DESTROY_WITH_PARENT,
                                                     GTK_MESSAGE_ERROR,
@@ -69,6 +74,8 @@ G_MODULE_EXPORT void login(GtkWidget *widget, gpointer arg){
         disconnect();
         return;
     }
+    free(response);
+    protocol_version = header.version;
 
     g_signal_handler_disconnect(loginWindow, destroyHandler);
 
@@ -37,6 +37,23 @@ GtkTreeSelection *selection;
 GtkTreeIter selectedIter;
 GtkTreeModel *itemModel;
 struct editItemWidget *itemEditor;
+GtkEntryCompletion *nameCompletion;
+GtkListStore *nameCompletionStore;
+GHashTable *itemRows;           // Item id to its GtkTreeIter in itemListStore
+gboolean watching = FALSE;      // The server pushes changes, no need to reload after a write
+
+#define NAME_COMPLETIONS 10     // Names offered while typing in the item editor
+
+/**
+ * Rows the editor was opened on when more than one item is selected. Saving
+ * applies only the fields changed from the baseline to each of them.
+ */
+struct bulkEditState {
+    Item *items;
+    int count;
+    Item baseline;
+};
+struct bulkEditState bulkEdit = {NULL, 0};
 
 /**
  * ENUM used for assigning columns for the treeview
@@ -99,19 +116,10 @@ void cancelItemEdit(GtkWidget* widget, gpointer data){
 }
 
 /**
- * Signal handler for pressing the save button in the item editor
- *
- * This will either create a PUT or a MOD request depending on if
- * we are editing an item or creating a new one.
- *
- * @param widget
- * @param data
+ * Reads the current values of the item editor's fields
+ * @param item - filled in from the editor
  */
-void saveItemEdit(GtkWidget* widget, gpointer data){
-    gtk_widget_hide(GTK_WIDGET(data));
-
-    // Get data from all relevant fields
-    Item *item = (Item*)malloc(sizeof(Item));
+void read_item_editor(Item *item){
     bzero(item->name, BUFFER_SIZE);
     bzero(item->description, BUFFER_SIZE);
 
@@ -125,6 +133,141 @@ void saveItemEdit(GtkWidget* widget, gpointer data){
     item->critChance = gtk_spin_button_get_value(itemEditor->itemCrit);
     item->range = (int)gtk_spin_button_get_value(itemEditor->itemRange);
     snprintf(item->description, BUFFER_SIZE, "%s", (char*)gtk_entry_get_text(itemEditor->itemDescription));
+}
+
+/**
+ * Forgets the rows of a previous multi-item edit
+ */
+void clear_bulk_edit(){
+    free(bulkEdit.items);
+    bulkEdit.items = NULL;
+    bulkEdit.count = 0;
+}
+
+/**
+ * Copies every selected row of the item table into an array of items
+ * @param items - set to the array, to be freed by the caller
+ * @return number of selected items
+ */
+int get_selected_items(Item **items){
+    GList *rows = gtk_tree_selection_get_selected_rows(selection, &itemModel);
+    int count = 0;
+
+    *items = (Item*)calloc(g_list_length(rows) + 1, sizeof(Item));
+
+    for(GList *row = rows; row != NULL; row = row->next){
+        GtkTreeIter iter;
+        gchar *name = NULL;
+        gchar *desc = NULL;
+        Item *item = &(*items)[count];
+
+        if(!gtk_tree_model_get_iter(itemModel, &iter, (GtkTreePath*)row->data))
+            continue;
+
+        gtk_tree_model_get(itemModel, &iter,
+                ID, &item->id,
+                NAME, &name,
+                ARMOR, &item->armor,
+                HEALTH, &item->health,
+                MANA, &item->mana,
+                SELL_PRICE, &item->sellPrice,
+                DAMAGE, &item->damage,
+                CRIT_CHANCE, &item->critChance,
+                RANGE, &item->range,
+                DESCRIPTION, &desc,
+                -1);
+        snprintf(item->name, BUFFER_SIZE, "%s", name ? name : "");
+        snprintf(item->description, BUFFER_SIZE, "%s", desc ? desc : "");
+        g_free(name);
+        g_free(desc);
+        count++;
+    }
+
+    g_list_free_full(rows, (GDestroyNotify)gtk_tree_path_free);
+    return count;
+}
+
+/**
+ * Applies the fields changed in the editor to every item of a multi-item
+ * edit and saves them all with one MMOD request, which the server runs as a
+ * single transaction.
+ */
+void saveBulkEdit(){
+    Item edited;
+    read_item_editor(&edited);
+    Item *base = &bulkEdit.baseline;
+
+    char *msg = NULL;
+    size_t msgSize = 0;
+    FILE *out = open_memstream(&msg, &msgSize);
+    fprintf(out, "MMOD ");
+
+    for(int i = 0; i < bulkEdit.count; i++){
+        Item *item = &bulkEdit.items[i];
+
+        if(strcmp(edited.name, base->name) != 0)
+            snprintf(item->name, BUFFER_SIZE, "%s", edited.name);
+        if(edited.armor != base->armor)
+            item->armor = edited.armor;
+        if(edited.health != base->health)
+            item->health = edited.health;
+        if(edited.mana != base->mana)
+            item->mana = edited.mana;
+        if(edited.sellPrice != base->sellPrice)
+            item->sellPrice = edited.sellPrice;
+        if(edited.damage != base->damage)
+            item->damage = edited.damage;
+        if(edited.critChance != base->critChance)
+            item->critChance = edited.critChance;
+        if(edited.range != base->range)
+            item->range = edited.range;
+        if(strcmp(edited.description, base->description) != 0)
+            snprintf(item->description, BUFFER_SIZE, "%s", edited.description);
+
+        char *serialized_item = NULL;
+        serialized_item = serialize_item(item, serialized_item);
+        fputs(serialized_item, out);
+        free(serialized_item);
+    }
+    fclose(out);
+    clear_bulk_edit();
+
+    int request_id = send_frame(ssl, msg, msgSize);
+    if(request_id < 0){
+        display_error_dialog("Error communicating with server");
+    }
+    free(msg);
+
+    char *response = recv_response(ssl, request_id, NULL);
+    if(response == NULL || strcmp(response, "FAILURE") == 0){
+        display_error_dialog("Unable to update items in database");
+    }else if(!watching){
+        get_all_items_from_database();
+    }
+    free(response);
+}
+
+/**
+ * Signal handler for pressing the save button in the item editor
+ *
+ * This will either create a PUT or a MOD request depending on if
+ * we are editing an item or creating a new one, or an MMOD request
+ * when several items were selected.
+ *
+ * @param widget
+ * @param data
+ */
+void saveItemEdit(GtkWidget* widget, gpointer data){
+    gtk_widget_hide(GTK_WIDGET(data));
+
+    if(bulkEdit.count > 1){
+        saveBulkEdit();
+        return;
+    }
+
+    // Get data from all relevant fields
+    Item *item = (Item*)malloc(sizeof(Item));
+    read_item_editor(item);
 
     char* serialized_item = NULL;
     serialized_item = serialize_item(item, serialized_item);
@@ -137,7 +280,8 @@ void saveItemEdit(GtkWidget* widget, gpointer data){
     }
 
     strcat(msg, serialized_item);
-    if(SSL_write(ssl, msg, strlen(msg)) < 0){
+    int request_id = send_frame(ssl, msg, strlen(msg));
+    if(request_id < 0){
         display_error_dialog("Error communicating with server");
     }
 
@@ -145,50 +289,107 @@ void saveItemEdit(GtkWidget* widget, gpointer data){
     free(msg);
     free(serialized_item);
 
-    char response[BUFFER_SIZE] = {0};
-    SSL_read(ssl, response, BUFFER_SIZE);
-    if(strcmp(response, "FAILURE") == 0){
+    char *response = recv_response(ssl, request_id, NULL);
+    if(response == NULL || strcmp(response, "FAILURE") == 0){
         display_error_dialog("Unable to add to database");
-    }else{
+    }else if(!watching){
         get_all_items_from_database();
     }
+    free(response);
 }
 
 /**
- * Creates a delete request for the currently selected item.
+ * Creates a delete request for the currently selected items.
  * Will display a confirmation dialog to ensure user decision
  * @param widget
  * @param user_data
  */
 void deleteItemHandler(GtkWidget* widget, gpointer user_data){
 
-    int id = -1;
-    if(gtk_tree_selection_get_selected(selection, &itemModel, &selectedIter)) {
-        gtk_tree_model_get(itemModel, &selectedIter,
-                           ID, &id, -1);
+    Item *items;
+    int count = get_selected_items(&items);
+    if(count == 0){
+        free(items);
+        return;
     }
 
-    char* msg1 = (char*)malloc(sizeof(char)*BUFFER_SIZE);
-    sprintf(msg1, "Are you sure you want to delete this item? (ID: %d)", id);
+    char msg1[BUFFER_SIZE];
+    if(count == 1)
+        sprintf(msg1, "Are you sure you want to delete this item? (ID: %d)", items[0].id);
+    else
+        sprintf(msg1, "Are you sure you want to delete these %d items?", count);
 
     if(displayConfirmationDialog(GTK_WIDGET(user_data), msg1) == FALSE){
+        free(items);
         return;
     }
-    free(msg1);
 
-    char msg[BUFFER_SIZE];
-    sprintf(msg, "DEL %d", id);
-    if(SSL_write(ssl, msg, strlen(msg)) < 0){
+    // All selected items go in one MDEL, deleted together in one transaction
+    char *msg = NULL;
+    size_t msgSize = 0;
+    FILE *out = open_memstream(&msg, &msgSize);
+    fprintf(out, "MDEL");
+    for(int i = 0; i < count; i++)
+        fprintf(out, " %d", items[i].id);
+    fclose(out);
+    free(items);
+
+    int request_id = send_frame(ssl, msg, msgSize);
+    if(request_id < 0){
         display_error_dialog("Error communicating with server");
     }
+    free(msg);
 
-    char response[BUFFER_SIZE] = {0};
-    SSL_read(ssl, response, BUFFER_SIZE);
-    if(strcmp(response, "FAILURE") == 0){
+    char *response = recv_response(ssl, request_id, NULL);
+    if(response == NULL || strcmp(response, "FAILURE") == 0){
         display_error_dialog("Could not delete item from database");
-    } else {
+    } else if(!watching){
         get_all_items_from_database();
     }
+    free(response);
+}
+
+/**
+ * Signal handler for typing in the item editor's name field. Asks the server
+ * for the names starting with what was typed so far and offers them as
+ * completions. Runs on every keystroke, so failures are ignored rather than
+ * reported.
+ * @param editable
+ * @param data
+ */
+void itemNameChanged(GtkEditable *editable, gpointer data){
+    const char *text = gtk_entry_get_text(GTK_ENTRY(editable));
+    gtk_list_store_clear(nameCompletionStore);
+    if(*text == '\0')
+        return;
+
+    char *msg = g_strdup_printf("COMPLETE %d %s", NAME_COMPLETIONS, text);
+    int request_id = send_frame(ssl, msg, strlen(msg));
+    g_free(msg);
+
+    char *response = recv_response(ssl, request_id, NULL);
+    if(response == NULL || strncmp(response, "SUCCESS ", 8) != 0){
+        free(response);
+        return;
+    }
+
+    size_t length = strlen(response);
+    if(length > 0 && response[length - 1] == GROUP_SEPARATOR)
+        response[length - 1] = '\0';
+
+    // Each match is "id\nname", items sharing a name come one after another
+    char separator[] = {RECORD_SEPARATOR, '\0'};
+    char *saveptr = NULL;
+    const char *previous = "";
+    for(char *token = strtok_r(response + 8, separator, &saveptr); token != NULL; token = strtok_r(NULL, separator, &saveptr)){
+        char *name = strchr(token, '\n');
+        if(name == NULL || strcmp(++name, previous) == 0)
+            continue;
+
+        gtk_list_store_insert_with_values(nameCompletionStore, NULL, -1, 0, name, -1);
+        previous = name;
+    }
+    free(response);
 }
 
 /**
@@ -203,7 +404,10 @@ void openItemEditor(Item *item){
 
     gtk_label_set_text(itemEditor->itemId, t);
     sprintf(t, "%s", item->name);
+    // Filling the editor in is not typing, don't ask for completions
+    g_signal_handlers_block_by_func(itemEditor->itemName, itemNameChanged, NULL);
     gtk_entry_set_text(itemEditor->itemName, t);
+    g_signal_handlers_unblock_by_func(itemEditor->itemName, itemNameChanged, NULL);
     gtk_spin_button_set_value(itemEditor->itemArmor, item->armor);
     gtk_spin_button_set_value(itemEditor->itemHealth, item->health);
     gtk_spin_button_set_value(itemEditor->itemMana, item->mana);
@@ -221,46 +425,38 @@ void openItemEditor(Item *item){
 
 /**
  * Signal handler for pressing the edit item button
- * Will pull the relevant information from the table and create an Item to be edited
+ * Will pull the relevant information from the table and create an Item to be edited.
+ * With several rows selected the editor starts from the first of them, and
+ * only the fields the user changes are applied to all of them.
  * @param user_data
  */
 G_MODULE_EXPORT void editItemDialog(gpointer user_data){
-    Item *item = (Item*)malloc(sizeof(Item));
-    bzero(item->name, BUFFER_SIZE);
-    bzero(item->description, BUFFER_SIZE);
+    Item *items;
+    int count = get_selected_items(&items);
 
-    gchar* name = (gchar*)malloc(sizeof(char)*BUFFER_SIZE);
-    bzero(name, BUFFER_SIZE);
-    gchar* desc = (gchar*)malloc(sizeof(char)*BUFFER_SIZE);
-    bzero(name, BUFFER_SIZE);
-
-    // Get selected Item
-    if(gtk_tree_selection_get_selected(selection, &itemModel, &selectedIter)){
-        gtk_tree_model_get(itemModel, &selectedIter,
-                ID, &item->id,
-                NAME, &name,
-                ARMOR, &item->armor,
-                HEALTH, &item->health,
-                MANA, &item->mana,
-                SELL_PRICE, &item->sellPrice,
-                DAMAGE, &item->damage,
-                CRIT_CHANCE, &item->critChance,
-                RANGE, &item->range,
-                DESCRIPTION, &desc,
-                -1);
-    }
-
-    if(name == NULL){
+    clear_bulk_edit();
+    if(count == 0){
+        free(items);
         display_error_dialog("Could not load item for editing");
+        return;
     }
 
-    snprintf(item->name, BUFFER_SIZE, "%s", name);
-    snprintf(item->description, BUFFER_SIZE, "%s", desc);
-    g_free(name);
-    g_free(desc);
-
     // Craft the Item
+    Item *item = (Item*)malloc(sizeof(Item));
+    *item = items[0];
     openItemEditor(item);
+
+    if(count > 1){
+        char t[BUFFER_SIZE];
+        sprintf(t, "%d items", count);
+        gtk_label_set_text(itemEditor->itemId, t);
+
+        bulkEdit.items = items;
+        bulkEdit.count = count;
+        read_item_editor(&bulkEdit.baseline);
+    } else {
+        free(items);
+    }
 }
 
 /**
@@ -284,6 +480,7 @@ G_MODULE_EXPORT void newItemDialog(gpointer data){
     item->critChance = 0.0;
     item->range = 0;
 
+    clear_bulk_edit();
     openItemEditor(item);
 }
 
@@ -298,90 +495,168 @@ void display_error_dialog(char* msg){
     gtk_widget_destroy(dialog);
 }
 
+/**
+ * Shows an item in the table, in place of the row it already has if any.
+ * @param item
+ */
+void put_item_row(Item *item){
+    GtkTreeIter *iter = (GtkTreeIter*)g_hash_table_lookup(itemRows, GINT_TO_POINTER(item->id));
+    if(iter == NULL){
+        // List store iters stay valid as long as their row exists
+        iter = g_new(GtkTreeIter, 1);
+        gtk_list_store_append(itemListStore, iter);
+        g_hash_table_insert(itemRows, GINT_TO_POINTER(item->id), iter);
+    }
+
+    gtk_list_store_set(itemListStore, iter,
+            ID, item->id,
+            NAME, item->name,
+            ARMOR, item->armor,
+            HEALTH, item->health,
+            MANA, item->mana,
+            SELL_PRICE, item->sellPrice,
+            DAMAGE, item->damage,
+            CRIT_CHANCE, item->critChance,
+            RANGE, item->range,
+            DESCRIPTION, item->description,
+            -1);
+}
+
+/**
+ * Removes an item's row from the table, if it has one.
+ * @param id
+ */
+void remove_item_row(int id){
+    GtkTreeIter *iter = (GtkTreeIter*)g_hash_table_lookup(itemRows, GINT_TO_POINTER(id));
+    if(iter == NULL)
+        return;
+
+    gtk_list_store_remove(itemListStore, iter);
+    g_hash_table_remove(itemRows, GINT_TO_POINTER(id));
+}
+
+/**
+ * Idle callback reloading the whole table.
+ * @param data
+ * @return FALSE, to run once
+ */
+gboolean reload_items(gpointer data){
+    get_all_items_from_database();
+    return FALSE;
+}
+
+/**
+ * Applies a change pushed by the server to the table:
+ *
+ *   EVENT PUT <item><RS>DEL <id><RS>...
+ *
+ * May run in the middle of another request, so it must not send one itself.
+ * After EVENT RESYNC, sent when this client fell behind and missed changes,
+ * the table is reloaded once the current request is done.
+ * @param payload
+ */
+void apply_item_event(char *payload){
+    if(strcmp(payload, "EVENT RESYNC") == 0){
+        g_idle_add(reload_items, NULL);
+        return;
+    }
+    if(strncmp(payload, "EVENT ", 6) != 0)
+        return;
+
+    char separator[] = {RECORD_SEPARATOR, '\0'};
+    char *saveptr = NULL;
+    for(char *token = strtok_r(payload + 6, separator, &saveptr); token != NULL; token = strtok_r(NULL, separator, &saveptr)){
+        Item item;
+        if(strncmp(token, "PUT ", 4) == 0 && deserialize_item(token + 4, &item) >= 9)
+            put_item_row(&item);
+        else if(strncmp(token, "DEL ", 4) == 0)
+            remove_item_row(atoi(token + 4));
+    }
+}
+
+/**
+ * Signal handler for data arriving from the server while no request is waiting,
+ * which can only be events.
+ * @param channel
+ * @param condition
+ * @param data
+ * @return FALSE to stop watching the socket
+ */
+gboolean onServerReadable(GIOChannel *channel, GIOCondition condition, gpointer data){
+    if((condition & (G_IO_HUP | G_IO_ERR)) || recv_events(ssl) < 0){
+        watching = FALSE;
+        display_error_dialog("Lost connection to server");
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/**
+ * Subscribes to the changes made by every client, so the table is updated in
+ * place rather than downloaded again after each write. Servers that don't
+ * support it leave the client reloading as before.
+ */
+void watch_items(){
+    set_event_handler(apply_item_event);
+
+    char request[] = "WATCH";
+    int request_id = send_frame(ssl, request, strlen(request));
+    char *response = recv_response(ssl, request_id, NULL);
+    watching = response != NULL && strcmp(response, "SUCCESS") == 0;
+    free(response);
+
+    if(watching){
+        GIOChannel *channel = g_io_channel_unix_new(sockfd);
+        g_io_add_watch(channel, G_IO_IN | G_IO_HUP | G_IO_ERR, onServerReadable, NULL);
+        g_io_channel_unref(channel);
+    }
+}
+
 /**
  * Method queries the database for all entities.
  * Will wipe the tree and re-display all found entities
  */
 void get_all_items_from_database(){
-    // One extra char to guarantee null-termination
-    char buffer[BUFFER_SIZE + 1] = {0};
-    sprintf(buffer, "GET ALL");
-    SSL_write(ssl, buffer, strlen(buffer));
-
-    bzero(buffer, BUFFER_SIZE);
-    SSL_read(ssl, buffer, BUFFER_SIZE);
-    if(strcmp("FAILURE", buffer) == 0){
-        display_error_dialog("Could not Retrieve items from database");
+    char request[] = "GET ALL";
+    int request_id = send_frame(ssl, request, strlen(request));
+    if(request_id < 0){
+        display_error_dialog("Error communicating with server");
         return;
     }
 
-    size_t mem_size = 1024*4;
-    size_t cur_size = 1024*4;
-    char* allItems = (char*)malloc(sizeof(char)*mem_size);
-    bzero(allItems, mem_size);
-    do{
-        if(strlen(buffer) + strlen(allItems) >= cur_size){
-            cur_size += mem_size;
-            allItems = realloc(allItems, cur_size);
-        }
-        strncat(allItems, buffer, strlen(buffer));
-        // process
-        bzero(buffer, BUFFER_SIZE);
-        SSL_read(ssl, buffer, BUFFER_SIZE);
-    } while(buffer[strlen(buffer)-1] != GROUP_SEPARATOR);
-
-
-    // EXPERIMENTAL
-    if(strlen(buffer) + strlen(allItems) >= cur_size){
-        cur_size += mem_size;
-        allItems = realloc(allItems, cur_size);
+    // recv_response joins the frames of a streamed table back together
+    char *allItems = recv_response(ssl, request_id, NULL);
+    if(allItems == NULL || strcmp("FAILURE", allItems) == 0){
+        display_error_dialog("Could not Retrieve items from database");
+        free(allItems);
+        return;
     }
-    strncat(allItems, buffer, strlen(buffer)-1);
+
+    size_t length = strlen(allItems);
+    if(length > 0 && allItems[length - 1] == GROUP_SEPARATOR)
+        allItems[length - 1] = '\0';
 
     // Need to remove first SUCCESS\n bytes
     allItems += 8;
 
-    // Need to tokenize now...
+    gtk_list_store_clear(itemListStore);
+    g_hash_table_remove_all(itemRows);
+
+    // Rows go straight into the store, so there is no limit on how many items are shown
     char* token;
     char str2[] = {RECORD_SEPARATOR, '\0'};
-    Item *items[MAX_ITEMS];
-    bzero(items, MAX_ITEMS);
-    Item *newItem;
-    int available = 0;
+    Item item;
 
     token = strtok(allItems, str2);
     while(token != NULL){
-        newItem = (Item*)malloc(sizeof(Item));
-        deserialize_item(token, newItem);
-        items[available++] = newItem;
+        deserialize_item(token, &item);
+        put_item_row(&item);
         token = strtok(NULL, str2);
     }
 
-    free(token);
     allItems -=8; // Must account for the removed bytes
     free(allItems);
 
-    gtk_list_store_clear(itemListStore);
-
-
-    for(int i = 0; i < available; i++){
-        GtkTreeIter iter;
-        gtk_list_store_append(itemListStore, &iter);
-        gtk_list_store_set(itemListStore, &iter,
-                ID, items[i]->id,
-                NAME, items[i]->name,
-                ARMOR, items[i]->armor,
-                HEALTH, items[i]->health,
-                MANA, items[i]->mana,
-                SELL_PRICE, items[i]->sellPrice,
-                DAMAGE, items[i]->damage,
-                CRIT_CHANCE, items[i]->critChance,
-                RANGE, items[i]->range,
-                DESCRIPTION, items[i]->description,
-                -1);
-        freeItem(items[i]);
-    }
-
     GtkTreeIter iter;
     gtk_tree_model_get_iter_first(itemModel, &iter);
     gtk_tree_selection_select_iter(selection, &iter);
@@ -424,6 +699,8 @@ void create_main_ui(){
     itemEditor->itemDamage = GTK_SPIN_BUTTON(gtk_builder_get_object(builder, "itemDamage"));
     itemEditor->itemCrit = GTK_SPIN_BUTTON(gtk_builder_get_object(builder, "itemCrit"));
     itemEditor->itemRange = GTK_SPIN_BUTTON(gtk_builder_get_object(builder, "itemRange"));
+    nameCompletion = GTK_ENTRY_COMPLETION(gtk_builder_get_object(builder, "entrycompletion1"));
+    nameCompletionStore = GTK_LIST_STORE(gtk_builder_get_object(builder, "nameCompletionStore"));
 
     itemModel = gtk_tree_view_get_model(itemTreeView);
 
@@ -431,18 +708,24 @@ void create_main_ui(){
     g_signal_connect(itemEditor->editItemSaveButton, "clicked", G_CALLBACK(saveItemEdit), editItemDialogWidget);
     g_signal_connect(editItemDialogWidget, "delete-event", G_CALLBACK(onWidgetDelete), NULL);
 
+    // The store has to be refilled before the completion looks at it, so connect first
+    g_signal_connect(itemEditor->itemName, "changed", G_CALLBACK(itemNameChanged), NULL);
+    gtk_entry_set_completion(itemEditor->itemName, nameCompletion);
+
     gtk_window_set_transient_for(GTK_WINDOW(editItemDialogWidget), GTK_WINDOW(mainWindow));
 
     gtk_builder_connect_signals(builder, NULL);
     g_object_unref(G_OBJECT(builder));
 
     selection = gtk_tree_view_get_selection(itemTreeView);
-    gtk_tree_selection_set_mode(selection, GTK_SELECTION_SINGLE);
+    gtk_tree_selection_set_mode(selection, GTK_SELECTION_MULTIPLE);
 
     g_signal_connect(modifyButton, "clicked", G_CALLBACK(editItemDialog), NULL);
     g_signal_connect(createButton, "clicked", G_CALLBACK(newItemDialog), NULL);
     g_signal_connect(deleteButton, "clicked", G_CALLBACK(deleteItemHandler), G_OBJECT(mainWindow));
 
+    itemRows = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free);
+    watch_items();
     get_all_items_from_database();
 
 
@@ -1,5 +1,12 @@
+#include <limits.h>
+#include <netinet/tcp.h>
+
 #include "network.h"
 
+int protocol_version = PROTOCOL_VERSION;
+static int next_request_id = 0;
+static event_handler on_event = NULL;
+
 /**
  * Method responsible for connecting to a remote host on a given port
  * @param hostname
@@ -32,32 +39,42 @@ int create_socket(char* hostname, unsigned int port){
         return -1;
     }
 
+    // The first request follows the last handshake message, don't hold it back for an ACK
+    int nodelay = 1;
+    setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
     return sockfd;
 }
 
 /**
- * Responsible for initializing connection to the database server
+ * Responsible for initializing connection to the database server. The SSL
+ * context outlives the connection, so connecting again, after a failed login
+ * for instance, resumes the TLS session instead of a full handshake.
  * @param hostname
  * @param port
  * @return
  */
 int database_connect(char* hostname, int port) {
-    OpenSSL_add_all_algorithms();
-    if (SSL_library_init() < 0) {
-        fprintf(stderr, "Could not initialize SSL\n");
-        return -1;
-    }
+    if (ssl_ctx == NULL) {
+        OpenSSL_add_all_algorithms();
+        if (SSL_library_init() < 0) {
+            fprintf(stderr, "Could not initialize SSL\n");
+            return -1;
+        }
 
-    method = SSLv23_client_method();
+        method = SSLv23_client_method();
 
-    ssl_ctx = SSL_CTX_new(method);
-    if (ssl_ctx == NULL) {
-        fprintf(stderr, "Could not create SSL Context\n");
-        return -1;
-    }
+        ssl_ctx = SSL_CTX_new(method);
+        if (ssl_ctx == NULL) {
+            fprintf(stderr, "Could not create SSL Context\n");
+            return -1;
+        }
 
+        SSL_CTX_set_options(ssl_ctx, SSL_OP_NO_SSLv2);
+        tls_configure(ssl_ctx, NULL);
+        tls_enable_client_sessions(ssl_ctx);
+    }
 
-    SSL_CTX_set_options(ssl_ctx, SSL_OP_NO_SSLv2);
     ssl = SSL_new(ssl_ctx);
 
     sockfd = create_socket(hostname, port);
@@ -67,6 +84,7 @@ int database_connect(char* hostname, int port) {
     }
 
     SSL_set_fd(ssl, sockfd);
+    tls_resume_session(ssl);
 
     if (SSL_connect(ssl) != 1) {
         fprintf(stderr, "Could not establish secure connection\n");
@@ -77,11 +95,196 @@ int database_connect(char* hostname, int port) {
 }
 
 /**
- * Disconnects and cleans up the file descriptors
+ * Disconnects and cleans up the file descriptors. The SSL context is kept
+ * for the next connection.
  * @return
  */
 int disconnect(){
     SSL_free(ssl);
-    SSL_CTX_free(ssl_ctx);
+    ssl = NULL;
     close(sockfd);
 }
+
+/**
+ * Reads exactly len bytes from the connection
+ * @param ssl
+ * @param buf
+ * @param len
+ * @return 0 on success, -1 on error or disconnect
+ */
+static int read_exact(SSL *ssl, unsigned char *buf, size_t len){
+    size_t total = 0;
+    while(total < len){
+        int rcount = SSL_read(ssl, buf + total, (int)(len - total));
+        if(rcount <= 0)
+            return -1;
+        total += rcount;
+    }
+    return 0;
+}
+
+/**
+ * Sends one request frame to the server, tagged with a fresh request id
+ * @param ssl
+ * @param payload
+ * @param length
+ * @return The request id to wait for with recv_response, or -1 on error
+ */
+int send_frame(SSL *ssl, const char *payload, size_t length){
+    unsigned char *frame = (unsigned char*)malloc(FRAME_HEADER_SIZE + length);
+    if(frame == NULL)
+        return -1;
+
+    // Ids stay positive so they can share the return value with errors
+    if(next_request_id == INT_MAX)
+        next_request_id = 0;
+    int request_id = ++next_request_id;
+
+    // Header and payload go out as a single record
+    size_t header_len = pack_frame_header(frame, (uint8_t)protocol_version, 0, (uint32_t)length, (uint32_t)request_id);
+    memcpy(frame + header_len, payload, length);
+
+    int r = SSL_write(ssl, frame, (int)(header_len + length));
+    free(frame);
+
+    return r <= 0 ? -1 : request_id;
+}
+
+/**
+ * Receives one response frame from the server
+ * @param ssl
+ * @param header filled in with the frame header, may be NULL
+ * @return The NUL terminated payload, to be freed by the caller, or NULL on error
+ */
+char *recv_frame(SSL *ssl, FrameHeader *header){
+    unsigned char raw[FRAME_HEADER_SIZE];
+    FrameHeader h;
+
+    // The version byte decides how long the rest of the header is
+    if(read_exact(ssl, raw, FRAME_HEADER_SIZE_V1) < 0)
+        return NULL;
+    int header_len = unpack_frame_header(raw, FRAME_HEADER_SIZE_V1, &h);
+    if(header_len == 0){
+        if(read_exact(ssl, raw + FRAME_HEADER_SIZE_V1, frame_header_size(raw[1]) - FRAME_HEADER_SIZE_V1) < 0)
+            return NULL;
+        header_len = unpack_frame_header(raw, frame_header_size(raw[1]), &h);
+    }
+    if(header_len <= 0){
+        fprintf(stderr, "Invalid frame received from server\n");
+        return NULL;
+    }
+
+    char *payload = (char*)malloc(h.length + 1);
+    if(payload == NULL)
+        return NULL;
+    if(read_exact(ssl, (unsigned char*)payload, h.length) < 0){
+        free(payload);
+        return NULL;
+    }
+    payload[h.length] = '\0';
+
+    if(header != NULL)
+        *header = h;
+    return payload;
+}
+
+/**
+ * Receives the response to a request sent with send_frame. Responses to
+ * other requests are skipped, the client only ever waits on one at a time.
+ * A response streamed over several frames is joined back together.
+ * @param ssl
+ * @param request_id id returned by send_frame
+ * @param header filled in with the header of the last frame and the total length, may be NULL
+ * @return The NUL terminated payload, to be freed by the caller, or NULL on error
+ */
+char *recv_response(SSL *ssl, int request_id, FrameHeader *header){
+    FrameHeader h;
+    char *response = NULL;
+    size_t length = 0;
+
+    if(request_id < 0)
+        return NULL;
+
+    while(1){
+        char *payload = recv_frame(ssl, &h);
+        if(payload == NULL){
+            free(response);
+            return NULL;
+        }
+
+        // Changes pushed by the server can come in ahead of the response
+        if(h.flags & FRAME_FLAG_EVENT){
+            if(on_event != NULL)
+                on_event(payload);
+            free(payload);
+            continue;
+        }
+
+        // Version 1 servers answer in order and don't echo ids
+        if(h.version >= 2 && h.request_id != (uint32_t)request_id){
+            fprintf(stderr, "Dropping response to stale request %u\n", h.request_id);
+            free(payload);
+            continue;
+        }
+
+        if(response == NULL){
+            response = payload;
+        } else {
+            char *joined = (char*)realloc(response, length + h.length + 1);
+            if(joined == NULL){
+                free(response);
+                free(payload);
+                return NULL;
+            }
+            response = joined;
+            memcpy(response + length, payload, h.length + 1);
+            free(payload);
+        }
+        length += h.length;
+
+        if(h.version < 2 || !(h.flags & FRAME_FLAG_MORE)){
+            if(header != NULL){
+                *header = h;
+                header->length = (uint32_t)length;
+            }
+            // Events already decrypted won't wake up a watch on the socket, hand them over now
+            if(SSL_pending(ssl) > 0 && recv_events(ssl) < 0){
+                free(response);
+                return NULL;
+            }
+            return response;
+        }
+    }
+}
+
+/**
+ * Sets the function that event frames are handed to, by recv_response and
+ * recv_events. Events are dropped while there is none.
+ * @param handler
+ */
+void set_event_handler(event_handler handler){
+    on_event = handler;
+}
+
+/**
+ * Handles the event frames that have arrived while no request was waiting.
+ * Call it when the socket is readable. Only whole frames are sent, so this
+ * doesn't block for long once part of one is there. Anything but an event is
+ * a response nobody waits for anymore, and is dropped.
+ * @param ssl
+ * @return 0 on success, -1 on error or disconnect
+ */
+int recv_events(SSL *ssl){
+    do {
+        FrameHeader h;
+        char *payload = recv_frame(ssl, &h);
+        if(payload == NULL)
+            return -1;
+
+        if((h.flags & FRAME_FLAG_EVENT) && on_event != NULL)
+            on_event(payload);
+        free(payload);
+    } while(SSL_pending(ssl) > 0);
+
+    return 0;
+}
@@ -8,6 +8,7 @@
 #include <netdb.h>
 #include <errno.h>
 #include <resolv.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -24,15 +25,29 @@
 #include <openssl/x509.h>
 #include <openssl/x509_vfy.h>
 
+#include "../protocol.h"
+#include "../tls.h"
+
 const SSL_METHOD* method;
 int sockfd;
 SSL_CTX *ssl_ctx;
 SSL *ssl;
 
 
+// Version offered at login, replaced by the one the server picks
+extern int protocol_version;
+
+// Called with the payload of every event frame pushed after a WATCH
+typedef void (*event_handler)(char *payload);
+
 int create_socket(char* hostname, unsigned int port);
 int database_connect(char* hostname, int port);
 int disconnect();
+int send_frame(SSL *ssl, const char *payload, size_t length);
+char *recv_frame(SSL *ssl, FrameHeader *header);
+char *recv_response(SSL *ssl, int request_id, FrameHeader *header);
+void set_event_handler(event_handler handler);
+int recv_events(SSL *ssl);
 
 
 #endif //CS469_PROJECT_NETWORK_H
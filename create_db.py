@@ -18,7 +18,13 @@ create_items_table = """CREATE TABLE IF NOT EXISTS items(
     damage integer NOT NULL,
     critChance real NOT NULL,
     range integer NOT NULL,
-    description text NOT NULL
+    description text NOT NULL,
+    version integer NOT NULL DEFAULT 1
+);"""
+
+create_tombstones_table = """CREATE TABLE IF NOT EXISTS tombstones(
+    id integer PRIMARY KEY,
+    version integer NOT NULL
 );"""
 
 c = conn.cursor()
@@ -27,6 +33,8 @@ c.execute("DROP TABLE IF EXISTS users;")
 c.execute(create_users_table)
 c.execute("DROP TABLE IF EXISTS items;")
 c.execute(create_items_table)
+c.execute("DROP TABLE IF EXISTS tombstones;")
+c.execute(create_tombstones_table)
 
 sql = "INSERT INTO items(name, armorPoints, healthPoints, manaPoints, sellPrice, damage, critChance, range, description) VALUES (?,?,?,?,?,?,?,?,'DESCRIPTION');"
 
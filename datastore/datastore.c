@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <argp.h>
+#include <signal.h>
 #include <stdlib.h>
 
 #include "../globals.h"
@@ -16,11 +17,14 @@ struct Arguments {
     int listenPort;
     char *psk;
     char *filename;
+    int backlog;
+    struct tls_options tls;
 };
 static struct argp_option options[] = {
         {"listen-port",'l',"<port>", 0, "Port to listen on. Default: 6644"},
         {"key",'k',"<key>", 0, "Pre-shared key used to authenticate remote server."},
         {"config", 'c', "<filename>", 0, "A config file that can be used in lieu of CLI arguments. This will override all CLI arguments."},
+        {"backlog", 'b', "<n>", 0, "Connections queued while a sync is being stored. Default: 1024"},
         {0}
 };
 
@@ -45,6 +49,13 @@ static error_t parse_args(int key, char *arg, struct argp_state *state){
         case 'c':
             arguments->filename = arg;
             break;
+        case 'b':
+            arguments->backlog = strtol(arg, &pEnd, 10);
+            if(arguments->backlog <= 0){
+                fprintf(stderr, "Invalid listen backlog %s\n", arg);
+                arguments->backlog = DEFAULT_LISTEN_BACKLOG;
+            }
+            break;
         default:
             return ARGP_ERR_UNKNOWN;
     }
@@ -66,6 +77,7 @@ int main(int argc, char *argv[]){
     arguments.listenPort = DEFAULT_BACKUP_PORT;
     arguments.psk = "";
     arguments.filename = NULL;
+    arguments.backlog = DEFAULT_LISTEN_BACKLOG;
 
     argp_parse(&argp, argc, argv, 0, 0, &arguments);
     if(arguments.filename != NULL) parse_conf_file(&arguments);
@@ -75,14 +87,21 @@ int main(int argc, char *argv[]){
     printf("\tListen port: %d\n", arguments.listenPort);
     printf("\tConfig file: %s\n", arguments.filename ? arguments.filename: "NULL");
 
-    int serverFd = create_socket(arguments.listenPort);
+    int serverFd = create_socket(arguments.listenPort, arguments.backlog);
     if (serverFd < 0) {
         fprintf(stderr, "Could not create socket\n");
         exit(-1);
     }
 
+    // The server may hang up while we answer it
+    signal(SIGPIPE, SIG_IGN);
+
     SSL_CTX * ssl_ctx = create_new_context();
-    configure_context(ssl_ctx);
+    if (ssl_ctx == NULL || configure_context(ssl_ctx, &arguments.tls) != 0) {
+        fprintf(stderr, "Could not set up TLS\n");
+        ERR_print_errors_fp(stderr);
+        exit(-1);
+    }
 
     char * command = malloc(strlen(arguments.psk) + strlen("REPLICATE \n") + 1);
     sprintf(command, "REPLICATE %s\n", arguments.psk);
@@ -232,6 +251,19 @@ int parse_conf_file(void *args){
             arguments->psk = strdup(value);
         }
 
+        if(strcmp(field, "LISTEN_BACKLOG") == 0){
+            val = strtol(value, &stop, 10);
+            if(stop == NULL || *stop != '\0' || val <= 0){
+                fprintf(stderr, "Error interpreting listen backlog: %s\n", value);
+                fclose(file);
+                return -1;
+            }
+            arguments->backlog = val;
+        }
+
+        // TLS_CIPHERS, TLS_CIPHERSUITES and TLS_GROUPS
+        tls_parse_option(&arguments->tls, field, value);
+
         bzero(field, BUFFER_SIZE);
         bzero(value, BUFFER_SIZE);
     }
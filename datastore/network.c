@@ -3,9 +3,10 @@
  */
 #include "network.h"
 
-int create_socket(unsigned int port){
+int create_socket(unsigned int port, int backlog){
     int s;
     struct sockaddr_in addr;
+    int on = 1;
 
     addr.sin_family = AF_INET;
     addr.sin_port = htons(port);
@@ -16,11 +17,13 @@ int create_socket(unsigned int port){
         return -1;
     }
 
-    if(bind(s, (struct sockaddr*)&addr, sizeof(addr)) < 0)
-        return -1;
+    // A restart must not wait for the previous run's connections to leave TIME_WAIT
+    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
 
-    if(listen(s, 1) < 0)
+    if(bind(s, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(s, backlog) < 0){
+        close(s);
         return -1;
+    }
 
     return s;
 }
@@ -47,8 +50,11 @@ SSL_CTX* create_new_context(){
     return ssl_ctx;
 }
 
-int configure_context(SSL_CTX* ssl_ctx){
+int configure_context(SSL_CTX* ssl_ctx, const struct tls_options *options){
     SSL_CTX_set_ecdh_auto(ssl_ctx, 1);
+    if(tls_configure(ssl_ctx, options) != 0)
+        return -1;
+    tls_enable_server_sessions(ssl_ctx, "datastore");
 
     if(SSL_CTX_use_certificate_file(ssl_ctx, CERTIFICATE_FILE, SSL_FILETYPE_PEM) <= 0)
         return -1;
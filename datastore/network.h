@@ -12,6 +12,8 @@
 #include <openssl/ssl.h>
 #include <openssl/err.h>
 
+#include "../tls.h"
+
 #define CERTIFICATE_FILE  "cert.pem"
 #define KEY_FILE          "key.pem"
 #define USE_OPENSSL
@@ -22,9 +24,10 @@
  * port.
  *
  * @param port The local port to bind to.
+ * @param backlog Connections the kernel queues until they are accepted
  * @return An open and listening socket fd, or -1 on error
  */
-int create_socket(unsigned int port);
+int create_socket(unsigned int port, int backlog);
 
 /**
  * Helper functions to initialize and shutdown the openssl library for the
@@ -42,12 +45,14 @@ SSL_CTX* create_new_context();
 
 /**
  * Configures the given SSL_CTX to use the appropriate encryption configuration.
- * Loads the defined CERTIFICATE_FILE and KEY_FILE.
+ * Loads the defined CERTIFICATE_FILE and KEY_FILE, and lets the inventory
+ * server resume its session on every SYNC after the first.
  *
  * @param ssl_ctx The context to configure.
+ * @param options Algorithm choices, or NULL for the defaults
  * @return 0 on success, -1 on error
  */
-int configure_context(SSL_CTX* ssl_ctx);
+int configure_context(SSL_CTX* ssl_ctx, const struct tls_options *options);
 
 
 
@@ -47,12 +47,13 @@ char* serialize_item(Item *item, char* result){
  * Convert a string to an Item struct
  * @param buf
  * @param item
+ * @return Number of fields parsed, 10 for a complete item
  */
-void deserialize_item(char *buf, Item *item) {
+int deserialize_item(char *buf, Item *item) {
     bzero(item->name, BUFFER_SIZE);
     bzero(item->description, BUFFER_SIZE);
 
-    sscanf(buf, "%d\n%[^\n]\n%d\n%d\n%d\n%d\n%d\n%lf\n%d\n%[^\x1e]",
+    return sscanf(buf, "%d\n%255[^\n]\n%d\n%d\n%d\n%d\n%d\n%lf\n%d\n%255[^\x1e]",
            &item->id,
            item->name,
            &item->armor,
@@ -9,14 +9,13 @@
 #include <stdlib.h>
 #include <stdio.h>
 
-#define MAX_ITEMS 1024
 #define DEFAULT_SERVER_PORT 4466
 #define DEFAULT_BACKUP_PORT 6644
 #define DEFAULT_SERVER "localhost"
 #define DEFAULT_DATABASE "items.db"
 #define DEFAULT_INTERVAL 24*60*60
+#define DEFAULT_LISTEN_BACKLOG 1024
 #define BUFFER_SIZE 256
-#define MAX_CLIENTS 512
 #define SALT_LENGTH 11
 
 #define GROUP_SEPARATOR 0x1d
@@ -45,6 +44,6 @@ void *malloc_aligned(unsigned int size);
 
 void freeItem(Item* item);
 char* serialize_item(Item* item, char* result);
-void deserialize_item(char *buf, Item *item);
+int deserialize_item(char *buf, Item *item);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,282 @@
+//
+// AUTH worker pool and session tokens, see auth.h. A worker reads the
+// password hash once, releasing the statement before hashing so no read
+// transaction stays open through crypt(), and hashes with crypt_r() and its
+// own scratch space, since crypt() shares one static buffer between threads.
+//
+
+#define _GNU_SOURCE
+#include <crypt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#include <openssl/sha.h>
+
+#include "auth.h"
+#include "metrics.h"
+#include "trace.h"
+
+#define AUTH_MAC_LENGTH (2 * SHA256_DIGEST_LENGTH)
+
+struct auth_worker {
+    struct queue_root *queue;
+    const char *database;
+    int id;
+};
+
+// Written by auth_init() before any thread starts, only read afterwards
+static unsigned char token_key[AUTH_KEY_SIZE];
+
+static void *auth_worker_thread(void *data);
+static int password_hash(struct db_statements *statements, const char *username, char *hash);
+static int check_password(const char *hash, const char *password, struct crypt_data *scratch);
+static int sign_token(const char *username, long long expiry, const char *hash, char *mac);
+static char *login_response(const char *username, const char *hash);
+
+int auth_init(const char *database){
+    sqlite3 *db = NULL;
+    sqlite3_stmt *stmt = NULL;
+    int r = -1;
+
+    if(sqlite3_open(database, &db) != SQLITE_OK){
+        fprintf(stderr, "Auth: Cannot open database: %s\n", sqlite3_errmsg(db));
+        sqlite3_close(db);
+        return -1;
+    }
+    sqlite3_busy_timeout(db, DB_BUSY_TIMEOUT);
+
+    if(sqlite3_exec(db, "CREATE TABLE IF NOT EXISTS token_key (key BLOB NOT NULL)", NULL, NULL, NULL) != SQLITE_OK
+       || sqlite3_prepare_v2(db, "SELECT key FROM token_key LIMIT 1", -1, &stmt, NULL) != SQLITE_OK){
+        fprintf(stderr, "Auth: Could not read the token key: %s\n", sqlite3_errmsg(db));
+        sqlite3_finalize(stmt);
+        sqlite3_close(db);
+        return -1;
+    }
+
+    if(sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_bytes(stmt, 0) == AUTH_KEY_SIZE){
+        memcpy(token_key, sqlite3_column_blob(stmt, 0), AUTH_KEY_SIZE);
+        r = 0;
+    }
+    sqlite3_finalize(stmt);
+    stmt = NULL;
+
+    // First start, or a key of the wrong size: tokens signed with the old one stop working
+    if(r != 0 && RAND_bytes(token_key, AUTH_KEY_SIZE) == 1
+       && sqlite3_exec(db, "DELETE FROM token_key", NULL, NULL, NULL) == SQLITE_OK
+       && sqlite3_prepare_v2(db, "INSERT INTO token_key (key) VALUES (?)", -1, &stmt, NULL) == SQLITE_OK){
+        sqlite3_bind_blob(stmt, 1, token_key, AUTH_KEY_SIZE, SQLITE_STATIC);
+        if(sqlite3_step(stmt) == SQLITE_DONE)
+            r = 0;
+    }
+    if(r != 0)
+        fprintf(stderr, "Auth: Could not create the token key: %s\n", sqlite3_errmsg(db));
+
+    sqlite3_finalize(stmt);
+    sqlite3_close(db);
+    return r;
+}
+
+struct auth_pool *auth_pool_start(const char *database, int workers){
+    struct auth_pool *pool = (struct auth_pool*)calloc(1, sizeof(struct auth_pool));
+    if(pool == NULL)
+        return NULL;
+    pool->queues = (struct queue_root**)calloc(workers, sizeof(struct queue_root*));
+    if(pool->queues == NULL){
+        free(pool);
+        return NULL;
+    }
+    pool->workers = workers;
+    atomic_init(&pool->next, 0);
+
+    for(int i = 0; i < workers; i++){
+        pthread_t thread;
+        struct auth_worker *worker = (struct auth_worker*)malloc(sizeof(struct auth_worker));
+        if(worker == NULL)
+            return NULL;
+        worker->queue = pool->queues[i] = ALLOC_QUEUE_ROOT();
+        metrics_add_queue(METRIC_QUEUE_AUTH, worker->queue);
+        worker->database = database;
+        worker->id = i;
+        int err = pthread_create(&thread, NULL, auth_worker_thread, (void*)worker);
+        if(err != 0){
+            fprintf(stderr, "Auth: Could not start worker %d: %d\n", i, err);
+            return NULL;
+        }
+        pthread_detach(thread);
+    }
+    return pool;
+}
+
+struct queue_root *auth_pool_queue(struct auth_pool *pool){
+    unsigned int next = atomic_fetch_add_explicit(&pool->next, 1, memory_order_relaxed);
+    return pool->queues[next % pool->workers];
+}
+
+char *auth_resume(struct db_statements *statements, const char *request){
+    char username[BUFFER_SIZE];
+    char token[AUTH_TOKEN_SIZE];
+    char hash[BUFFER_SIZE];
+    char mac[AUTH_MAC_LENGTH + 1];
+
+    if(sscanf(request, "RESUME %255s %95s", username, token) != 2)
+        return NULL;
+
+    char *given = strchr(token, '.');
+    if(given == NULL)
+        return NULL;
+    *given++ = '\0';
+
+    char *end;
+    long long expiry = strtoll(token, &end, 10);
+    long long now = (long long)time(NULL);
+    if(end == token || *end != '\0' || expiry < now || expiry > now + AUTH_TOKEN_LIFETIME)
+        return NULL;
+
+    if(password_hash(statements, username, hash) != 0
+       || sign_token(username, expiry, hash, mac) != 0
+       || strlen(given) != AUTH_MAC_LENGTH
+       || CRYPTO_memcmp(given, mac, AUTH_MAC_LENGTH) != 0)
+        return NULL;
+
+    return login_response(username, hash);
+}
+
+/**
+ * Answers the AUTH requests of one queue from a read-only connection.
+ * @param data worker
+ * @return NULL
+ */
+static void *auth_worker_thread(void *data){
+    struct auth_worker *worker = (struct auth_worker*)data;
+    sqlite3 *db = NULL;
+    struct db_statements statements;
+
+    if(sqlite3_open_v2(worker->database, &db, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK){
+        fprintf(stderr, "FATAL: Auth worker %d cannot open database: %s\n", worker->id, sqlite3_errmsg(db));
+        exit(-1);
+    }
+    sqlite3_busy_timeout(db, DB_BUSY_TIMEOUT);
+    trace_database(db);
+
+    // Tens of kilobytes, too much to put on the stack on every login
+    struct crypt_data *scratch = (struct crypt_data*)calloc(1, sizeof(struct crypt_data));
+    if(scratch == NULL || db_statements_init(&statements, db) != SQLITE_OK){
+        fprintf(stderr, "FATAL: Auth worker %d could not start\n", worker->id);
+        exit(-1);
+    }
+
+    fprintf(stdout, "AUTH_WORKER_%d: Ready\n", worker->id);
+    while(1){
+        struct queue_head *msg = queue_get_wait(worker->queue);
+        struct queue_head *response = alloc_queue_message();
+        metrics_dequeued(METRIC_QUEUE_AUTH, msg);
+        trace_begin(msg);
+        char username[BUFFER_SIZE];
+        char password[BUFFER_SIZE];
+        char hash[BUFFER_SIZE];
+
+        fprintf(stdout, "AUTH_WORKER_%d: Authenticating user\n", worker->id);
+        if(sscanf(msg->operation, "AUTH %255s %255s", username, password) == 2
+           && password_hash(&statements, username, hash) == 0
+           && check_password(hash, password, scratch) == 0){
+            char *answer = login_response(username, hash);
+            if(answer != NULL){
+                INIT_QUEUE_HEAD(response, answer, NULL);
+                free(answer);
+            }
+        }
+        explicit_bzero(password, sizeof(password));
+
+        // Anything but a valid AUTH is answered with FAILURE
+        trace_end(msg);
+        send_response(msg, response);
+    }
+
+    return NULL;
+}
+
+/**
+ * Reads the stored password hash of a user.
+ * @param statements
+ * @param username
+ * @param hash Receives the hash, BUFFER_SIZE bytes
+ * @return 0 on success, -1 if there is no such user
+ */
+static int password_hash(struct db_statements *statements, const char *username, char *hash){
+    sqlite3_stmt *stmt = db_statement(statements, STMT_USER_PASSWORD);
+    if(stmt == NULL)
+        return -1;
+    sqlite3_bind_text(stmt, 1, username, -1, SQLITE_STATIC);
+
+    int r = -1;
+    if(sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_text(stmt, 0) != NULL){
+        snprintf(hash, BUFFER_SIZE, "%s", (const char*)sqlite3_column_text(stmt, 0));
+        r = 0;
+    }
+    sqlite3_reset(stmt);
+    return r;
+}
+
+/**
+ * Hashes a password with the salt and method of the stored hash and compares the result.
+ * @param hash Stored hash
+ * @param password
+ * @param scratch crypt_r() state of the calling thread
+ * @return 0 if the password matches, -1 otherwise
+ */
+static int check_password(const char *hash, const char *password, struct crypt_data *scratch){
+    const char *hashed = crypt_r(password, hash, scratch);
+    if(hashed == NULL || strcmp(hashed, hash) != 0)
+        return -1;
+    return 0;
+}
+
+/**
+ * Computes the MAC of a token.
+ * @param username
+ * @param expiry
+ * @param hash Stored password hash of the user
+ * @param mac Receives the MAC in hex, AUTH_MAC_LENGTH + 1 bytes
+ * @return 0 on success, -1 on error
+ */
+static int sign_token(const char *username, long long expiry, const char *hash, char *mac){
+    char data[3 * BUFFER_SIZE];
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int length = 0;
+
+    // The NULs keep the fields apart, no two different logins sign the same bytes
+    int n = snprintf(data, sizeof(data), "%s%c%lld%c%s", username, '\0', expiry, '\0', hash);
+    if(n < 0 || (size_t)n >= sizeof(data))
+        return -1;
+    if(HMAC(EVP_sha256(), token_key, AUTH_KEY_SIZE, (unsigned char*)data, n, digest, &length) == NULL
+       || length != SHA256_DIGEST_LENGTH)
+        return -1;
+
+    for(unsigned int i = 0; i < length; i++)
+        sprintf(mac + 2 * i, "%02x", digest[i]);
+    return 0;
+}
+
+/**
+ * Builds the answer to a successful login, carrying a new token.
+ * @param username
+ * @param hash Stored password hash of the user
+ * @return The response to be freed by the caller, or NULL on error
+ */
+static char *login_response(const char *username, const char *hash){
+    char mac[AUTH_MAC_LENGTH + 1];
+    long long expiry = (long long)time(NULL) + AUTH_TOKEN_LIFETIME;
+    char *response = NULL;
+
+    if(sign_token(username, expiry, hash, mac) != 0
+       || asprintf(&response, "SUCCESS\n%lld.%s", expiry, mac) < 0)
+        return NULL;
+    return response;
+}
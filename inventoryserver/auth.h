@@ -0,0 +1,77 @@
+#ifndef CS469_PROJECT_AUTH_H
+#define CS469_PROJECT_AUTH_H
+
+#include "queue.h"
+#include "statements.h"
+
+/**
+ * Logins. Checking a password hashes it with crypt(), thousands of SHA-256
+ * rounds, which used to keep the database threads from anything else while a
+ * burst of clients logged in. AUTH requests now go to their own pool of
+ * workers, each reading password hashes from its own read-only connection.
+ *
+ * A successful AUTH is answered with a session token:
+ *
+ *   SUCCESS\n<expiry>.<mac>
+ *
+ * which a client that reconnects before <expiry>, in seconds since the epoch,
+ * presents instead of its password:
+ *
+ *   RESUME <username> <token>
+ *
+ * and is answered like an AUTH, with a fresh token. Checking a token is an
+ * HMAC over the username, the expiry and the stored password hash, so it
+ * costs microseconds instead of a crypt(), and changing the password or
+ * removing the user revokes every token issued for it. The HMAC key is kept
+ * in the database, tokens stay valid across restarts.
+ */
+
+#define AUTH_TOKEN_LIFETIME (15 * 60)  // Seconds a token can be resumed with
+#define AUTH_KEY_SIZE       32
+#define AUTH_TOKEN_SIZE     96         // Enough for the expiry, the '.' and the hex MAC
+
+/**
+ * Workers that answer AUTH requests.
+ */
+struct auth_pool {
+    struct queue_root **queues;   // One per worker, so every queue keeps a single consumer
+    int workers;
+    _Atomic unsigned int next;    // Round robin, advanced by every I/O thread
+};
+
+/**
+ * Loads the key tokens are signed with, creating it the first time. Must run
+ * before any thread issues or checks a token.
+ *
+ * @param database Path to the database file
+ * @return 0 on success, -1 on error
+ */
+int auth_init(const char *database);
+
+/**
+ * Starts the AUTH workers.
+ *
+ * @param database Path to the database file, opened read-only by every worker
+ * @param workers Number of workers, at least 1
+ * @return The running pool, or NULL on error
+ */
+struct auth_pool *auth_pool_start(const char *database, int workers);
+
+/**
+ * Picks the worker queue for the next AUTH request.
+ *
+ * @param pool
+ * @return The queue to put the request on
+ */
+struct queue_root *auth_pool_queue(struct auth_pool *pool);
+
+/**
+ * Answers a RESUME request.
+ *
+ * @param statements Statement cache of the connection to read the password hash from
+ * @param request The RESUME request
+ * @return The response to be freed by the caller, or NULL if the token isn't valid
+ */
+char *auth_resume(struct db_statements *statements, const char *request);
+
+#endif //CS469_PROJECT_AUTH_H
@@ -0,0 +1,273 @@
+//
+// In-memory copy of the items table, so GET by id doesn't have to run a
+// query. The whole table is loaded when the writer thread starts, and the
+// writer applies every committed change. Readers share the cache under a
+// read lock.
+//
+// Entries are never removed, a deleted item becomes a negative entry. That
+// keeps linear probing free of tombstones, and deleted ids are answered
+// without touching the database. Once the cache is complete every unknown
+// id is negative anyway, so negative entries are dropped whenever the table
+// is rehashed and PUT/DEL churn can't grow it without bound.
+//
+// Every change is passed on to the column store, which FIND scans, the
+// search index, the name index and the change feed for WATCH.
+//
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+
+#include "cache.h"
+#include "columns.h"
+#include "feed.h"
+#include "names.h"
+#include "search.h"
+#include "statements.h"
+
+static struct cache_entry *find_slot(struct cache_entry *entries, size_t capacity, int id);
+static void grow(struct item_cache *cache);
+static struct cache_entry *store(struct item_cache *cache, int id, const Item *item);
+
+struct item_cache *item_cache_create(){
+    struct item_cache *cache = (struct item_cache*)calloc(1, sizeof(struct item_cache));
+    if(cache == NULL)
+        return NULL;
+
+    cache->capacity = CACHE_INITIAL_CAPACITY;
+    cache->entries = (struct cache_entry*)calloc(cache->capacity, sizeof(struct cache_entry));
+    cache->columns = column_store_create();
+    cache->search = search_index_create();
+    cache->names = name_index_create();
+    cache->feed = change_feed_create();
+    if(cache->entries == NULL || cache->columns == NULL || cache->search == NULL || cache->names == NULL
+       || cache->feed == NULL){
+        free(cache->entries);
+        free(cache);
+        return NULL;
+    }
+    cache->version = -1;
+    pthread_rwlock_init(&cache->lock, NULL);
+    return cache;
+}
+
+int item_cache_load(struct item_cache *cache, sqlite3_stmt *stmt){
+    int count = 0;
+    int r;
+
+    pthread_rwlock_wrlock(&cache->lock);
+    while((r = sqlite3_step(stmt)) == SQLITE_ROW){
+        Item item;
+        new_item_from_row(stmt, &item);
+        store(cache, item.id, &item);
+        column_store_put(cache->columns, &item);
+        search_index_update(cache->search, NULL, &item);
+        name_index_update(cache->names, NULL, &item);
+        count++;
+    }
+    cache->complete = r == SQLITE_DONE;
+    cache->generation++;
+    column_store_set_complete(cache->columns, cache->complete);
+    search_index_set_complete(cache->search, cache->complete);
+    name_index_set_complete(cache->names, cache->complete);
+    pthread_rwlock_unlock(&cache->lock);
+
+    if(r != SQLITE_DONE){
+        fprintf(stderr, "Cache: Could not load items, lookups will fall back to the database\n");
+        return -1;
+    }
+    fprintf(stdout, "Cache: Loaded %d items\n", count);
+    return 0;
+}
+
+int item_cache_get(struct item_cache *cache, int id, Item *item){
+    int result;
+
+    pthread_rwlock_rdlock(&cache->lock);
+    struct cache_entry *entry = find_slot(cache->entries, cache->capacity, id);
+    if(entry->state == ENTRY_PRESENT){
+        *item = *entry->item;
+        result = CACHE_HIT;
+    } else if(entry->state == ENTRY_NEGATIVE || cache->complete){
+        result = CACHE_NEGATIVE;
+    } else {
+        result = CACHE_MISS;
+    }
+    pthread_rwlock_unlock(&cache->lock);
+
+    // Counters are bumped by concurrent readers holding the shared lock
+    if(result == CACHE_HIT)
+        __atomic_add_fetch(&cache->hits, 1, __ATOMIC_RELAXED);
+    else if(result == CACHE_NEGATIVE)
+        __atomic_add_fetch(&cache->negative_hits, 1, __ATOMIC_RELAXED);
+    else
+        __atomic_add_fetch(&cache->misses, 1, __ATOMIC_RELAXED);
+    return result;
+}
+
+unsigned long item_cache_generation(struct item_cache *cache){
+    pthread_rwlock_rdlock(&cache->lock);
+    unsigned long generation = cache->generation;
+    pthread_rwlock_unlock(&cache->lock);
+    return generation;
+}
+
+sqlite3_int64 item_cache_version(struct item_cache *cache){
+    return __atomic_load_n(&cache->version, __ATOMIC_ACQUIRE);
+}
+
+void item_cache_set_version(struct item_cache *cache, sqlite3_int64 version){
+    __atomic_store_n(&cache->version, version, __ATOMIC_RELEASE);
+}
+
+void item_cache_fill(struct item_cache *cache, int id, const Item *item, unsigned long generation){
+    pthread_rwlock_wrlock(&cache->lock);
+    if(cache->generation == generation && (item != NULL || cache->negative < CACHE_MAX_NEGATIVE)){
+        struct cache_entry *entry = find_slot(cache->entries, cache->capacity, id);
+        // Never let a read downgrade what the writer stored
+        if(entry->state == ENTRY_EMPTY)
+            store(cache, id, item);
+    }
+    pthread_rwlock_unlock(&cache->lock);
+}
+
+void item_cache_put(struct item_cache *cache, const Item *item){
+    Item old;
+
+    pthread_rwlock_wrlock(&cache->lock);
+    // The search and name indexes need the old text to find what to drop
+    struct cache_entry *entry = find_slot(cache->entries, cache->capacity, item->id);
+    int replaced = entry->state == ENTRY_PRESENT;
+    if(replaced)
+        old = *entry->item;
+    store(cache, item->id, item);
+    cache->generation++;
+    pthread_rwlock_unlock(&cache->lock);
+
+    column_store_put(cache->columns, item);
+    search_index_update(cache->search, replaced ? &old : NULL, item);
+    name_index_update(cache->names, replaced ? &old : NULL, item);
+    change_feed_put(cache->feed, item);
+}
+
+void item_cache_remove(struct item_cache *cache, int id){
+    Item old;
+
+    pthread_rwlock_wrlock(&cache->lock);
+    struct cache_entry *entry = find_slot(cache->entries, cache->capacity, id);
+    int removed = entry->state == ENTRY_PRESENT;
+    if(removed)
+        old = *entry->item;
+    // Watchers only hear about ids that may have existed
+    int existed = removed || !cache->complete;
+    // A complete cache already answers unknown ids negatively
+    if(entry->state != ENTRY_EMPTY || !cache->complete)
+        store(cache, id, NULL);
+    cache->generation++;
+    pthread_rwlock_unlock(&cache->lock);
+
+    column_store_remove(cache->columns, id);
+    if(removed){
+        search_index_update(cache->search, &old, NULL);
+        name_index_update(cache->names, &old, NULL);
+    }
+    if(existed)
+        change_feed_remove(cache->feed, id);
+}
+
+long item_cache_count(struct item_cache *cache){
+    pthread_rwlock_rdlock(&cache->lock);
+    long count = cache->complete ? (long)(cache->used - cache->negative) : -1;
+    pthread_rwlock_unlock(&cache->lock);
+    return count;
+}
+
+char *item_cache_stats(struct item_cache *cache){
+    char *result = NULL;
+
+    pthread_rwlock_rdlock(&cache->lock);
+    asprintf(&result, "SUCCESS\nitems %lu\nnegative %lu\ncomplete %d\nhits %lu\nnegative_hits %lu\nmisses %lu",
+             (unsigned long)(cache->used - cache->negative),
+             (unsigned long)cache->negative,
+             cache->complete,
+             __atomic_load_n(&cache->hits, __ATOMIC_RELAXED),
+             __atomic_load_n(&cache->negative_hits, __ATOMIC_RELAXED),
+             __atomic_load_n(&cache->misses, __ATOMIC_RELAXED));
+    pthread_rwlock_unlock(&cache->lock);
+    return result;
+}
+
+/**
+ * Finds the slot holding id, or the empty slot where it would be inserted.
+ */
+static struct cache_entry *find_slot(struct cache_entry *entries, size_t capacity, int id){
+    // Fibonacci hashing, ids are mostly sequential
+    size_t slot = ((uint32_t)id * 2654435769u) & (capacity - 1);
+
+    while(entries[slot].state != ENTRY_EMPTY && entries[slot].id != id)
+        slot = (slot + 1) & (capacity - 1);
+    return &entries[slot];
+}
+
+/**
+ * Rehashes a full table, dropping negative entries once the cache is complete.
+ * Doubles it unless that leaves it at most half full. Caller holds the write lock.
+ */
+static void grow(struct item_cache *cache){
+    int drop_negative = cache->complete;
+    size_t kept = drop_negative ? cache->used - cache->negative : cache->used;
+    size_t capacity = (kept + 1) * 2 > cache->capacity ? cache->capacity * 2 : cache->capacity;
+    struct cache_entry *entries = (struct cache_entry*)calloc(capacity, sizeof(struct cache_entry));
+    if(entries == NULL){
+        perror("Could not grow item cache");
+        exit(-1);
+    }
+
+    for(size_t i = 0; i < cache->capacity; i++){
+        if(cache->entries[i].state == ENTRY_PRESENT
+           || (cache->entries[i].state == ENTRY_NEGATIVE && !drop_negative))
+            *find_slot(entries, capacity, cache->entries[i].id) = cache->entries[i];
+    }
+
+    free(cache->entries);
+    cache->entries = entries;
+    cache->capacity = capacity;
+    cache->used = kept;
+    if(drop_negative)
+        cache->negative = 0;
+}
+
+/**
+ * Stores an item, or a negative entry when item is NULL. Caller holds the write lock.
+ */
+static struct cache_entry *store(struct item_cache *cache, int id, const Item *item){
+    // Keep the load factor under 0.7
+    if((cache->used + 1) * 10 > cache->capacity * 7)
+        grow(cache);
+
+    struct cache_entry *entry = find_slot(cache->entries, cache->capacity, id);
+    if(entry->state == ENTRY_EMPTY){
+        entry->id = id;
+        cache->used++;
+    } else if(entry->state == ENTRY_NEGATIVE){
+        cache->negative--;
+    }
+
+    if(item != NULL){
+        if(entry->item == NULL){
+            entry->item = (Item*)malloc(sizeof(Item));
+            if(entry->item == NULL){
+                perror("Could not cache item");
+                exit(-1);
+            }
+        }
+        *entry->item = *item;
+        entry->state = ENTRY_PRESENT;
+    } else {
+        free(entry->item);
+        entry->item = NULL;
+        entry->state = ENTRY_NEGATIVE;
+        cache->negative++;
+    }
+    return entry;
+}
@@ -0,0 +1,160 @@
+#ifndef CS469_PROJECT_CACHE_H
+#define CS469_PROJECT_CACHE_H
+
+#include <pthread.h>
+#include <sqlite3.h>
+
+#include "../globals.h"
+
+struct column_store;
+struct search_index;
+struct name_index;
+struct change_feed;
+
+#define CACHE_INITIAL_CAPACITY 1024
+#define CACHE_MAX_NEGATIVE     (64 * 1024)  // Negative entries learned from reads, bounds lookups of random ids
+
+/**
+ * Lookup results
+ */
+#define CACHE_MISS     0    // Unknown id, ask the database
+#define CACHE_HIT      1    // The item was copied out
+#define CACHE_NEGATIVE 2    // The id is known not to exist
+
+/**
+ * Slot states
+ */
+#define ENTRY_EMPTY    0
+#define ENTRY_PRESENT  1
+#define ENTRY_NEGATIVE 2
+
+struct cache_entry {
+    int id;
+    int state;
+    Item *item;             // Only set for ENTRY_PRESENT
+};
+
+/**
+ * Items keyed by id, in an open addressing hash table. Any number of threads
+ * may look items up, but only the writer thread may change them, and only
+ * after the change has been committed to the database.
+ */
+struct item_cache {
+    pthread_rwlock_t lock;
+    struct cache_entry *entries;
+    size_t capacity;        // Always a power of two
+    size_t used;            // Slots that are not ENTRY_EMPTY
+    size_t negative;
+    int complete;           // Every item in the table is cached, so unknown ids don't exist
+    unsigned long generation;
+    sqlite3_int64 version;          // Of the latest committed change (see versions.h), -1 until the writer read it
+    struct column_store *columns;   // Numeric fields again, by column, kept in step with the entries
+    struct search_index *search;    // Trigrams of the names and descriptions, kept in step too
+    struct name_index *names;       // Sorted names, for autocompletion
+    struct change_feed *feed;       // Changes for WATCH, published by the writer after each request
+
+    unsigned long hits;
+    unsigned long negative_hits;
+    unsigned long misses;
+};
+
+/**
+ * Allocates an empty cache, along with its column store, search and name
+ * indexes and change feed.
+ *
+ * @return The cache, or NULL on error
+ */
+struct item_cache *item_cache_create();
+
+/**
+ * Fills the cache, its column store, search and name indexes with every row of the items table.
+ * Once this succeeds the cache is complete and lookups never need the database.
+ *
+ * @param cache
+ * @param stmt Statement selecting every column of every item
+ * @return 0 on success, -1 on error
+ */
+int item_cache_load(struct item_cache *cache, sqlite3_stmt *stmt);
+
+/**
+ * Looks an item up.
+ *
+ * @param cache
+ * @param id
+ * @param item Receives a copy of the item on a hit
+ * @return CACHE_HIT, CACHE_NEGATIVE or CACHE_MISS
+ */
+int item_cache_get(struct item_cache *cache, int id, Item *item);
+
+/**
+ * Current generation. Read it before querying the database on a miss, and
+ * hand it to item_cache_fill() with the result.
+ *
+ * @param cache
+ * @return generation
+ */
+unsigned long item_cache_generation(struct item_cache *cache);
+
+/**
+ * Version of the latest committed change. Doesn't take the lock.
+ *
+ * @param cache
+ * @return The version, or -1 if the writer hasn't started yet
+ */
+sqlite3_int64 item_cache_version(struct item_cache *cache);
+
+/**
+ * Publishes the version of a committed change. Writer thread only, after
+ * recording the change itself, so whoever sees the version sees the change.
+ *
+ * @param cache
+ * @param version
+ */
+void item_cache_set_version(struct item_cache *cache, sqlite3_int64 version);
+
+/**
+ * Caches the result of a database lookup made after a miss. The result is
+ * dropped if the writer changed the cache since `generation`, as it may then be stale.
+ *
+ * @param cache
+ * @param id
+ * @param item The item found, or NULL if it doesn't exist
+ * @param generation Value of item_cache_generation() from before the lookup
+ */
+void item_cache_fill(struct item_cache *cache, int id, const Item *item, unsigned long generation);
+
+/**
+ * Records a committed insert or update, in the column store, search and name
+ * indexes and change feed too. Writer thread only.
+ *
+ * @param cache
+ * @param item
+ */
+void item_cache_put(struct item_cache *cache, const Item *item);
+
+/**
+ * Records that an id no longer exists, after a committed delete, in the
+ * column store, search and name indexes and change feed too. Writer thread only.
+ *
+ * @param cache
+ * @param id
+ */
+void item_cache_remove(struct item_cache *cache, int id);
+
+/**
+ * Number of items in the table, as far as the cache knows.
+ *
+ * @param cache
+ * @return The item count, or -1 if the cache is not complete
+ */
+long item_cache_count(struct item_cache *cache);
+
+/**
+ * Formats the cache counters for the CACHE command.
+ *
+ * @param cache
+ * @return Response string to be freed by the caller
+ */
+char *item_cache_stats(struct item_cache *cache);
+
+#endif //CS469_PROJECT_CACHE_H
@@ -0,0 +1,511 @@
+//
+// Columnar copy of the numeric item fields. FIND and STATS with only numeric
+// predicates are answered here instead of from SQLite: every predicate is compared
+// against a whole block of rows at once with SIMD instructions, giving a
+// bitmap of the rows that match, and the bitmaps of all predicates are ANDed.
+// A block whose bitmap runs empty skips the remaining predicates.
+//
+// AVX2 is used when the CPU has it, otherwise SSE2, which every x86-64 CPU
+// has. Other architectures get the scalar kernels.
+//
+
+#define _GNU_SOURCE
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define COLUMNS_X86
+#endif
+
+#include "columns.h"
+
+/**
+ * A predicate in the form the kernels take. Integer comparisons become the
+ * inclusive range [low, high], or everything outside it when negated.
+ */
+struct filter {
+    int field;
+    int op;
+    double operand;
+    int32_t low;
+    int32_t high;
+    int negate;
+};
+
+#define FILTER_EVALUATE 0
+#define FILTER_NEVER    1
+#define FILTER_ALWAYS   2
+
+static int compile_filters(const struct predicate *predicates, int count, struct filter *filters);
+static int compile_filter(const struct predicate *predicate, struct filter *filter);
+static uint64_t match_rows(struct column_store *store, const struct filter *filters, int count, size_t block);
+static uint64_t match_block(struct column_store *store, const struct filter *filter, size_t row);
+static size_t find_row(struct column_store *store, int id);
+static void set_row(struct column_store *store, size_t row, const Item *item);
+static void insert_row(struct column_store *store, size_t row);
+static void compact(struct column_store *store);
+static void resize(struct column_store *store, size_t capacity);
+
+static inline int row_live(struct column_store *store, size_t row){
+    return (int)((store->live[row / COLUMNS_BLOCK] >> (row % COLUMNS_BLOCK)) & 1);
+}
+
+static inline void set_row_live(struct column_store *store, size_t row, int live){
+    uint64_t bit = (uint64_t)1 << (row % COLUMNS_BLOCK);
+    if(live)
+        store->live[row / COLUMNS_BLOCK] |= bit;
+    else
+        store->live[row / COLUMNS_BLOCK] &= ~bit;
+}
+
+static uint64_t match_ints_scalar(const int32_t *values, int32_t low, int32_t high){
+    uint64_t mask = 0;
+    for(int i = 0; i < COLUMNS_BLOCK; i++)
+        mask |= (uint64_t)(values[i] >= low && values[i] <= high) << i;
+    return mask;
+}
+
+static uint64_t match_doubles_scalar(const double *values, int op, double operand){
+    uint64_t mask = 0;
+    for(int i = 0; i < COLUMNS_BLOCK; i++){
+        int match;
+        switch(op){
+            case OP_EQ: match = values[i] == operand; break;
+            case OP_NE: match = values[i] != operand; break;
+            case OP_LT: match = values[i] < operand; break;
+            case OP_LE: match = values[i] <= operand; break;
+            case OP_GT: match = values[i] > operand; break;
+            default:    match = values[i] >= operand; break;
+        }
+        mask |= (uint64_t)match << i;
+    }
+    return mask;
+}
+
+#ifdef COLUMNS_X86
+static uint64_t match_ints_sse2(const int32_t *values, int32_t low, int32_t high){
+    __m128i below = _mm_set1_epi32(low);
+    __m128i above = _mm_set1_epi32(high);
+    uint64_t outside = 0;
+
+    for(int i = 0; i < COLUMNS_BLOCK; i += 4){
+        __m128i x = _mm_load_si128((const __m128i*)(values + i));
+        __m128i miss = _mm_or_si128(_mm_cmpgt_epi32(below, x), _mm_cmpgt_epi32(x, above));
+        outside |= (uint64_t)_mm_movemask_ps(_mm_castsi128_ps(miss)) << i;
+    }
+    return ~outside;
+}
+
+// The comparison is a macro argument so each operator gets its own loop
+#define SCAN_DOUBLES_SSE2(compare)                                                  \
+    for(int i = 0; i < COLUMNS_BLOCK; i += 2)                                       \
+        mask |= (uint64_t)_mm_movemask_pd(compare(_mm_load_pd(values + i), v)) << i
+
+static uint64_t match_doubles_sse2(const double *values, int op, double operand){
+    __m128d v = _mm_set1_pd(operand);
+    uint64_t mask = 0;
+
+    switch(op){
+        case OP_EQ: SCAN_DOUBLES_SSE2(_mm_cmpeq_pd); break;
+        case OP_NE: SCAN_DOUBLES_SSE2(_mm_cmpneq_pd); break;
+        case OP_LT: SCAN_DOUBLES_SSE2(_mm_cmplt_pd); break;
+        case OP_LE: SCAN_DOUBLES_SSE2(_mm_cmple_pd); break;
+        case OP_GT: SCAN_DOUBLES_SSE2(_mm_cmpgt_pd); break;
+        default:    SCAN_DOUBLES_SSE2(_mm_cmpge_pd); break;
+    }
+    return mask;
+}
+
+__attribute__((target("avx2")))
+static uint64_t match_ints_avx2(const int32_t *values, int32_t low, int32_t high){
+    __m256i below = _mm256_set1_epi32(low);
+    __m256i above = _mm256_set1_epi32(high);
+    uint64_t outside = 0;
+
+    for(int i = 0; i < COLUMNS_BLOCK; i += 8){
+        __m256i x = _mm256_load_si256((const __m256i*)(values + i));
+        __m256i miss = _mm256_or_si256(_mm256_cmpgt_epi32(below, x), _mm256_cmpgt_epi32(x, above));
+        outside |= (uint64_t)_mm256_movemask_ps(_mm256_castsi256_ps(miss)) << i;
+    }
+    return ~outside;
+}
+
+#define SCAN_DOUBLES_AVX2(predicate)                                                                \
+    for(int i = 0; i < COLUMNS_BLOCK; i += 4)                                                       \
+        mask |= (uint64_t)_mm256_movemask_pd(_mm256_cmp_pd(_mm256_load_pd(values + i), v, predicate)) << i
+
+__attribute__((target("avx2")))
+static uint64_t match_doubles_avx2(const double *values, int op, double operand){
+    __m256d v = _mm256_set1_pd(operand);
+    uint64_t mask = 0;
+
+    switch(op){
+        case OP_EQ: SCAN_DOUBLES_AVX2(_CMP_EQ_OQ); break;
+        case OP_NE: SCAN_DOUBLES_AVX2(_CMP_NEQ_UQ); break;
+        case OP_LT: SCAN_DOUBLES_AVX2(_CMP_LT_OQ); break;
+        case OP_LE: SCAN_DOUBLES_AVX2(_CMP_LE_OQ); break;
+        case OP_GT: SCAN_DOUBLES_AVX2(_CMP_GT_OQ); break;
+        default:    SCAN_DOUBLES_AVX2(_CMP_GE_OQ); break;
+    }
+    return mask;
+}
+#endif
+
+struct column_store *column_store_create(){
+    struct column_store *store = (struct column_store*)calloc(1, sizeof(struct column_store));
+    if(store == NULL)
+        return NULL;
+
+    pthread_rwlock_init(&store->lock, NULL);
+    resize(store, COLUMNS_INITIAL_CAPACITY);
+
+    const char *kernels = "scalar";
+    store->match_ints = match_ints_scalar;
+    store->match_doubles = match_doubles_scalar;
+#ifdef COLUMNS_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")){
+        kernels = "AVX2";
+        store->match_ints = match_ints_avx2;
+        store->match_doubles = match_doubles_avx2;
+    } else if(__builtin_cpu_supports("sse2")){
+        kernels = "SSE2";
+        store->match_ints = match_ints_sse2;
+        store->match_doubles = match_doubles_sse2;
+    }
+#endif
+    fprintf(stdout, "Columns: Scanning with %s\n", kernels);
+    return store;
+}
+
+void column_store_put(struct column_store *store, const Item *item){
+    pthread_rwlock_wrlock(&store->lock);
+    size_t row = find_row(store, item->id);
+    if(row == store->rows || ((int32_t*)store->values[0])[row] != item->id)
+        insert_row(store, row);
+    if(!row_live(store, row))
+        store->deleted--;
+
+    set_row(store, row, item);
+    set_row_live(store, row, 1);
+    pthread_rwlock_unlock(&store->lock);
+}
+
+void column_store_remove(struct column_store *store, int id){
+    pthread_rwlock_wrlock(&store->lock);
+    size_t row = find_row(store, id);
+    if(row < store->rows && ((int32_t*)store->values[0])[row] == id && row_live(store, row)){
+        set_row_live(store, row, 0);
+        store->deleted++;
+
+        // Deleted rows still cost scan time, drop them once they are half the store
+        if(store->deleted > COLUMNS_BLOCK && store->deleted * 2 > store->rows)
+            compact(store);
+    }
+    pthread_rwlock_unlock(&store->lock);
+}
+
+void column_store_set_complete(struct column_store *store, int complete){
+    pthread_rwlock_wrlock(&store->lock);
+    store->complete = complete;
+    pthread_rwlock_unlock(&store->lock);
+}
+
+int column_store_supports(const struct predicate *predicate){
+    return item_columns[predicate->field].type != SQLITE_TEXT;
+}
+
+long column_store_find(struct column_store *store, const struct predicate *predicates, int count,
+                       int *ids, size_t max){
+    struct filter filters[FIND_MAX_PREDICATES];
+    int filter_count = compile_filters(predicates, count, filters);
+
+    pthread_rwlock_rdlock(&store->lock);
+    if(!store->complete){
+        pthread_rwlock_unlock(&store->lock);
+        return -1;
+    }
+
+    size_t found = 0;
+    size_t blocks = filter_count < 0 ? 0 : (store->rows + COLUMNS_BLOCK - 1) / COLUMNS_BLOCK;
+    const int32_t *row_ids = (const int32_t*)store->values[0];
+    for(size_t block = 0; block < blocks && found < max; block++){
+        size_t row = block * COLUMNS_BLOCK;
+        uint64_t mask = match_rows(store, filters, filter_count, block);
+
+        while(mask != 0 && found < max){
+            ids[found++] = row_ids[row + __builtin_ctzll(mask)];
+            mask &= mask - 1;
+        }
+    }
+    pthread_rwlock_unlock(&store->lock);
+
+    return (long)found;
+}
+
+int column_store_stats(struct column_store *store, const struct predicate *predicates, int count,
+                       int field, struct column_stats *stats){
+    struct filter filters[FIND_MAX_PREDICATES];
+    int filter_count = compile_filters(predicates, count, filters);
+
+    pthread_rwlock_rdlock(&store->lock);
+    if(!store->complete){
+        pthread_rwlock_unlock(&store->lock);
+        return -1;
+    }
+
+    size_t blocks = filter_count < 0 ? 0 : (store->rows + COLUMNS_BLOCK - 1) / COLUMNS_BLOCK;
+    int floating = item_columns[field].type == SQLITE_FLOAT;
+    for(size_t block = 0; block < blocks; block++){
+        size_t row = block * COLUMNS_BLOCK;
+        uint64_t mask = match_rows(store, filters, filter_count, block);
+
+        for(; mask != 0; mask &= mask - 1){
+            size_t i = row + __builtin_ctzll(mask);
+            column_stats_add(stats, floating ? ((const double*)store->values[field])[i]
+                                             : ((const int32_t*)store->values[field])[i]);
+        }
+    }
+    pthread_rwlock_unlock(&store->lock);
+
+    return 0;
+}
+
+void column_stats_init(struct column_stats *stats, int buckets, double low, double high){
+    memset(stats, 0, sizeof(struct column_stats));
+    stats->min = INFINITY;
+    stats->max = -INFINITY;
+    stats->buckets = buckets;
+    stats->low = low;
+    stats->high = high;
+}
+
+void column_stats_add(struct column_stats *stats, double value){
+    stats->count++;
+    stats->sum += value;
+    if(value < stats->min)
+        stats->min = value;
+    if(value > stats->max)
+        stats->max = value;
+
+    if(stats->buckets == 0)
+        return;
+    if(value < stats->low){
+        stats->below++;
+    } else if(value > stats->high){
+        stats->above++;
+    } else {
+        int bucket = (int)((value - stats->low) / (stats->high - stats->low) * stats->buckets);
+        stats->histogram[bucket < stats->buckets ? bucket : stats->buckets - 1]++;
+    }
+}
+
+/**
+ * Compiles predicates into filters, leaving out those every row passes.
+ * @return The number of filters, or -1 if no row can match
+ */
+static int compile_filters(const struct predicate *predicates, int count, struct filter *filters){
+    int filter_count = 0;
+    int never = 0;
+
+    for(int i = 0; i < count && i < FIND_MAX_PREDICATES; i++){
+        int kind = compile_filter(&predicates[i], &filters[filter_count]);
+        if(kind == FILTER_NEVER)
+            never = 1;
+        else if(kind == FILTER_EVALUATE)
+            filter_count++;
+    }
+    return never ? -1 : filter_count;
+}
+
+/**
+ * Matches one block of rows against every filter. Caller holds the lock.
+ * @return Bitmap of the live rows passing all of them
+ */
+static uint64_t match_rows(struct column_store *store, const struct filter *filters, int count, size_t block){
+    uint64_t mask = store->live[block];
+    for(int i = 0; i < count && mask != 0; i++)
+        mask &= match_block(store, &filters[i], block * COLUMNS_BLOCK);
+    return mask;
+}
+
+/**
+ * Turns a predicate into a filter. An integer column compared with a
+ * fraction, or with a value out of its range, may match everything or nothing.
+ * @return FILTER_EVALUATE, or FILTER_NEVER or FILTER_ALWAYS if no row needs to be looked at
+ */
+static int compile_filter(const struct predicate *predicate, struct filter *filter){
+    filter->field = predicate->field;
+    filter->op = predicate->op;
+    filter->operand = predicate->number;
+    filter->negate = 0;
+    if(item_columns[predicate->field].type != SQLITE_INTEGER)
+        return FILTER_EVALUATE;
+
+    double value = predicate->number;
+    double low = INT32_MIN;
+    double high = INT32_MAX;
+    switch(predicate->op){
+        case OP_EQ:
+        case OP_NE:
+            filter->negate = predicate->op == OP_NE;
+            if(value != floor(value))
+                return filter->negate ? FILTER_ALWAYS : FILTER_NEVER;
+            low = high = value;
+            break;
+        case OP_LT: high = ceil(value) - 1; break;
+        case OP_LE: high = floor(value); break;
+        case OP_GT: low = floor(value) + 1; break;
+        default:    low = ceil(value); break;
+    }
+
+    low = fmax(low, INT32_MIN);
+    high = fmin(high, INT32_MAX);
+    if(low > high)
+        return filter->negate ? FILTER_ALWAYS : FILTER_NEVER;
+
+    filter->low = (int32_t)low;
+    filter->high = (int32_t)high;
+    return FILTER_EVALUATE;
+}
+
+/**
+ * Matches one block of rows, starting at row, against a filter.
+ * @return Bitmap of the matching rows
+ */
+static uint64_t match_block(struct column_store *store, const struct filter *filter, size_t row){
+    if(item_columns[filter->field].type == SQLITE_FLOAT)
+        return store->match_doubles((const double*)store->values[filter->field] + row, filter->op, filter->operand);
+
+    uint64_t mask = store->match_ints((const int32_t*)store->values[filter->field] + row, filter->low, filter->high);
+    return filter->negate ? ~mask : mask;
+}
+
+/**
+ * Binary search for id. Caller holds the lock.
+ * @return The row holding id, or the row it would be inserted at
+ */
+static size_t find_row(struct column_store *store, int id){
+    const int32_t *ids = (const int32_t*)store->values[0];
+
+    // New items get the highest id yet, so check the end first
+    if(store->rows == 0 || ids[store->rows - 1] < id)
+        return store->rows;
+
+    size_t low = 0;
+    size_t high = store->rows;
+    while(low < high){
+        size_t middle = low + (high - low) / 2;
+        if(ids[middle] < id)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return low;
+}
+
+/**
+ * Copies the numeric fields of an item into a row. Caller holds the write lock.
+ */
+static void set_row(struct column_store *store, size_t row, const Item *item){
+    for(int i = 0; i < ITEM_COLUMN_COUNT; i++){
+        if(item_columns[i].type == SQLITE_INTEGER)
+            ((int32_t*)store->values[i])[row] = (int32_t)item_number(item, i);
+        else if(item_columns[i].type == SQLITE_FLOAT)
+            ((double*)store->values[i])[row] = item_number(item, i);
+    }
+}
+
+/**
+ * Opens up an unset, deleted row at row. Caller holds the write lock.
+ */
+static void insert_row(struct column_store *store, size_t row){
+    if(store->rows == store->capacity)
+        resize(store, store->capacity * 2);
+
+    // Only ids below the highest one land in the middle, SQLite hands out ascending ids
+    if(row < store->rows){
+        for(int i = 0; i < ITEM_COLUMN_COUNT; i++){
+            if(store->values[i] == NULL)
+                continue;
+            size_t width = item_columns[i].type == SQLITE_FLOAT ? sizeof(double) : sizeof(int32_t);
+            char *values = (char*)store->values[i];
+            memmove(values + (row + 1) * width, values + row * width, (store->rows - row) * width);
+        }
+        for(size_t i = store->rows; i > row; i--)
+            set_row_live(store, i, row_live(store, i - 1));
+    }
+
+    set_row_live(store, row, 0);
+    store->rows++;
+    store->deleted++;
+}
+
+/**
+ * Drops the deleted rows, keeping the others in order. Caller holds the write lock.
+ */
+static void compact(struct column_store *store){
+    size_t kept = 0;
+
+    for(size_t row = 0; row < store->rows; row++){
+        if(!row_live(store, row))
+            continue;
+        if(kept != row){
+            for(int i = 0; i < ITEM_COLUMN_COUNT; i++){
+                if(item_columns[i].type == SQLITE_INTEGER)
+                    ((int32_t*)store->values[i])[kept] = ((int32_t*)store->values[i])[row];
+                else if(item_columns[i].type == SQLITE_FLOAT)
+                    ((double*)store->values[i])[kept] = ((double*)store->values[i])[row];
+            }
+        }
+        kept++;
+    }
+
+    // Every row below kept is live now
+    memset(store->live, 0, store->capacity / COLUMNS_BLOCK * sizeof(uint64_t));
+    for(size_t block = 0; block < kept / COLUMNS_BLOCK; block++)
+        store->live[block] = ~(uint64_t)0;
+    if(kept % COLUMNS_BLOCK != 0)
+        store->live[kept / COLUMNS_BLOCK] = ((uint64_t)1 << (kept % COLUMNS_BLOCK)) - 1;
+
+    store->rows = kept;
+    store->deleted = 0;
+}
+
+/**
+ * Moves every column to aligned arrays of the given capacity. Rows past the
+ * end are zeroed, the kernels read whole blocks. Caller holds the write lock.
+ */
+static void resize(struct column_store *store, size_t capacity){
+    for(int i = 0; i < ITEM_COLUMN_COUNT; i++){
+        if(item_columns[i].type == SQLITE_TEXT)
+            continue;
+
+        size_t width = item_columns[i].type == SQLITE_FLOAT ? sizeof(double) : sizeof(int32_t);
+        void *values;
+        if(posix_memalign(&values, COLUMNS_ALIGNMENT, capacity * width) != 0){
+            perror("Could not grow column store");
+            exit(-1);
+        }
+        memset(values, 0, capacity * width);
+        if(store->values[i] != NULL)
+            memcpy(values, store->values[i], store->rows * width);
+
+        free(store->values[i]);
+        store->values[i] = values;
+    }
+
+    uint64_t *live = (uint64_t*)calloc(capacity / COLUMNS_BLOCK, sizeof(uint64_t));
+    if(live == NULL){
+        perror("Could not grow column store");
+        exit(-1);
+    }
+    if(store->live != NULL)
+        memcpy(live, store->live, store->capacity / COLUMNS_BLOCK * sizeof(uint64_t));
+
+    free(store->live);
+    store->live = live;
+    store->capacity = capacity;
+}
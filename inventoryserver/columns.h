@@ -0,0 +1,142 @@
+#ifndef CS469_PROJECT_COLUMNS_H
+#define CS469_PROJECT_COLUMNS_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "query.h"
+
+#define COLUMNS_BLOCK            64     // Rows per word of a selection bitmap
+#define COLUMNS_ALIGNMENT        64
+#define COLUMNS_INITIAL_CAPACITY (16 * COLUMNS_BLOCK)
+#define STATS_MAX_BUCKETS        1000
+
+/**
+ * The numeric fields of every item, one array per item_columns entry, with
+ * row i of each array belonging to the same item. Rows are kept in id order.
+ * Deleted rows stay in place until a compaction, with their bit cleared in
+ * `live`.
+ *
+ * Only the writer thread changes the store, through the item cache (see
+ * item_cache_put()). Never take the item cache lock while holding this one.
+ */
+struct column_store {
+    pthread_rwlock_t lock;
+    void *values[ITEM_COLUMN_COUNT];    // int32_t or double by item_columns type, NULL for text
+    uint64_t *live;                     // One bit per row
+    size_t rows;                        // Rows in use, deleted ones included
+    size_t capacity;                    // Always a multiple of COLUMNS_BLOCK
+    size_t deleted;
+    int complete;                       // Every item in the table is stored
+
+    // Scan kernels for the best instruction set of this CPU, each matching one block of rows
+    uint64_t (*match_ints)(const int32_t *values, int32_t low, int32_t high);
+    uint64_t (*match_doubles)(const double *values, int op, double operand);
+};
+
+/**
+ * Aggregates of one numeric field over a set of items, and optionally a
+ * histogram of `buckets` equal buckets spanning [low, high].
+ */
+struct column_stats {
+    unsigned long count;
+    double min;
+    double max;
+    double sum;
+
+    int buckets;                        // 0 for no histogram
+    double low;
+    double high;
+    unsigned long below;                // Values under low
+    unsigned long above;                // Values over high
+    unsigned long histogram[STATS_MAX_BUCKETS];
+};
+
+/**
+ * Allocates an empty store and picks the scan kernels for this CPU.
+ *
+ * @return The store, or NULL on error
+ */
+struct column_store *column_store_create();
+
+/**
+ * Records a committed insert or update. Writer thread only.
+ *
+ * @param store
+ * @param item
+ */
+void column_store_put(struct column_store *store, const Item *item);
+
+/**
+ * Records a committed delete. Writer thread only.
+ *
+ * @param store
+ * @param id
+ */
+void column_store_remove(struct column_store *store, int id);
+
+/**
+ * Marks the store as holding every item, once the initial load succeeded.
+ * Scans of an incomplete store fail.
+ *
+ * @param store
+ * @param complete
+ */
+void column_store_set_complete(struct column_store *store, int complete);
+
+/**
+ * Tells whether a predicate can be evaluated by column_store_find().
+ *
+ * @param predicate
+ * @return 1 for predicates on numeric fields, 0 otherwise
+ */
+int column_store_supports(const struct predicate *predicate);
+
+/**
+ * Finds the ids of the items matching all predicates, in id order. The
+ * predicates are evaluated over whole columns with vector compares, a block
+ * of rows at a time, into selection bitmaps.
+ *
+ * @param store
+ * @param predicates Predicates accepted by column_store_supports()
+ * @param count
+ * @param ids Receives at most max ids
+ * @param max
+ * @return The number of ids written, or -1 if the store is not complete
+ */
+long column_store_find(struct column_store *store, const struct predicate *predicates, int count,
+                       int *ids, size_t max);
+
+/**
+ * Computes the aggregates of a numeric field over the items matching all
+ * predicates, in a single scan of the store.
+ *
+ * @param store
+ * @param predicates Predicates accepted by column_store_supports()
+ * @param count
+ * @param field Index into item_columns of a numeric field
+ * @param stats Set up by column_stats_init()
+ * @return 0 on success, -1 if the store is not complete
+ */
+int column_store_stats(struct column_store *store, const struct predicate *predicates, int count,
+                       int field, struct column_stats *stats);
+
+/**
+ * Empties a set of aggregates.
+ *
+ * @param stats
+ * @param buckets Histogram buckets, at most STATS_MAX_BUCKETS, or 0
+ * @param low Lower end of the histogram
+ * @param high Upper end of the histogram, the last bucket includes it
+ */
+void column_stats_init(struct column_stats *stats, int buckets, double low, double high);
+
+/**
+ * Adds a value to a set of aggregates.
+ *
+ * @param stats
+ * @param value
+ */
+void column_stats_add(struct column_stats *stats, double value);
+
+#endif //CS469_PROJECT_COLUMNS_H
@@ -0,0 +1,107 @@
+//
+// Change feed behind WATCH. Clients used to download the whole table after
+// each of their own writes, and never heard about anyone else's. Now the
+// writer hands each request's changes to the I/O threads as one small
+// event, which they copy by reference to every watching connection.
+//
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "feed.h"
+#include "statements.h"
+
+static int start_event(struct change_feed *feed);
+
+struct change_feed *change_feed_create(){
+    struct change_feed *feed = (struct change_feed*)calloc(1, sizeof(struct change_feed));
+    if(feed == NULL)
+        return NULL;
+
+    pthread_mutex_init(&feed->lock, NULL);
+    atomic_init(&feed->watchers, 0);
+    return feed;
+}
+
+int change_feed_add_queue(struct change_feed *feed, struct queue_root *queue){
+    pthread_mutex_lock(&feed->lock);
+    if(feed->queue_count == feed->queue_capacity){
+        int capacity = feed->queue_capacity ? feed->queue_capacity * 2 : 8;
+        struct queue_root **queues = (struct queue_root**)realloc(feed->queues, capacity * sizeof(struct queue_root*));
+        if(queues == NULL){
+            pthread_mutex_unlock(&feed->lock);
+            return -1;
+        }
+        feed->queues = queues;
+        feed->queue_capacity = capacity;
+    }
+    feed->queues[feed->queue_count++] = queue;
+    pthread_mutex_unlock(&feed->lock);
+    return 0;
+}
+
+void change_feed_watchers(struct change_feed *feed, int delta){
+    atomic_fetch_add_explicit(&feed->watchers, delta, memory_order_relaxed);
+}
+
+void change_feed_put(struct change_feed *feed, const Item *item){
+    if(start_event(feed) != 0)
+        return;
+
+    fputs("PUT ", feed->pending);
+    print_item(feed->pending, item);
+    fputc(RECORD_SEPARATOR, feed->pending);
+}
+
+void change_feed_remove(struct change_feed *feed, int id){
+    if(start_event(feed) != 0)
+        return;
+
+    fprintf(feed->pending, "DEL %d%c", id, RECORD_SEPARATOR);
+}
+
+void change_feed_publish(struct change_feed *feed){
+    if(feed->pending == NULL)
+        return;
+
+    int failed = fclose(feed->pending) != 0;
+    feed->pending = NULL;
+    struct shared_buffer *buffer = failed ? NULL : shared_buffer_wrap(feed->pending_data, feed->pending_length);
+    if(buffer == NULL){
+        fprintf(stderr, "Feed: Could not publish changes, watchers will miss them\n");
+        free(feed->pending_data);
+        feed->pending_data = NULL;
+        return;
+    }
+    feed->pending_data = NULL;
+
+    // One message per reactor, each holding a reference to the same payload
+    pthread_mutex_lock(&feed->lock);
+    for(int i = 0; i < feed->queue_count; i++){
+        struct queue_head *event = alloc_queue_message();
+        INIT_QUEUE_HEAD_SHARED(event, buffer, NULL);
+        event->flags = RESPONSE_EVENT;
+        queue_put(event, feed->queues[i]);
+    }
+    pthread_mutex_unlock(&feed->lock);
+
+    shared_buffer_release(buffer);
+}
+
+/**
+ * Opens the event of the current request, unless nobody is watching.
+ * @return 0 if changes should be recorded, -1 otherwise
+ */
+static int start_event(struct change_feed *feed){
+    if(feed->pending != NULL)
+        return 0;
+    if(atomic_load_explicit(&feed->watchers, memory_order_relaxed) == 0)
+        return -1;
+
+    feed->pending = open_memstream(&feed->pending_data, &feed->pending_length);
+    if(feed->pending == NULL)
+        return -1;
+    fputs("EVENT ", feed->pending);
+    return 0;
+}
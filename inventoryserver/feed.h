@@ -0,0 +1,84 @@
+#ifndef CS469_PROJECT_FEED_H
+#define CS469_PROJECT_FEED_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+
+#include "../globals.h"
+#include "queue.h"
+
+/**
+ * Committed changes to the items table, pushed to the connections that sent
+ * WATCH. While anyone watches, the item cache records every change the
+ * writer thread commits for a request, and once the request is done they go
+ * out together as one event:
+ *
+ *   EVENT PUT <item><RS>DEL <id><RS>...
+ *
+ * with the item in the GET ALL format. PUT covers inserts and updates alike.
+ * The event is queued once on every reactor, each of which passes it on to
+ * its own watchers.
+ */
+struct change_feed {
+    pthread_mutex_t lock;           // Guards the queues, reactors are added while the writer runs
+    struct queue_root **queues;     // Response queues of the reactors
+    int queue_count;
+    int queue_capacity;
+    atomic_long watchers;           // Over every reactor. Nothing is recorded while there are none
+
+    FILE *pending;                  // Event of the current request, writer thread only
+    char *pending_data;
+    size_t pending_length;
+};
+
+/**
+ * Allocates a feed with no reactors.
+ *
+ * @return The feed, or NULL on error
+ */
+struct change_feed *change_feed_create();
+
+/**
+ * Adds a reactor's response queue to those receiving events.
+ *
+ * @param feed
+ * @param queue
+ * @return 0 on success, -1 on error
+ */
+int change_feed_add_queue(struct change_feed *feed, struct queue_root *queue);
+
+/**
+ * Counts connections starting or stopping to watch. Reactor threads only.
+ *
+ * @param feed
+ * @param delta 1 or -1
+ */
+void change_feed_watchers(struct change_feed *feed, int delta);
+
+/**
+ * Records a committed insert or update. Writer thread only.
+ *
+ * @param feed
+ * @param item
+ */
+void change_feed_put(struct change_feed *feed, const Item *item);
+
+/**
+ * Records a committed delete. Writer thread only.
+ *
+ * @param feed
+ * @param id
+ */
+void change_feed_remove(struct change_feed *feed, int id);
+
+/**
+ * Sends the changes recorded since the last call to every reactor, as
+ * messages flagged RESPONSE_EVENT with no connection. Does nothing if there
+ * were none. Writer thread only, after each request.
+ *
+ * @param feed
+ */
+void change_feed_publish(struct change_feed *feed);
+
+#endif //CS469_PROJECT_FEED_H
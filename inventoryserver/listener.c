@@ -0,0 +1,322 @@
+//
+// Acceptor threads, see listener.h. Accepting is only the handoff of a new
+// socket to an I/O thread, the TLS handshake happens there, so an acceptor
+// spends nearly all its time waiting in accept() and a few of them are
+// enough for any connection rate the I/O threads can take.
+//
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "listener.h"
+#include "network.h"
+#include "reactor.h"
+
+static void *acceptor_thread(void *data);
+static void count_accept(struct acceptor *acceptor);
+static void sample_queue(struct acceptor *acceptor);
+static int queue_length(int socketfd, unsigned int *length, unsigned int *backlog);
+static int port_in_use(unsigned int port);
+static int listen_counters(unsigned long *overflows, unsigned long *drops);
+
+struct listener *listener_open(unsigned int port, int acceptors, int backlog){
+    if(port_in_use(port)){
+        fprintf(stderr, "Listener: Port %u is already in use\n", port);
+        return NULL;
+    }
+
+    struct listener *listener = (struct listener*)calloc(1, sizeof(struct listener));
+    if(listener == NULL)
+        return NULL;
+    listener->acceptors = (struct acceptor*)calloc(acceptors, sizeof(struct acceptor));
+    if(listener->acceptors == NULL){
+        free(listener);
+        return NULL;
+    }
+    listener->count = acceptors;
+    listener->backlog = backlog;
+    atomic_init(&listener->next_reactor, 0);
+    atomic_init(&listener->accepted, 0);
+    atomic_init(&listener->errors, 0);
+    atomic_init(&listener->full, 0);
+    atomic_init(&listener->peak, 0);
+
+    for(int i = 0; i < acceptors; i++){
+        struct acceptor *acceptor = &listener->acceptors[i];
+        acceptor->id = i;
+        acceptor->listener = listener;
+        acceptor->socketfd = -1;
+        for(int j = 0; j < ACCEPT_RATE_WINDOW; j++){
+            atomic_init(&acceptor->seconds[j].second, 0);
+            atomic_init(&acceptor->seconds[j].count, 0);
+        }
+    }
+
+    int first = create_socket(port, backlog, acceptors > 1);
+    if(first < 0 && acceptors > 1){
+        fprintf(stderr, "Listener: SO_REUSEPORT unavailable (%s), acceptors share one socket\n", strerror(errno));
+        listener->shared = 1;
+        first = create_socket(port, backlog, 0);
+    }
+    if(first < 0){
+        fprintf(stderr, "Listener: Could not listen on port %u: %s\n", port, strerror(errno));
+        listener_close(listener);
+        return NULL;
+    }
+    listener->acceptors[0].socketfd = first;
+
+    for(int i = 1; i < acceptors; i++){
+        int s = listener->shared ? first : create_socket(port, backlog, 1);
+        if(s < 0){
+            fprintf(stderr, "Listener: Could not listen on port %u: %s\n", port, strerror(errno));
+            listener_close(listener);
+            return NULL;
+        }
+        listener->acceptors[i].socketfd = s;
+    }
+
+    if(listen_counters(&listener->overflows, &listener->drops) != 0)
+        listener->overflows = listener->drops = 0;
+    return listener;
+}
+
+int listener_start(struct listener *listener, struct reactor **reactors, int reactor_count){
+    listener->reactors = reactors;
+    listener->reactor_count = reactor_count;
+
+    for(int i = 0; i < listener->count; i++){
+        int err = pthread_create(&listener->acceptors[i].thread, NULL, acceptor_thread, &listener->acceptors[i]);
+        if(err != 0){
+            fprintf(stderr, "Listener: Could not start acceptor %d: %d\n", i, err);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void listener_wait(struct listener *listener){
+    for(int i = 0; i < listener->count; i++)
+        pthread_join(listener->acceptors[i].thread, NULL);
+}
+
+void listener_close(struct listener *listener){
+    for(int i = 0; i < listener->count; i++){
+        // A shared socket only belongs to the first acceptor
+        if(listener->acceptors[i].socketfd >= 0 && !(listener->shared && i > 0))
+            close(listener->acceptors[i].socketfd);
+    }
+    free(listener->acceptors);
+    free(listener);
+}
+
+char *listener_stats(struct listener *listener){
+    long now = (long)time(NULL);
+    unsigned long recent = 0;
+    unsigned int queued = 0;
+
+    for(int i = 0; i < listener->count; i++){
+        struct acceptor *acceptor = &listener->acceptors[i];
+        for(int j = 0; j < ACCEPT_RATE_WINDOW; j++){
+            long second = atomic_load_explicit(&acceptor->seconds[j].second, memory_order_acquire);
+            // Whole seconds only, the current one is still being counted
+            if(second < now && second >= now - ACCEPT_RATE_WINDOW)
+                recent += atomic_load_explicit(&acceptor->seconds[j].count, memory_order_relaxed);
+        }
+
+        unsigned int length, backlog;
+        if((!listener->shared || i == 0) && queue_length(acceptor->socketfd, &length, &backlog) == 0)
+            queued += length;
+    }
+
+    char *result = NULL;
+    size_t size = 0;
+    FILE *out = open_memstream(&result, &size);
+    if(out == NULL)
+        return NULL;
+
+    fprintf(out, "SUCCESS\nacceptors %d\nbacklog %d\naccepted %lu\naccept_rate %.1f\naccept_errors %lu\n"
+                 "queued %u\nqueue_peak %u\nqueue_full %lu",
+            listener->count, listener->backlog,
+            atomic_load_explicit(&listener->accepted, memory_order_relaxed),
+            (double)recent / ACCEPT_RATE_WINDOW,
+            atomic_load_explicit(&listener->errors, memory_order_relaxed),
+            queued,
+            atomic_load_explicit(&listener->peak, memory_order_relaxed),
+            atomic_load_explicit(&listener->full, memory_order_relaxed));
+
+    unsigned long overflows, drops;
+    if(listen_counters(&overflows, &drops) == 0)
+        fprintf(out, "\nlisten_overflows %lu\nlisten_drops %lu", overflows - listener->overflows, drops - listener->drops);
+
+    if(fclose(out) != 0){
+        free(result);
+        return NULL;
+    }
+    return result;
+}
+
+/**
+ * Accepts connections until accept() fails for good, spreading them over the I/O threads.
+ * @param data acceptor
+ * @return NULL
+ */
+static void *acceptor_thread(void *data){
+    struct acceptor *acceptor = (struct acceptor*)data;
+    struct listener *listener = acceptor->listener;
+
+    while(1){
+        int client = accept4(acceptor->socketfd, NULL, NULL, SOCK_CLOEXEC);
+        if(client < 0){
+            if(errno == EINTR)
+                continue;
+            atomic_fetch_add_explicit(&listener->errors, 1, memory_order_relaxed);
+            if(errno == ECONNABORTED || errno == EPROTO)
+                continue;
+            if(errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM){
+                // Connections keep queueing meanwhile, retrying at once would only spin
+                fprintf(stderr, "Acceptor %d: Failed to accept client: %s\n", acceptor->id, strerror(errno));
+                usleep(ACCEPT_RETRY_DELAY);
+                continue;
+            }
+            fprintf(stderr, "Acceptor %d: Failed to accept client: %s\n", acceptor->id, strerror(errno));
+            break;
+        }
+
+        count_accept(acceptor);
+        sample_queue(acceptor);
+
+        unsigned int next = atomic_fetch_add_explicit(&listener->next_reactor, 1, memory_order_relaxed);
+        reactor_add_connection(listener->reactors[next % listener->reactor_count], client);
+    }
+
+    return NULL;
+}
+
+/**
+ * Counts a connection in the total and in the current second. Only the
+ * acceptor itself writes its seconds.
+ * @param acceptor
+ */
+static void count_accept(struct acceptor *acceptor){
+    long now = (long)time(NULL);
+    struct accept_second *slot = &acceptor->seconds[now % ACCEPT_RATE_WINDOW];
+
+    if(atomic_load_explicit(&slot->second, memory_order_relaxed) != now){
+        atomic_store_explicit(&slot->count, 0, memory_order_relaxed);
+        atomic_store_explicit(&slot->second, now, memory_order_release);
+    }
+    atomic_fetch_add_explicit(&slot->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&acceptor->listener->accepted, 1, memory_order_relaxed);
+}
+
+/**
+ * Records how many connections were still waiting behind the one just accepted.
+ * @param acceptor
+ */
+static void sample_queue(struct acceptor *acceptor){
+    struct listener *listener = acceptor->listener;
+    unsigned int length, backlog;
+
+    if(queue_length(acceptor->socketfd, &length, &backlog) != 0)
+        return;
+
+    // The kernel queues up to backlog + 1, so it was full before this accept and may have turned connections away
+    if(length >= backlog)
+        atomic_fetch_add_explicit(&listener->full, 1, memory_order_relaxed);
+
+    unsigned int peak = atomic_load_explicit(&listener->peak, memory_order_relaxed);
+    while(length > peak && !atomic_compare_exchange_weak_explicit(&listener->peak, &peak, length,
+                                                                 memory_order_relaxed, memory_order_relaxed));
+}
+
+/**
+ * Reads the accept queue of a listening socket. For those, Linux reports the
+ * queue length in tcpi_unacked and its limit in tcpi_sacked.
+ * @param socketfd
+ * @param length Receives the number of connections waiting to be accepted
+ * @param backlog Receives the limit the kernel applies
+ * @return 0 on success, -1 on error
+ */
+static int queue_length(int socketfd, unsigned int *length, unsigned int *backlog){
+    struct tcp_info info;
+    socklen_t size = sizeof(info);
+
+    if(getsockopt(socketfd, IPPROTO_TCP, TCP_INFO, &info, &size) != 0 || info.tcpi_state != TCP_LISTEN)
+        return -1;
+    *length = info.tcpi_unacked;
+    *backlog = info.tcpi_sacked;
+    return 0;
+}
+
+/**
+ * Whether some socket already listens on the port. With SO_REUSEPORT a second
+ * server started by mistake would otherwise share the port and silently get
+ * half of the connections.
+ * @param port
+ * @return 1 if the port is taken, 0 otherwise
+ */
+static int port_in_use(unsigned int port){
+    struct sockaddr_in addr;
+    int on = 1;
+
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+    int s = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(s < 0)
+        return 0;
+    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    int in_use = bind(s, (struct sockaddr*)&addr, sizeof(addr)) < 0 && errno == EADDRINUSE;
+    close(s);
+    return in_use;
+}
+
+/**
+ * Reads the kernel's ListenOverflows and ListenDrops from /proc/net/netstat,
+ * a line of names followed by a line of values.
+ * @param overflows Accept queue overflows
+ * @param drops Connections dropped by listening sockets, overflows included
+ * @return 0 on success, -1 if they aren't available
+ */
+static int listen_counters(unsigned long *overflows, unsigned long *drops){
+    FILE *file = fopen("/proc/net/netstat", "r");
+    if(file == NULL)
+        return -1;
+
+    char *names = NULL, *values = NULL;
+    size_t names_size = 0, values_size = 0;
+    int found = 0;
+    while(getline(&names, &names_size, file) > 0 && getline(&values, &values_size, file) > 0){
+        if(strncmp(names, "TcpExt:", 7) != 0)
+            continue;
+
+        char *name_save, *value_save;
+        char *name = strtok_r(names, " \n", &name_save);
+        char *value = strtok_r(values, " \n", &value_save);
+        while(name != NULL && value != NULL){
+            if(strcmp(name, "ListenOverflows") == 0){
+                *overflows = strtoul(value, NULL, 10);
+                found |= 1;
+            } else if(strcmp(name, "ListenDrops") == 0){
+                *drops = strtoul(value, NULL, 10);
+                found |= 2;
+            }
+            name = strtok_r(NULL, " \n", &name_save);
+            value = strtok_r(NULL, " \n", &value_save);
+        }
+        break;
+    }
+
+    free(names);
+    free(values);
+    fclose(file);
+    return found == 3 ? 0 : -1;
+}
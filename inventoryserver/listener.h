@@ -0,0 +1,115 @@
+#ifndef CS469_PROJECT_LISTENER_H
+#define CS469_PROJECT_LISTENER_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+#define DEFAULT_ACCEPTORS    2
+#define ACCEPT_RATE_WINDOW   10     // Seconds the accept rate is averaged over
+#define ACCEPT_RETRY_DELAY   10000  // us to wait before accepting again when out of descriptors or memory
+
+struct reactor;
+
+/**
+ * Connections accepted by an acceptor during one second, for the accept rate.
+ */
+struct accept_second {
+    _Atomic long second;
+    _Atomic unsigned long count;
+};
+
+/**
+ * A thread accepting connections from its own listening socket and handing
+ * them to the I/O threads.
+ */
+struct acceptor {
+    pthread_t thread;
+    int id;
+    int socketfd;
+    struct listener *listener;
+    struct accept_second seconds[ACCEPT_RATE_WINDOW];
+};
+
+/**
+ * The server's listening port. Every acceptor binds its own socket to it with
+ * SO_REUSEPORT, and the kernel spreads incoming connections over their accept
+ * queues, so a burst of clients neither waits on one thread nor overflows a
+ * single queue. Where SO_REUSEPORT isn't available the acceptors share one
+ * socket instead.
+ *
+ * A connection that completes its handshake while the accept queue is full is
+ * dropped by the kernel, and the client retries its SYN a second later. The
+ * counters show whether that happens: the longest queue any acceptor saw, how
+ * often one found its queue full, and the host's ListenOverflows and ListenDrops
+ * since the server started.
+ */
+struct listener {
+    struct acceptor *acceptors;
+    int count;
+    int backlog;
+    int shared;                     // Every acceptor accepts from the first one's socket
+    struct reactor **reactors;
+    int reactor_count;
+    _Atomic unsigned int next_reactor;
+
+    _Atomic unsigned long accepted;
+    _Atomic unsigned long errors;
+    _Atomic unsigned long full;     // Times an acceptor found its queue at the backlog
+    _Atomic unsigned int peak;      // Longest accept queue seen by an acceptor
+    unsigned long overflows;        // Host wide ListenOverflows when the listener opened
+    unsigned long drops;            // Host wide ListenDrops when the listener opened
+};
+
+/**
+ * Binds the listening sockets. Fails if another process already listens on
+ * the port, even one that also uses SO_REUSEPORT.
+ *
+ * @param port
+ * @param acceptors Number of acceptor threads, at least 1
+ * @param backlog Length of each acceptor's accept queue, capped by net.core.somaxconn
+ * @return The listener, or NULL on error
+ */
+struct listener *listener_open(unsigned int port, int acceptors, int backlog);
+
+/**
+ * Starts the acceptor threads.
+ *
+ * @param listener
+ * @param reactors I/O threads accepted connections are spread over
+ * @param reactor_count
+ * @return 0 on success, -1 on error
+ */
+int listener_start(struct listener *listener, struct reactor **reactors, int reactor_count);
+
+/**
+ * Waits for the acceptor threads, which only return on an error accept() can't recover from.
+ *
+ * @param listener
+ */
+void listener_wait(struct listener *listener);
+
+/**
+ * Closes the listening sockets and frees the listener. The acceptors must have returned.
+ *
+ * @param listener
+ */
+void listener_close(struct listener *listener);
+
+/**
+ * Answers ACCEPTS:
+ *
+ *   SUCCESS\nacceptors <n>\nbacklog <n>\naccepted <n>\naccept_rate <per second>\n
+ *   accept_errors <n>\nqueued <n>\nqueue_peak <n>\nqueue_full <n>\n
+ *   listen_overflows <n>\nlisten_drops <n>
+ *
+ * queued is the number of connections waiting to be accepted right now, the
+ * accept rate is averaged over the last ACCEPT_RATE_WINDOW whole seconds. The
+ * listen counters are the kernel's, for every socket on the host, and are
+ * omitted where the kernel doesn't provide them.
+ *
+ * @param listener
+ * @return The response to be freed by the caller, or NULL on error
+ */
+char *listener_stats(struct listener *listener);
+
+#endif //CS469_PROJECT_LISTENER_H
@@ -0,0 +1,432 @@
+//
+// Counters and histograms, see metrics.h. Every update is a handful of
+// relaxed atomic adds on global state, nothing is ever locked or allocated,
+// and readers copy the buckets out before summing them, so a report may be
+// a few events behind but never blocks the threads being measured.
+//
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "../globals.h"
+#include "../buckets.h"
+#include "metrics.h"
+
+#define METRICS_MAX_QUEUES   256
+#define METRICS_HTTP_TIMEOUT 2     // Seconds a scraper gets to send its request
+#define METRICS_HTTP_REQUEST 4096  // Request line and headers, anything longer is cut off
+
+struct histogram {
+    _Atomic uint64_t count;
+    _Atomic uint64_t sum;           // us
+    _Atomic uint64_t max;           // us
+    _Atomic uint64_t buckets[BUCKET_COUNT];
+};
+
+struct tracked_queue {
+    int queue;
+    struct queue_root *root;
+};
+
+static const char *op_names[METRIC_OP_COUNT] = {"auth", "resume", "get", "put", "mod", "del", "sync", "other"};
+static const char *queue_names[METRIC_QUEUE_COUNT] = {"writer", "reader", "auth"};
+
+// Upper bounds of the Prometheus buckets, in us. The histograms are far finer, these are what a dashboard plots
+static const uint64_t export_bounds[] = {50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000,
+                                         100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000};
+
+static struct histogram requests[METRIC_OP_COUNT];
+static struct histogram queue_waits[METRIC_QUEUE_COUNT];
+static struct histogram handshakes;
+static _Atomic uint64_t resumed_handshakes;
+static _Atomic uint64_t bytes_in;
+static _Atomic uint64_t bytes_out;
+static _Atomic long connections;
+
+// Filled in at startup, before the threads that read them exist
+static struct tracked_queue queues[METRICS_MAX_QUEUES];
+static int queue_count;
+static char *privileged_users[METRICS_MAX_USERS];
+static int privileged_count;
+
+static void record(struct histogram *histogram, uint64_t value);
+static uint64_t snapshot(struct histogram *histogram, uint64_t *buckets);
+static void report_histogram(FILE *out, const char *name, struct histogram *histogram);
+static void export_histogram(FILE *out, const char *name, const char *label, const char *value,
+                             struct histogram *histogram);
+static long total_depth(int queue);
+static void *metrics_thread(void *data);
+static void serve_scrape(int client);
+
+int metrics_op(const char *payload, size_t length){
+    static const struct { const char *prefix; int op; } prefixes[] = {
+            {"AUTH ", METRIC_OP_AUTH}, {"RESUME ", METRIC_OP_RESUME}, {"GET ", METRIC_OP_GET},
+            {"PUT ", METRIC_OP_PUT}, {"MPUT ", METRIC_OP_PUT}, {"MOD ", METRIC_OP_MOD},
+            {"MMOD ", METRIC_OP_MOD}, {"DEL ", METRIC_OP_DEL}, {"MDEL ", METRIC_OP_DEL}};
+
+    for(size_t i = 0; i < sizeof(prefixes) / sizeof(prefixes[0]); i++){
+        size_t prefix = strlen(prefixes[i].prefix);
+        if(length >= prefix && strncmp(payload, prefixes[i].prefix, prefix) == 0)
+            return prefixes[i].op;
+    }
+    if(length == 4 && strncmp(payload, "SYNC", 4) == 0)
+        return METRIC_OP_SYNC;
+    return METRIC_OP_OTHER;
+}
+
+void metrics_request(int op, uint64_t started){
+    if(started == 0 || op < 0 || op >= METRIC_OP_COUNT)
+        return;
+    record(&requests[op], (metrics_now() - started) / 1000);
+}
+
+void metrics_add_queue(int queue, struct queue_root *root){
+    if(queue_count < METRICS_MAX_QUEUES){
+        queues[queue_count].queue = queue;
+        queues[queue_count].root = root;
+        queue_count++;
+    }
+}
+
+void metrics_dequeued(int queue, const struct queue_head *msg){
+    // The backup timer's SYNC and the writer's first message aren't stamped
+    if(msg->queued != 0)
+        record(&queue_waits[queue], (metrics_now() - msg->queued) / 1000);
+}
+
+void metrics_handshake(uint64_t started, int resumed){
+    record(&handshakes, (metrics_now() - started) / 1000);
+    if(resumed)
+        atomic_fetch_add_explicit(&resumed_handshakes, 1, memory_order_relaxed);
+}
+
+void metrics_bytes(size_t in, size_t out){
+    if(in > 0)
+        atomic_fetch_add_explicit(&bytes_in, in, memory_order_relaxed);
+    if(out > 0)
+        atomic_fetch_add_explicit(&bytes_out, out, memory_order_relaxed);
+}
+
+void metrics_connections(int delta){
+    atomic_fetch_add_explicit(&connections, delta, memory_order_relaxed);
+}
+
+int metrics_set_users(const char *users){
+    char *list = strdup(users);
+    char *save = NULL;
+
+    if(list == NULL)
+        return -1;
+    for(char *user = strtok_r(list, ", ", &save); user != NULL; user = strtok_r(NULL, ", ", &save)){
+        if(privileged_count == METRICS_MAX_USERS){
+            free(list);
+            return -1;
+        }
+        privileged_users[privileged_count++] = strdup(user);
+    }
+    free(list);
+    return 0;
+}
+
+int metrics_privileged(const char *username){
+    for(int i = 0; i < privileged_count; i++){
+        if(privileged_users[i] != NULL && strcmp(privileged_users[i], username) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+char *metrics_report(){
+    char *result = NULL;
+    size_t size = 0;
+    char name[64];
+
+    FILE *out = open_memstream(&result, &size);
+    if(out == NULL)
+        return NULL;
+
+    fprintf(out, "SUCCESS");
+    for(int i = 0; i < METRIC_OP_COUNT; i++){
+        snprintf(name, sizeof(name), "request_%s", op_names[i]);
+        report_histogram(out, name, &requests[i]);
+    }
+    for(int i = 0; i < METRIC_QUEUE_COUNT; i++){
+        snprintf(name, sizeof(name), "queue_%s_wait", queue_names[i]);
+        report_histogram(out, name, &queue_waits[i]);
+        fprintf(out, "\nqueue_%s_depth %ld", queue_names[i], total_depth(i));
+    }
+    report_histogram(out, "tls_handshake", &handshakes);
+    fprintf(out, "\ntls_resumed %lu\nbytes_in %lu\nbytes_out %lu\nconnections %ld",
+            (unsigned long)atomic_load_explicit(&resumed_handshakes, memory_order_relaxed),
+            (unsigned long)atomic_load_explicit(&bytes_in, memory_order_relaxed),
+            (unsigned long)atomic_load_explicit(&bytes_out, memory_order_relaxed),
+            atomic_load_explicit(&connections, memory_order_relaxed));
+
+    if(fclose(out) != 0){
+        free(result);
+        return NULL;
+    }
+    return result;
+}
+
+char *metrics_prometheus(){
+    char *result = NULL;
+    size_t size = 0;
+
+    FILE *out = open_memstream(&result, &size);
+    if(out == NULL)
+        return NULL;
+
+    fprintf(out, "# HELP inventory_request_duration_seconds Time from reading a request to its answer being ready to send.\n"
+                 "# TYPE inventory_request_duration_seconds histogram\n");
+    for(int i = 0; i < METRIC_OP_COUNT; i++)
+        export_histogram(out, "inventory_request_duration_seconds", "op", op_names[i], &requests[i]);
+
+    fprintf(out, "# HELP inventory_queue_wait_seconds Time requests wait for a database or auth thread.\n"
+                 "# TYPE inventory_queue_wait_seconds histogram\n");
+    for(int i = 0; i < METRIC_QUEUE_COUNT; i++)
+        export_histogram(out, "inventory_queue_wait_seconds", "queue", queue_names[i], &queue_waits[i]);
+
+    fprintf(out, "# HELP inventory_queue_depth Requests waiting for a database or auth thread.\n"
+                 "# TYPE inventory_queue_depth gauge\n");
+    for(int i = 0; i < METRIC_QUEUE_COUNT; i++)
+        fprintf(out, "inventory_queue_depth{queue=\"%s\"} %ld\n", queue_names[i], total_depth(i));
+
+    fprintf(out, "# HELP inventory_tls_handshake_seconds Time from accepting a connection to its TLS handshake completing.\n"
+                 "# TYPE inventory_tls_handshake_seconds histogram\n");
+    export_histogram(out, "inventory_tls_handshake_seconds", NULL, NULL, &handshakes);
+
+    fprintf(out, "# HELP inventory_tls_resumed_total TLS handshakes that resumed a session.\n"
+                 "# TYPE inventory_tls_resumed_total counter\n"
+                 "inventory_tls_resumed_total %lu\n"
+                 "# HELP inventory_received_bytes_total Bytes of requests read from clients.\n"
+                 "# TYPE inventory_received_bytes_total counter\n"
+                 "inventory_received_bytes_total %lu\n"
+                 "# HELP inventory_sent_bytes_total Bytes of responses written to clients.\n"
+                 "# TYPE inventory_sent_bytes_total counter\n"
+                 "inventory_sent_bytes_total %lu\n"
+                 "# HELP inventory_connections Open client connections.\n"
+                 "# TYPE inventory_connections gauge\n"
+                 "inventory_connections %ld\n",
+            (unsigned long)atomic_load_explicit(&resumed_handshakes, memory_order_relaxed),
+            (unsigned long)atomic_load_explicit(&bytes_in, memory_order_relaxed),
+            (unsigned long)atomic_load_explicit(&bytes_out, memory_order_relaxed),
+            atomic_load_explicit(&connections, memory_order_relaxed));
+
+    if(fclose(out) != 0){
+        free(result);
+        return NULL;
+    }
+    return result;
+}
+
+int metrics_serve(unsigned int port){
+    struct sockaddr_in addr;
+    int on = 1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    int s = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(s < 0)
+        return -1;
+    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if(bind(s, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(s, 16) < 0){
+        int saved = errno;
+        close(s);
+        errno = saved;
+        return -1;
+    }
+
+    pthread_t thread;
+    if(pthread_create(&thread, NULL, metrics_thread, (void*)(intptr_t)s) != 0){
+        close(s);
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+/**
+ * Adds a value to a histogram.
+ * @param histogram
+ * @param value us
+ */
+static void record(struct histogram *histogram, uint64_t value){
+    atomic_fetch_add_explicit(&histogram->buckets[bucket_index(value)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->sum, value, memory_order_relaxed);
+
+    uint64_t max = atomic_load_explicit(&histogram->max, memory_order_relaxed);
+    while(value > max && !atomic_compare_exchange_weak_explicit(&histogram->max, &max, value,
+                                                               memory_order_relaxed, memory_order_relaxed));
+}
+
+/**
+ * Copies the buckets of a histogram.
+ * @param histogram
+ * @param buckets Receives BUCKET_COUNT counts
+ * @return The number of values in the copy
+ */
+static uint64_t snapshot(struct histogram *histogram, uint64_t *buckets){
+    uint64_t total = 0;
+
+    for(int i = 0; i < BUCKET_COUNT; i++){
+        buckets[i] = atomic_load_explicit(&histogram->buckets[i], memory_order_relaxed);
+        total += buckets[i];
+    }
+    return total;
+}
+
+/**
+ * Writes the METRICS line of a histogram.
+ * @param out
+ * @param name
+ * @param histogram
+ */
+static void report_histogram(FILE *out, const char *name, struct histogram *histogram){
+    uint64_t buckets[BUCKET_COUNT];
+    uint64_t total = snapshot(histogram, buckets);
+    uint64_t sum = atomic_load_explicit(&histogram->sum, memory_order_relaxed);
+    uint64_t max = atomic_load_explicit(&histogram->max, memory_order_relaxed);
+
+    fprintf(out, "\n%s count %lu mean %lu p50 %lu p90 %lu p99 %lu p999 %lu max %lu", name,
+            (unsigned long)total, (unsigned long)(total > 0 ? sum / total : 0),
+            (unsigned long)bucket_percentile(buckets, total, max, 0.5),
+            (unsigned long)bucket_percentile(buckets, total, max, 0.9),
+            (unsigned long)bucket_percentile(buckets, total, max, 0.99),
+            (unsigned long)bucket_percentile(buckets, total, max, 0.999),
+            (unsigned long)(total > 0 ? max : 0));
+}
+
+/**
+ * Writes a histogram as Prometheus buckets, sum and count.
+ * @param out
+ * @param name
+ * @param label Label telling the series of the metric apart, or NULL
+ * @param value Value of the label
+ * @param histogram
+ */
+static void export_histogram(FILE *out, const char *name, const char *label, const char *value,
+                             struct histogram *histogram){
+    uint64_t buckets[BUCKET_COUNT];
+    uint64_t total = snapshot(histogram, buckets);
+    uint64_t sum = atomic_load_explicit(&histogram->sum, memory_order_relaxed);
+    char prefix[64] = "";
+    uint64_t below = 0;
+    int i = 0;
+
+    if(label != NULL)
+        snprintf(prefix, sizeof(prefix), "%s=\"%s\",", label, value);
+
+    for(size_t b = 0; b < sizeof(export_bounds) / sizeof(export_bounds[0]); b++){
+        for(; i < BUCKET_COUNT && bucket_end(i) <= export_bounds[b] + 1; i++)
+            below += buckets[i];
+        fprintf(out, "%s_bucket{%sle=\"%g\"} %lu\n", name, prefix, (double)export_bounds[b] / 1e6,
+                (unsigned long)below);
+    }
+    fprintf(out, "%s_bucket{%sle=\"+Inf\"} %lu\n", name, prefix, (unsigned long)total);
+
+    if(label != NULL)
+        snprintf(prefix, sizeof(prefix), "{%s=\"%s\"}", label, value);
+    fprintf(out, "%s_sum%s %.6f\n%s_count%s %lu\n", name, prefix, (double)sum / 1e6, name, prefix,
+            (unsigned long)total);
+}
+
+/**
+ * Sums the depths of the queues of one kind.
+ * @param queue METRIC_QUEUE_*
+ * @return Messages waiting
+ */
+static long total_depth(int queue){
+    long depth = 0;
+
+    for(int i = 0; i < queue_count; i++){
+        if(queues[i].queue == queue)
+            depth += queue_depth(queues[i].root);
+    }
+    return depth;
+}
+
+/**
+ * Answers scrapers one at a time. A scrape takes microseconds, and the
+ * endpoint only listens on the loopback address.
+ * @param data listening socket
+ * @return NULL
+ */
+static void *metrics_thread(void *data){
+    int s = (int)(intptr_t)data;
+
+    while(1){
+        int client = accept4(s, NULL, NULL, SOCK_CLOEXEC);
+        if(client < 0){
+            if(errno == EINTR || errno == ECONNABORTED)
+                continue;
+            fprintf(stderr, "Metrics: Failed to accept scraper: %s\n", strerror(errno));
+            usleep(100000);
+            continue;
+        }
+        serve_scrape(client);
+        close(client);
+    }
+
+    return NULL;
+}
+
+/**
+ * Reads one HTTP request and answers GET /metrics, anything else with 404.
+ * @param client
+ */
+static void serve_scrape(int client){
+    struct timeval timeout = {METRICS_HTTP_TIMEOUT, 0};
+    char request[METRICS_HTTP_REQUEST];
+    size_t length = 0;
+
+    // A scraper that never sends its request must not keep the others out
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    while(length < sizeof(request) - 1){
+        ssize_t n = recv(client, request + length, sizeof(request) - 1 - length, 0);
+        if(n <= 0)
+            return;
+        length += (size_t)n;
+        request[length] = '\0';
+        if(strstr(request, "\r\n\r\n") != NULL || strstr(request, "\n\n") != NULL)
+            break;
+    }
+
+    char *body = NULL;
+    const char *status = "404 Not Found";
+    if(strncmp(request, "GET /metrics ", 13) == 0 || strncmp(request, "GET /metrics?", 13) == 0){
+        body = metrics_prometheus();
+        status = body != NULL ? "200 OK" : "500 Internal Server Error";
+    }
+
+    char *response = NULL;
+    int n = asprintf(&response, "HTTP/1.0 %s\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                                "Content-Length: %zu\r\nConnection: close\r\n\r\n%s",
+                     status, body != NULL ? strlen(body) : 0, body != NULL ? body : "");
+    free(body);
+    if(n < 0)
+        return;
+
+    for(size_t sent = 0; sent < (size_t)n; ){
+        ssize_t w = send(client, response + sent, (size_t)n - sent, MSG_NOSIGNAL);
+        if(w <= 0)
+            break;
+        sent += (size_t)w;
+    }
+    free(response);
+}
@@ -0,0 +1,161 @@
+#ifndef CS469_PROJECT_METRICS_H
+#define CS469_PROJECT_METRICS_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include "queue.h"
+
+/**
+ * Server wide counters and latency histograms, updated with relaxed atomics
+ * from whichever thread sees the event and read without stopping anyone.
+ *
+ * Histograms are log-linear, HDR style, with the buckets of buckets.h: any
+ * value is recorded within 1/16 of its size, from 1 us up to about 19 hours,
+ * in a fixed 4 KB.
+ *
+ * They are reported by the METRICS command, to the users listed in
+ * METRICS_USERS, and in the Prometheus text format at
+ * http://127.0.0.1:<METRICS_PORT>/metrics.
+ */
+
+#define METRICS_MAX_USERS     16
+#define DEFAULT_METRICS_PORT  9466   // 0 turns the endpoint off
+
+/**
+ * Request types, each with its own latency histogram. Measured on the I/O
+ * thread, from a request's frame being read to its reply, the last chunk of
+ * a streamed one, coming back from the thread that answered it. SYNC is also
+ * measured on the writer when the backup timer asks for it.
+ */
+#define METRIC_OP_AUTH    0
+#define METRIC_OP_RESUME  1
+#define METRIC_OP_GET     2
+#define METRIC_OP_PUT     3
+#define METRIC_OP_MOD     4
+#define METRIC_OP_DEL     5
+#define METRIC_OP_SYNC    6
+#define METRIC_OP_OTHER   7   // PAGE, FIND, STATS, SEARCH, COMPLETE, CACHE...
+#define METRIC_OP_COUNT   8
+
+/**
+ * Queues whose depth and wait, from being queued by the I/O thread to being
+ * picked up, are measured.
+ */
+#define METRIC_QUEUE_WRITER  0
+#define METRIC_QUEUE_READER  1
+#define METRIC_QUEUE_AUTH    2
+#define METRIC_QUEUE_COUNT   3
+
+/**
+ * Monotonic clock, in nanoseconds.
+ */
+static inline uint64_t metrics_now(){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
+
+/**
+ * Classifies a request by its first word.
+ *
+ * @param payload
+ * @param length
+ * @return One of METRIC_OP_*
+ */
+int metrics_op(const char *payload, size_t length);
+
+/**
+ * Records the latency of a request.
+ *
+ * @param op METRIC_OP_*
+ * @param started metrics_now() when the request arrived, 0 if it wasn't timed
+ */
+void metrics_request(int op, uint64_t started);
+
+/**
+ * Counts a queue's messages in the depth of its kind. Called at startup,
+ * before anything reads the metrics.
+ *
+ * @param queue METRIC_QUEUE_*
+ * @param root
+ */
+void metrics_add_queue(int queue, struct queue_root *root);
+
+/**
+ * Records how long a request waited in a queue, from its queued stamp.
+ *
+ * @param queue METRIC_QUEUE_*
+ * @param msg The request just taken off the queue
+ */
+void metrics_dequeued(int queue, const struct queue_head *msg);
+
+/**
+ * Records a finished TLS handshake.
+ *
+ * @param started metrics_now() when the connection was accepted
+ * @param resumed Whether a previous session was resumed
+ */
+void metrics_handshake(uint64_t started, int resumed);
+
+/**
+ * Counts TLS payload bytes read from and written to clients.
+ *
+ * @param in
+ * @param out
+ */
+void metrics_bytes(size_t in, size_t out);
+
+/**
+ * Counts connections opened and closed.
+ *
+ * @param delta 1 for a new connection, -1 for a closed one
+ */
+void metrics_connections(int delta);
+
+/**
+ * Sets who may send METRICS, from the METRICS_USERS config field.
+ *
+ * @param users Comma separated user names. Copied
+ * @return 0 on success, -1 if there are more than METRICS_MAX_USERS
+ */
+int metrics_set_users(const char *users);
+
+/**
+ * Whether a user may send METRICS.
+ *
+ * @param username
+ * @return 1 if it may, 0 otherwise
+ */
+int metrics_privileged(const char *username);
+
+/**
+ * Answers METRICS:
+ *
+ *   SUCCESS\n<histogram> count <n> mean <us> p50 <us> p90 <us> p99 <us> p999 <us> max <us>\n...
+ *   queue_<queue>_depth <n>\n...tls_resumed <n>\nbytes_in <n>\nbytes_out <n>\nconnections <n>
+ *
+ * with a histogram line for every request type, request_<op>, the wait on
+ * every kind of queue, queue_<queue>_wait, and TLS handshakes, tls_handshake.
+ *
+ * @return The response to be freed by the caller, or NULL on error
+ */
+char *metrics_report();
+
+/**
+ * Renders every metric in the Prometheus text exposition format.
+ *
+ * @return The text to be freed by the caller, or NULL on error
+ */
+char *metrics_prometheus();
+
+/**
+ * Starts a thread serving metrics_prometheus() over HTTP on the loopback address.
+ *
+ * @param port
+ * @return 0 on success, -1 if the port couldn't be bound
+ */
+int metrics_serve(unsigned int port);
+
+#endif //CS469_PROJECT_METRICS_H
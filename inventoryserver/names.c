@@ -0,0 +1,233 @@
+//
+// COMPLETE command, for autocompleting item names as they are typed. Names
+// are kept in one sorted array, so a prefix is a binary search away from its
+// first match and the rest follow it. Inserts and deletes move part of the
+// array, but they come from the writer thread, which waits on a commit for
+// each of them anyway.
+//
+
+#define _GNU_SOURCE
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "names.h"
+
+static void insert_slot(struct name_index *index, struct name_entry *entry);
+static void remove_slot(struct name_index *index, int id, const char *name);
+static size_t lower_bound(const struct name_index *index, uint64_t head, const char *name, int id);
+static int compare_slot(const struct name_slot *slot, uint64_t head, const char *name, int id);
+static int compare_names(const char *a, const char *b);
+static int has_prefix(const char *name, const char *prefix);
+static uint64_t name_head(const char *name);
+
+static inline unsigned char fold(unsigned char c){
+    return c >= 'A' && c <= 'Z' ? (unsigned char)(c - 'A' + 'a') : c;
+}
+
+static int compare_slots(const void *a, const void *b){
+    const struct name_slot *y = (const struct name_slot*)b;
+    return compare_slot((const struct name_slot*)a, y->head, y->entry->name, y->entry->id);
+}
+
+struct name_index *name_index_create(){
+    struct name_index *index = (struct name_index*)calloc(1, sizeof(struct name_index));
+    if(index == NULL)
+        return NULL;
+
+    index->capacity = NAMES_INITIAL_CAPACITY;
+    index->slots = (struct name_slot*)malloc(index->capacity * sizeof(struct name_slot));
+    if(index->slots == NULL){
+        free(index);
+        return NULL;
+    }
+    pthread_rwlock_init(&index->lock, NULL);
+    return index;
+}
+
+void name_index_update(struct name_index *index, const Item *old, const Item *item){
+    // Most updates leave the name alone
+    if(old != NULL && item != NULL && strcmp(old->name, item->name) == 0)
+        return;
+
+    struct name_entry *entry = NULL;
+    if(item != NULL){
+        size_t length = strnlen(item->name, BUFFER_SIZE - 1);
+        entry = (struct name_entry*)malloc(sizeof(struct name_entry) + length + 1);
+        if(entry == NULL){
+            perror("Could not add to name index");
+            exit(-1);
+        }
+        entry->id = item->id;
+        memcpy(entry->name, item->name, length);
+        entry->name[length] = '\0';
+    }
+
+    pthread_rwlock_wrlock(&index->lock);
+    if(old != NULL)
+        remove_slot(index, old->id, old->name);
+    if(entry != NULL)
+        insert_slot(index, entry);
+    pthread_rwlock_unlock(&index->lock);
+}
+
+void name_index_set_complete(struct name_index *index, int complete){
+    pthread_rwlock_wrlock(&index->lock);
+    if(complete && !index->complete)
+        qsort(index->slots, index->count, sizeof(struct name_slot), compare_slots);
+    index->complete = complete;
+    pthread_rwlock_unlock(&index->lock);
+}
+
+char *complete_names(struct item_cache *cache, const char *request){
+    int limit = 0;
+    int end = -1;
+    if(sscanf(request, "COMPLETE %d%n", &limit, &end) != 1 || end < 0 || limit <= 0 || limit > NAMES_MAX_RESULTS)
+        return NULL;
+
+    // An empty prefix lists the first names
+    const char *prefix = request + end;
+    if(*prefix == ' ')
+        prefix++;
+    else if(*prefix != '\0')
+        return NULL;
+    if(strlen(prefix) >= BUFFER_SIZE)
+        return NULL;
+
+    char *result = NULL;
+    size_t length = 0;
+    FILE *out = open_memstream(&result, &length);
+    if(out == NULL)
+        return NULL;
+
+    struct name_index *index = cache->names;
+    pthread_rwlock_rdlock(&index->lock);
+    if(!index->complete){
+        pthread_rwlock_unlock(&index->lock);
+        fclose(out);
+        free(result);
+        return NULL;
+    }
+
+    fputs("SUCCESS ", out);
+    int found = 0;
+    for(size_t i = lower_bound(index, name_head(prefix), prefix, INT_MIN);
+        i < index->count && found < limit && has_prefix(index->slots[i].entry->name, prefix); i++){
+        if(found++ > 0)
+            fputc(RECORD_SEPARATOR, out);
+        fprintf(out, "%d\n%s", index->slots[i].entry->id, index->slots[i].entry->name);
+    }
+    pthread_rwlock_unlock(&index->lock);
+    fputc(GROUP_SEPARATOR, out);
+
+    if(fclose(out) != 0){
+        free(result);
+        return NULL;
+    }
+    return result;
+}
+
+/**
+ * Adds a name in its place, or at the end while loading. Caller holds the write lock.
+ */
+static void insert_slot(struct name_index *index, struct name_entry *entry){
+    if(index->count == index->capacity){
+        size_t capacity = index->capacity * 2;
+        struct name_slot *slots = (struct name_slot*)realloc(index->slots, capacity * sizeof(struct name_slot));
+        if(slots == NULL){
+            perror("Could not grow name index");
+            exit(-1);
+        }
+        index->slots = slots;
+        index->capacity = capacity;
+    }
+
+    uint64_t head = name_head(entry->name);
+    size_t at = index->complete ? lower_bound(index, head, entry->name, entry->id) : index->count;
+    memmove(index->slots + at + 1, index->slots + at, (index->count - at) * sizeof(struct name_slot));
+    index->slots[at].head = head;
+    index->slots[at].entry = entry;
+    index->count++;
+}
+
+/**
+ * Drops the name of an item, if present. Caller holds the write lock.
+ */
+static void remove_slot(struct name_index *index, int id, const char *name){
+    size_t at = index->count;
+    if(index->complete){
+        at = lower_bound(index, name_head(name), name, id);
+        if(at < index->count && index->slots[at].entry->id != id)
+            at = index->count;
+    } else {
+        for(size_t i = 0; i < index->count && at == index->count; i++){
+            if(index->slots[i].entry->id == id)
+                at = i;
+        }
+    }
+    if(at == index->count)
+        return;
+
+    free(index->slots[at].entry);
+    memmove(index->slots + at, index->slots + at + 1, (index->count - at - 1) * sizeof(struct name_slot));
+    index->count--;
+}
+
+/**
+ * Binary search of a sorted index.
+ * @return Position of the first slot not ordered before name and id
+ */
+static size_t lower_bound(const struct name_index *index, uint64_t head, const char *name, int id){
+    size_t low = 0;
+    size_t high = index->count;
+    while(low < high){
+        size_t middle = low + (high - low) / 2;
+        if(compare_slot(&index->slots[middle], head, name, id) < 0)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return low;
+}
+
+/**
+ * Orders a slot against a name and id, by the heads first, which agree with
+ * the names whenever they differ.
+ */
+static int compare_slot(const struct name_slot *slot, uint64_t head, const char *name, int id){
+    if(slot->head != head)
+        return slot->head < head ? -1 : 1;
+
+    int c = compare_names(slot->entry->name, name);
+    if(c != 0)
+        return c;
+    return (slot->entry->id > id) - (slot->entry->id < id);
+}
+
+/**
+ * strcasecmp() for ASCII only, whatever the locale.
+ */
+static int compare_names(const char *a, const char *b){
+    while(*a != '\0' && fold(*a) == fold(*b)){
+        a++;
+        b++;
+    }
+    return (int)fold(*a) - (int)fold(*b);
+}
+
+static int has_prefix(const char *name, const char *prefix){
+    while(*prefix != '\0' && fold(*name) == fold(*prefix)){
+        name++;
+        prefix++;
+    }
+    return *prefix == '\0';
+}
+
+static uint64_t name_head(const char *name){
+    uint64_t head = 0;
+    for(int i = 0; i < 8; i++){
+        unsigned char c = *name != '\0' ? fold(*name++) : 0;
+        head = head << 8 | c;
+    }
+    return head;
+}
@@ -0,0 +1,86 @@
+#ifndef CS469_PROJECT_NAMES_H
+#define CS469_PROJECT_NAMES_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "cache.h"
+
+#define NAMES_INITIAL_CAPACITY 1024
+#define NAMES_MAX_RESULTS      100
+
+/**
+ * An item's name, allocated along with it.
+ */
+struct name_entry {
+    int id;
+    char name[];
+};
+
+/**
+ * Element of the sorted array. The start of the name is kept next to the
+ * pointer, so a binary search mostly compares integers and rarely follows it.
+ */
+struct name_slot {
+    uint64_t head;          // First 8 bytes of the name, case folded, big endian, zero padded
+    struct name_entry *entry;
+};
+
+/**
+ * Item names sorted ignoring ASCII case, then by id, for prefix lookups. Only
+ * the writer thread changes it, through the item cache (see item_cache_put()).
+ * Never take the item cache lock while holding this one.
+ */
+struct name_index {
+    pthread_rwlock_t lock;
+    struct name_slot *slots;
+    size_t count;
+    size_t capacity;
+    int complete;           // Every item is in. Until then slots are appended unsorted
+};
+
+/**
+ * Allocates an empty index.
+ *
+ * @return The index, or NULL on error
+ */
+struct name_index *name_index_create();
+
+/**
+ * Records a committed insert, update or delete. Writer thread only.
+ *
+ * @param index
+ * @param old The item as it was, or NULL for an insert or if it is unknown
+ * @param item The item as it is now, or NULL for a delete
+ */
+void name_index_update(struct name_index *index, const Item *old, const Item *item);
+
+/**
+ * Marks the index as covering every item, once the initial load succeeded,
+ * and sorts it. Lookups in an incomplete index fail.
+ *
+ * @param index
+ * @param complete
+ */
+void name_index_set_complete(struct name_index *index, int complete);
+
+/**
+ * Answers a COMPLETE request:
+ *
+ *   COMPLETE <count> <prefix>
+ *
+ * with the first count (at most NAMES_MAX_RESULTS) items whose name starts
+ * with prefix, ignoring ASCII case, in name order:
+ *
+ *   SUCCESS <id>\n<name><RS><id>\n<name>...<GS>
+ *
+ * Cheap enough to send on every keystroke, it is a binary search and a short
+ * scan of the index.
+ *
+ * @param cache
+ * @param request The COMPLETE request
+ * @return The response to be freed by the caller, or NULL if the request is invalid or failed
+ */
+char *complete_names(struct item_cache *cache, const char *request);
+
+#endif //CS469_PROJECT_NAMES_H
@@ -4,25 +4,33 @@
 
 #include "network.h"
 #include <netdb.h>
+#include <netinet/tcp.h>
 
-int create_socket(unsigned int port){
+int create_socket(unsigned int port, int backlog, int reuseport){
     int s;
     struct sockaddr_in addr;
+    int on = 1;
 
     addr.sin_family = AF_INET;
     addr.sin_port = htons(port);
     addr.sin_addr.s_addr = htonl(INADDR_ANY);
 
-    s = socket(AF_INET, SOCK_STREAM, 0);
+    s = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
     if(s < 0){
         return -1;
     }
 
-    if(bind(s, (struct sockaddr*)&addr, sizeof(addr)) < 0)
-        return -1;
+    // A restart must not wait for the previous run's connections to leave TIME_WAIT
+    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
 
-    if(listen(s, 1) < 0)
+    if((reuseport && setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0)
+       || bind(s, (struct sockaddr*)&addr, sizeof(addr)) < 0
+       || listen(s, backlog) < 0){
+        int error = errno;
+        close(s);
+        errno = error;
         return -1;
+    }
 
     return s;
 }
@@ -53,6 +61,10 @@ int create_client_socket(char* hostname, unsigned int port){
         return -1;
     }
 
+    // The REPLICATE command follows the last handshake message, don't hold it back for an ACK
+    int nodelay = 1;
+    setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
     return sockfd;
 }
 
@@ -78,7 +90,7 @@ SSL_CTX* create_new_context(){
     return ssl_ctx;
 }
 
-SSL_CTX* create_new_client_context() {
+SSL_CTX* create_new_client_context(const struct tls_options *options) {
 	OpenSSL_add_all_algorithms();
     if (SSL_library_init() < 0) {
         fprintf(stderr, "Could not initialize SSL\n");
@@ -94,12 +106,20 @@ SSL_CTX* create_new_client_context() {
     }
 
     SSL_CTX_set_options(ssl_ctx, SSL_OP_NO_SSLv2);
+    // Only ever connects to the backup server, so later syncs resume the first one's session
+    if (tls_configure(ssl_ctx, options) != 0 || tls_enable_client_sessions(ssl_ctx) != 0) {
+        SSL_CTX_free(ssl_ctx);
+        return NULL;
+    }
 
 	return ssl_ctx;
 }
 
-int configure_context(SSL_CTX* ssl_ctx){
+int configure_context(SSL_CTX* ssl_ctx, const struct tls_options *options){
     SSL_CTX_set_ecdh_auto(ssl_ctx, 1);
+    if(tls_configure(ssl_ctx, options) != 0)
+        return -1;
+    tls_enable_server_sessions(ssl_ctx, "inventoryserver");
 
     if(SSL_CTX_use_certificate_file(ssl_ctx, CERTIFICATE_FILE, SSL_FILETYPE_PEM) <= 0)
         return -1;
@@ -16,19 +16,29 @@
 #include <openssl/ssl.h>
 #include <openssl/err.h>
 
+#include "../tls.h"
+
 #define CERTIFICATE_FILE  "cert.pem"
 #define KEY_FILE          "key.pem"
 #define USE_OPENSSL
 
 static pthread_mutex_t *lockarray;
 
-int create_socket(unsigned int port);
+/**
+ * Creates a socket listening on every address at the given port.
+ *
+ * @param port
+ * @param backlog Length of the accept queue
+ * @param reuseport Whether other sockets may listen on the port too, with SO_REUSEPORT
+ * @return The socket, or -1 with errno set on error
+ */
+int create_socket(unsigned int port, int backlog, int reuseport);
 int create_client_socket(char* hostname, unsigned int port);
 void init_openssl();
 void cleanup_openssl();
 SSL_CTX* create_new_context();
-SSL_CTX* create_new_client_context();
-int configure_context(SSL_CTX* ssl_ctx);
+SSL_CTX* create_new_client_context(const struct tls_options *options);
+int configure_context(SSL_CTX* ssl_ctx, const struct tls_options *options);
 
 
 
@@ -0,0 +1,197 @@
+//
+// PAGE command. Walks the items table in any sort order a page at a time,
+// using keyset pagination: the cursor handed to the client holds the sort key
+// of the last item it got, and the next page is read from the index right
+// after it. The server keeps no state between pages.
+//
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+
+#include "page.h"
+
+static char *encode_cursor(int column, int descending, sqlite3_stmt *stmt);
+static int decode_cursor(const char *cursor, int column, int descending, sqlite3_int64 *id, char *value, size_t size);
+
+char *page_items(struct db_statements *statements, const char *request){
+    char sort[BUFFER_SIZE];
+    char cursor[PAGE_MAX_CURSOR + 1] = "";
+    int size;
+
+    if(sscanf(request, "PAGE %d %255s %1024s", &size, sort, cursor) < 2)
+        return NULL;
+    if(size <= 0 || size > PAGE_MAX_SIZE)
+        return NULL;
+
+    int descending = sort[0] == '-';
+    const char *field = descending ? sort + 1 : sort;
+    int column = item_column_find(field);
+    if(column < 0)
+        return NULL;
+
+    sqlite3_int64 after_id = 0;
+    char after_value[BUFFER_SIZE];
+    int first = cursor[0] == '\0';
+    if(!first && decode_cursor(cursor, column, descending, &after_id, after_value, sizeof(after_value)) != 0)
+        return NULL;
+
+    // Column names come from item_columns, never from the request. ?1 is the
+    // sort key and ?2 the id of the last item sent, ?3 the number of rows
+    const char *name = item_columns[column].column;
+    const char *direction = descending ? "DESC" : "ASC";
+    const char *compare = descending ? "<" : ">";
+    char sql[BUFFER_SIZE * 2];
+    if(column == 0 && first)
+        snprintf(sql, sizeof(sql), "SELECT * FROM items ORDER BY id %s LIMIT ?3", direction);
+    else if(column == 0)
+        snprintf(sql, sizeof(sql), "SELECT * FROM items WHERE id %s ?2 ORDER BY id %s LIMIT ?3", compare, direction);
+    else if(first)
+        snprintf(sql, sizeof(sql), "SELECT * FROM items ORDER BY %s %s, id %s LIMIT ?3", name, direction, direction);
+    else
+        // (key, id) > (?1, ?2) would only seek on key and then walk every item sharing it.
+        // Split in two, each half is a single index seek
+        snprintf(sql, sizeof(sql),
+                 "SELECT * FROM (SELECT * FROM items WHERE %s = ?1 AND id %s ?2 ORDER BY id %s LIMIT ?3) "
+                 "UNION ALL "
+                 "SELECT * FROM (SELECT * FROM items WHERE %s %s ?1 ORDER BY %s %s, id %s LIMIT ?3) "
+                 "ORDER BY %s %s, id %s LIMIT ?3",
+                 name, compare, direction,
+                 name, compare, name, direction, direction,
+                 name, direction, direction);
+
+    sqlite3_stmt *stmt = db_statement_sql(statements, sql);
+    if(stmt == NULL)
+        return NULL;
+
+    if(!first && column != 0){
+        switch(item_columns[column].type){
+            case SQLITE_INTEGER:
+                sqlite3_bind_int64(stmt, 1, strtoll(after_value, NULL, 10));
+                break;
+            case SQLITE_FLOAT:
+                sqlite3_bind_double(stmt, 1, strtod(after_value, NULL));
+                break;
+            default:
+                sqlite3_bind_text(stmt, 1, after_value, -1, SQLITE_TRANSIENT);
+                break;
+        }
+    }
+    if(!first)
+        sqlite3_bind_int64(stmt, 2, after_id);
+    // One extra row tells whether there is a next page
+    sqlite3_bind_int(stmt, 3, size + 1);
+
+    char *items = NULL;
+    size_t length = 0;
+    FILE *out = open_memstream(&items, &length);
+    if(out == NULL){
+        sqlite3_reset(stmt);
+        return NULL;
+    }
+
+    char *next = NULL;
+    int rows = 0;
+    int r;
+    while((r = sqlite3_step(stmt)) == SQLITE_ROW){
+        if(rows == size)
+            break;
+        if(rows > 0)
+            fputc(RECORD_SEPARATOR, out);
+        print_item_row(out, stmt);
+        rows++;
+
+        // Remember the key of the last item sent, the extra row only proves there is more
+        if(rows == size)
+            next = encode_cursor(column, descending, stmt);
+    }
+    fputc(GROUP_SEPARATOR, out);
+    fclose(out);
+
+    int more = r == SQLITE_ROW;
+    sqlite3_reset(stmt);
+
+    if((r != SQLITE_ROW && r != SQLITE_DONE) || (more && next == NULL)){
+        free(items);
+        free(next);
+        return NULL;
+    }
+
+    char *response = NULL;
+    asprintf(&response, "SUCCESS %s\n%s", more ? next : "-", items);
+    free(items);
+    free(next);
+    return response;
+}
+
+/**
+ * Encodes the sort key of the current row as a cursor. The sort it belongs to
+ * is part of the cursor, so it can't be replayed against another one.
+ */
+static char *encode_cursor(int column, int descending, sqlite3_stmt *stmt){
+    char *plain = NULL;
+
+    switch(item_columns[column].type){
+        case SQLITE_INTEGER:
+            asprintf(&plain, "%d %d %lld %lld", column, descending, sqlite3_column_int64(stmt, 0),
+                     sqlite3_column_int64(stmt, column));
+            break;
+        case SQLITE_FLOAT:
+            asprintf(&plain, "%d %d %lld %.17g", column, descending, sqlite3_column_int64(stmt, 0),
+                     sqlite3_column_double(stmt, column));
+            break;
+        default:
+            asprintf(&plain, "%d %d %lld %s", column, descending, sqlite3_column_int64(stmt, 0),
+                     (const char*)sqlite3_column_text(stmt, column));
+            break;
+    }
+    if(plain == NULL)
+        return NULL;
+
+    size_t length = strlen(plain);
+    if(length * 2 > PAGE_MAX_CURSOR){
+        free(plain);
+        return NULL;
+    }
+
+    char *cursor = (char*)malloc(length * 2 + 1);
+    if(cursor != NULL){
+        for(size_t i = 0; i < length; i++)
+            sprintf(cursor + i * 2, "%02x", (unsigned char)plain[i]);
+        cursor[length * 2] = '\0';
+    }
+    free(plain);
+    return cursor;
+}
+
+/**
+ * Decodes a cursor made by encode_cursor() for the same sort.
+ * @return 0 on success, -1 if the cursor is malformed or belongs to another sort
+ */
+static int decode_cursor(const char *cursor, int column, int descending, sqlite3_int64 *id, char *value, size_t size){
+    char plain[PAGE_MAX_CURSOR / 2 + 1];
+    size_t length = strlen(cursor);
+
+    if(length % 2 != 0 || length / 2 >= sizeof(plain))
+        return -1;
+    for(size_t i = 0; i < length / 2; i++){
+        unsigned int byte;
+        if(sscanf(cursor + i * 2, "%2x", &byte) != 1)
+            return -1;
+        plain[i] = (char)byte;
+    }
+    plain[length / 2] = '\0';
+
+    int cursor_column, cursor_descending, offset;
+    long long cursor_id;
+    if(sscanf(plain, "%d %d %lld%n", &cursor_column, &cursor_descending, &cursor_id, &offset) != 3)
+        return -1;
+    if(plain[offset] != ' ')
+        return -1;
+    if(cursor_column != column || cursor_descending != descending)
+        return -1;
+
+    *id = cursor_id;
+    snprintf(value, size, "%s", plain + offset + 1);
+    return 0;
+}
@@ -0,0 +1,34 @@
+#ifndef CS469_PROJECT_PAGE_H
+#define CS469_PROJECT_PAGE_H
+
+#include <sqlite3.h>
+
+#include "statements.h"
+
+#define PAGE_MAX_SIZE   1000
+#define PAGE_MAX_CURSOR 1024    // Longest cursor token accepted, hex encoded
+
+/**
+ * Answers a PAGE request:
+ *
+ *   PAGE <size> <sort> [<cursor>]
+ *
+ * `sort` is one of the item_columns fields, prefixed with '-' for descending
+ * order, and is served from its index (see query_create_indexes()). Ties are
+ * broken by id. Without a cursor the first page is returned.
+ * The response is
+ *
+ *   SUCCESS <cursor>\n<item>RS<item>...GS
+ *
+ * where `cursor` is an opaque token that asks for the next page when passed
+ * back with the same sort, or "-" after the last page. Pages are located by
+ * the sort key of the last item sent rather than an offset, so items added or
+ * removed meanwhile never shift a page.
+ *
+ * @param statements Statement cache of the calling thread's connection
+ * @param request The PAGE request
+ * @return The response to be freed by the caller, or NULL if the request is invalid or failed
+ */
+char *page_items(struct db_statements *statements, const char *request);
+
+#endif //CS469_PROJECT_PAGE_H
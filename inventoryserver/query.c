@@ -0,0 +1,380 @@
+//
+// FIND command. Predicates are parsed against a whitelist of fields and
+// operators and turned into a parameterized query, so no text from the
+// request ever ends up in SQL. Every filterable field has an index on
+// (column, id), which SQLite maintains on every write, and FIND picks the
+// index of its most selective predicate itself, so a selective FIND reads the
+// matching items instead of the whole table.
+//
+// A FIND on numeric fields only doesn't need SQLite at all, it is scanned in
+// the column store and the items are copied from the item cache.
+//
+
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "columns.h"
+#include "query.h"
+#include "snapshot.h"
+
+static const char *operators[] = {
+        [OP_EQ] = "=",
+        [OP_NE] = "!=",
+        [OP_LT] = "<",
+        [OP_LE] = "<=",
+        [OP_GT] = ">",
+        [OP_GE] = ">=",
+        [OP_PREFIX] = "^",
+};
+#define OPERATOR_COUNT (sizeof(operators) / sizeof(operators[0]))
+
+static int parse_predicate(const char *line, size_t length, struct predicate *predicate);
+static int prefix_upper_bound(const char *prefix, char *upper, size_t size);
+static char *find_in_columns(struct item_cache *cache, struct predicate *predicates, int count);
+static int predicate_matches(const struct predicate *predicate, const Item *item);
+static long probe_predicate(struct db_statements *statements, struct predicate *predicate);
+static int append_predicate(FILE *out, const struct predicate *predicate, int param);
+static int bind_predicate(sqlite3_stmt *stmt, const struct predicate *predicate, int param);
+
+int query_create_indexes(sqlite3 *db){
+    char sql[BUFFER_SIZE];
+
+    for(int i = 1; i < ITEM_COLUMN_COUNT; i++){
+        snprintf(sql, sizeof(sql), "CREATE INDEX IF NOT EXISTS items_by_%s ON items(%s, id)",
+                 item_columns[i].field, item_columns[i].column);
+
+        char *error = NULL;
+        int retCode = sqlite3_exec(db, sql, NULL, NULL, &error);
+        if(retCode != SQLITE_OK){
+            fprintf(stderr, "Database: Could not create index on %s: %s\n", item_columns[i].field, error);
+            sqlite3_free(error);
+            return retCode;
+        }
+    }
+
+    return SQLITE_OK;
+}
+
+int parse_predicates(const char *lines, struct predicate *predicates){
+    int count = 0;
+    const char *line = lines;
+    while(*line != '\0'){
+        const char *end = strchr(line, '\n');
+        size_t length = end ? (size_t)(end - line) : strlen(line);
+
+        if(length > 0){
+            if(count == FIND_MAX_PREDICATES || parse_predicate(line, length, &predicates[count]) != 0)
+                return -1;
+            count++;
+        }
+
+        line += length;
+        if(*line == '\n')
+            line++;
+    }
+
+    return count;
+}
+
+int parse_find(const char *request, struct predicate *predicates){
+    if(strncmp(request, "FIND ", 5) != 0)
+        return -1;
+
+    int count = parse_predicates(request + 5, predicates);
+    return count > 0 ? count : -1;
+}
+
+void append_predicates(FILE *out, const struct predicate *predicates, int count){
+    int param = 1;
+    for(int i = 0; i < count; i++){
+        if(i > 0)
+            fputs(" AND ", out);
+        param = append_predicate(out, &predicates[i], param);
+    }
+}
+
+void bind_predicates(sqlite3_stmt *stmt, const struct predicate *predicates, int count){
+    int param = 1;
+    for(int i = 0; i < count; i++)
+        param = bind_predicate(stmt, &predicates[i], param);
+}
+
+char *find_items(struct db_statements *statements, struct item_cache *cache, const char *request){
+    struct predicate predicates[FIND_MAX_PREDICATES];
+
+    int count = parse_find(request, predicates);
+    if(count < 0)
+        return NULL;
+
+    char *found = find_in_columns(cache, predicates, count);
+    if(found != NULL)
+        return found;
+
+    // Without range statistics SQLite can't tell a selective range from one
+    // that matches every item, so ask the indexes how many items each
+    // predicate matches, and start from the one matching the fewest
+    int driver = -1;
+    long fewest = FIND_PROBE_LIMIT;
+    for(int i = 0; i < count; i++){
+        long matches = probe_predicate(statements, &predicates[i]);
+        if(matches >= 0 && matches < fewest){
+            driver = i;
+            fewest = matches;
+        }
+    }
+
+    // Only column names and operators from the whitelists go into the SQL, every operand is bound
+    char *sql = NULL;
+    size_t sql_length = 0;
+    FILE *out = open_memstream(&sql, &sql_length);
+    if(out == NULL)
+        return NULL;
+
+    if(driver >= 0)
+        fprintf(out, "SELECT * FROM items INDEXED BY items_by_%s WHERE ", item_columns[predicates[driver].field].field);
+    else
+        fputs("SELECT * FROM items NOT INDEXED WHERE ", out);
+
+    append_predicates(out, predicates, count);
+
+    // Ordering by +id keeps SQLite from trading the chosen index for a scan in id order.
+    // Without one nothing is selective, and the scan in id order stops once it has enough matches
+    fprintf(out, " ORDER BY %s LIMIT %d", driver >= 0 ? "+id" : "id", FIND_MAX_RESULTS);
+    if(fclose(out) != 0){
+        free(sql);
+        return NULL;
+    }
+
+    sqlite3_stmt *stmt = db_statement_sql(statements, sql);
+    free(sql);
+    if(stmt == NULL)
+        return NULL;
+
+    bind_predicates(stmt, predicates, count);
+
+    size_t length;
+    char *result = marshalItems(stmt, &length);
+    sqlite3_reset(stmt);
+    return result;
+}
+
+/**
+ * Answers a FIND from the column store, if it supports every predicate.
+ * @return The response, or NULL if the database has to answer it
+ */
+static char *find_in_columns(struct item_cache *cache, struct predicate *predicates, int count){
+    for(int i = 0; i < count; i++){
+        if(!column_store_supports(&predicates[i]))
+            return NULL;
+    }
+
+    int ids[FIND_MAX_RESULTS];
+    long found = column_store_find(cache->columns, predicates, count, ids, FIND_MAX_RESULTS);
+    if(found < 0)
+        return NULL;
+
+    char *result = NULL;
+    size_t length = 0;
+    FILE *out = open_memstream(&result, &length);
+    if(out == NULL)
+        return NULL;
+
+    fputs("SUCCESS ", out);
+    for(long i = 0; i < found; i++){
+        Item item;
+        int hit = item_cache_get(cache, ids[i], &item) == CACHE_HIT;
+        for(int j = 0; hit && j < count; j++)
+            hit = predicate_matches(&predicates[j], &item);
+
+        // The writer changed the item since the scan, the database has a consistent answer
+        if(!hit){
+            fclose(out);
+            free(result);
+            return NULL;
+        }
+
+        if(i > 0)
+            fputc(RECORD_SEPARATOR, out);
+        print_item(out, &item);
+    }
+    fputc(GROUP_SEPARATOR, out);
+
+    if(fclose(out) != 0){
+        free(result);
+        return NULL;
+    }
+    return result;
+}
+
+/**
+ * Checks a numeric predicate against an item.
+ * @return 1 if it matches, 0 otherwise
+ */
+static int predicate_matches(const struct predicate *predicate, const Item *item){
+    double value = item_number(item, predicate->field);
+
+    switch(predicate->op){
+        case OP_EQ: return value == predicate->number;
+        case OP_NE: return value != predicate->number;
+        case OP_LT: return value < predicate->number;
+        case OP_LE: return value <= predicate->number;
+        case OP_GT: return value > predicate->number;
+        case OP_GE: return value >= predicate->number;
+        default:    return 0;
+    }
+}
+
+/**
+ * Counts the items a predicate matches through its index, stopping at FIND_PROBE_LIMIT.
+ * @return The count, or -1 if the predicate can't be answered from an index
+ */
+static long probe_predicate(struct db_statements *statements, struct predicate *predicate){
+    // id is the rowid and needs no probing, != can't seek
+    if(predicate->field == 0 || predicate->op == OP_NE)
+        return -1;
+
+    char *sql = NULL;
+    size_t sql_length = 0;
+    FILE *out = open_memstream(&sql, &sql_length);
+    if(out == NULL)
+        return -1;
+
+    fprintf(out, "SELECT count(*) FROM (SELECT 1 FROM items INDEXED BY items_by_%s WHERE ",
+            item_columns[predicate->field].field);
+    append_predicate(out, predicate, 1);
+    fprintf(out, " LIMIT %d)", FIND_PROBE_LIMIT);
+    if(fclose(out) != 0){
+        free(sql);
+        return -1;
+    }
+
+    sqlite3_stmt *stmt = db_statement_sql(statements, sql);
+    free(sql);
+    if(stmt == NULL)
+        return -1;
+
+    bind_predicate(stmt, predicate, 1);
+    long matches = sqlite3_step(stmt) == SQLITE_ROW ? sqlite3_column_int64(stmt, 0) : -1;
+    sqlite3_reset(stmt);
+    return matches;
+}
+
+/**
+ * Writes a predicate as SQL, with numbered parameters starting at param.
+ * @return The next free parameter number
+ */
+static int append_predicate(FILE *out, const struct predicate *predicate, int param){
+    const char *column = item_columns[predicate->field].column;
+
+    if(predicate->op != OP_PREFIX){
+        fprintf(out, "%s %s ?%d", column, operators[predicate->op], param);
+        return param + 1;
+    }
+
+    if(predicate->has_upper){
+        fprintf(out, "(%s >= ?%d AND %s < ?%d)", column, param, column, param + 1);
+        return param + 2;
+    }
+    fprintf(out, "%s >= ?%d", column, param);
+    return param + 1;
+}
+
+/**
+ * Binds the operands of a predicate written by append_predicate().
+ * @return The next free parameter number
+ */
+static int bind_predicate(sqlite3_stmt *stmt, const struct predicate *predicate, int param){
+    if(item_columns[predicate->field].type != SQLITE_TEXT){
+        sqlite3_bind_double(stmt, param, predicate->number);
+        return param + 1;
+    }
+
+    sqlite3_bind_text(stmt, param++, predicate->text, -1, SQLITE_TRANSIENT);
+    if(predicate->op == OP_PREFIX && predicate->has_upper)
+        sqlite3_bind_text(stmt, param++, predicate->upper, -1, SQLITE_TRANSIENT);
+    return param;
+}
+
+/**
+ * Parses one `<field> <op> <value>` line. Spaces around the operator are optional.
+ * @return 0 on success, -1 if the field, operator or value is not valid
+ */
+static int parse_predicate(const char *line, size_t length, struct predicate *predicate){
+    const char *end = line + length;
+    const char *p = line;
+    char field[32];
+    char op[3];
+    size_t n;
+
+    while(p < end && isspace((unsigned char)*p))
+        p++;
+    for(n = 0; p < end && isalpha((unsigned char)*p) && n < sizeof(field) - 1; n++)
+        field[n] = *p++;
+    field[n] = '\0';
+
+    while(p < end && isspace((unsigned char)*p))
+        p++;
+    for(n = 0; p < end && strchr("<>=!^", *p) != NULL && n < sizeof(op) - 1; n++)
+        op[n] = *p++;
+    op[n] = '\0';
+
+    while(p < end && isspace((unsigned char)*p))
+        p++;
+    size_t value_length = (size_t)(end - p);
+    if(value_length == 0 || value_length >= BUFFER_SIZE)
+        return -1;
+
+    predicate->field = item_column_find(field);
+    if(predicate->field < 0)
+        return -1;
+
+    predicate->op = -1;
+    for(size_t i = 0; i < OPERATOR_COUNT; i++){
+        if(strcmp(op, operators[i]) == 0)
+            predicate->op = (int)i;
+    }
+    if(predicate->op < 0)
+        return -1;
+
+    memcpy(predicate->text, p, value_length);
+    predicate->text[value_length] = '\0';
+
+    if(item_columns[predicate->field].type == SQLITE_TEXT){
+        if(predicate->op == OP_PREFIX)
+            predicate->has_upper = prefix_upper_bound(predicate->text, predicate->upper, BUFFER_SIZE) == 0;
+        return 0;
+    }
+
+    // Numbers don't have prefixes, and must be numbers
+    char *number_end;
+    predicate->number = strtod(predicate->text, &number_end);
+    while(isspace((unsigned char)*number_end))
+        number_end++;
+    if(predicate->op == OP_PREFIX || number_end == predicate->text || *number_end != '\0' || isnan(predicate->number))
+        return -1;
+    return 0;
+}
+
+/**
+ * Computes the smallest string greater than every string starting with prefix,
+ * so a prefix match becomes a range the name index can seek to.
+ * @return 0 on success, -1 if there is no such string and the range is open ended
+ */
+static int prefix_upper_bound(const char *prefix, char *upper, size_t size){
+    size_t length = strlen(prefix);
+    if(length >= size)
+        return -1;
+    memcpy(upper, prefix, length + 1);
+
+    while(length > 0 && (unsigned char)upper[length - 1] == 0xFF)
+        upper[--length] = '\0';
+    if(length == 0)
+        return -1;
+
+    upper[length - 1] = (char)((unsigned char)upper[length - 1] + 1);
+    return 0;
+}
@@ -0,0 +1,104 @@
+#ifndef CS469_PROJECT_QUERY_H
+#define CS469_PROJECT_QUERY_H
+
+#include "cache.h"
+#include "statements.h"
+
+#define FIND_MAX_PREDICATES 16
+#define FIND_MAX_RESULTS    1000
+#define FIND_PROBE_LIMIT    5000    // Predicates matching more items than this are not worth an index
+
+/**
+ * Comparison operators of a FIND predicate
+ */
+#define OP_EQ     0
+#define OP_NE     1
+#define OP_LT     2
+#define OP_LE     3
+#define OP_GT     4
+#define OP_GE     5
+#define OP_PREFIX 6     // Text only, the value starts with the operand
+
+/**
+ * One parsed `<field> <op> <value>` condition.
+ */
+struct predicate {
+    int field;                  // Index into item_columns
+    int op;
+    double number;              // Operand of numeric fields
+    char text[BUFFER_SIZE];     // Operand of name
+    char upper[BUFFER_SIZE];    // Exclusive upper bound of a prefix match
+    int has_upper;              // 0 if the prefix match is open ended
+};
+
+/**
+ * Creates an index on (column, id) for every item_columns field but id, if it
+ * doesn't exist yet. SQLite keeps them up to date on every write. Run once by
+ * the writer thread on startup.
+ *
+ * @param db Writable database connection
+ * @return SQLITE_OK, or the error of the first index that could not be created
+ */
+int query_create_indexes(sqlite3 *db);
+
+/**
+ * Parses newline separated `<field> <op> <value>` predicates, as taken by FIND.
+ *
+ * @param lines The predicates, possibly none
+ * @param predicates Receives at most FIND_MAX_PREDICATES predicates
+ * @return The number of predicates, or -1 if one is invalid
+ */
+int parse_predicates(const char *lines, struct predicate *predicates);
+
+/**
+ * Parses the predicates of a FIND request:
+ *
+ *   FIND <field> <op> <value>\n<field> <op> <value>...
+ *
+ * `field` is id, name, armor, health, mana, sellPrice, damage, critChance or
+ * range, and `op` one of = != < <= > >=. Names also take ^ for "starts with".
+ * The value runs to the end of the line, so names may contain spaces.
+ *
+ * @param request The FIND request
+ * @param predicates Receives at most FIND_MAX_PREDICATES predicates
+ * @return The number of predicates, or -1 if the request is invalid
+ */
+int parse_find(const char *request, struct predicate *predicates);
+
+/**
+ * Writes predicates as SQL conditions joined by AND, with numbered parameters
+ * from ?1 on. Only whitelisted column names and operators end up in the SQL.
+ *
+ * @param out
+ * @param predicates
+ * @param count At least 1
+ */
+void append_predicates(FILE *out, const struct predicate *predicates, int count);
+
+/**
+ * Binds the operands of predicates written by append_predicates().
+ *
+ * @param stmt
+ * @param predicates
+ * @param count
+ */
+void bind_predicates(sqlite3_stmt *stmt, const struct predicate *predicates, int count);
+
+/**
+ * Answers a FIND request with every item matching all of its predicates, in
+ * id order and in the GET ALL format. At most FIND_MAX_RESULTS items are
+ * returned; a client that gets that many asks again with `id > <last id>`
+ * added. Numeric predicates are scanned in the cache's column store. Any other
+ * FIND goes to the database, where every field is backed by an index (see
+ * query_create_indexes()), and the query starts from the index of the
+ * predicate matching the fewest items, so a selective query only reads the
+ * items it matches.
+ *
+ * @param statements Statement cache of the calling thread's connection
+ * @param cache
+ * @param request The FIND request
+ * @return The response to be freed by the caller, or NULL if the request is invalid or failed
+ */
+char *find_items(struct db_statements *statements, struct item_cache *cache, const char *request);
+
+#endif //CS469_PROJECT_QUERY_H
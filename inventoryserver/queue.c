@@ -1,82 +1,448 @@
 //
-// Thread safe queue implementation borrowed from:
-// https://github.com/majek/dump/blob/master/msqueue/queue_lock_mutex.c
+// Lock-free multi-producer/single-consumer queue, after Dmitry Vyukov's
+// intrusive MPSC node based queue:
+// http://www.1024cores.net/home/lock-free-algorithms/queues/intrusive-mpsc-node-based-queue
+//
+// Any number of threads may queue_put() concurrently, but only one thread may
+// ever dequeue from a given root. That matches how the server uses its queues:
+// many I/O threads feed the single database thread, and the database thread
+// answers into one response queue per I/O thread.
+//
+// Messages are recycled through a small per-thread pool, and their operation
+// buffer is kept with them, so the steady state enqueue/dequeue path neither
+// allocates nor takes a lock. Large payloads that many messages carry at once
+// can be attached by reference as a shared_buffer instead of being copied.
 //
 
+#define _GNU_SOURCE
+#include <time.h>
+#include <errno.h>
+#include <limits.h>
 #include <string.h>
-#include <pthread.h>
-#include "queue.h"
+#include <stdint.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
 
+#include "../globals.h"
+#include "queue.h"
 
 #define QUEUE_POISON1 ((void*)0xCAFEBAB5)
 
 struct queue_root {
+    // Producers swing tail, the consumer owns head
+    struct queue_head *_Atomic tail;
+    char pad[64 - sizeof(struct queue_head*)];
+
     struct queue_head *head;
-    pthread_mutex_t head_lock;
+    struct queue_head stub;
+
+    // Parking for queue_get_wait(). Producers only make a syscall when the consumer sleeps
+    _Atomic uint32_t wake_seq;
+    _Atomic int waiting;
 
-    struct queue_head *tail;
-    pthread_mutex_t tail_lock;
+    int notify_fd;
+    _Atomic int notified;
 
-    struct queue_head divider;
+    _Atomic long depth;         // Messages put and not yet taken
 };
 
+/**
+ * Per-thread free list of messages. Messages freed by a thread go back to that
+ * thread's pool, which balances out because the database thread turns every
+ * request into a response and the I/O threads turn every response back into a request.
+ */
+static __thread struct queue_head *pool_head = NULL;
+static __thread unsigned int pool_size = 0;
+
+static void queue_push(struct queue_head *new, struct queue_root *root);
+
 struct queue_root *ALLOC_QUEUE_ROOT()
 {
     struct queue_root *root = \
-		malloc(sizeof(struct queue_root));
-    pthread_mutex_init(&root->head_lock, NULL);
-    pthread_mutex_init(&root->tail_lock, NULL);
+		malloc_aligned(sizeof(struct queue_root));
 
-    root->divider.next = NULL;
-    root->head = &root->divider;
-    root->tail = &root->divider;
+    root->stub.next = NULL;
+    root->head = &root->stub;
+    atomic_store(&root->tail, &root->stub);
+    atomic_store(&root->wake_seq, 0);
+    atomic_store(&root->waiting, 0);
+    root->notify_fd = -1;
+    atomic_store(&root->notified, 0);
+    atomic_store(&root->depth, 0);
     return root;
 }
 
+/**
+ * Gets a zeroed message, reusing one from the calling thread's pool if possible.
+ * @return a message ready for INIT_QUEUE_HEAD
+ */
+struct queue_head *alloc_queue_message()
+{
+    struct queue_head *msg = pool_head;
+
+    if (msg != NULL) {
+        pool_head = msg->next;
+        pool_size--;
+    } else {
+        msg = calloc(1, sizeof(struct queue_head));
+        if (msg == NULL)
+            return NULL;
+    }
+
+    atomic_store_explicit(&msg->next, NULL, memory_order_relaxed);
+    msg->response_queue = NULL;
+    msg->context = NULL;
+    msg->request_id = 0;
+    msg->flags = 0;
+    msg->shared = NULL;
+    msg->cursor = 0;
+    msg->started = 0;
+    msg->queued = 0;
+    msg->op = 0;
+    memset(&msg->stamps, 0, sizeof(msg->stamps));
+    msg->length = 0;
+    if (msg->operation != NULL)
+        msg->operation[0] = '\0';
+    return msg;
+}
+
+/**
+ * Copies operation into the message. The operation buffer belongs to the
+ * message and is only grown, never shrunk, while the message is recycled.
+ */
 void INIT_QUEUE_HEAD(struct queue_head *head, char* operation, struct queue_root *r_queue)
 {
-    head->next = QUEUE_POISON1;
-    head->operation = strdup(operation);
+    INIT_QUEUE_HEAD_LEN(head, operation, strlen(operation), r_queue);
+}
+
+/**
+ * Same as INIT_QUEUE_HEAD for an operation that is not NUL terminated, such as
+ * a frame payload. The copy is always NUL terminated.
+ */
+void INIT_QUEUE_HEAD_LEN(struct queue_head *head, const char* operation, size_t length, struct queue_root *r_queue)
+{
+    if (head->shared != NULL) {
+        shared_buffer_release(head->shared);
+        head->shared = NULL;
+    }
+
+    if (head->operation == NULL || head->capacity < length + 1) {
+        size_t capacity = head->capacity ? head->capacity : QUEUE_MIN_BUFFER;
+        while (capacity < length + 1)
+            capacity *= 2;
+
+        char *buffer = realloc(head->operation, capacity);
+        if (buffer == NULL) {
+            perror("Could not grow queue message");
+            exit(-1);
+        }
+        head->operation = buffer;
+        head->capacity = capacity;
+    }
+
+    memcpy(head->operation, operation, length);
+    head->operation[length] = '\0';
+    head->length = length;
+    atomic_store_explicit(&head->next, QUEUE_POISON1, memory_order_relaxed);
     head->response_queue = r_queue;
+    head->context = NULL;
+    head->request_id = 0;
+    head->flags = 0;
+    head->cursor = 0;
+    head->started = 0;
+    head->queued = 0;
+    head->op = 0;
+    memset(&head->stamps, 0, sizeof(head->stamps));
+}
+
+/**
+ * Points the message at a shared payload instead of copying it. The message
+ * takes its own reference, which free_queue_message() drops.
+ */
+void INIT_QUEUE_HEAD_SHARED(struct queue_head *head, struct shared_buffer *buffer, struct queue_root *r_queue)
+{
+    shared_buffer_acquire(buffer);
+    if (head->shared != NULL)
+        shared_buffer_release(head->shared);
+
+    head->shared = buffer;
+    head->length = buffer->length;
+    if (head->operation != NULL)
+        head->operation[0] = '\0';
+    atomic_store_explicit(&head->next, QUEUE_POISON1, memory_order_relaxed);
+    head->response_queue = r_queue;
+    head->context = NULL;
+    head->request_id = 0;
+    head->flags = 0;
+    head->cursor = 0;
+    head->started = 0;
+    head->queued = 0;
+    head->op = 0;
+    memset(&head->stamps, 0, sizeof(head->stamps));
+}
+
+/**
+ * Wraps a heap allocated payload in a shared buffer with one reference.
+ * @param data - taken over by the buffer and freed with the last reference
+ * @param length - payload length in bytes
+ * @return the buffer, or NULL if it could not be allocated
+ */
+struct shared_buffer *shared_buffer_wrap(char *data, size_t length)
+{
+    struct shared_buffer *buffer = malloc(sizeof(struct shared_buffer));
+    if (buffer == NULL)
+        return NULL;
+
+    atomic_init(&buffer->refcount, 1);
+    buffer->length = length;
+    buffer->data = data;
+    return buffer;
+}
+
+struct shared_buffer *shared_buffer_acquire(struct shared_buffer *buffer)
+{
+    atomic_fetch_add_explicit(&buffer->refcount, 1, memory_order_relaxed);
+    return buffer;
+}
+
+void shared_buffer_release(struct shared_buffer *buffer)
+{
+    if (buffer == NULL)
+        return;
+    if (atomic_fetch_sub_explicit(&buffer->refcount, 1, memory_order_acq_rel) == 1) {
+        free(buffer->data);
+        free(buffer);
+    }
+}
+
+/**
+ * Registers an eventfd that is signalled every time a message is put on the queue.
+ * This lets an epoll loop sleep until a response is available instead of polling.
+ * @param root
+ * @param fd eventfd to signal, or -1 to disable
+ */
+void queue_set_notify_fd(struct queue_root *root, int fd)
+{
+    root->notify_fd = fd;
+}
+
+/**
+ * Re-arms the eventfd notification. The consumer calls this after reading the
+ * eventfd and before draining, so producers only write the eventfd once per drain.
+ * @param root
+ */
+void queue_ack_notify(struct queue_root *root)
+{
+    atomic_store(&root->notified, 0);
+}
+
+static void queue_push(struct queue_head *new,
+                       struct queue_root *root)
+{
+    atomic_store_explicit(&new->next, NULL, memory_order_relaxed);
+
+    struct queue_head *prev = atomic_exchange_explicit(&root->tail, new, memory_order_acq_rel);
+    atomic_store_explicit(&prev->next, new, memory_order_release);
 }
 
 void queue_put(struct queue_head *new,
                struct queue_root *root)
 {
-    new->next = NULL;
+    // Counted first, so the consumer never takes the depth below zero
+    atomic_fetch_add_explicit(&root->depth, 1, memory_order_relaxed);
+    queue_push(new, root);
+
+    // Pairs with the fence in queue_get_wait(): either we see the waiter or it sees our node
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&root->waiting, memory_order_relaxed)) {
+        atomic_fetch_add(&root->wake_seq, 1);
+        syscall(SYS_futex, &root->wake_seq, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    }
 
-    pthread_mutex_lock(&root->tail_lock);
-    root->tail->next = new;
-    root->tail = new;
-    pthread_mutex_unlock(&root->tail_lock);
+    if (root->notify_fd >= 0 && atomic_exchange(&root->notified, 1) == 0) {
+        uint64_t one = 1;
+        write(root->notify_fd, &one, sizeof(one));
+    }
 }
 
+/**
+ * Dequeues a message without blocking. Must only be called by the queue's consumer thread.
+ * @param root
+ * @return the oldest message, or NULL if the queue is empty
+ */
 struct queue_head *queue_get(struct queue_root *root)
 {
-    struct queue_head *head, *next;
+    struct queue_head *head = root->head;
+    struct queue_head *next = atomic_load_explicit(&head->next, memory_order_acquire);
 
-    while (1) {
-        pthread_mutex_lock(&root->head_lock);
-        head = root->head;
-        next = head->next;
-        if (next == NULL) {
-            pthread_mutex_unlock(&root->head_lock);
+    if (head == &root->stub) {
+        if (next == NULL)
             return NULL;
-        }
         root->head = next;
-        pthread_mutex_unlock(&root->head_lock);
+        head = next;
+        next = atomic_load_explicit(&head->next, memory_order_acquire);
+    }
 
-        if (head == &root->divider) {
-            queue_put(head, root);
-            continue;
-        }
+    if (next != NULL) {
+        root->head = next;
+        atomic_store_explicit(&head->next, QUEUE_POISON1, memory_order_relaxed);
+        atomic_fetch_sub_explicit(&root->depth, 1, memory_order_relaxed);
+        return head;
+    }
+
+    // A producer has swung tail but not linked its node yet. It will wake us once it does
+    if (head != atomic_load_explicit(&root->tail, memory_order_acquire))
+        return NULL;
 
-        head->next = QUEUE_POISON1;
+    // head is the last real node, put the stub behind it so it can be detached
+    queue_push(&root->stub, root);
+    next = atomic_load_explicit(&head->next, memory_order_acquire);
+    if (next != NULL) {
+        root->head = next;
+        atomic_store_explicit(&head->next, QUEUE_POISON1, memory_order_relaxed);
+        atomic_fetch_sub_explicit(&root->depth, 1, memory_order_relaxed);
         return head;
     }
+
+    return NULL;
+}
+
+/**
+ * Parks the consumer on the queue's futex until a producer wakes it.
+ * @return the dequeued message, or NULL if the timeout expired
+ */
+static struct queue_head *queue_park(struct queue_root *root, const struct timespec *deadline)
+{
+    struct queue_head *head;
+
+    while (1) {
+        if ((head = queue_get(root)) != NULL)
+            return head;
+
+        uint32_t seq = atomic_load(&root->wake_seq);
+        atomic_store(&root->waiting, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+
+        if ((head = queue_get(root)) != NULL) {
+            atomic_store(&root->waiting, 0);
+            return head;
+        }
+
+        struct timespec timeout, *wait = NULL;
+        if (deadline != NULL) {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            timeout.tv_sec = deadline->tv_sec - now.tv_sec;
+            timeout.tv_nsec = deadline->tv_nsec - now.tv_nsec;
+            if (timeout.tv_nsec < 0) {
+                timeout.tv_sec--;
+                timeout.tv_nsec += 1000000000L;
+            }
+            if (timeout.tv_sec < 0) {
+                atomic_store(&root->waiting, 0);
+                return queue_get(root);
+            }
+            wait = &timeout;
+        }
+
+        syscall(SYS_futex, &root->wake_seq, FUTEX_WAIT_PRIVATE, seq, wait, NULL, 0);
+        atomic_store(&root->waiting, 0);
+    }
+}
+
+/**
+ * Blocks until a message is available and returns it.
+ * @param root
+ * @return the dequeued message, never NULL
+ */
+struct queue_head *queue_get_wait(struct queue_root *root)
+{
+    return queue_park(root, NULL);
+}
+
+/**
+ * Blocks until a message is available or the timeout expires.
+ * @param root
+ * @param timeout_ms maximum time to wait in milliseconds
+ * @return the dequeued message, or NULL on timeout
+ */
+struct queue_head *queue_get_timed(struct queue_root *root, long timeout_ms)
+{
+    struct timespec deadline;
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    return queue_park(root, &deadline);
 }
 
+/**
+ * Number of messages waiting in a queue. Read from any thread, the answer may
+ * already be out of date.
+ * @param root
+ * @return the depth
+ */
+long queue_depth(struct queue_root *root)
+{
+    return atomic_load_explicit(&root->depth, memory_order_relaxed);
+}
+
+/**
+ * Returns a message to the calling thread's pool, or to the heap once the pool is full.
+ * Oversized operation buffers are released so one large reply doesn't pin memory.
+ * @param msg
+ */
 void free_queue_message(struct queue_head *msg){
-    free(msg->operation);
-    free(msg);
+    if (msg->shared != NULL) {
+        shared_buffer_release(msg->shared);
+        msg->shared = NULL;
+    }
+
+    if (pool_size >= QUEUE_POOL_SIZE) {
+        free(msg->operation);
+        free(msg);
+        return;
+    }
+
+    if (msg->capacity > QUEUE_MAX_POOLED_BUFFER) {
+        free(msg->operation);
+        msg->operation = NULL;
+        msg->capacity = 0;
+    }
+
+    atomic_store_explicit(&msg->next, pool_head, memory_order_relaxed);
+    pool_head = msg;
+    pool_size++;
+}
+
+/**
+ * Sends a response back to the I/O thread the request came from and releases the request.
+ * @param msg request being answered
+ * @param response answer, an empty response is turned into FAILURE
+ */
+void send_response(struct queue_head *msg, struct queue_head *response){
+    // Unknown operations still get an answer so the client is not left waiting
+    if(response->length == 0)
+        INIT_QUEUE_HEAD(response, "FAILURE", NULL);
+
+    // Response here, tagged with the connection that asked for it
+    response->context = msg->context;
+    response->request_id = msg->request_id;
+    response->flags |= msg->flags;
+    response->started = msg->started;
+    response->queued = msg->queued;
+    response->op = msg->op;
+    response->stamps = msg->stamps;
+    if(msg->response_queue != NULL)
+        queue_put(response, msg->response_queue);
+    else
+        free_queue_message(response);
+    // msg needs to be freed and response should be de-referenced
+    free_queue_message(msg);
 }
@@ -6,18 +6,94 @@
 #define CS469_PROJECT_QUEUE_H
 
 #include <malloc.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+#define QUEUE_MIN_BUFFER        256
+#define QUEUE_POOL_SIZE         1024
+#define QUEUE_MAX_POOLED_BUFFER (64 * 1024)
+#define QUEUE_LABEL_SIZE        32
+
+/**
+ * Message flags understood by both the I/O threads and the database threads.
+ * A response is one chunk of a streamed reply when it carries RESPONSE_MORE,
+ * and the I/O thread asks for the next chunk, from `cursor`, once it has been sent.
+ */
+#define REQUEST_STREAM   0x2    // The client accepts a response split over several frames
+#define REQUEST_CONTINUE 0x4    // Asks for the next chunk of a streamed response
+#define RESPONSE_MORE    0x8    // More chunks follow this response
+#define RESPONSE_EVENT   0x10   // A change pushed to watchers, not the answer to a request
+
+/**
+ * Immutable, reference counted payload that many messages can point at
+ * instead of each carrying their own copy, such as the GET ALL snapshot.
+ */
+struct shared_buffer {
+    _Atomic unsigned long refcount;
+    size_t length;
+    char *data;
+};
+
+/**
+ * When a request reached each stage on its way through the server, in
+ * monotonic ns. Copied from a request to its response, and only filled in
+ * while slow requests are traced, see trace.h.
+ */
+struct queue_stamps {
+    uint64_t read;              // The SSL_read that returned the request's last bytes was called
+    uint64_t decrypted;         // That SSL_read returned
+    uint64_t dequeued;          // A worker thread took the request
+    uint64_t answered;          // The worker put the response on the I/O thread's queue
+    uint64_t received;          // The I/O thread took the response
+    uint64_t sqlite;            // Time the worker spent in SQL statements, not a timestamp
+    unsigned int statements;
+    char label[QUEUE_LABEL_SIZE];   // Start of the request
+};
 
 struct queue_root;
 struct queue_head {
-    struct queue_head *next;
+    struct queue_head *_Atomic next;
     char *operation;
+    size_t length;
+    size_t capacity;
     struct queue_root* response_queue;
+    void *context;
+    uint32_t request_id;
+    unsigned int flags;         // Owned by the sender, copied to the response
+    struct shared_buffer *shared;   // When set, the payload is shared->data instead of operation
+    int64_t cursor;                 // Where a streamed response continues
+    uint64_t started;               // When the request was read, copied to the response. 0 if it isn't timed
+    uint64_t queued;                // When the request was put on the queue it is waiting in
+    int op;                         // Which latency histogram the request counts in
+    struct queue_stamps stamps;
 };
 
+/**
+ * Payload of a message, whether it was copied in or shared.
+ * @param head
+ * @return the first of head->length payload bytes
+ */
+static inline const char *queue_message_data(const struct queue_head *head)
+{
+    return head->shared != NULL ? head->shared->data : head->operation;
+}
+
 struct queue_root *ALLOC_QUEUE_ROOT();
+struct queue_head *alloc_queue_message();
 void INIT_QUEUE_HEAD(struct queue_head *head, char* operation, struct queue_root *r_queue);
+void INIT_QUEUE_HEAD_LEN(struct queue_head *head, const char* operation, size_t length, struct queue_root *r_queue);
+void INIT_QUEUE_HEAD_SHARED(struct queue_head *head, struct shared_buffer *buffer, struct queue_root *r_queue);
+struct shared_buffer *shared_buffer_wrap(char *data, size_t length);
+struct shared_buffer *shared_buffer_acquire(struct shared_buffer *buffer);
+void shared_buffer_release(struct shared_buffer *buffer);
+void queue_set_notify_fd(struct queue_root *root, int fd);
+void queue_ack_notify(struct queue_root *root);
 void queue_put(struct queue_head *new, struct queue_root *root);
 struct queue_head *queue_get(struct queue_root *root);
+struct queue_head *queue_get_wait(struct queue_root *root);
+struct queue_head *queue_get_timed(struct queue_root *root, long timeout_ms);
+long queue_depth(struct queue_root *root);
 void free_queue_message(struct queue_head *msg);
+void send_response(struct queue_head *msg, struct queue_head *response);
 
 #endif //CS469_PROJECT_QUEUE_H
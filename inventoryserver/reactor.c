@@ -0,0 +1,948 @@
+//
+// Event driven connection handling. A small, fixed number of I/O threads
+// multiplex every client connection with epoll, so an idle client costs a
+// connection struct and an SSL* rather than a whole thread stack.
+//
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "../globals.h"
+#include "../protocol.h"
+#include "metrics.h"
+#include "network.h"
+#include "reactor.h"
+#include "trace.h"
+
+static void *reactor_thread(void *data);
+static void handle_connection_event(struct connection *conn, unsigned int events);
+static void handle_responses(struct reactor *r);
+static void read_connection(struct connection *conn);
+static void consume_input(struct connection *conn, unsigned char *data, size_t len);
+static int append_input(struct connection *conn, unsigned char *data, size_t len);
+static void dispatch_frame(struct connection *conn, FrameHeader *header, char *payload, size_t length);
+static int is_login(const char *payload, size_t length);
+static void refuse_login(struct connection *conn, uint32_t request_id);
+static void handle_watch(struct connection *conn, uint32_t request_id, int watch);
+static void handle_accepts(struct connection *conn, uint32_t request_id);
+static void handle_metrics(struct connection *conn, uint32_t request_id);
+static void stop_watching(struct connection *conn);
+static void deliver_event(struct reactor *r, struct queue_head *event);
+static void event_sent(struct connection *conn);
+static struct queue_root *route_request(struct connection *conn, const char *payload, size_t length);
+static void queue_output(struct connection *conn, struct queue_head *msg);
+static void continue_stream(struct connection *conn, struct queue_head *chunk);
+static void request_done(struct connection *conn, struct queue_head *response);
+static void flush_connection(struct connection *conn);
+static int accepting_requests(struct connection *conn);
+static void update_interest(struct connection *conn, int wants_read);
+static void close_connection(struct connection *conn);
+static void release_connection(struct connection *conn);
+static void free_released_connections(struct reactor *r);
+
+struct reactor *reactor_start(int id, SSL_CTX *ctx, struct queue_root *db_queue,
+                              struct queue_root **read_queues, int read_queue_count, struct auth_pool *auth,
+                              struct change_feed *feed, struct listener *listener){
+    struct reactor *r = (struct reactor*)calloc(1, sizeof(struct reactor));
+    if(r == NULL){
+        return NULL;
+    }
+
+    r->id = id;
+    r->ctx = ctx;
+    r->db_queue = db_queue;
+    r->read_queues = read_queues;
+    r->read_queue_count = read_queue_count;
+    r->auth = auth;
+    r->feed = feed;
+    r->listener = listener;
+    r->responses = ALLOC_QUEUE_ROOT();
+    r->scratch = (unsigned char*)malloc(REACTOR_IO_CHUNK);
+    r->staging = (unsigned char*)malloc(REACTOR_IO_CHUNK);
+
+    r->epollfd = epoll_create1(EPOLL_CLOEXEC);
+    if(r->epollfd < 0){
+        fprintf(stderr, "Reactor: Could not create epoll set: %s\n", strerror(errno));
+        free(r);
+        return NULL;
+    }
+
+    r->eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(r->eventfd < 0){
+        fprintf(stderr, "Reactor: Could not create eventfd: %s\n", strerror(errno));
+        close(r->epollfd);
+        free(r);
+        return NULL;
+    }
+    queue_set_notify_fd(r->responses, r->eventfd);
+
+    // A NULL data pointer marks the wakeup fd
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if(epoll_ctl(r->epollfd, EPOLL_CTL_ADD, r->eventfd, &ev) < 0){
+        fprintf(stderr, "Reactor: Could not watch eventfd: %s\n", strerror(errno));
+        close(r->eventfd);
+        close(r->epollfd);
+        free(r);
+        return NULL;
+    }
+
+    int err = pthread_create(&r->thread_id, NULL, reactor_thread, (void*)r);
+    if(err != 0){
+        fprintf(stderr, "Reactor: Could not start I/O thread: %d\n", err);
+        close(r->eventfd);
+        close(r->epollfd);
+        free(r);
+        return NULL;
+    }
+
+    return r;
+}
+
+int reactor_add_connection(struct reactor *r, int socketfd){
+    struct connection *conn = (struct connection*)calloc(1, sizeof(struct connection));
+    if(conn == NULL){
+        close(socketfd);
+        return -1;
+    }
+
+    int flags = fcntl(socketfd, F_GETFL, 0);
+    if(flags < 0 || fcntl(socketfd, F_SETFL, flags | O_NONBLOCK) < 0){
+        fprintf(stderr, "Reactor: Could not make socket non-blocking: %s\n", strerror(errno));
+        free(conn);
+        close(socketfd);
+        return -1;
+    }
+
+    // Responses and handshake flights go out in several writes, Nagle would hold the last one
+    // until the client's delayed ACK, about 40 ms later
+    int nodelay = 1;
+    setsockopt(socketfd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+    conn->ssl = SSL_new(r->ctx);
+    if(conn->ssl == NULL){
+        fprintf(stderr, "Error creating new SSL\n");
+        free(conn);
+        close(socketfd);
+        return -1;
+    }
+    SSL_set_mode(conn->ssl, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER
+                            | SSL_MODE_RELEASE_BUFFERS);
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+    // GUI clients routinely exit without a close_notify, treat that as a normal hang up
+    SSL_set_options(conn->ssl, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+
+    if(SSL_set_fd(conn->ssl, socketfd) <= 0){
+        fprintf(stderr, "Could not bind to secure socket: %s\n", strerror(errno));
+        SSL_free(conn->ssl);
+        free(conn);
+        close(socketfd);
+        return -1;
+    }
+
+    conn->socketfd = socketfd;
+    conn->accepted_at = metrics_now();
+    conn->state = CONN_HANDSHAKE;
+    conn->reactor = r;
+    conn->events = EPOLLIN;
+
+    struct epoll_event ev = {0};
+    ev.events = conn->events;
+    ev.data.ptr = conn;
+    if(epoll_ctl(r->epollfd, EPOLL_CTL_ADD, socketfd, &ev) < 0){
+        fprintf(stderr, "Reactor: Could not register client: %s\n", strerror(errno));
+        SSL_free(conn->ssl);
+        free(conn);
+        close(socketfd);
+        return -1;
+    }
+
+    __atomic_add_fetch(&r->connections, 1, __ATOMIC_RELAXED);
+    metrics_connections(1);
+    return 0;
+}
+
+/**
+ * Main loop of an I/O thread. Waits on the epoll set and services readable or
+ * writable connections, as well as responses coming back from the database thread.
+ * @param data reactor
+ * @return NULL
+ */
+static void *reactor_thread(void *data){
+    struct reactor *r = (struct reactor*)data;
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+
+    fprintf(stdout, "IO_THREAD_%d: Waiting for connections\n", r->id);
+
+    while(1){
+        int n = epoll_wait(r->epollfd, events, MAX_EPOLL_EVENTS, -1);
+        if(n < 0){
+            if(errno == EINTR)
+                continue;
+            fprintf(stderr, "IO_THREAD_%d: epoll_wait failed: %s\n", r->id, strerror(errno));
+            break;
+        }
+
+        for(int i = 0; i < n; i++){
+            if(events[i].data.ptr == NULL){
+                uint64_t count;
+                read(r->eventfd, &count, sizeof(count));
+                queue_ack_notify(r->responses);
+                handle_responses(r);
+            } else {
+                handle_connection_event((struct connection*)events[i].data.ptr, events[i].events);
+            }
+        }
+
+        // Later events in the batch may still point at a connection closed earlier in it
+        free_released_connections(r);
+    }
+
+    return NULL;
+}
+
+/**
+ * Drives a single connection forward after epoll reported activity on it.
+ * @param conn
+ * @param events epoll event mask
+ */
+static void handle_connection_event(struct connection *conn, unsigned int events){
+    if(conn->closed)
+        return;
+
+    if(events & (EPOLLHUP | EPOLLERR)){
+        close_connection(conn);
+        return;
+    }
+
+    if(conn->state == CONN_HANDSHAKE){
+        int ret = SSL_accept(conn->ssl);
+        if(ret != 1){
+            switch(SSL_get_error(conn->ssl, ret)){
+                case SSL_ERROR_WANT_READ:
+                    update_interest(conn, 1);
+                    return;
+                case SSL_ERROR_WANT_WRITE:
+                    conn->ssl_wants_write = 1;
+                    update_interest(conn, 0);
+                    return;
+                default:
+                    fprintf(stderr, "Server: Could not establish a secure connection:\n");
+                    ERR_print_errors_fp(stderr);
+                    close_connection(conn);
+                    return;
+            }
+        }
+        conn->ssl_wants_write = 0;
+        conn->state = CONN_AUTH;
+        metrics_handshake(conn->accepted_at, SSL_session_reused(conn->ssl));
+    }
+
+    conn->ssl_wants_write = 0;
+    if(conn->out_head != NULL)
+        flush_connection(conn);
+
+    if(!conn->closed && accepting_requests(conn))
+        read_connection(conn);
+
+    if(!conn->closed)
+        update_interest(conn, accepting_requests(conn));
+}
+
+/**
+ * Reads everything currently available on the connection and dispatches
+ * each complete frame. Partial frames are kept until the rest arrives.
+ * @param conn
+ */
+static void read_connection(struct connection *conn){
+    struct reactor *r = conn->reactor;
+
+    while(!conn->closed && accepting_requests(conn)){
+        uint64_t before = trace_now();
+        int rcount = SSL_read(conn->ssl, r->scratch, REACTOR_IO_CHUNK);
+        if(rcount > 0){
+            conn->read_at = before;
+            conn->decrypted_at = trace_now();
+            metrics_bytes((size_t)rcount, 0);
+            consume_input(conn, r->scratch, (size_t)rcount);
+            continue;
+        }
+
+        switch(SSL_get_error(conn->ssl, rcount)){
+            case SSL_ERROR_WANT_READ:
+                return;
+            case SSL_ERROR_WANT_WRITE:
+                conn->ssl_wants_write = 1;
+                return;
+            case SSL_ERROR_ZERO_RETURN:
+                close_connection(conn);
+                return;
+            case SSL_ERROR_SYSCALL:
+                // Peer hung up without a close_notify
+                if(errno == 0){
+                    close_connection(conn);
+                    return;
+                }
+                // fall through
+            default:
+                fprintf(stderr, "Error reading from client: %s\n", strerror(errno));
+                close_connection(conn);
+                return;
+        }
+    }
+}
+
+/**
+ * Splits received bytes into frames. Bytes that don't complete a frame, or
+ * that arrive while the connection isn't accepting requests, are buffered on
+ * the connection. Idle connections hold no input buffer at all.
+ * @param conn
+ * @param data newly read bytes, may be NULL to only process buffered input
+ * @param len
+ */
+static void consume_input(struct connection *conn, unsigned char *data, size_t len){
+    if(conn->in_length > 0 || data == NULL){
+        if(len > 0 && append_input(conn, data, len) < 0){
+            close_connection(conn);
+            return;
+        }
+        data = conn->in_buffer;
+        len = conn->in_length;
+    }
+
+    size_t pos = 0;
+    while(!conn->closed && accepting_requests(conn)){
+        FrameHeader header;
+        int header_len = unpack_frame_header(data + pos, len - pos, &header);
+        if(header_len < 0 || (header_len > 0 && conn->state == CONN_READY && header.version != conn->version)){
+            fprintf(stderr, "IO_THREAD_%d: Protocol error from client %d\n", conn->reactor->id, conn->socketfd);
+            close_connection(conn);
+            return;
+        }
+        if(header_len == 0 || len - pos - header_len < header.length)
+            break;
+
+        dispatch_frame(conn, &header, (char*)data + pos + header_len, header.length);
+        pos += header_len + header.length;
+    }
+
+    if(conn->closed)
+        return;
+
+    size_t leftover = len - pos;
+    if(data == conn->in_buffer){
+        if(leftover > 0 && pos > 0)
+            memmove(conn->in_buffer, conn->in_buffer + pos, leftover);
+        conn->in_length = leftover;
+    } else if(leftover > 0 && append_input(conn, data + pos, leftover) < 0){
+        close_connection(conn);
+        return;
+    }
+
+    if(conn->in_length == 0 && conn->in_buffer != NULL){
+        free(conn->in_buffer);
+        conn->in_buffer = NULL;
+        conn->in_capacity = 0;
+    }
+}
+
+static int append_input(struct connection *conn, unsigned char *data, size_t len){
+    if(conn->in_length + len > conn->in_capacity){
+        size_t capacity = conn->in_capacity ? conn->in_capacity : REACTOR_IO_CHUNK;
+        while(capacity < conn->in_length + len)
+            capacity *= 2;
+        if(capacity > MAX_FRAME_SIZE + 2 * REACTOR_IO_CHUNK){
+            fprintf(stderr, "IO_THREAD_%d: Client %d exceeded the maximum frame size\n", conn->reactor->id, conn->socketfd);
+            return -1;
+        }
+
+        unsigned char *buffer = realloc(conn->in_buffer, capacity);
+        if(buffer == NULL)
+            return -1;
+        conn->in_buffer = buffer;
+        conn->in_capacity = capacity;
+    }
+
+    memcpy(conn->in_buffer + conn->in_length, data, len);
+    conn->in_length += len;
+    return 0;
+}
+
+/**
+ * Relays a request to the database thread. The reply comes back on the
+ * reactor's response queue tagged with this connection.
+ * @param conn
+ * @param header
+ * @param payload
+ * @param length
+ */
+static void dispatch_frame(struct connection *conn, FrameHeader *header, char *payload, size_t length){
+    struct reactor *r = conn->reactor;
+
+    if(length == 0)
+        return;
+
+    // The login frame carries the highest version the client speaks
+    if(conn->state == CONN_AUTH){
+        int version = negotiate_version(header->version);
+        if(version < 0){
+            fprintf(stderr, "IO_THREAD_%d: Client %d speaks unsupported protocol version %d\n",
+                    r->id, conn->socketfd, header->version);
+            conn->version = PROTOCOL_MIN_VERSION;
+            refuse_login(conn, header->request_id);
+            return;
+        }
+        conn->version = version;
+
+        // Nothing is served before a login, whatever the request
+        if(!is_login(payload, length)){
+            fprintf(stderr, "IO_THREAD_%d: Client %d sent a request before logging in\n", r->id, conn->socketfd);
+            refuse_login(conn, header->request_id);
+            return;
+        }
+    }
+
+    struct queue_head *query = alloc_queue_message();
+    INIT_QUEUE_HEAD_LEN(query, payload, length, r->responses);
+    query->context = conn;
+    query->request_id = header->request_id;
+    query->started = query->queued = metrics_now();
+    query->op = metrics_op(payload, length);
+    query->stamps.read = conn->read_at;
+    query->stamps.decrypted = conn->decrypted_at;
+    trace_label(query, payload, length);
+    if(conn->version >= 2)
+        query->flags |= REQUEST_STREAM;
+
+    // Decided before the login is checked, it only matters once the login succeeds
+    if(conn->state == CONN_AUTH){
+        char username[BUFFER_SIZE];
+        conn->privileged = sscanf(query->operation, "%*s %255s", username) == 1 && metrics_privileged(username);
+    }
+
+    if(conn->state == CONN_READY)
+        fprintf(stdout, "Message received: %s\n", query->operation);
+
+    // Subscriptions and the counters live on the I/O threads, the database never sees them
+    if(conn->state == CONN_READY && (strcmp(query->operation, "WATCH") == 0 || strcmp(query->operation, "UNWATCH") == 0)){
+        handle_watch(conn, header->request_id, query->operation[0] == 'W');
+        free_queue_message(query);
+        return;
+    }
+    if(conn->state == CONN_READY && strcmp(query->operation, "ACCEPTS") == 0){
+        handle_accepts(conn, header->request_id);
+        free_queue_message(query);
+        return;
+    }
+    if(conn->state == CONN_READY && strcmp(query->operation, "METRICS") == 0){
+        handle_metrics(conn, header->request_id);
+        free_queue_message(query);
+        return;
+    }
+
+    // Only one login attempt per connection, stop reading until it is answered
+    struct queue_root *queue;
+    if(conn->state == CONN_AUTH && strncmp(payload, "AUTH ", 5) == 0)
+        queue = auth_pool_queue(r->auth);
+    else
+        queue = route_request(conn, payload, length);
+    if(conn->state == CONN_AUTH)
+        conn->state = CONN_AUTH_PENDING;
+
+    if(queue == r->db_queue){
+        query->flags |= REQUEST_ON_WRITER;
+        conn->writes_inflight++;
+    }
+
+    conn->inflight++;
+    queue_put(query, queue);
+}
+
+/**
+ * Whether the first request of a connection is one that logs in.
+ * @param payload
+ * @param length
+ * @return 1 for AUTH and RESUME, 0 otherwise
+ */
+static int is_login(const char *payload, size_t length){
+    return (length > 5 && strncmp(payload, "AUTH ", 5) == 0)
+           || (length > 7 && strncmp(payload, "RESUME ", 7) == 0);
+}
+
+/**
+ * Answers a login the I/O thread rejects itself with FAILURE, and closes the
+ * connection once that is sent.
+ * @param conn
+ * @param request_id
+ */
+static void refuse_login(struct connection *conn, uint32_t request_id){
+    conn->state = CONN_CLOSING;
+
+    struct queue_head *failure = alloc_queue_message();
+    INIT_QUEUE_HEAD(failure, "FAILURE", NULL);
+    failure->request_id = request_id;
+    queue_output(conn, failure);
+}
+
+// Requests that only read, and can be answered by any database thread
+static const char *read_requests[] = {"RESUME ", "GET ", "PAGE ", "FIND ", "STATS ", "SEARCH ", "COMPLETE "};
+
+/**
+ * Picks the database thread for a request. Reads are spread round robin over
+ * the reader threads, everything else goes to the single writer. A pipelining
+ * client expects to read its own writes, so while it has requests pending on
+ * the writer its reads are queued behind them.
+ * @param conn
+ * @param payload
+ * @param length
+ * @return The queue to put the request on
+ */
+static struct queue_root *route_request(struct connection *conn, const char *payload, size_t length){
+    struct reactor *r = conn->reactor;
+
+    if(r->read_queue_count == 0 || conn->writes_inflight > 0)
+        return r->db_queue;
+
+    for(size_t i = 0; i < sizeof(read_requests) / sizeof(read_requests[0]); i++){
+        size_t prefix = strlen(read_requests[i]);
+        if(length > prefix && strncmp(payload, read_requests[i], prefix) == 0)
+            return r->read_queues[r->next_reader++ % r->read_queue_count];
+    }
+
+    return r->db_queue;
+}
+
+/**
+ * Appends a response to the connection's output queue.
+ * @param conn
+ * @param msg
+ */
+static void queue_output(struct connection *conn, struct queue_head *msg){
+    msg->next = NULL;
+    if(conn->out_tail != NULL)
+        conn->out_tail->next = msg;
+    else
+        conn->out_head = msg;
+    conn->out_tail = msg;
+}
+
+/**
+ * Moves every response the database thread has produced for this reactor
+ * onto the owning connection's output queue.
+ * @param r
+ */
+static void handle_responses(struct reactor *r){
+    struct queue_head *response;
+
+    while((response = queue_get(r->responses)) != NULL){
+        if(response->flags & RESPONSE_EVENT){
+            deliver_event(r, response);
+            free_queue_message(response);
+            continue;
+        }
+
+        struct connection *conn = (struct connection*)response->context;
+        response->stamps.received = trace_now();
+        // A streamed response stays in flight until its last chunk, unless nobody is left to read it
+        if(!(response->flags & RESPONSE_MORE) || conn->closed)
+            request_done(conn, response);
+
+        if(conn->closed){
+            free_queue_message(response);
+            if(conn->inflight == 0)
+                release_connection(conn);
+            continue;
+        }
+
+        if(conn->state == CONN_AUTH_PENDING){
+            // Not the response itself, it carries the session token
+            if(strcmp("FAILURE", response->operation) == 0)
+                conn->state = CONN_CLOSING;
+            else
+                conn->state = CONN_READY;
+            fprintf(stdout, "IO_THREAD_%d_%d Login %s\n", r->id, conn->socketfd,
+                    conn->state == CONN_READY ? "accepted" : "refused");
+        }
+
+        queue_output(conn, response);
+
+        flush_connection(conn);
+        if(!conn->closed){
+            // A reply may have reopened the pipeline, frames sent behind it may already be buffered
+            if(accepting_requests(conn) && conn->in_length > 0)
+                consume_input(conn, NULL, 0);
+            if(!conn->closed && conn->state == CONN_READY && accepting_requests(conn) && !conn->ssl_wants_write)
+                read_connection(conn);
+            if(!conn->closed)
+                update_interest(conn, accepting_requests(conn));
+        }
+    }
+}
+
+/**
+ * Writes as much of the pending output as the socket accepts without blocking.
+ * Connections in the closing state are torn down once their output drains.
+ * @param conn
+ */
+static void flush_connection(struct connection *conn){
+    struct reactor *r = conn->reactor;
+
+    size_t header_size = frame_header_size(conn->version);
+
+    while(conn->out_head != NULL){
+        struct queue_head *msg = conn->out_head;
+        const char *payload = queue_message_data(msg);
+        size_t total = header_size + msg->length;
+
+        if(conn->out_offset < total){
+            const void *chunk;
+            size_t chunk_len;
+
+            if(conn->out_offset < header_size){
+                // Send the header and the start of the payload as one record. The staged bytes
+                // are rebuilt identically if SSL_write has to be retried
+                unsigned char header[FRAME_HEADER_SIZE];
+                uint16_t flags = (msg->flags & RESPONSE_MORE ? FRAME_FLAG_MORE : 0)
+                                 | (msg->flags & RESPONSE_EVENT ? FRAME_FLAG_EVENT : 0);
+                pack_frame_header(header, conn->version, flags, (uint32_t)msg->length, msg->request_id);
+
+                size_t head_len = header_size - conn->out_offset;
+                size_t body_len = msg->length < REACTOR_IO_CHUNK - FRAME_HEADER_SIZE ?
+                                  msg->length : REACTOR_IO_CHUNK - FRAME_HEADER_SIZE;
+                memcpy(r->staging, header + conn->out_offset, head_len);
+                memcpy(r->staging + head_len, payload, body_len);
+                chunk = r->staging;
+                chunk_len = head_len + body_len;
+            } else {
+                chunk = payload + (conn->out_offset - header_size);
+                chunk_len = total - conn->out_offset;
+            }
+
+            int wcount = SSL_write(conn->ssl, chunk, (int)chunk_len);
+            if(wcount <= 0){
+                switch(SSL_get_error(conn->ssl, wcount)){
+                    case SSL_ERROR_WANT_WRITE:
+                        conn->ssl_wants_write = 1;
+                        return;
+                    case SSL_ERROR_WANT_READ:
+                        return;
+                    default:
+                        fprintf(stderr, "Error writing to client: %s\n", strerror(errno));
+                        close_connection(conn);
+                        return;
+                }
+            }
+            metrics_bytes(0, (size_t)wcount);
+            conn->out_offset += wcount;
+            if(conn->out_offset < total)
+                continue;
+        }
+
+        conn->out_head = msg->next;
+        if(conn->out_head == NULL)
+            conn->out_tail = NULL;
+        conn->out_offset = 0;
+        if(msg->flags & RESPONSE_MORE)
+            continue_stream(conn, msg);
+        if(msg->flags & RESPONSE_EVENT)
+            event_sent(conn);
+        else if(!(msg->flags & RESPONSE_MORE))
+            trace_request(msg, r->id, conn->socketfd);
+        free_queue_message(msg);
+    }
+
+    if(conn->state == CONN_CLOSING)
+        close_connection(conn);
+}
+
+/**
+ * Asks for the chunk after one that has just been written out. Chunks are
+ * only requested as fast as the client reads them, so a streamed response
+ * holds one chunk in memory however large it is.
+ * @param conn
+ * @param chunk the chunk that was sent, carrying the cursor to continue from
+ */
+static void continue_stream(struct connection *conn, struct queue_head *chunk){
+    struct reactor *r = conn->reactor;
+
+    // GET ALL is the only response that is streamed
+    struct queue_head *query = alloc_queue_message();
+    INIT_QUEUE_HEAD(query, "GET ALL", r->responses);
+    query->context = conn;
+    query->request_id = chunk->request_id;
+    query->flags = (chunk->flags & ~RESPONSE_MORE) | REQUEST_CONTINUE;
+    query->cursor = chunk->cursor;
+    query->started = chunk->started;
+    query->op = chunk->op;
+    query->queued = metrics_now();
+    query->stamps = chunk->stamps;
+
+    // Stay on the thread that answered so far, see route_request()
+    if(query->flags & REQUEST_ON_WRITER)
+        queue_put(query, r->db_queue);
+    else
+        queue_put(query, r->read_queues[r->next_reader++ % r->read_queue_count]);
+}
+
+/**
+ * Answers WATCH and UNWATCH. A watching connection receives every committed
+ * change as an event frame tagged with the id of its latest WATCH, until it
+ * sends UNWATCH or hangs up.
+ * @param conn
+ * @param request_id
+ * @param watch 1 for WATCH, 0 for UNWATCH
+ */
+static void handle_watch(struct connection *conn, uint32_t request_id, int watch){
+    struct reactor *r = conn->reactor;
+    struct queue_head *reply = alloc_queue_message();
+
+    // Version 1 clients take every frame for the answer to their last request
+    if(watch && conn->version < 2){
+        INIT_QUEUE_HEAD(reply, "FAILURE", NULL);
+    } else {
+        if(watch && !conn->watching){
+            conn->watching = 1;
+            conn->prev_watcher = NULL;
+            conn->next_watcher = r->watchers;
+            if(r->watchers != NULL)
+                r->watchers->prev_watcher = conn;
+            r->watchers = conn;
+            change_feed_watchers(r->feed, 1);
+        } else if(!watch && conn->watching){
+            stop_watching(conn);
+        }
+        conn->watch_id = request_id;
+        INIT_QUEUE_HEAD(reply, "SUCCESS", NULL);
+    }
+
+    reply->request_id = request_id;
+    queue_output(conn, reply);
+}
+
+/**
+ * Answers ACCEPTS from the acceptors' counters.
+ * @param conn
+ * @param request_id
+ */
+static void handle_accepts(struct connection *conn, uint32_t request_id){
+    struct queue_head *reply = alloc_queue_message();
+    char *stats = listener_stats(conn->reactor->listener);
+
+    if(stats != NULL){
+        INIT_QUEUE_HEAD(reply, stats, NULL);
+        free(stats);
+    } else {
+        INIT_QUEUE_HEAD(reply, "FAILURE", NULL);
+    }
+    reply->request_id = request_id;
+    queue_output(conn, reply);
+}
+
+/**
+ * Answers METRICS from the server's counters, to privileged users only.
+ * @param conn
+ * @param request_id
+ */
+static void handle_metrics(struct connection *conn, uint32_t request_id){
+    struct queue_head *reply = alloc_queue_message();
+    char *report = conn->privileged ? metrics_report() : NULL;
+
+    if(report != NULL){
+        INIT_QUEUE_HEAD(reply, report, NULL);
+        free(report);
+    } else {
+        INIT_QUEUE_HEAD(reply, "FAILURE", NULL);
+    }
+    reply->request_id = request_id;
+    queue_output(conn, reply);
+}
+
+static void stop_watching(struct connection *conn){
+    struct reactor *r = conn->reactor;
+
+    if(conn->prev_watcher != NULL)
+        conn->prev_watcher->next_watcher = conn->next_watcher;
+    else
+        r->watchers = conn->next_watcher;
+    if(conn->next_watcher != NULL)
+        conn->next_watcher->prev_watcher = conn->prev_watcher;
+
+    conn->prev_watcher = NULL;
+    conn->next_watcher = NULL;
+    conn->watching = 0;
+    change_feed_watchers(r->feed, -1);
+}
+
+/**
+ * Passes an event from the change feed on to every watcher of the reactor.
+ * They all point at the payload of the event instead of copying it. A watcher
+ * that lets WATCH_MAX_BACKLOG events pile up misses the next ones.
+ * @param r
+ * @param event
+ */
+static void deliver_event(struct reactor *r, struct queue_head *event){
+    struct connection *next;
+
+    for(struct connection *conn = r->watchers; conn != NULL; conn = next){
+        // Flushing may close the connection, which takes it off the list
+        next = conn->next_watcher;
+
+        if(conn->events_queued >= WATCH_MAX_BACKLOG){
+            conn->events_lost = 1;
+            continue;
+        }
+
+        struct queue_head *copy = alloc_queue_message();
+        INIT_QUEUE_HEAD_SHARED(copy, event->shared, NULL);
+        copy->request_id = conn->watch_id;
+        copy->flags = RESPONSE_EVENT;
+        conn->events_queued++;
+        queue_output(conn, copy);
+
+        flush_connection(conn);
+        if(!conn->closed)
+            update_interest(conn, accepting_requests(conn));
+    }
+}
+
+/**
+ * Accounts for an event written out. Once a watcher that missed events has
+ * caught up, it is told to reload everything instead.
+ * @param conn
+ */
+static void event_sent(struct connection *conn){
+    conn->events_queued--;
+    if(conn->events_queued > 0 || !conn->events_lost || !conn->watching)
+        return;
+
+    struct queue_head *resync = alloc_queue_message();
+    INIT_QUEUE_HEAD(resync, "EVENT RESYNC", NULL);
+    resync->request_id = conn->watch_id;
+    resync->flags = RESPONSE_EVENT;
+    conn->events_lost = 0;
+    conn->events_queued++;
+    queue_output(conn, resync);
+}
+
+/**
+ * Accounts for the final response to a request, and records its latency
+ * unless the client is gone.
+ * @param conn
+ * @param response
+ */
+static void request_done(struct connection *conn, struct queue_head *response){
+    conn->inflight--;
+    if(response->flags & REQUEST_ON_WRITER)
+        conn->writes_inflight--;
+    if(!conn->closed)
+        metrics_request(response->op, response->started);
+}
+
+/**
+ * Whether new requests may be read from the connection. Version 2 clients tag
+ * requests with an id and may pipeline up to MAX_PIPELINED_REQUESTS of them,
+ * version 1 clients match replies by order so they get one request at a time.
+ * The login request is always handled alone.
+ * @param conn
+ * @return 1 if another request can be dispatched, 0 otherwise
+ */
+static int accepting_requests(struct connection *conn){
+    if(conn->state == CONN_AUTH)
+        return conn->inflight == 0;
+    if(conn->state != CONN_READY)
+        return 0;
+    return conn->inflight < (conn->version >= 2 ? MAX_PIPELINED_REQUESTS : 1);
+}
+
+/**
+ * Recomputes the epoll interest set of a connection. Level triggered, so we
+ * only ask for writability while there is something to write.
+ * @param conn
+ * @param wants_read
+ */
+static void update_interest(struct connection *conn, int wants_read){
+    unsigned int events = 0;
+
+    if(wants_read || conn->state == CONN_HANDSHAKE)
+        events |= EPOLLIN;
+    if(conn->out_head != NULL || conn->ssl_wants_write)
+        events |= EPOLLOUT;
+
+    if(events == conn->events)
+        return;
+
+    struct epoll_event ev = {0};
+    ev.events = events;
+    ev.data.ptr = conn;
+    if(epoll_ctl(conn->reactor->epollfd, EPOLL_CTL_MOD, conn->socketfd, &ev) < 0){
+        fprintf(stderr, "Reactor: Could not update client: %s\n", strerror(errno));
+        close_connection(conn);
+        return;
+    }
+    conn->events = events;
+}
+
+/**
+ * Tears down the socket and SSL state of a connection. The struct itself is
+ * kept alive until the database thread has answered every in-flight request.
+ * @param conn
+ */
+static void close_connection(struct connection *conn){
+    if(conn->closed)
+        return;
+
+    epoll_ctl(conn->reactor->epollfd, EPOLL_CTL_DEL, conn->socketfd, NULL);
+    if(conn->watching)
+        stop_watching(conn);
+    if(conn->state != CONN_HANDSHAKE)
+        SSL_shutdown(conn->ssl);
+    SSL_free(conn->ssl);
+    conn->ssl = NULL;
+    close(conn->socketfd);
+
+    while(conn->out_head != NULL){
+        struct queue_head *msg = conn->out_head;
+        conn->out_head = msg->next;
+        // The rest of an unsent stream will never be asked for
+        if(msg->flags & RESPONSE_MORE)
+            request_done(conn, msg);
+        free_queue_message(msg);
+    }
+    conn->out_tail = NULL;
+    free(conn->in_buffer);
+    conn->in_buffer = NULL;
+    conn->in_length = 0;
+    conn->closed = 1;
+    __atomic_sub_fetch(&conn->reactor->connections, 1, __ATOMIC_RELAXED);
+    metrics_connections(-1);
+
+    if(conn->inflight == 0)
+        release_connection(conn);
+}
+
+/**
+ * Queues a closed connection with no outstanding requests to be freed once the
+ * current batch of events has been handled.
+ * @param conn
+ */
+static void release_connection(struct connection *conn){
+    conn->next_released = conn->reactor->released;
+    conn->reactor->released = conn;
+}
+
+static void free_released_connections(struct reactor *r){
+    while(r->released != NULL){
+        struct connection *conn = r->released;
+        r->released = conn->next_released;
+        free(conn);
+    }
+}
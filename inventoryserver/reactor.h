@@ -0,0 +1,122 @@
+#ifndef CS469_PROJECT_REACTOR_H
+#define CS469_PROJECT_REACTOR_H
+
+#include <pthread.h>
+#include <openssl/ssl.h>
+
+#include "auth.h"
+#include "feed.h"
+#include "listener.h"
+#include "queue.h"
+
+#define DEFAULT_IO_THREADS 4
+#define MAX_EPOLL_EVENTS   256
+#define REACTOR_IO_CHUNK   (16 * 1024)
+#define MAX_PIPELINED_REQUESTS 64   // Per connection, reading pauses once this many are in flight
+#define WATCH_MAX_BACKLOG  256      // Events queued on a connection before it misses some and is told to resync
+
+// Queue message flag: the request was sent to the writer thread. The others are in queue.h
+#define REQUEST_ON_WRITER 0x1
+
+/**
+ * Connection states. Every connection starts in the handshake state, is
+ * allowed exactly one AUTH or RESUME request, anything else closes it, and is
+ * only promoted to READY once the credentials are accepted.
+ */
+#define CONN_HANDSHAKE    0
+#define CONN_AUTH         1
+#define CONN_AUTH_PENDING 2
+#define CONN_READY        3
+#define CONN_CLOSING      4
+
+/**
+ * An I/O thread. Each reactor owns an epoll set, the connections registered
+ * with it, and a response queue that the database thread replies into.
+ */
+struct reactor {
+    pthread_t thread_id;
+    int id;
+    int epollfd;
+    int eventfd;
+    SSL_CTX *ctx;
+    struct queue_root *db_queue;
+    struct queue_root **read_queues;
+    int read_queue_count;
+    unsigned int next_reader;
+    struct auth_pool *auth;
+    struct queue_root *responses;
+    unsigned long connections;
+    struct change_feed *feed;
+    struct listener *listener;      // Answers ACCEPTS
+    struct connection *watchers;    // Connections that sent WATCH, linked through next_watcher
+
+    unsigned char *scratch;
+    unsigned char *staging;
+    struct connection *released;
+};
+
+/**
+ * Per-client state. Owned by exactly one reactor, and only ever touched from
+ * that reactor's thread once it has been registered.
+ */
+struct connection {
+    int socketfd;
+    int state;
+    int closed;
+    int inflight;
+    int writes_inflight;
+    int ssl_wants_write;
+    int version;
+    int privileged;             // Logged in as one of the users allowed to send METRICS
+    unsigned int events;
+    uint64_t accepted_at;       // For the handshake time
+    uint64_t read_at;           // When the last SSL_read that returned data was called, while tracing
+    uint64_t decrypted_at;      // When it returned
+    SSL *ssl;
+    struct reactor *reactor;
+    struct connection *next_released;
+
+    int watching;
+    uint32_t watch_id;          // Request id of the WATCH, events are tagged with it
+    int events_queued;          // Events in the output queue
+    int events_lost;            // Events were dropped since the backlog was full
+    struct connection *prev_watcher;
+    struct connection *next_watcher;
+
+    unsigned char *in_buffer;
+    size_t in_length;
+    size_t in_capacity;
+
+    struct queue_head *out_head;
+    struct queue_head *out_tail;
+    size_t out_offset;
+};
+
+/**
+ * Allocates and starts a reactor thread.
+ *
+ * @param id Index of the reactor, used for logging
+ * @param ctx Server SSL context used for new connections
+ * @param db_queue Queue of the writer thread, which handles every request that changes the database
+ * @param read_queues Queues of the reader threads, GET and RESUME are spread over them
+ * @param read_queue_count Number of reader queues, 0 sends everything to db_queue
+ * @param auth Workers AUTH requests are spread over
+ * @param feed Change feed the reactor's watchers are counted in. The caller adds the reactor's queue to it
+ * @param listener Listening port, whose counters ACCEPTS reports
+ * @return The running reactor, or NULL on error
+ */
+struct reactor *reactor_start(int id, SSL_CTX *ctx, struct queue_root *db_queue,
+                              struct queue_root **read_queues, int read_queue_count, struct auth_pool *auth,
+                              struct change_feed *feed, struct listener *listener);
+
+/**
+ * Hands a freshly accepted socket to a reactor. The socket is switched to
+ * non-blocking mode and the TLS handshake is driven by the reactor thread.
+ *
+ * @param r The reactor that will own the connection
+ * @param socketfd Accepted client socket
+ * @return 0 on success, -1 on error (the socket is closed)
+ */
+int reactor_add_connection(struct reactor *r, int socketfd);
+
+#endif //CS469_PROJECT_REACTOR_H
@@ -0,0 +1,568 @@
+//
+// SEARCH command, backed by a trigram inverted index. Every three consecutive
+// bytes of an item's name and description, case folded, map to the ascending
+// ids of the items containing them. A substring can only occur in items that
+// hold all of its trigrams, so intersecting their posting lists leaves a few
+// candidates, which are checked against the text in the item cache. A fuzzy
+// search counts how many of the trigrams each item holds instead.
+//
+// Trigrams too common to narrow a search down are not indexed at all, which
+// is also what keeps the memory of the index bounded.
+//
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+
+#include "search.h"
+#include "snapshot.h"
+
+/**
+ * Position in a posting list during a fuzzy search.
+ */
+struct cursor {
+    const int *ids;
+    uint32_t next;
+    uint32_t count;
+};
+
+struct match {
+    int id;
+    int score;
+};
+
+static int item_trigrams(const Item *item, uint32_t *trigrams);
+static int text_trigrams(const char *text, uint32_t *trigrams, int count);
+static int unique_trigrams(uint32_t *trigrams, int count);
+static struct posting_list *find_list(struct posting_list *lists, size_t capacity, uint32_t trigram);
+static struct posting_list *get_list(struct search_index *index, uint32_t trigram);
+static void grow(struct search_index *index);
+static void add_posting(struct search_index *index, struct posting_list *list, int id);
+static void remove_posting(struct search_index *index, struct posting_list *list, int id);
+static void saturate(struct search_index *index, struct posting_list *list);
+static size_t seek(const int *ids, size_t from, size_t count, int id);
+static size_t intersect(int *candidates, size_t count, const struct posting_list *list);
+static char *search_substring(struct db_statements *statements, struct item_cache *cache, const char *text,
+                              const uint32_t *trigrams, int count);
+static char *search_database(struct db_statements *statements, const char *text);
+static char *search_fuzzy(struct item_cache *cache, const uint32_t *trigrams, int count);
+static int collect_best(struct cursor *cursors, int count, int needed, struct match *best);
+static void sift_down(struct cursor *heap, int count, int at);
+
+static inline unsigned char fold(unsigned char c){
+    return c >= 'A' && c <= 'Z' ? (unsigned char)(c - 'A' + 'a') : c;
+}
+
+static int compare_lengths(const void *a, const void *b){
+    uint32_t x = (*(struct posting_list* const*)a)->count;
+    uint32_t y = (*(struct posting_list* const*)b)->count;
+    return (x > y) - (x < y);
+}
+
+struct search_index *search_index_create(){
+    struct search_index *index = (struct search_index*)calloc(1, sizeof(struct search_index));
+    if(index == NULL)
+        return NULL;
+
+    index->capacity = SEARCH_INITIAL_CAPACITY;
+    index->max_list = SEARCH_MAX_LIST;
+    index->lists = (struct posting_list*)calloc(index->capacity, sizeof(struct posting_list));
+    if(index->lists == NULL){
+        free(index);
+        return NULL;
+    }
+    pthread_rwlock_init(&index->lock, NULL);
+    return index;
+}
+
+void search_index_update(struct search_index *index, const Item *old, const Item *item){
+    uint32_t removed[SEARCH_MAX_TRIGRAMS];
+    uint32_t added[SEARCH_MAX_TRIGRAMS];
+    int removed_count = old ? item_trigrams(old, removed) : 0;
+    int added_count = item ? item_trigrams(item, added) : 0;
+    int id = item ? item->id : old->id;
+
+    pthread_rwlock_wrlock(&index->lock);
+
+    // Both are sorted, so walk them together. Lists of trigrams in both stay as they are
+    int i = 0;
+    int j = 0;
+    while(i < removed_count || j < added_count){
+        if(j == added_count || (i < removed_count && removed[i] < added[j])){
+            struct posting_list *list = find_list(index->lists, index->capacity, removed[i++]);
+            if(list->trigram != 0)
+                remove_posting(index, list, id);
+        } else if(i == removed_count || added[j] < removed[i]){
+            add_posting(index, get_list(index, added[j++]), id);
+        } else {
+            i++;
+            j++;
+        }
+    }
+
+    // Over budget, halve the length a list may have, long lists narrow searches down the least
+    while(index->postings > SEARCH_MAX_POSTINGS && index->max_list > 1){
+        index->max_list /= 2;
+        for(size_t slot = 0; slot < index->capacity; slot++){
+            if(index->lists[slot].count > index->max_list)
+                saturate(index, &index->lists[slot]);
+        }
+    }
+
+    pthread_rwlock_unlock(&index->lock);
+}
+
+void search_index_set_complete(struct search_index *index, int complete){
+    pthread_rwlock_wrlock(&index->lock);
+    index->complete = complete;
+    pthread_rwlock_unlock(&index->lock);
+}
+
+char *search_items(struct db_statements *statements, struct item_cache *cache, const char *request){
+    if(strncmp(request, "SEARCH ", 7) != 0)
+        return NULL;
+
+    const char *text = request + 7;
+    int fuzzy = *text == '~';
+    if(fuzzy)
+        text++;
+
+    size_t length = strlen(text);
+    if(length < SEARCH_MIN_LENGTH || length >= BUFFER_SIZE)
+        return NULL;
+
+    uint32_t trigrams[SEARCH_MAX_TRIGRAMS];
+    int count = unique_trigrams(trigrams, text_trigrams(text, trigrams, 0));
+
+    if(fuzzy)
+        return search_fuzzy(cache, trigrams, count);
+    return search_substring(statements, cache, text, trigrams, count);
+}
+
+/**
+ * Finds the items containing text.
+ */
+static char *search_substring(struct db_statements *statements, struct item_cache *cache, const char *text,
+                              const uint32_t *trigrams, int count){
+    struct search_index *index = cache->search;
+    struct posting_list *lists[SEARCH_MAX_TRIGRAMS];
+    int list_count = 0;
+    int missing = 0;
+
+    pthread_rwlock_rdlock(&index->lock);
+    if(!index->complete){
+        pthread_rwlock_unlock(&index->lock);
+        return NULL;
+    }
+
+    for(int i = 0; i < count && !missing; i++){
+        struct posting_list *list = find_list(index->lists, index->capacity, trigrams[i]);
+        if(list->saturated)
+            continue;
+        missing = list->trigram == 0 || list->count == 0;
+        lists[list_count++] = list;
+    }
+
+    if(!missing && list_count == 0){
+        // Every trigram is too common to be indexed
+        pthread_rwlock_unlock(&index->lock);
+        return search_database(statements, text);
+    }
+
+    int *candidates = NULL;
+    size_t candidate_count = 0;
+    if(!missing){
+        // Start from the shortest list, the others can only take candidates away
+        qsort(lists, list_count, sizeof(struct posting_list*), compare_lengths);
+        candidate_count = lists[0]->count;
+        candidates = (int*)malloc(candidate_count * sizeof(int));
+        if(candidates == NULL){
+            pthread_rwlock_unlock(&index->lock);
+            return NULL;
+        }
+        memcpy(candidates, lists[0]->ids, candidate_count * sizeof(int));
+
+        for(int i = 1; i < list_count && candidate_count > 0; i++)
+            candidate_count = intersect(candidates, candidate_count, lists[i]);
+    }
+    pthread_rwlock_unlock(&index->lock);
+
+    char *result = NULL;
+    size_t length = 0;
+    FILE *out = open_memstream(&result, &length);
+    if(out == NULL){
+        free(candidates);
+        return NULL;
+    }
+
+    // Holding every trigram doesn't mean holding them in a row, check the text
+    fputs("SUCCESS ", out);
+    int found = 0;
+    for(size_t i = 0; i < candidate_count && found < SEARCH_MAX_RESULTS; i++){
+        Item item;
+        if(item_cache_get(cache, candidates[i], &item) != CACHE_HIT)
+            continue;
+        if(strcasestr(item.name, text) == NULL && strcasestr(item.description, text) == NULL)
+            continue;
+
+        if(found++ > 0)
+            fputc(RECORD_SEPARATOR, out);
+        print_item(out, &item);
+    }
+    fputc(GROUP_SEPARATOR, out);
+    free(candidates);
+
+    if(fclose(out) != 0){
+        free(result);
+        return NULL;
+    }
+    return result;
+}
+
+/**
+ * Finds the items containing text by scanning the table, for text made of
+ * trigrams that are all too common to be indexed.
+ */
+static char *search_database(struct db_statements *statements, const char *text){
+    char sql[BUFFER_SIZE];
+    // lower() and strcasestr() both fold ASCII only
+    snprintf(sql, sizeof(sql), "SELECT * FROM items WHERE instr(lower(name), lower(?1)) > 0 "
+                               "OR instr(lower(description), lower(?1)) > 0 ORDER BY id LIMIT %d", SEARCH_MAX_RESULTS);
+
+    sqlite3_stmt *stmt = db_statement_sql(statements, sql);
+    if(stmt == NULL)
+        return NULL;
+
+    sqlite3_bind_text(stmt, 1, text, -1, SQLITE_TRANSIENT);
+    size_t length;
+    char *result = marshalItems(stmt, &length);
+    sqlite3_reset(stmt);
+    return result;
+}
+
+/**
+ * Finds the items sharing at least 1 / SEARCH_FUZZY_SHARE of the trigrams of
+ * the text, best matches first. Saturated trigrams are in too many items to tell them apart,
+ * and don't count.
+ */
+static char *search_fuzzy(struct item_cache *cache, const uint32_t *trigrams, int count){
+    struct search_index *index = cache->search;
+    struct cursor cursors[SEARCH_MAX_TRIGRAMS];
+    struct match best[SEARCH_MAX_RESULTS];
+    int cursor_count = 0;
+    int total = 0;
+
+    pthread_rwlock_rdlock(&index->lock);
+    if(!index->complete){
+        pthread_rwlock_unlock(&index->lock);
+        return NULL;
+    }
+
+    for(int i = 0; i < count; i++){
+        struct posting_list *list = find_list(index->lists, index->capacity, trigrams[i]);
+        if(list->saturated)
+            continue;
+
+        // A trigram no item has still counts against every item
+        total++;
+        if(list->count > 0){
+            cursors[cursor_count].ids = list->ids;
+            cursors[cursor_count].next = 0;
+            cursors[cursor_count].count = list->count;
+            cursor_count++;
+        }
+    }
+
+    if(total == 0){
+        pthread_rwlock_unlock(&index->lock);
+        return NULL;
+    }
+    int found = collect_best(cursors, cursor_count, (total + SEARCH_FUZZY_SHARE - 1) / SEARCH_FUZZY_SHARE, best);
+    pthread_rwlock_unlock(&index->lock);
+
+    char *result = NULL;
+    size_t length = 0;
+    FILE *out = open_memstream(&result, &length);
+    if(out == NULL)
+        return NULL;
+
+    fputs("SUCCESS ", out);
+    int written = 0;
+    for(int i = 0; i < found; i++){
+        Item item;
+        if(item_cache_get(cache, best[i].id, &item) != CACHE_HIT)
+            continue;
+
+        if(written++ > 0)
+            fputc(RECORD_SEPARATOR, out);
+        print_item(out, &item);
+    }
+    fputc(GROUP_SEPARATOR, out);
+
+    if(fclose(out) != 0){
+        free(result);
+        return NULL;
+    }
+    return result;
+}
+
+/**
+ * Merges posting lists, scoring every id by the number of lists holding it.
+ * Caller holds the read lock.
+ * @return The number of matches in best, ordered by score then id, all scoring at least needed
+ */
+static int collect_best(struct cursor *cursors, int count, int needed, struct match *best){
+    int found = 0;
+
+    // Min-heap of the lists by their next id
+    for(int i = count / 2 - 1; i >= 0; i--)
+        sift_down(cursors, count, i);
+
+    while(count > 0){
+        int id = cursors[0].ids[cursors[0].next];
+        int score = 0;
+
+        while(count > 0 && cursors[0].ids[cursors[0].next] == id){
+            score++;
+            if(++cursors[0].next == cursors[0].count)
+                cursors[0] = cursors[--count];
+            sift_down(cursors, count, 0);
+        }
+
+        // Ids arrive ascending, so on equal scores the earlier one stays ahead
+        if(score < needed || (found == SEARCH_MAX_RESULTS && score <= best[found - 1].score))
+            continue;
+
+        int at = found < SEARCH_MAX_RESULTS ? found++ : found - 1;
+        while(at > 0 && best[at - 1].score < score){
+            best[at] = best[at - 1];
+            at--;
+        }
+        best[at].id = id;
+        best[at].score = score;
+    }
+    return found;
+}
+
+static void sift_down(struct cursor *heap, int count, int at){
+    while(1){
+        int smallest = at;
+        int left = 2 * at + 1;
+        int right = left + 1;
+        if(left < count && heap[left].ids[heap[left].next] < heap[smallest].ids[heap[smallest].next])
+            smallest = left;
+        if(right < count && heap[right].ids[heap[right].next] < heap[smallest].ids[heap[smallest].next])
+            smallest = right;
+        if(smallest == at)
+            return;
+
+        struct cursor swap = heap[at];
+        heap[at] = heap[smallest];
+        heap[smallest] = swap;
+        at = smallest;
+    }
+}
+
+/**
+ * Collects the distinct trigrams of an item's name and description.
+ * @return The number of trigrams, sorted
+ */
+static int item_trigrams(const Item *item, uint32_t *trigrams){
+    int count = text_trigrams(item->name, trigrams, 0);
+    count = text_trigrams(item->description, trigrams, count);
+    return unique_trigrams(trigrams, count);
+}
+
+/**
+ * Appends the trigrams of a text, which is shorter than BUFFER_SIZE, after the first count.
+ * @return The new count
+ */
+static int text_trigrams(const char *text, uint32_t *trigrams, int count){
+    size_t length = strnlen(text, BUFFER_SIZE - 1);
+    for(size_t i = 0; i + 2 < length; i++)
+        trigrams[count++] = (uint32_t)fold(text[i]) << 16 | (uint32_t)fold(text[i + 1]) << 8 | fold(text[i + 2]);
+    return count;
+}
+
+/**
+ * Sorts trigrams and drops the duplicates. There are at most SEARCH_MAX_TRIGRAMS.
+ * @return The number left
+ */
+static int unique_trigrams(uint32_t *trigrams, int count){
+    uint32_t buffer[SEARCH_MAX_TRIGRAMS];
+    uint32_t *from = trigrams;
+    uint32_t *to = buffer;
+
+    // Radix sort a byte at a time, qsort() took most of the time spent indexing an item
+    for(int shift = 0; shift < 24; shift += 8){
+        int offsets[257] = {0};
+        for(int i = 0; i < count; i++)
+            offsets[((from[i] >> shift) & 0xFF) + 1]++;
+        for(int b = 0; b < 256; b++)
+            offsets[b + 1] += offsets[b];
+        for(int i = 0; i < count; i++)
+            to[offsets[(from[i] >> shift) & 0xFF]++] = from[i];
+
+        uint32_t *swap = from;
+        from = to;
+        to = swap;
+    }
+
+    // Three passes leave them in buffer, copy back the distinct ones
+    int kept = 0;
+    for(int i = 0; i < count; i++){
+        if(kept == 0 || from[i] != trigrams[kept - 1])
+            trigrams[kept++] = from[i];
+    }
+    return kept;
+}
+
+/**
+ * Finds the slot holding trigram, or the empty slot where it would be inserted.
+ */
+static struct posting_list *find_list(struct posting_list *lists, size_t capacity, uint32_t trigram){
+    size_t slot = (trigram * 2654435769u) & (capacity - 1);
+
+    while(lists[slot].trigram != 0 && lists[slot].trigram != trigram)
+        slot = (slot + 1) & (capacity - 1);
+    return &lists[slot];
+}
+
+/**
+ * Finds the list of a trigram, adding an empty one if there is none. Caller holds the write lock.
+ */
+static struct posting_list *get_list(struct search_index *index, uint32_t trigram){
+    // Keep the load factor under 0.7
+    if((index->used + 1) * 10 > index->capacity * 7)
+        grow(index);
+
+    struct posting_list *list = find_list(index->lists, index->capacity, trigram);
+    if(list->trigram == 0){
+        list->trigram = trigram;
+        index->used++;
+    }
+    return list;
+}
+
+/**
+ * Doubles the table. Caller holds the write lock.
+ */
+static void grow(struct search_index *index){
+    size_t capacity = index->capacity * 2;
+    struct posting_list *lists = (struct posting_list*)calloc(capacity, sizeof(struct posting_list));
+    if(lists == NULL){
+        perror("Could not grow search index");
+        exit(-1);
+    }
+
+    for(size_t i = 0; i < index->capacity; i++){
+        if(index->lists[i].trigram != 0)
+            *find_list(lists, capacity, index->lists[i].trigram) = index->lists[i];
+    }
+
+    free(index->lists);
+    index->lists = lists;
+    index->capacity = capacity;
+}
+
+/**
+ * Adds an id to a list, keeping it sorted. Caller holds the write lock.
+ */
+static void add_posting(struct search_index *index, struct posting_list *list, int id){
+    if(list->saturated)
+        return;
+
+    // New items have the highest id yet
+    size_t at = list->count > 0 && list->ids[list->count - 1] >= id ? seek(list->ids, 0, list->count, id) : list->count;
+    if(at < list->count && list->ids[at] == id)
+        return;
+
+    if(list->count >= index->max_list){
+        saturate(index, list);
+        return;
+    }
+    if(list->count == list->capacity){
+        uint32_t capacity = list->capacity ? list->capacity * 2 : 4;
+        int *ids = (int*)realloc(list->ids, capacity * sizeof(int));
+        if(ids == NULL){
+            perror("Could not grow posting list");
+            exit(-1);
+        }
+        list->ids = ids;
+        list->capacity = capacity;
+    }
+
+    memmove(list->ids + at + 1, list->ids + at, (list->count - at) * sizeof(int));
+    list->ids[at] = id;
+    list->count++;
+    index->postings++;
+}
+
+/**
+ * Removes an id from a list. Caller holds the write lock.
+ */
+static void remove_posting(struct search_index *index, struct posting_list *list, int id){
+    size_t at = seek(list->ids, 0, list->count, id);
+    if(at == list->count || list->ids[at] != id)
+        return;
+
+    memmove(list->ids + at, list->ids + at + 1, (list->count - at - 1) * sizeof(int));
+    list->count--;
+    index->postings--;
+}
+
+/**
+ * Drops the ids of a list for good. Caller holds the write lock.
+ */
+static void saturate(struct search_index *index, struct posting_list *list){
+    index->postings -= list->count;
+    free(list->ids);
+    list->ids = NULL;
+    list->count = 0;
+    list->capacity = 0;
+    list->saturated = 1;
+}
+
+/**
+ * Finds the first position at or after from holding an id not less than id.
+ * Gallops ahead before searching, as intersections mostly move forward by little.
+ */
+static size_t seek(const int *ids, size_t from, size_t count, int id){
+    size_t high = from;
+    size_t step = 1;
+
+    while(high < count && ids[high] < id){
+        from = high + 1;
+        high += step;
+        step *= 2;
+    }
+    if(high > count)
+        high = count;
+
+    while(from < high){
+        size_t middle = from + (high - from) / 2;
+        if(ids[middle] < id)
+            from = middle + 1;
+        else
+            high = middle;
+    }
+    return from;
+}
+
+/**
+ * Keeps the candidates found in list.
+ * @return The number kept
+ */
+static size_t intersect(int *candidates, size_t count, const struct posting_list *list){
+    size_t kept = 0;
+    size_t at = 0;
+
+    for(size_t i = 0; i < count; i++){
+        at = seek(list->ids, at, list->count, candidates[i]);
+        if(at == list->count)
+            break;
+        if(list->ids[at] == candidates[i])
+            candidates[kept++] = candidates[i];
+    }
+    return kept;
+}
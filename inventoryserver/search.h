@@ -0,0 +1,91 @@
+#ifndef CS469_PROJECT_SEARCH_H
+#define CS469_PROJECT_SEARCH_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "cache.h"
+#include "statements.h"
+
+#define SEARCH_INITIAL_CAPACITY 4096
+#define SEARCH_MIN_LENGTH       3                   // Shortest text with a trigram
+#define SEARCH_MAX_RESULTS      100
+#define SEARCH_MAX_LIST         (64 * 1024)         // Longer posting lists are dropped, see struct posting_list
+#define SEARCH_MAX_POSTINGS     (32 * 1024 * 1024)  // Bounds the whole index to about 128 MB
+#define SEARCH_FUZZY_SHARE      3                   // A fuzzy match holds at least a third of the trigrams
+#define SEARCH_MAX_TRIGRAMS     (2 * BUFFER_SIZE)   // Of one item, name and description
+
+/**
+ * Ids of the items containing a trigram, ascending. A trigram found in too
+ * many items is saturated: its ids are dropped, and searches skip it, as it
+ * hardly narrows them down.
+ */
+struct posting_list {
+    uint32_t trigram;       // Three case folded bytes, 0 for an empty slot
+    int saturated;
+    int *ids;
+    uint32_t count;
+    uint32_t capacity;
+};
+
+/**
+ * Trigram inverted index over item names and descriptions, in an open
+ * addressing hash table keyed by trigram. Only the writer thread changes it,
+ * through the item cache (see item_cache_put()). Never take the item cache
+ * lock while holding this one.
+ */
+struct search_index {
+    pthread_rwlock_t lock;
+    struct posting_list *lists;
+    size_t capacity;        // Always a power of two
+    size_t used;
+    size_t postings;        // Ids in all lists
+    uint32_t max_list;      // Longer lists are saturated. Starts at SEARCH_MAX_LIST, halved whenever
+                            // the index grows past SEARCH_MAX_POSTINGS
+    int complete;           // Every item in the table is indexed
+};
+
+/**
+ * Allocates an empty index.
+ *
+ * @return The index, or NULL on error
+ */
+struct search_index *search_index_create();
+
+/**
+ * Records a committed insert, update or delete. Writer thread only.
+ *
+ * @param index
+ * @param old The item as it was, or NULL for an insert or if it is unknown
+ * @param item The item as it is now, or NULL for a delete
+ */
+void search_index_update(struct search_index *index, const Item *old, const Item *item);
+
+/**
+ * Marks the index as covering every item, once the initial load succeeded.
+ * Searches of an incomplete index fail.
+ *
+ * @param index
+ * @param complete
+ */
+void search_index_set_complete(struct search_index *index, int complete);
+
+/**
+ * Answers a SEARCH request:
+ *
+ *   SEARCH <text>      Items whose name or description contains text
+ *   SEARCH ~<text>     Items whose name or description shares at least a
+ *                      third of the trigrams of text, best matches first
+ *
+ * Matching ignores ASCII case, text needs at least SEARCH_MIN_LENGTH
+ * characters, and at most SEARCH_MAX_RESULTS items are returned, in the GET
+ * ALL format. Substring matches come in id order.
+ *
+ * @param statements Statement cache of the calling thread's connection
+ * @param cache
+ * @param request The SEARCH request
+ * @return The response to be freed by the caller, or NULL if the request is invalid or failed
+ */
+char *search_items(struct db_statements *statements, struct item_cache *cache, const char *request);
+
+#endif //CS469_PROJECT_SEARCH_H
@@ -5,22 +5,48 @@
 #include <pthread.h>
 #include <sqlite3.h>
 #include <fcntl.h>
-#include <crypt.h>
+#include <limits.h>
+#include <signal.h>
+#include <sys/resource.h>
 
 #include "../globals.h"
 #include "network.h"
 #include "queue.h"
+#include "reactor.h"
+#include "statements.h"
+#include "cache.h"
+#include "snapshot.h"
+#include "page.h"
+#include "query.h"
+#include "stats.h"
+#include "search.h"
+#include "names.h"
+#include "feed.h"
+#include "versions.h"
+#include "auth.h"
+#include "listener.h"
+#include "metrics.h"
+#include "trace.h"
+
+#define DEFAULT_DB_READERS 4
+#define SYNC_SNAPSHOT_SUFFIX ".sync"   // Next to the database, the copy a SYNC ships
 
 void *handle_database_thread(void *data);
-void *client_thread(void *data);
+void *handle_reader_thread(void *data);
+int handle_read_request(struct db_statements *statements, struct item_cache *cache, struct items_snapshot *snapshot,
+                        struct queue_head *msg, struct queue_head *response);
+int enable_wal(char *database);
 void *timer_thread_handler(void *data);
-int db_login(sqlite3 *db, char *username, char *password);
-int authenticate(const char *hash, char *password);
 static error_t parse_args(int key, char *arg, struct argp_state *state);
 int parse_conf_file(void *args);
 int parse_interval(char *interval);
-char * marshalItems(sqlite3_stmt *stmt);
-void new_item_from_row(sqlite3_stmt * stmt, Item * item);
+int default_auth_workers();
+int db_insert_item(struct db_statements *statements, Item *item, sqlite3_int64 version);
+int db_update_item(struct db_statements *statements, Item *item, sqlite3_int64 version);
+int db_delete_item(struct db_statements *statements, int id, sqlite3_int64 version);
+int db_snapshot(sqlite3 *db, const char *filename);
+char *db_batch(struct db_statements *statements, struct item_cache *cache, int operation, char *payload,
+               sqlite3_int64 version);
 
 struct Arguments {
     int listenPort;
@@ -30,22 +56,28 @@ struct Arguments {
     char *filename;
     char *database;
     int interval;
+    int ioThreads;
+    int readers;
+    int authWorkers;
+    int acceptors;
+    int backlog;
+    int metricsPort;
+    char *metricsUsers;
+    double traceThreshold;
+    char *traceFile;
+    int traceRate;
+    struct tls_options tls;
 };
 
-typedef struct {
-    pthread_t thread_id;
-    int socketfd;
-    int open;
-    SSL_CTX* ctx;
-    struct queue_root* queue;
-} client_data;
-
 typedef struct {
     struct queue_root* queue;
+    struct item_cache *cache;
+    struct items_snapshot *snapshot;
     char *database;
     char *backupServer;
     int backupPort;
     char *backupPsk;
+    const struct tls_options *tls;
 } db_info;
 
 typedef struct {
@@ -53,6 +85,14 @@ typedef struct {
     int interval;
 } timer_info;
 
+typedef struct {
+    struct queue_root* queue;
+    struct item_cache *cache;
+    struct items_snapshot *snapshot;
+    char *database;
+    int id;
+} reader_info;
+
 static struct argp_option options[] = {
         {"listen-port",'l',"<port>", 0, "Port to listen on. Default: 4466"},
         {"backup-inventoryserver", 's', "<inventoryserver>", 0, "Server to backup to. Default: localhost"},
@@ -61,6 +101,15 @@ static struct argp_option options[] = {
         {"config", 'c', "<filename>", 0, "A config file that can be used in lieu of CLI arguments. This will override all CLI arguments."},
         {"database", 'd', "<filename>", 0, "SQLite 3 database file to use for the application. Default: items.db"},
         {"backup-interval",'i',"<n:H>", 0, "How frequently to backup the database. The time format is time:unit. Acceptable units are [H]ours, [m]inutes, [s]econds. Default: 24:H"},
+        {"io-threads", 't', "<n>", 0, "Number of I/O threads servicing client connections. Default: 4"},
+        {"readers", 'r', "<n>", 0, "Number of database reader threads serving GET and RESUME. 0 serves everything from the writer. Default: 4"},
+        {"auth-workers", 'a', "<n>", 0, "Number of threads checking AUTH passwords. Default: number of CPUs"},
+        {"acceptors", 'A', "<n>", 0, "Number of threads accepting connections, each with its own listening socket. Default: 2"},
+        {"backlog", 'b', "<n>", 0, "Connections each acceptor's queue holds before the kernel turns new ones away. Default: 1024"},
+        {"metrics-port", 'm', "<port>", 0, "Local port serving Prometheus metrics on 127.0.0.1. 0 turns it off. Default: 9466"},
+        {"metrics-users", 'u', "<user,...>", 0, "Users allowed to send METRICS. Default: none"},
+        {"trace-threshold", 'T', "<ms>", 0, "Dump requests slower than this to the trace file. 0 turns tracing off. Default: 0"},
+        {"trace-file", 'F', "<filename>", 0, "Chrome trace-event file slow requests are appended to. Default: trace.json"},
         {0}
 };
 
@@ -70,7 +119,7 @@ static struct argp_option options[] = {
  *  Reads arguments and confic file
  *  spawns DB thread
  *  sets up network listener
- *  Spawns new thread for every connected client
+ *  Starts a fixed pool of I/O threads and hands every connected client to one of them
  */
 struct argp argp = { options, parse_args, 0, "A program to manage remote database queries."};
 int main(int argc, char *argv[]){
@@ -78,7 +127,7 @@ int main(int argc, char *argv[]){
     struct Arguments arguments = {0};
     SSL_CTX *ssl_ctx;
 
-    client_data clients[MAX_CLIENTS];
+    struct reactor **reactors;
     pthread_t database_thread;
     pthread_t timer_thread;
     struct queue_root *db_queue;
@@ -91,6 +140,16 @@ int main(int argc, char *argv[]){
     arguments.database = DEFAULT_DATABASE;
     arguments.interval = DEFAULT_INTERVAL;
     arguments.filename = NULL;
+    arguments.ioThreads = DEFAULT_IO_THREADS;
+    arguments.readers = DEFAULT_DB_READERS;
+    arguments.authWorkers = default_auth_workers();
+    arguments.acceptors = DEFAULT_ACCEPTORS;
+    arguments.backlog = DEFAULT_LISTEN_BACKLOG;
+    arguments.metricsPort = DEFAULT_METRICS_PORT;
+    arguments.metricsUsers = "";
+    arguments.traceThreshold = 0;
+    arguments.traceFile = DEFAULT_TRACE_FILE;
+    arguments.traceRate = DEFAULT_TRACE_RATE;
 
     argp_parse(&argp, argc, argv, 0, 0, &arguments);
     if(arguments.filename != NULL) parse_conf_file(&arguments);
@@ -101,19 +160,75 @@ int main(int argc, char *argv[]){
     printf("\tServer: %s:%d\n", arguments.server, arguments.backupPort);
     printf("\tConfig file: %s\n", arguments.filename ? arguments.filename: "NULL");
     printf("\tBackup interval: %d seconds\n", arguments.interval);
+    printf("\tI/O threads: %d\n", arguments.ioThreads);
+    printf("\tDatabase readers: %d\n", arguments.readers);
+    printf("\tAuth workers: %d\n", arguments.authWorkers);
+    printf("\tAcceptors: %d, backlog %d\n", arguments.acceptors, arguments.backlog);
+    printf("\tMetrics port: %d\n", arguments.metricsPort);
+
+    if(metrics_set_users(arguments.metricsUsers) != 0){
+        fprintf(stderr, "Server: At most %d users may send METRICS\n", METRICS_MAX_USERS);
+        return -1;
+    }
+
+    // Before any thread opens the database, every connection has its statements timed
+    if(arguments.traceThreshold > 0){
+        if(trace_start(arguments.traceFile, (uint64_t)(arguments.traceThreshold * 1000), arguments.traceRate) == 0)
+            printf("\tTracing requests slower than %g ms to %s\n", arguments.traceThreshold, arguments.traceFile);
+        else
+            fprintf(stderr, "Server: Could not open trace file %s: %s\n", arguments.traceFile, strerror(errno));
+    }
+
+    // Every client is a file descriptor now, not a thread. Allow as many as the hard limit permits
+    struct rlimit limit;
+    if(getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max){
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    // A client that hangs up while we write to it, even just a session ticket, must not kill the server
+    signal(SIGPIPE, SIG_IGN);
 
     // Initializing global writer queue
     db_queue = ALLOC_QUEUE_ROOT();
-    struct queue_head *sample_item = malloc_aligned(sizeof(struct queue_head));
+    metrics_add_queue(METRIC_QUEUE_WRITER, db_queue);
+    struct queue_head *sample_item = alloc_queue_message();
     INIT_QUEUE_HEAD(sample_item, "INITIALIZATION", NULL);
     queue_put(sample_item, db_queue);
 
+    // Readers only run alongside the writer in WAL mode
+    if(enable_wal(arguments.database) != 0)
+        arguments.readers = 0;
+
+    // Before any thread prepares statements that use the version column
+    if(versions_migrate(arguments.database) != 0)
+        fprintf(stderr, "Server: Could not add versions to the database, GET SINCE will fail\n");
+    if(auth_init(arguments.database) != 0){
+        fprintf(stderr, "Server: Could not load the session token key\n");
+        return -1;
+    }
+
+    // Shared by the writer, which loads and updates it, and the readers
+    struct item_cache *cache = item_cache_create();
+    if(cache == NULL){
+        fprintf(stderr, "Server: Could not allocate item cache\n");
+        return -1;
+    }
+    struct items_snapshot *snapshot = items_snapshot_create();
+    if(snapshot == NULL){
+        fprintf(stderr, "Server: Could not allocate GET ALL snapshot\n");
+        return -1;
+    }
+
     db_info *info = (db_info*)malloc(sizeof(db_info));
+    info->cache = cache;
+    info->snapshot = snapshot;
     info->database = arguments.database;
     info->queue = db_queue;
     info->backupServer = arguments.server;
     info->backupPort = arguments.backupPort;
     info->backupPsk = arguments.backupPsk;
+    info->tls = &arguments.tls;
 
     // Need to spawn Database server
     err = pthread_create(&database_thread, NULL, handle_database_thread, (void *)info);
@@ -122,6 +237,31 @@ int main(int argc, char *argv[]){
         return -1;
     }
 
+    // Each reader gets its own queue, so the queues stay single consumer
+    struct queue_root **read_queues = (struct queue_root**)malloc(sizeof(struct queue_root*) * (arguments.readers + 1));
+    for(i = 0; i < arguments.readers; i++){
+        pthread_t reader_thread;
+        reader_info *reader = (reader_info*)malloc(sizeof(reader_info));
+        reader->queue = read_queues[i] = ALLOC_QUEUE_ROOT();
+        metrics_add_queue(METRIC_QUEUE_READER, reader->queue);
+        reader->cache = cache;
+        reader->snapshot = snapshot;
+        reader->database = arguments.database;
+        reader->id = i;
+        err = pthread_create(&reader_thread, NULL, handle_reader_thread, (void*)reader);
+        if(err != 0){
+            fprintf(stderr, "Server: Could not initialize database reader %d: %d\n", i, err);
+            return -1;
+        }
+    }
+
+    // Password checks are CPU bound, they get threads of their own instead of holding up reads
+    struct auth_pool *auth = auth_pool_start(arguments.database, arguments.authWorkers);
+    if(auth == NULL){
+        fprintf(stderr, "Server: Could not initialize auth workers\n");
+        return -1;
+    }
+
     timer_info *timer = (timer_info*)malloc(sizeof(timer_info));
     timer->interval = arguments.interval;
     timer->queue = db_queue;
@@ -134,49 +274,49 @@ int main(int argc, char *argv[]){
     init_openssl();
     // init_locks();
     ssl_ctx = create_new_context();
-    configure_context(ssl_ctx);
-
-    // Initialize clients
-    for(i = 0;i < MAX_CLIENTS; i++){
-        clients[i].open = 1;
-        clients[i].ctx = ssl_ctx;
-        clients[i].queue = db_queue;
+    if(ssl_ctx == NULL || configure_context(ssl_ctx, &arguments.tls) != 0){
+        fprintf(stderr, "Server: Could not set up TLS\n");
+        ERR_print_errors_fp(stderr);
+        return -1;
     }
 
-    unsigned int sockfd;
-
-    sockfd = create_socket(arguments.listenPort);
-    if(sockfd < 0){
+    // Bound before the I/O threads start, connections queue up until the acceptors run
+    struct listener *listener = listener_open(arguments.listenPort, arguments.acceptors, arguments.backlog);
+    if(listener == NULL){
         fprintf(stderr, "Could not create socket\n");
         exit(-1);
     }
-    fprintf(stdout, "Server: Listening for network connections!\n");
-    while(true){
-        int client;
-        struct sockaddr_in addr;
-        unsigned int len = sizeof(addr);
-        // char client_addr[INET_ADDRSTRLEN];
-
-        client = accept((int)sockfd, (struct sockaddr*)&addr, &len);
-        if(client < 0){
-            fprintf(stderr, "Failed to accept client\n");
-            break;
+
+    // Start the I/O threads
+    reactors = (struct reactor**)malloc(sizeof(struct reactor*) * arguments.ioThreads);
+    for(i = 0; i < arguments.ioThreads; i++){
+        reactors[i] = reactor_start(i, ssl_ctx, db_queue, read_queues, arguments.readers, auth, cache->feed,
+                                    listener);
+        if(reactors[i] == NULL || change_feed_add_queue(cache->feed, reactors[i]->responses) != 0){
+            fprintf(stderr, "Server: Could not initialize I/O thread %d\n", i);
+            return -1;
         }
+    }
 
-        // Find first open
-        // Spawn new Thread with client here
-        for(i =0; i < MAX_CLIENTS && !clients[i].open; ++i);
-        if(i == MAX_CLIENTS) continue; // Already at max clients
+    // Each acceptor spreads its clients over the I/O threads
+    if(listener_start(listener, reactors, arguments.ioThreads) != 0){
+        fprintf(stderr, "Server: Could not initialize acceptors\n");
+        return -1;
+    }
+    fprintf(stdout, "Server: Listening for network connections!\n");
 
-        clients[i].socketfd = client;
-        clients[i].queue = db_queue;
-        err = pthread_create(&clients[i].thread_id, NULL, client_thread, (void*)&(clients[i]));
-        pthread_detach(clients[i].thread_id);
+    // Only for monitoring, the server runs on without it
+    if(arguments.metricsPort > 0){
+        if(metrics_serve(arguments.metricsPort) == 0)
+            fprintf(stdout, "Server: Serving metrics on 127.0.0.1:%d\n", arguments.metricsPort);
+        else
+            fprintf(stderr, "Server: Could not serve metrics on port %d: %s\n", arguments.metricsPort, strerror(errno));
     }
+    listener_wait(listener);
 
     SSL_CTX_free(ssl_ctx);
     cleanup_openssl();
-    close(sockfd);
+    listener_close(listener);
 
     return 0;
 }
@@ -198,6 +338,7 @@ void *handle_database_thread(void *data){
     sqlite3 *db = NULL;
     int retCode;
     sqlite3_stmt *stmt = NULL;
+    SSL_CTX *backup_ctx = NULL;     // Kept from one SYNC to the next, so they resume the TLS session
 
     retCode = sqlite3_open(info->database, &db);
     if(retCode != SQLITE_OK){
@@ -206,6 +347,7 @@ void *handle_database_thread(void *data){
         exit(-1);
     }
     fprintf(stdout, "Server: Database opened!\n");
+    trace_database(db);
 
     retCode = sqlite3_prepare(db, valid_schema_query, -1, &stmt, 0);
     if(retCode != SQLITE_OK || stmt == NULL){
@@ -225,131 +367,82 @@ void *handle_database_thread(void *data){
         }
         retCode = sqlite3_step(stmt);
     }
+    sqlite3_finalize(stmt);
+    sqlite3_busy_timeout(db, DB_BUSY_TIMEOUT);
+
+    // PAGE and FIND are served from indexes, not by scanning the whole table
+    if(query_create_indexes(db) != SQLITE_OK)
+        fprintf(stderr, "Database: PAGE and FIND will run without indexes\n");
+
+    struct db_statements statements;
+    if(db_statements_init(&statements, db) != SQLITE_OK){
+        fprintf(stderr, "Database: Invalid schema. Could not prepare statements\n");
+        sqlite3_close(db);
+        exit(-1);
+    }
 
-    // Read the database every 10ms, operate if actions
+    struct item_cache *cache = info->cache;
+    stmt = db_statement(&statements, STMT_GET_ALL);
+    item_cache_load(cache, stmt);
+    sqlite3_reset(stmt);
+
+    sqlite3_int64 version = 0;
+    if(versions_latest(db, &version) == SQLITE_OK)
+        item_cache_set_version(cache, version);
+    else
+        fprintf(stderr, "Database: Could not read the latest version: %s\n", sqlite3_errmsg(db));
+
+    // Sleep on the queue until a request arrives, operate on it immediately
 
     // Operations will be GET, PUT, DEL, and MOD[ify]
     // SYNC, AUTH, and TERM are also available.
     int flag= 1;
     while(flag){
-        struct queue_head *msg = queue_get(db_queue);
+        struct queue_head *msg = queue_get_wait(db_queue);
 
         if(msg != NULL){
-            char username[BUFFER_SIZE];
-            char password[BUFFER_SIZE];
+            metrics_dequeued(METRIC_QUEUE_WRITER, msg);
+            trace_begin(msg);
 
             // Only allocate a response if we have a valid message
-            struct queue_head *response = malloc(sizeof(struct queue_head));
-
-            if(sscanf(msg->operation, "AUTH %s %s", username, password) == 2){
-                fprintf(stdout, "DB_THREAD: Authenticating user\n");
-                retCode = db_login(db, username, password);
-                if(retCode != 0)
-                    INIT_QUEUE_HEAD(response, "FAILURE", NULL);
-                else
-                    INIT_QUEUE_HEAD(response, "SUCCESS", NULL);
-            }
-
-            if(sscanf(msg->operation, "GET %s", request_data) == 1) {
-                // GET all items
-                if (strcmp(request_data, "ALL") == 0) {
-                    const char *sql = "SELECT * FROM items";
-                    sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
-
-                    // marshal directly into string:
-                    char * result = marshalItems(stmt);
-                    INIT_QUEUE_HEAD(response, result, NULL);
-                    free(result); // INIT_QUEUE_HEAD does a strdup
-
-                    sqlite3_finalize(stmt);
-                } else {
-                    int id = atoi(request_data);
-
-                    const char *sql = "SELECT * FROM items WHERE id=?";
-                    sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
-                    sqlite3_bind_int(stmt, 1, id);
-
-                    fprintf(stdout, "Getting 1 where id = %d\n", id);
+            struct queue_head *response = alloc_queue_message();
 
-                    int ret = sqlite3_step(stmt);
-                    Item item;
-                    if (ret == SQLITE_ROW) {
-                        new_item_from_row(stmt, &item);
-                        // item found: serialize it into response
+            // Reads usually go to the reader pool, but not while the same client has writes pending
+            handle_read_request(&statements, cache, info->snapshot, msg, response);
 
-                        char* itemInfo = NULL;
-                        itemInfo = serialize_item(&item, itemInfo);
+            // Every write request that commits gets the next version
+            version = item_cache_version(cache) + 1;
 
-                        char* responseString;
-                        asprintf(&responseString, "SUCCESS\n%s", itemInfo);
-
-                        // serialize_item(&item, request_data + strlen(request_data), BUFFER_SIZE - strlen(request_data));
-                        INIT_QUEUE_HEAD(response, responseString, NULL);
-                    } else {
-                        INIT_QUEUE_HEAD(response, "FAILURE", NULL);
-                    }
-
-                    sqlite3_finalize(stmt);
-                }
-            }
-
-            if(sscanf(msg->operation, "PUT %[^\x1e]", request_data) == 1){
+            // Items can be larger than request_data now that requests are framed, parse them in place
+            if(strncmp(msg->operation, "PUT ", 4) == 0 && msg->length > 4){
                 // Insert new item
                 Item item;
-                deserialize_item(request_data, &item);
-
-                const char * sql = "INSERT INTO items "
-                    "(name, armorPoints, healthPoints, manaPoints, sellPrice,"
-                    " damage, critChance, range, description) "
-                    "VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?)";
-                sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
-                sqlite3_bind_text(stmt, 1, item.name, strlen(item.name), NULL);
-                sqlite3_bind_int(stmt, 2, item.armor);
-                sqlite3_bind_int(stmt, 3, item.health);
-                sqlite3_bind_int(stmt, 4, item.mana);
-                sqlite3_bind_int(stmt, 5, item.sellPrice);
-                sqlite3_bind_int(stmt, 6, item.damage);
-                sqlite3_bind_double(stmt, 7, item.critChance);
-                sqlite3_bind_int(stmt, 8, item.range);
-                sqlite3_bind_text(stmt, 9, item.description, strlen(item.description), NULL);
-
-                int ret = sqlite3_step(stmt);
+                // The description is the only field allowed to be empty
+                int ret = deserialize_item(msg->operation + 4, &item) < 9
+                        ? SQLITE_MISUSE : db_insert_item(&statements, &item, version);
                 if (ret == SQLITE_DONE) {
-                    item.id = sqlite3_last_insert_rowid(db);
+                    item_cache_put(cache, &item);
+                    item_cache_set_version(cache, version);
                     // success
                     sprintf(request_data, "SUCCESS\n%d", item.id);
-                    INIT_QUEUE_HEAD(response, strdup(request_data), NULL);
+                    INIT_QUEUE_HEAD(response, request_data, NULL);
                 }
                 else {
                     INIT_QUEUE_HEAD(response, "FAILURE", NULL);
                 }
-
-                sqlite3_finalize(stmt);
             }
 
-            if(sscanf(msg->operation, "MOD %[^\x1e]", request_data) == 1){
+            if(strncmp(msg->operation, "MOD ", 4) == 0 && msg->length > 4){
                 // Modify existing item
                 Item item;
-                deserialize_item(request_data, &item);
-
-                const char * sql = "UPDATE items SET "
-                    "name=?, armorPoints=?, healthPoints=?, manaPoints=?, "
-                    "sellPrice=?, damage=?, critChance=?, range=?, description=? "
-                    "WHERE id=?";
-                sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
-                sqlite3_bind_text(stmt, 1, item.name, strlen(item.name), NULL);
-                sqlite3_bind_int(stmt, 2, item.armor);
-                sqlite3_bind_int(stmt, 3, item.health);
-                sqlite3_bind_int(stmt, 4, item.mana);
-                sqlite3_bind_int(stmt, 5, item.sellPrice);
-                sqlite3_bind_int(stmt, 6, item.damage);
-                sqlite3_bind_double(stmt, 7, item.critChance);
-                sqlite3_bind_int(stmt, 8, item.range);
-                sqlite3_bind_text(stmt, 9, item.description, strlen(item.description), NULL);
-                sqlite3_bind_int(stmt, 10, item.id);
-
-                int ret = sqlite3_step(stmt);
+                int ret = deserialize_item(msg->operation + 4, &item) < 9
+                        ? SQLITE_MISUSE : db_update_item(&statements, &item, version);
                 if (ret == SQLITE_DONE) {
+                    if (sqlite3_changes(db) > 0) {
+                        item_cache_put(cache, &item);
+                        item_cache_set_version(cache, version);
+                    } else
+                        item_cache_remove(cache, item.id);
                     // success
                     INIT_QUEUE_HEAD(response, "SUCCESS", NULL);
                 }
@@ -357,20 +450,18 @@ void *handle_database_thread(void *data){
                     // failure
                     INIT_QUEUE_HEAD(response, "FAILURE", NULL);
                 }
-
-                sqlite3_finalize(stmt);
             }
 
-            if(sscanf(msg->operation, "DEL %s", request_data) == 1){
+            if(sscanf(msg->operation, "DEL %255s", request_data) == 1){
                 // Delete existing
                 int id = atoi(request_data);
 
-                const char * sql = "DELETE FROM items WHERE id=?";
-                sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
-                sqlite3_bind_int(stmt, 1, id);
-
-                int ret = sqlite3_step(stmt);
+                int ret = db_delete_item(&statements, id, version);
                 if (ret == SQLITE_DONE) {
+                    int deleted = sqlite3_changes(db) > 0;
+                    item_cache_remove(cache, id);
+                    if (deleted)
+                        item_cache_set_version(cache, version);
                     // success
                     INIT_QUEUE_HEAD(response, "SUCCESS", NULL);
                 }
@@ -378,30 +469,56 @@ void *handle_database_thread(void *data){
                     // item not found case
                     INIT_QUEUE_HEAD(response, "FAILURE", NULL);
                 }
+            }
 
-                sqlite3_finalize(stmt);
+            // Batched writes: MPUT/MMOD carry RECORD_SEPARATOR terminated items, MDEL a list of ids
+            int batch = 0;
+            if(strncmp(msg->operation, "MPUT ", 5) == 0)
+                batch = CLIENT_PUT;
+            else if(strncmp(msg->operation, "MMOD ", 5) == 0)
+                batch = CLIENT_MOD;
+            else if(strncmp(msg->operation, "MDEL ", 5) == 0)
+                batch = CLIENT_DEL;
+
+            if(batch != 0){
+                char *result = db_batch(&statements, cache, batch, msg->operation + 5, version);
+                if(result != NULL){
+                    INIT_QUEUE_HEAD(response, result, NULL);
+                    free(result);
+                } else {
+                    INIT_QUEUE_HEAD(response, "FAILURE", NULL);
+                }
             }
 
-            if(sscanf(msg->operation, "TERM %s", request_data) == 1){
+            if(sscanf(msg->operation, "TERM %255s", request_data) == 1){
                 flag = 0;
             }
 
             if(strcmp(msg->operation, "SYNC") == 0){
-                SSL_CTX * ssl_ctx = NULL;
                 SSL * ssl = NULL;
-                int backupSockFd;
-                int dbFileFd = 0;
+                int backupSockFd = -1;
+                int dbFileFd = -1;
                 char success = 1;
+                char snapshot[PATH_MAX];
 
                 fprintf(stdout, "Beginning synchronization!\n");
 
                 // NOTE: this doesn't loop. We use it for an early-return on error
                 while (1) {
-                    // Close database handle.
-                    sqlite3_close(db);
+                    // The database file alone misses whatever is still in the WAL, ship a consistent copy instead
+                    snprintf(snapshot, sizeof(snapshot), "%s%s", info->database, SYNC_SNAPSHOT_SUFFIX);
+                    if (db_snapshot(db, snapshot) != SQLITE_DONE) {
+                        success = 0;
+                        break;
+                    }
 
-                    ssl_ctx = create_new_client_context();
-                    ssl = SSL_new(ssl_ctx);
+                    if (backup_ctx == NULL)
+                        backup_ctx = create_new_client_context(info->tls);
+                    if (backup_ctx == NULL) {
+                        success = 0;
+                        break;
+                    }
+                    ssl = SSL_new(backup_ctx);
 
                     // Open connection to remote server
                     backupSockFd = create_client_socket(info->backupServer, info->backupPort);
@@ -411,6 +528,7 @@ void *handle_database_thread(void *data){
                         break;
                     }
                     SSL_set_fd(ssl, backupSockFd);
+                    tls_resume_session(ssl);
                     if (SSL_connect(ssl) != 1) {
                         fprintf(stderr, "Could not establish secure connection\n");
                         ERR_print_errors_fp(stderr);
@@ -419,9 +537,9 @@ void *handle_database_thread(void *data){
                     }
 
                     // Open as standard file,
-                    dbFileFd = open(info->database, O_RDONLY);
+                    dbFileFd = open(snapshot, O_RDONLY);
                     if (dbFileFd < 0) {
-                        fprintf(stderr, "Error reopening database file for sync: %s\n", strerror(errno));
+                        fprintf(stderr, "Error opening database snapshot for sync: %s\n", strerror(errno));
                         success = 0;
                         break;
                     }
@@ -442,8 +560,10 @@ void *handle_database_thread(void *data){
                             break;
                         }
                     }
-                    if (rcount < 0)
+                    if (rcount < 0) {
+                        success = 0;
                         break;
+                    }
                     SSL_shutdown(ssl);
                     // get success response back
                     while ((rcount = SSL_read(ssl, buffer, BUFFER_SIZE)) > 0)
@@ -466,21 +586,13 @@ void *handle_database_thread(void *data){
                 // shut down connection to remote server
                 if (ssl)
                     SSL_free(ssl);
-                if (ssl_ctx)
-                    SSL_CTX_free(ssl_ctx);
-                if(backupSockFd)
+                if(backupSockFd >= 0)
                     close(backupSockFd);
 
-                // close file
-                if(dbFileFd)
+                // close and remove the snapshot
+                if(dbFileFd >= 0)
                     close(dbFileFd);
-
-                // reopen as database again.
-                retCode = sqlite3_open(info->database, &db);
-                if(retCode != SQLITE_OK){
-                    fprintf(stderr, "Error opening database after sync\n");
-                    success = 0;
-                }
+                unlink(snapshot);
 
                 if(success)
                     INIT_QUEUE_HEAD(response, "SUCCESS", NULL);
@@ -488,155 +600,238 @@ void *handle_database_thread(void *data){
                     INIT_QUEUE_HEAD(response, "FAILURE", NULL);
             }
 
-            // Response here
-            if(msg->response_queue != NULL)
-                queue_put(response, msg->response_queue);
-            // msg needs to be freed and response should be de-referenced
-            free_queue_message(msg);
+            // Watchers hear about the changes before the client that made them gets its answer
+            change_feed_publish(cache->feed);
+            // Client requests are timed by their I/O thread, the backup timer's SYNC has nobody else to time it
+            if(msg->response_queue == NULL)
+                metrics_request(msg->op, msg->started);
+            trace_end(msg);
+            send_response(msg, response);
             response = NULL;
         }
-
-        usleep(10000); // Wait 10 ms between reads
     }
 
+    db_statements_finalize(&statements);
     sqlite3_close(db);
+    if(backup_ctx != NULL)
+        SSL_CTX_free(backup_ctx);
 
     return NULL;
 }
 
 /**
- * Each client gets its own thread to recieve network requests from.
- * Requests are relayed to the database thread through a thread safe queue.
- *
- * @param data
- * @return
+ * Answers the requests that only read the database, RESUME, GET, PAGE, FIND, STATS, SEARCH, COMPLETE
+ * and CACHE. Used by the writer thread as well as the reader pool.
+ * @param statements - statement cache of the connection to read from
+ * @param cache - item cache, consulted before the database for GET by id
+ * @param snapshot - shared GET ALL response
+ * @param msg - request
+ * @param response - filled in with the answer if the request was a read
+ * @return 1 if msg was a read request, 0 otherwise
  */
-void *client_thread(void *data){
-    char buffer[BUFFER_SIZE];
-    client_data *client_info = (client_data*)data;
-    int opFlag = 0;
-
-    SSL *ssl = SSL_new(client_info->ctx);
-    if(ssl == NULL){
-        fprintf(stderr, "Error creating new SSL\n");
+int handle_read_request(struct db_statements *statements, struct item_cache *cache, struct items_snapshot *snapshot,
+                        struct queue_head *msg, struct queue_head *response){
+    char request_data[BUFFER_SIZE];
+    sqlite3_stmt *stmt;
+    int handled = 0;
+
+    if(strncmp(msg->operation, "RESUME ", 7) == 0){
+        handled = 1;
+        // A login with a token from an earlier AUTH, no password hashing involved
+        char *resumed = auth_resume(statements, msg->operation);
+        if(resumed != NULL){
+            INIT_QUEUE_HEAD(response, resumed, NULL);
+            free(resumed);
+        }
     }
-    int socketfd = client_info->socketfd;
 
-    if(SSL_set_fd(ssl, socketfd) < 0){
-        fprintf(stderr, "Could not bind to secure socket: %s\n", strerror(errno));
-        pthread_exit(NULL);
-    }
+    if(sscanf(msg->operation, "GET %255s", request_data) == 1) {
+        handled = 1;
+        // GET all items
+        if (strcmp(request_data, "SINCE") == 0) {
+            // Only what changed after the version the client already has
+            char *changes = changes_since(statements, cache, msg->operation);
+            if (changes != NULL) {
+                INIT_QUEUE_HEAD(response, changes, NULL);
+                free(changes);
+            }
+        } else if (strcmp(request_data, "ALL") == 0 && items_stream_wanted(cache, msg)) {
+            // Too large to keep serialized, sent a chunk at a time as the client reads it
+            if (items_stream_chunk(statements, msg, response) != 0)
+                fprintf(stderr, "DB_THREAD: Could not read items: %s\n", sqlite3_errmsg(statements->db));
+        } else if (strcmp(request_data, "ALL") == 0) {
+            // Every client gets a reference to the same serialized response
+            struct shared_buffer *all = items_snapshot_get(snapshot, cache, statements);
+            if (all != NULL) {
+                INIT_QUEUE_HEAD_SHARED(response, all, NULL);
+                shared_buffer_release(all);
+            }
+        } else {
+            int id = atoi(request_data);
+            Item item;
 
-    if(SSL_accept(ssl) <= 0){
-        fprintf(stderr, "Server: Could not establish a secure connection:\n");
-        ERR_print_errors_fp(stderr);
-        pthread_exit(NULL);
-    }
+            fprintf(stdout, "Getting 1 where id = %d\n", id);
 
-    // Prep the message and return queue
-    struct queue_root *msgQueue = ALLOC_QUEUE_ROOT();
-    struct queue_head *query = malloc_aligned(sizeof(struct queue_head));
+            int cached = item_cache_get(cache, id, &item);
+            if (cached == CACHE_MISS) {
+                unsigned long generation = item_cache_generation(cache);
 
-    bzero(buffer, BUFFER_SIZE);
-    // Listen for AUTH request
-    int rcount = SSL_read(ssl, buffer, BUFFER_SIZE);
-    if(rcount < 0){
-        fprintf(stderr, "Could not read from client: %s\n", strerror(errno));
-    }
+                stmt = db_statement(statements, STMT_GET_ITEM);
+                sqlite3_bind_int(stmt, 1, id);
 
-    // But for now, lets just send it to the database thread for some PoC
-    INIT_QUEUE_HEAD(query, buffer, msgQueue);
-    queue_put(query, client_info->queue);
-    query = NULL; // Remove reference to it
+                int ret = sqlite3_step(stmt);
+                if (ret == SQLITE_ROW) {
+                    new_item_from_row(stmt, &item);
+                    cached = CACHE_HIT;
+                    item_cache_fill(cache, id, &item, generation);
+                } else if (ret == SQLITE_DONE) {
+                    cached = CACHE_NEGATIVE;
+                    item_cache_fill(cache, id, NULL, generation);
+                }
+                sqlite3_reset(stmt);
+            }
+
+            if (cached == CACHE_HIT) {
+                // item found: serialize it into response
 
-    // Check the response queue until a response is received;
-    struct queue_head *response = malloc_aligned(sizeof(struct queue_head));
-    do{
-        response = queue_get(msgQueue);
-        usleep(10000);
-    }while(response == NULL);
+                char* itemInfo = NULL;
+                itemInfo = serialize_item(&item, itemInfo);
 
-    fprintf(stdout, "CLIENT_THREAD_%d Message Received: %s\n", socketfd, response->operation);
+                char* responseString;
+                asprintf(&responseString, "SUCCESS\n%s", itemInfo);
 
-    bzero(buffer, BUFFER_SIZE);
-    strncpy(buffer, response->operation, BUFFER_SIZE);
-    int validLogin = 1;
-    if(strcmp("FAILURE", response->operation) == 0){
-        validLogin = 0;
+                // serialize_item(&item, request_data + strlen(request_data), BUFFER_SIZE - strlen(request_data));
+                INIT_QUEUE_HEAD(response, responseString, NULL);
+                free(responseString);
+                free(itemInfo);
+            } else {
+                INIT_QUEUE_HEAD(response, "FAILURE", NULL);
+            }
+        }
     }
-    SSL_write(ssl, buffer, (int)strlen(buffer));
 
-    while(validLogin){
+    if(strncmp(msg->operation, "PAGE ", 5) == 0){
+        handled = 1;
+        char *page = page_items(statements, msg->operation);
+        if(page != NULL){
+            INIT_QUEUE_HEAD(response, page, NULL);
+            free(page);
+        }
+    }
 
-        bzero(buffer, BUFFER_SIZE);
-        if(SSL_read(ssl, buffer, BUFFER_SIZE) < 0) {
-            fprintf(stderr, "Error reading from client: %s\n", strerror(errno));
-            validLogin = 0;
-            continue;
+    if(strncmp(msg->operation, "FIND ", 5) == 0){
+        handled = 1;
+        char *found = find_items(statements, cache, msg->operation);
+        if(found != NULL){
+            INIT_QUEUE_HEAD(response, found, NULL);
+            free(found);
         }
-        if(strlen(buffer) == 0){
-            continue;
+    }
+
+    if(strncmp(msg->operation, "STATS ", 6) == 0){
+        handled = 1;
+        char *stats = stats_items(statements, cache, msg->operation);
+        if(stats != NULL){
+            INIT_QUEUE_HEAD(response, stats, NULL);
+            free(stats);
         }
+    }
 
-        fprintf(stdout, "Message received: %s\n", buffer);
+    if(strncmp(msg->operation, "SEARCH ", 7) == 0){
+        handled = 1;
+        char *found = search_items(statements, cache, msg->operation);
+        if(found != NULL){
+            INIT_QUEUE_HEAD(response, found, NULL);
+            free(found);
+        }
+    }
 
-        query = (struct queue_head*)malloc(sizeof(struct queue_head));
-        INIT_QUEUE_HEAD(query, buffer, msgQueue);
-        // fprintf(stdout, "%s\n", query->operation);
-        queue_put(query, client_info->queue);
+    if(strncmp(msg->operation, "COMPLETE ", 9) == 0){
+        handled = 1;
+        char *names = complete_names(cache, msg->operation);
+        if(names != NULL){
+            INIT_QUEUE_HEAD(response, names, NULL);
+            free(names);
+        }
+    }
 
+    if(strcmp(msg->operation, "CACHE") == 0){
+        handled = 1;
+        char *stats = item_cache_stats(cache);
+        INIT_QUEUE_HEAD(response, stats, NULL);
+        free(stats);
+    }
 
-        if(sscanf(query->operation, "GET %s", buffer) == 1){
-            opFlag = CLIENT_GET;
-        }
-        else if(sscanf(query->operation, "PUT %s", buffer) == 1){
-            opFlag = CLIENT_PUT;
-        }
-        else if(sscanf(query->operation, "MOD %s", buffer) == 1){
-            opFlag = CLIENT_MOD;
-        }
-        else if(sscanf(query->operation, "DEL %s", buffer) == 1){
-            opFlag = CLIENT_DEL;
-        }
+    return handled;
+}
 
-        response = NULL;
-        do{
-            response = queue_get(msgQueue);
-            usleep(10000);
-        } while( response == NULL);
-
-        switch(opFlag){
-            case CLIENT_GET:
-            case CLIENT_PUT:
-            case CLIENT_MOD:
-            case CLIENT_DEL:
-                if((rcount = SSL_write(ssl, response->operation, (int)strlen(response->operation))) < 0){
-                    fprintf(stderr, "Error writing to client: %s\n", strerror(errno));
-                    validLogin = 0;
-                    continue;
-                }
-                fprintf(stdout, "wrote %d bytes\n", rcount);
+/**
+ * Switches the database to write-ahead logging. This is stored in the database
+ * file, and lets the reader connections run while the writer commits.
+ * @param database - path to the database file
+ * @return 0 on success, -1 on error
+ */
+int enable_wal(char *database){
+    sqlite3 *db = NULL;
+    sqlite3_stmt *stmt = NULL;
+    int r = -1;
 
-                break;
-            default:
-                fprintf(stderr, "Not supported yet\n");
-                break;
-        }
+    if(sqlite3_open(database, &db) != SQLITE_OK){
+        fprintf(stderr, "FATAL: Cannot open database: %s\n", sqlite3_errmsg(db));
+        sqlite3_close(db);
+        return -1;
+    }
+    sqlite3_busy_timeout(db, DB_BUSY_TIMEOUT);
+
+    if(sqlite3_prepare_v2(db, "PRAGMA journal_mode=WAL", -1, &stmt, NULL) == SQLITE_OK
+       && sqlite3_step(stmt) == SQLITE_ROW
+       && strcmp((const char*)sqlite3_column_text(stmt, 0), "wal") == 0)
+        r = 0;
+    else
+        fprintf(stderr, "Database: Could not enable WAL mode: %s\n", sqlite3_errmsg(db));
+
+    sqlite3_finalize(stmt);
+    sqlite3_close(db);
+    return r;
+}
+
+/**
+ * A reader thread serves GET and RESUME requests from its own read-only
+ * connection, so reads neither wait behind writes nor behind each other.
+ * @param data reader info
+ * @return NULL
+ */
+void *handle_reader_thread(void *data){
+    reader_info *info = (reader_info*)data;
+    sqlite3 *db = NULL;
+    struct db_statements statements;
 
-        // Free the response and get ready for the next one
-        free_queue_message(response);
+    if(sqlite3_open_v2(info->database, &db, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK){
+        fprintf(stderr, "FATAL: Reader %d cannot open database: %s\n", info->id, sqlite3_errmsg(db));
+        exit(-1);
     }
+    sqlite3_busy_timeout(db, DB_BUSY_TIMEOUT);
+    trace_database(db);
 
-    if(response->operation) {
-        if(SSL_write(ssl, response->operation, strlen(response->operation)) < 0){
-            fprintf(stderr, "SERVER: Error writing to client: %s\n", strerror(errno));
-        }
+    if(db_statements_init(&statements, db) != SQLITE_OK){
+        fprintf(stderr, "Database: Reader %d could not prepare statements\n", info->id);
+        exit(-1);
+    }
+
+    fprintf(stdout, "DB_READER_%d: Ready\n", info->id);
+    while(1){
+        struct queue_head *msg = queue_get_wait(info->queue);
+        struct queue_head *response = alloc_queue_message();
+        metrics_dequeued(METRIC_QUEUE_READER, msg);
+        trace_begin(msg);
+
+        // Anything else was misrouted, and is answered with FAILURE
+        handle_read_request(&statements, info->cache, info->snapshot, msg, response);
+        trace_end(msg);
+        send_response(msg, response);
     }
 
-    SSL_free(ssl);
-    close(client_info->socketfd);
-    client_info->open = 1;
-    pthread_exit(NULL);
+    return NULL;
 }
 
 /**
@@ -651,68 +846,23 @@ void* timer_thread_handler(void *data){
     fprintf(stdout, "Initializing Backup thread\n");
     timer_info *info = (timer_info*)data;
 
-    struct queue_head *sync_message = malloc_aligned(sizeof(struct queue_head));
+    struct queue_head *sync_message;
 
     while(1){
         sleep(info->interval);
-        free(sync_message);
-        sync_message= malloc_aligned(sizeof(struct queue_head));
+        // The database thread owns the message once it is queued
+        sync_message = alloc_queue_message();
         if(sync_message == NULL){
             fprintf(stderr, "Could not create synchronization message");
             exit(-1);
         }
         INIT_QUEUE_HEAD(sync_message, "SYNC", NULL);
+        sync_message->started = sync_message->queued = metrics_now();
+        sync_message->op = METRIC_OP_SYNC;
         queue_put(sync_message, info->queue);
     }
 }
 
-/**
- * Given a username and password, this method gets the selected user's password
- * and checks that the provided password is the same.
- * @param db - handle to the database
- * @param username - user attempting logon
- * @param password - attempted login password
- * @return
- */
-int db_login(sqlite3 *db, char *username, char *password) {
-    const char *sql = "SELECT password FROM users where username=? LIMIT 1;";
-    sqlite3_stmt *stmt;
-    int retCode;
-    sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
-    sqlite3_bind_text(stmt, 1, username, strlen(username), NULL);
-
-    retCode = sqlite3_step(stmt);
-    if(retCode == SQLITE_DONE){
-        // No Such user exists
-        return -1;
-    }
-
-    char *hash = malloc(sizeof(char)*BUFFER_SIZE);
-    strncpy(hash, (char*)sqlite3_column_text(stmt, 0), BUFFER_SIZE);
-    sqlite3_finalize(stmt);
-    int r = authenticate(hash, password);
-
-    free(hash);
-
-    return r;
-}
-
-/**
- * Method that takes hash from database and password from user to
- * Determine if there is a valid login.
- *
- * @param hash
- * @param password]
- * @return
- */
-int authenticate(const char *hash, char *password){
-    char salt[SALT_LENGTH];
-    strncpy(salt, hash, SALT_LENGTH);
-    salt[11] = '\0';
-
-    return strncmp(hash, crypt(password, salt), BUFFER_SIZE);
-}
-
 /**
  * Parses command line arguments
  * @param key
@@ -752,6 +902,61 @@ static error_t parse_args(int key, char *arg, struct argp_state *state){
             }
             arguments->interval = interval;
             break;
+        case 't':
+            arguments->ioThreads = (int)strtol(arg, &pEnd, 10);
+            if(arguments->ioThreads <= 0){
+                fprintf(stderr, "Invalid I/O thread count %s\n", arg);
+                arguments->ioThreads = DEFAULT_IO_THREADS;
+            }
+            break;
+        case 'r':
+            arguments->readers = (int)strtol(arg, &pEnd, 10);
+            if(arguments->readers < 0){
+                fprintf(stderr, "Invalid reader count %s\n", arg);
+                arguments->readers = DEFAULT_DB_READERS;
+            }
+            break;
+        case 'a':
+            arguments->authWorkers = (int)strtol(arg, &pEnd, 10);
+            if(arguments->authWorkers <= 0){
+                fprintf(stderr, "Invalid auth worker count %s\n", arg);
+                arguments->authWorkers = default_auth_workers();
+            }
+            break;
+        case 'A':
+            arguments->acceptors = (int)strtol(arg, &pEnd, 10);
+            if(arguments->acceptors <= 0){
+                fprintf(stderr, "Invalid acceptor count %s\n", arg);
+                arguments->acceptors = DEFAULT_ACCEPTORS;
+            }
+            break;
+        case 'b':
+            arguments->backlog = (int)strtol(arg, &pEnd, 10);
+            if(arguments->backlog <= 0){
+                fprintf(stderr, "Invalid listen backlog %s\n", arg);
+                arguments->backlog = DEFAULT_LISTEN_BACKLOG;
+            }
+            break;
+        case 'm':
+            arguments->metricsPort = (int)strtol(arg, &pEnd, 10);
+            if(arguments->metricsPort < 0 || arguments->metricsPort > 65535){
+                fprintf(stderr, "Invalid metrics port %s\n", arg);
+                arguments->metricsPort = DEFAULT_METRICS_PORT;
+            }
+            break;
+        case 'u':
+            arguments->metricsUsers = arg;
+            break;
+        case 'T':
+            arguments->traceThreshold = strtod(arg, &pEnd);
+            if(*pEnd != '\0' || arguments->traceThreshold < 0){
+                fprintf(stderr, "Invalid trace threshold %s\n", arg);
+                arguments->traceThreshold = 0;
+            }
+            break;
+        case 'F':
+            arguments->traceFile = arg;
+            break;
         default:
             return ARGP_ERR_UNKNOWN;
     }
@@ -823,6 +1028,97 @@ int parse_conf_file(void *args){
             arguments->interval = val;
         }
 
+        if(strcmp(field, "IO_THREADS") == 0){
+            val = strtol(value, &stop, 10);
+            if(stop == NULL || *stop != '\0' || val <= 0){
+                fprintf(stderr, "Error interpreting I/O thread count: %s\n", value);
+                fclose(file);
+                return -1;
+            }
+            arguments->ioThreads = val;
+        }
+
+        if(strcmp(field, "READERS") == 0){
+            val = strtol(value, &stop, 10);
+            if(stop == NULL || *stop != '\0' || val < 0){
+                fprintf(stderr, "Error interpreting database reader count: %s\n", value);
+                fclose(file);
+                return -1;
+            }
+            arguments->readers = val;
+        }
+
+        if(strcmp(field, "AUTH_WORKERS") == 0){
+            val = strtol(value, &stop, 10);
+            if(stop == NULL || *stop != '\0' || val <= 0){
+                fprintf(stderr, "Error interpreting auth worker count: %s\n", value);
+                fclose(file);
+                return -1;
+            }
+            arguments->authWorkers = val;
+        }
+
+        if(strcmp(field, "ACCEPTORS") == 0){
+            val = strtol(value, &stop, 10);
+            if(stop == NULL || *stop != '\0' || val <= 0){
+                fprintf(stderr, "Error interpreting acceptor count: %s\n", value);
+                fclose(file);
+                return -1;
+            }
+            arguments->acceptors = val;
+        }
+
+        if(strcmp(field, "LISTEN_BACKLOG") == 0){
+            val = strtol(value, &stop, 10);
+            if(stop == NULL || *stop != '\0' || val <= 0){
+                fprintf(stderr, "Error interpreting listen backlog: %s\n", value);
+                fclose(file);
+                return -1;
+            }
+            arguments->backlog = val;
+        }
+
+        if(strcmp(field, "METRICS_PORT") == 0){
+            val = strtol(value, &stop, 10);
+            if(stop == NULL || *stop != '\0' || val < 0 || val > 65535){
+                fprintf(stderr, "Error interpreting metrics port: %s\n", value);
+                fclose(file);
+                return -1;
+            }
+            arguments->metricsPort = val;
+        }
+
+        if(strcmp(field, "METRICS_USERS") == 0){
+            arguments->metricsUsers = strdup(value);
+        }
+
+        if(strcmp(field, "TRACE_THRESHOLD") == 0){
+            double threshold = strtod(value, &stop);
+            if(stop == NULL || *stop != '\0' || threshold < 0){
+                fprintf(stderr, "Error interpreting trace threshold: %s\n", value);
+                fclose(file);
+                return -1;
+            }
+            arguments->traceThreshold = threshold;
+        }
+
+        if(strcmp(field, "TRACE_FILE") == 0){
+            arguments->traceFile = strdup(value);
+        }
+
+        if(strcmp(field, "TRACE_RATE") == 0){
+            val = strtol(value, &stop, 10);
+            if(stop == NULL || *stop != '\0' || val <= 0){
+                fprintf(stderr, "Error interpreting trace rate: %s\n", value);
+                fclose(file);
+                return -1;
+            }
+            arguments->traceRate = val;
+        }
+
+        // TLS_CIPHERS, TLS_CIPHERSUITES and TLS_GROUPS
+        tls_parse_option(&arguments->tls, field, value);
+
         bzero(field, BUFFER_SIZE);
         bzero(value, BUFFER_SIZE);
     }
@@ -877,66 +1173,258 @@ int parse_interval(char* interval){
 }
 
 /**
- * Marshalls all items from a GET ALL request directly into a serialized message
- * @param stmt
+ * One auth worker per CPU, password hashing keeps every one of them busy
  * @return
  */
-char * marshalItems(sqlite3_stmt *stmt){
-    size_t cur_size =1024*4;
-    size_t mem_size = 1024*4;
-    char* result = (char*)malloc(sizeof(char)*mem_size); // Allocate 4Kb
-    bzero(result, sizeof(char)*mem_size);
-    strncat(result, "SUCCESS ", 9);
-
-    int r;
-    r = sqlite3_step(stmt);
-    while(r == SQLITE_ROW ){
-        char* curItem;
-        asprintf(&curItem, "%d\n%s\n%d\n%d\n%d\n%d\n%d\n%f\n%d\n%s%c",
-                 sqlite3_column_int(stmt, 0), // id
-                 (const char*)sqlite3_column_text(stmt, 1), // name
-                 sqlite3_column_int(stmt, 2), // armor
-                 sqlite3_column_int(stmt, 3), // health
-                 sqlite3_column_int(stmt, 4), // mana
-                 sqlite3_column_int(stmt, 5), // sellPrice
-                 sqlite3_column_int(stmt, 6), // damage
-                 sqlite3_column_double(stmt, 7), // critical
-                 sqlite3_column_int(stmt, 8), //range
-                 (const char*)sqlite3_column_text(stmt, 9),
-                 RECORD_SEPARATOR
-         );
-
-        // Need to append
-        if(strlen(curItem) + strlen(result) >= cur_size){ // Amount of data is too large, we need to add more memory
-            cur_size += mem_size;
-            result = realloc(result, cur_size);
-        }
-        strncat(result, curItem, strlen(curItem));
-        free(curItem);
-        r = sqlite3_step(stmt);
-    }
+int default_auth_workers(){
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 0 ? (int)cpus : 1;
+}
 
-    // Replace last character with group separator
-    // -1 should be \x0, -2 should be RECORD_SEPARATOR
-    result[strlen(result)-1] = GROUP_SEPARATOR;
+/**
+ * Inserts an item. On success the item's id is set to the new row id.
+ * @param statements
+ * @param item
+ * @param version - version of the write request
+ * @return SQLITE_DONE on success, an SQLite error code otherwise
+ */
+int db_insert_item(struct db_statements *statements, Item *item, sqlite3_int64 version){
+    sqlite3_stmt *stmt = db_statement(statements, STMT_INSERT_ITEM);
+    if(stmt == NULL)
+        return sqlite3_errcode(statements->db);
+    sqlite3_bind_text(stmt, 1, item->name, strlen(item->name), NULL);
+    sqlite3_bind_int(stmt, 2, item->armor);
+    sqlite3_bind_int(stmt, 3, item->health);
+    sqlite3_bind_int(stmt, 4, item->mana);
+    sqlite3_bind_int(stmt, 5, item->sellPrice);
+    sqlite3_bind_int(stmt, 6, item->damage);
+    sqlite3_bind_double(stmt, 7, item->critChance);
+    sqlite3_bind_int(stmt, 8, item->range);
+    sqlite3_bind_text(stmt, 9, item->description, strlen(item->description), NULL);
+    sqlite3_bind_int64(stmt, 10, version);
+
+    int ret = sqlite3_step(stmt);
+    if(ret == SQLITE_DONE)
+        item->id = sqlite3_last_insert_rowid(statements->db);
+    sqlite3_reset(stmt);
+    return ret;
+}
 
-    return result;
+/**
+ * Writes a consistent copy of the database, WAL included, to a new file.
+ * Readers carry on meanwhile, and writes wait for the copy as for any other request.
+ * @param db
+ * @param filename - replaced if it exists
+ * @return SQLITE_DONE on success, an SQLite error code otherwise
+ */
+int db_snapshot(sqlite3 *db, const char *filename){
+    sqlite3_stmt *stmt = NULL;
+
+    // VACUUM INTO refuses to overwrite, a previous sync may have died before removing its copy
+    unlink(filename);
+    int ret = sqlite3_prepare_v2(db, "VACUUM INTO ?", -1, &stmt, NULL);
+    if(ret == SQLITE_OK){
+        sqlite3_bind_text(stmt, 1, filename, -1, NULL);
+        ret = sqlite3_step(stmt);
+    }
+    if(ret != SQLITE_DONE)
+        fprintf(stderr, "Could not snapshot database for sync: %s\n", sqlite3_errmsg(db));
+    sqlite3_finalize(stmt);
+    return ret;
 }
 
 /**
- * Given a SQLITE_ROW, convert all relevant fields into an Item struct
- * @param stmt
+ * Overwrites every field of the item with the matching id.
+ * sqlite3_changes() tells whether such an item existed.
+ * @param statements
  * @param item
+ * @param version - version of the write request
+ * @return SQLITE_DONE on success, an SQLite error code otherwise
  */
-void new_item_from_row(sqlite3_stmt * stmt, Item * item) {
-    item->id = sqlite3_column_int(stmt, 0);
-    snprintf(item->name, BUFFER_SIZE, "%s", (const char*)sqlite3_column_text(stmt, 1));
-    item->armor = sqlite3_column_int(stmt, 2);
-    item->health = sqlite3_column_int(stmt, 3);
-    item->mana = sqlite3_column_int(stmt, 4); // mana
-    item->sellPrice = sqlite3_column_int(stmt, 5); // sell price
-    item->damage = sqlite3_column_int(stmt, 6);
-    item->critChance = sqlite3_column_double(stmt, 7);
-    item->range = sqlite3_column_int(stmt, 8); // range
-    snprintf(item->description, BUFFER_SIZE, "%s", (const char*)sqlite3_column_text(stmt, 9));
+int db_update_item(struct db_statements *statements, Item *item, sqlite3_int64 version){
+    sqlite3_stmt *stmt = db_statement(statements, STMT_UPDATE_ITEM);
+    if(stmt == NULL)
+        return sqlite3_errcode(statements->db);
+    sqlite3_bind_text(stmt, 1, item->name, strlen(item->name), NULL);
+    sqlite3_bind_int(stmt, 2, item->armor);
+    sqlite3_bind_int(stmt, 3, item->health);
+    sqlite3_bind_int(stmt, 4, item->mana);
+    sqlite3_bind_int(stmt, 5, item->sellPrice);
+    sqlite3_bind_int(stmt, 6, item->damage);
+    sqlite3_bind_double(stmt, 7, item->critChance);
+    sqlite3_bind_int(stmt, 8, item->range);
+    sqlite3_bind_text(stmt, 9, item->description, strlen(item->description), NULL);
+    sqlite3_bind_int64(stmt, 10, version);
+    sqlite3_bind_int(stmt, 11, item->id);
+
+    int ret = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+    return ret;
+}
+
+/**
+ * Deletes the item with the given id, leaving a tombstone for GET SINCE.
+ * sqlite3_changes() tells whether such an item existed.
+ * @param statements
+ * @param id
+ * @param version - version of the write request
+ * @return SQLITE_DONE on success, an SQLite error code otherwise
+ */
+int db_delete_item(struct db_statements *statements, int id, sqlite3_int64 version){
+    sqlite3 *db = statements->db;
+    sqlite3_stmt *stmt = db_statement(statements, STMT_DELETE_ITEM);
+    sqlite3_stmt *tombstone = db_statement(statements, STMT_INSERT_TOMBSTONE);
+    if(stmt == NULL || tombstone == NULL)
+        return sqlite3_errcode(db);
+
+    // Both or neither. Outside of a batch the savepoint is the transaction
+    if(sqlite3_exec(db, "SAVEPOINT item_delete", NULL, NULL, NULL) != SQLITE_OK)
+        return sqlite3_errcode(db);
+
+    sqlite3_bind_int(stmt, 1, id);
+    int ret = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+
+    if(ret == SQLITE_DONE && sqlite3_changes(db) > 0){
+        sqlite3_bind_int(tombstone, 1, id);
+        sqlite3_bind_int64(tombstone, 2, version);
+        ret = sqlite3_step(tombstone);
+        sqlite3_reset(tombstone);
+    }
+
+    if(ret != SQLITE_DONE)
+        sqlite3_exec(db, "ROLLBACK TO item_delete", NULL, NULL, NULL);
+    if(sqlite3_exec(db, "RELEASE item_delete", NULL, NULL, NULL) != SQLITE_OK && ret == SQLITE_DONE)
+        ret = sqlite3_errcode(db);
+    return ret;
+}
+
+/**
+ * Applies a batch of inserts, updates or deletes in a single transaction, so
+ * the whole batch costs one journal sync instead of one per item. If any
+ * statement fails the transaction is rolled back and nothing is applied.
+ *
+ * The response has one line per item, in request order, after the status:
+ *   SUCCESS\n<id> OK\n<id> MISSING ...
+ * MPUT reports the id assigned to each new item, MMOD and MDEL report
+ * MISSING for ids that don't exist.
+ *
+ * @param statements
+ * @param cache - item cache, updated once the batch is committed
+ * @param operation CLIENT_PUT, CLIENT_MOD or CLIENT_DEL
+ * @param payload Items separated by RECORD_SEPARATOR, or ids separated by whitespace for deletes
+ * @param version - version of the write request, shared by every item of the batch
+ * @return The response string to be freed by the caller, or NULL if the batch was rejected
+ */
+char *db_batch(struct db_statements *statements, struct item_cache *cache, int operation, char *payload,
+               sqlite3_int64 version){
+    sqlite3 *db = statements->db;
+    char *result = NULL;
+    size_t resultSize = 0;
+    int count = 0;
+    int failed = 0;
+
+    // What each item turned into, applied to the cache only if the batch commits
+    Item *applied = NULL;
+    char *exists = NULL;
+    int appliedCapacity = 0;
+
+    if(sqlite3_exec(db, "BEGIN IMMEDIATE", NULL, NULL, NULL) != SQLITE_OK){
+        fprintf(stderr, "DB_THREAD: Could not start batch: %s\n", sqlite3_errmsg(db));
+        return NULL;
+    }
+
+    FILE *out = open_memstream(&result, &resultSize);
+    fprintf(out, "SUCCESS");
+
+    char *cursor = payload;
+    while(!failed){
+        Item item;
+        int ret;
+
+        if(operation == CLIENT_DEL){
+            char *end;
+            long id = strtol(cursor, &end, 10);
+            if(end == cursor){
+                // Anything but trailing whitespace is a malformed id
+                while(*end == ' ' || *end == '\n')
+                    end++;
+                failed = *end != '\0';
+                break;
+            }
+            cursor = end;
+            item.id = (int)id;
+            ret = db_delete_item(statements, item.id, version);
+        } else {
+            while(*cursor == '\n')
+                cursor++;
+            if(*cursor == '\0')
+                break;
+
+            char *end = strchr(cursor, RECORD_SEPARATOR);
+            // The description is the only field allowed to be empty
+            if(deserialize_item(cursor, &item) < 9){
+                failed = 1;
+                break;
+            }
+            cursor = end != NULL ? end + 1 : cursor + strlen(cursor);
+
+            if(operation == CLIENT_PUT)
+                ret = db_insert_item(statements, &item, version);
+            else
+                ret = db_update_item(statements, &item, version);
+        }
+
+        if(ret != SQLITE_DONE){
+            fprintf(stderr, "DB_THREAD: Batch item %d failed: %s\n", count, sqlite3_errmsg(db));
+            failed = 1;
+            break;
+        }
+
+        if(count == appliedCapacity){
+            appliedCapacity = appliedCapacity ? appliedCapacity * 2 : 64;
+            applied = (Item*)realloc(applied, sizeof(Item) * appliedCapacity);
+            exists = (char*)realloc(exists, appliedCapacity);
+            if(applied == NULL || exists == NULL){
+                perror("Could not grow batch");
+                exit(-1);
+            }
+        }
+        applied[count] = item;
+        exists[count] = operation != CLIENT_DEL && sqlite3_changes(db) > 0;
+
+        fprintf(out, "\n%d %s", item.id, sqlite3_changes(db) > 0 ? "OK" : "MISSING");
+        count++;
+    }
+    fclose(out);
+
+    if(failed || count == 0){
+        sqlite3_exec(db, "ROLLBACK", NULL, NULL, NULL);
+        free(result);
+        free(applied);
+        free(exists);
+        return NULL;
+    }
+
+    if(sqlite3_exec(db, "COMMIT", NULL, NULL, NULL) != SQLITE_OK){
+        fprintf(stderr, "DB_THREAD: Could not commit batch: %s\n", sqlite3_errmsg(db));
+        sqlite3_exec(db, "ROLLBACK", NULL, NULL, NULL);
+        free(result);
+        free(applied);
+        free(exists);
+        return NULL;
+    }
+
+    for(int i = 0; i < count; i++){
+        if(exists[i])
+            item_cache_put(cache, &applied[i]);
+        else
+            item_cache_remove(cache, applied[i].id);
+    }
+    item_cache_set_version(cache, version);
+    free(applied);
+    free(exists);
+
+    fprintf(stdout, "DB_THREAD: Applied batch of %d items\n", count);
+    return result;
 }
@@ -0,0 +1,137 @@
+//
+// Shared GET ALL response. Serializing the whole table is the most expensive
+// thing the server does, and clients reload the whole list after every edit,
+// so the result is kept and handed to every connection by reference. It only
+// has to be rebuilt once per change to the items, no matter how many clients
+// ask for it.
+//
+// Tables too large to keep serialized are streamed instead, one bounded chunk
+// at a time, to clients that speak protocol version 2.
+//
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+
+#include "snapshot.h"
+
+struct items_snapshot *items_snapshot_create(){
+    struct items_snapshot *snapshot = (struct items_snapshot*)calloc(1, sizeof(struct items_snapshot));
+    if(snapshot == NULL)
+        return NULL;
+
+    pthread_mutex_init(&snapshot->lock, NULL);
+    return snapshot;
+}
+
+struct shared_buffer *items_snapshot_get(struct items_snapshot *snapshot, struct item_cache *cache,
+                                         struct db_statements *statements){
+    pthread_mutex_lock(&snapshot->lock);
+
+    // Read before querying, so a write that lands during the rebuild leaves it stale
+    unsigned long generation = item_cache_generation(cache);
+    if(snapshot->payload == NULL || snapshot->generation != generation){
+        sqlite3_stmt *stmt = db_statement(statements, STMT_GET_ALL);
+        size_t length;
+        char *data = stmt ? marshalItems(stmt, &length) : NULL;
+        if(stmt != NULL)
+            sqlite3_reset(stmt);
+
+        struct shared_buffer *rebuilt = data ? shared_buffer_wrap(data, length) : NULL;
+        if(rebuilt == NULL){
+            free(data);
+            pthread_mutex_unlock(&snapshot->lock);
+            return NULL;
+        }
+
+        fprintf(stdout, "Rebuilt GET ALL snapshot, %zu bytes\n", length);
+        shared_buffer_release(snapshot->payload);
+        snapshot->payload = rebuilt;
+        snapshot->generation = generation;
+    }
+
+    struct shared_buffer *payload = shared_buffer_acquire(snapshot->payload);
+    pthread_mutex_unlock(&snapshot->lock);
+    return payload;
+}
+
+int items_stream_wanted(struct item_cache *cache, struct queue_head *request){
+    if(!(request->flags & REQUEST_STREAM))
+        return 0;
+    if(request->flags & REQUEST_CONTINUE)
+        return 1;
+
+    long count = item_cache_count(cache);
+    return count < 0 || count > SNAPSHOT_MAX_ITEMS;
+}
+
+int items_stream_chunk(struct db_statements *statements, struct queue_head *request, struct queue_head *response){
+    int first = !(request->flags & REQUEST_CONTINUE);
+
+    sqlite3_stmt *stmt = db_statement(statements, STMT_GET_ALL_AFTER);
+    if(stmt == NULL)
+        return -1;
+    sqlite3_bind_int64(stmt, 1, first ? INT64_MIN : request->cursor);
+
+    size_t length;
+    int more;
+    sqlite3_int64 last_id;
+    char *chunk = marshal_items_chunk(stmt, first, STREAM_CHUNK_SIZE, &length, &more, &last_id);
+    sqlite3_reset(stmt);
+    if(chunk == NULL)
+        return -1;
+
+    INIT_QUEUE_HEAD_LEN(response, chunk, length, NULL);
+    free(chunk);
+    if(more){
+        response->flags |= RESPONSE_MORE;
+        response->cursor = last_id;
+    }
+    return 0;
+}
+
+char *marshal_items_chunk(sqlite3_stmt *stmt, int first, size_t limit, size_t *length, int *more, sqlite3_int64 *last_id){
+    char *result = NULL;
+    size_t size = 0;
+    FILE *out = open_memstream(&result, &size);
+    if(out == NULL)
+        return NULL;
+
+    // Records are separated rather than terminated, so a chunk can end after any of them
+    size_t written = 0;
+    if(first)
+        written += fprintf(out, "SUCCESS ");
+
+    int rows = 0;
+    int r = SQLITE_DONE;
+    while(written < limit && (r = sqlite3_step(stmt)) == SQLITE_ROW){
+        if(rows > 0 || !first)
+            written += fprintf(out, "%c", RECORD_SEPARATOR);
+        written += print_item_row(out, stmt);
+        *last_id = sqlite3_column_int64(stmt, 0);
+        rows++;
+    }
+
+    *more = r == SQLITE_ROW;
+    if(r != SQLITE_ROW && r != SQLITE_DONE){
+        fclose(out);
+        free(result);
+        return NULL;
+    }
+    if(!*more)
+        fprintf(out, "%c", GROUP_SEPARATOR);
+
+    if(fclose(out) != 0){
+        free(result);
+        return NULL;
+    }
+
+    *length = size;
+    return result;
+}
+
+char *marshalItems(sqlite3_stmt *stmt, size_t *length){
+    int more;
+    sqlite3_int64 last_id;
+    return marshal_items_chunk(stmt, 1, SIZE_MAX, length, &more, &last_id);
+}
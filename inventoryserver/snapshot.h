@@ -0,0 +1,93 @@
+#ifndef CS469_PROJECT_SNAPSHOT_H
+#define CS469_PROJECT_SNAPSHOT_H
+
+#include <pthread.h>
+
+#include "cache.h"
+#include "queue.h"
+#include "statements.h"
+
+#define SNAPSHOT_MAX_ITEMS (50 * 1000)  // Larger tables are streamed to clients that support it
+#define STREAM_CHUNK_SIZE  (60 * 1024)  // Stays under QUEUE_MAX_POOLED_BUFFER so chunks reuse message buffers
+
+/**
+ * The serialized GET ALL response, shared by every client that asks for it
+ * until an item changes. It is tied to the item cache generation, which the
+ * writer bumps on every committed change, and is rebuilt by the first GET ALL
+ * that finds it stale.
+ */
+struct items_snapshot {
+    pthread_mutex_t lock;   // Held while rebuilding, so a burst of GET ALLs builds it once
+    struct shared_buffer *payload;
+    unsigned long generation;
+};
+
+/**
+ * Allocates an empty snapshot, built on first use.
+ *
+ * @return The snapshot, or NULL on error
+ */
+struct items_snapshot *items_snapshot_create();
+
+/**
+ * Gets the current GET ALL response, rebuilding it first if an item changed
+ * since it was built.
+ *
+ * @param snapshot
+ * @param cache Item cache whose generation tracks writes
+ * @param statements Statement cache of the calling thread's connection, used to rebuild
+ * @return A reference to the response to be released by the caller, or NULL on error
+ */
+struct shared_buffer *items_snapshot_get(struct items_snapshot *snapshot, struct item_cache *cache,
+                                         struct db_statements *statements);
+
+/**
+ * Whether a GET ALL should be streamed rather than answered from the snapshot.
+ *
+ * @param cache
+ * @param request The GET ALL request
+ * @return 1 to stream, 0 to use the snapshot
+ */
+int items_stream_wanted(struct item_cache *cache, struct queue_head *request);
+
+/**
+ * Answers a streamed GET ALL with its next chunk of at most about
+ * STREAM_CHUNK_SIZE bytes. The first chunk starts where the GET ALL response
+ * does and the last one ends with its group separator, so the chunks
+ * concatenate to the same payload a single frame would have carried. Every
+ * chunk but the last is flagged RESPONSE_MORE, with the cursor to continue from.
+ *
+ * Each chunk is read in its own transaction, continuing after the last id
+ * sent, so a stream never holds a reader or a read transaction while the
+ * client catches up.
+ *
+ * @param statements Statement cache of the calling thread's connection
+ * @param request GET ALL request, or a REQUEST_CONTINUE request for the next chunk
+ * @param response Filled in with the chunk
+ * @return 0 on success, -1 on error
+ */
+int items_stream_chunk(struct db_statements *statements, struct queue_head *request, struct queue_head *response);
+
+/**
+ * Serializes rows of a GET ALL statement into a response, or part of one.
+ *
+ * @param stmt Statement selecting every column of the items, ordered by id
+ * @param first Whether this is the start of the response
+ * @param limit Stop once the output reaches this many bytes
+ * @param length Receives the length of the output
+ * @param more Receives 1 if the limit was reached before the last row, 0 if the response is complete
+ * @param last_id Receives the id of the last row written
+ * @return The output to be freed by the caller, or NULL on error
+ */
+char *marshal_items_chunk(sqlite3_stmt *stmt, int first, size_t limit, size_t *length, int *more, sqlite3_int64 *last_id);
+
+/**
+ * Serializes every row of a GET ALL statement into a response.
+ *
+ * @param stmt Statement selecting every column of every item
+ * @param length Receives the length of the response
+ * @return The response to be freed by the caller, or NULL on error
+ */
+char *marshalItems(sqlite3_stmt *stmt, size_t *length);
+
+#endif //CS469_PROJECT_SNAPSHOT_H
@@ -0,0 +1,175 @@
+//
+// Prepared statement cache for the database thread. Every request used to
+// compile its SQL from scratch, which costs more than running these simple
+// single row statements. Statements are now compiled when the database is
+// opened and reused with sqlite3_reset().
+//
+
+#include <stdio.h>
+#include <string.h>
+
+#include "statements.h"
+
+static const char *statement_sql[STMT_COUNT] = {
+        [STMT_GET_ALL] = "SELECT * FROM items",
+        [STMT_GET_ITEM] = "SELECT * FROM items WHERE id=?",
+        [STMT_INSERT_ITEM] = "INSERT INTO items "
+                             "(name, armorPoints, healthPoints, manaPoints, sellPrice,"
+                             " damage, critChance, range, description, version) "
+                             "VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?)",
+        [STMT_UPDATE_ITEM] = "UPDATE items SET "
+                             "name=?, armorPoints=?, healthPoints=?, manaPoints=?, "
+                             "sellPrice=?, damage=?, critChance=?, range=?, description=?, version=? "
+                             "WHERE id=?",
+        [STMT_DELETE_ITEM] = "DELETE FROM items WHERE id=?",
+        [STMT_USER_PASSWORD] = "SELECT password FROM users where username=? LIMIT 1;",
+        [STMT_GET_ALL_AFTER] = "SELECT * FROM items WHERE id > ? ORDER BY id",
+        [STMT_INSERT_TOMBSTONE] = "INSERT OR REPLACE INTO tombstones (id, version) VALUES (?, ?)",
+};
+
+const struct item_column item_columns[ITEM_COLUMN_COUNT] = {
+        {"id",         "id",           SQLITE_INTEGER},
+        {"name",       "name",         SQLITE_TEXT},
+        {"armor",      "armorPoints",  SQLITE_INTEGER},
+        {"health",     "healthPoints", SQLITE_INTEGER},
+        {"mana",       "manaPoints",   SQLITE_INTEGER},
+        {"sellPrice",  "sellPrice",    SQLITE_INTEGER},
+        {"damage",     "damage",       SQLITE_INTEGER},
+        {"critChance", "critChance",   SQLITE_FLOAT},
+        {"range",      "range",        SQLITE_INTEGER},
+};
+
+int db_statements_init(struct db_statements *cache, sqlite3 *db){
+    memset(cache, 0, sizeof(struct db_statements));
+    cache->db = db;
+
+    for(int i = 0; i < STMT_COUNT; i++){
+        int retCode = sqlite3_prepare_v3(db, statement_sql[i], -1, SQLITE_PREPARE_PERSISTENT,
+                                         &cache->stmt[i], NULL);
+        if(retCode != SQLITE_OK){
+            fprintf(stderr, "Database: Could not prepare \"%s\": %s\n", statement_sql[i], sqlite3_errmsg(db));
+            db_statements_finalize(cache);
+            return retCode;
+        }
+    }
+
+    return SQLITE_OK;
+}
+
+void db_statements_finalize(struct db_statements *cache){
+    for(int i = 0; i < STMT_COUNT; i++){
+        sqlite3_finalize(cache->stmt[i]);
+        cache->stmt[i] = NULL;
+    }
+    for(int i = 0; i < STMT_DYNAMIC_MAX; i++){
+        sqlite3_finalize(cache->dynamic[i].stmt);
+        free(cache->dynamic[i].sql);
+        cache->dynamic[i].stmt = NULL;
+        cache->dynamic[i].sql = NULL;
+    }
+}
+
+sqlite3_stmt *db_statement(struct db_statements *cache, int which){
+    sqlite3_stmt *stmt = cache->stmt[which];
+
+    // Empty after a failed init, try again rather than failing every request
+    if(stmt == NULL){
+        if(sqlite3_prepare_v3(cache->db, statement_sql[which], -1, SQLITE_PREPARE_PERSISTENT,
+                              &stmt, NULL) != SQLITE_OK){
+            fprintf(stderr, "Database: Could not prepare \"%s\": %s\n", statement_sql[which],
+                    sqlite3_errmsg(cache->db));
+            return NULL;
+        }
+        cache->stmt[which] = stmt;
+    }
+
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    return stmt;
+}
+
+sqlite3_stmt *db_statement_sql(struct db_statements *cache, const char *sql){
+    struct dynamic_statement *slot = NULL;
+
+    for(int i = 0; i < STMT_DYNAMIC_MAX && cache->dynamic[i].sql != NULL; i++){
+        if(strcmp(cache->dynamic[i].sql, sql) == 0){
+            slot = &cache->dynamic[i];
+            break;
+        }
+    }
+
+    if(slot == NULL){
+        sqlite3_stmt *stmt;
+        if(sqlite3_prepare_v3(cache->db, sql, -1, SQLITE_PREPARE_PERSISTENT, &stmt, NULL) != SQLITE_OK){
+            fprintf(stderr, "Database: Could not prepare \"%s\": %s\n", sql, sqlite3_errmsg(cache->db));
+            return NULL;
+        }
+
+        // Slots fill up in order, then get reused round robin
+        slot = &cache->dynamic[cache->next_evicted];
+        cache->next_evicted = (cache->next_evicted + 1) % STMT_DYNAMIC_MAX;
+        sqlite3_finalize(slot->stmt);
+        free(slot->sql);
+        slot->stmt = stmt;
+        slot->sql = strdup(sql);
+    }
+
+    sqlite3_reset(slot->stmt);
+    sqlite3_clear_bindings(slot->stmt);
+    return slot->stmt;
+}
+
+int item_column_find(const char *field){
+    for(int i = 0; i < ITEM_COLUMN_COUNT; i++){
+        if(strcmp(field, item_columns[i].field) == 0)
+            return i;
+    }
+    return -1;
+}
+
+double item_number(const Item *item, int field){
+    switch(field){
+        case 0: return item->id;
+        case 2: return item->armor;
+        case 3: return item->health;
+        case 4: return item->mana;
+        case 5: return item->sellPrice;
+        case 6: return item->damage;
+        case 7: return item->critChance;
+        case 8: return item->range;
+        default: return 0;
+    }
+}
+
+int print_item(FILE *out, const Item *item){
+    return fprintf(out, "%d\n%s\n%d\n%d\n%d\n%d\n%d\n%f\n%d\n%s",
+                   item->id, item->name, item->armor, item->health, item->mana,
+                   item->sellPrice, item->damage, item->critChance, item->range, item->description);
+}
+
+int print_item_row(FILE *out, sqlite3_stmt *stmt){
+    return fprintf(out, "%d\n%s\n%d\n%d\n%d\n%d\n%d\n%f\n%d\n%s",
+                   sqlite3_column_int(stmt, 0), // id
+                   (const char*)sqlite3_column_text(stmt, 1), // name
+                   sqlite3_column_int(stmt, 2), // armor
+                   sqlite3_column_int(stmt, 3), // health
+                   sqlite3_column_int(stmt, 4), // mana
+                   sqlite3_column_int(stmt, 5), // sellPrice
+                   sqlite3_column_int(stmt, 6), // damage
+                   sqlite3_column_double(stmt, 7), // critical
+                   sqlite3_column_int(stmt, 8), //range
+                   (const char*)sqlite3_column_text(stmt, 9));
+}
+
+void new_item_from_row(sqlite3_stmt * stmt, Item * item) {
+    item->id = sqlite3_column_int(stmt, 0);
+    snprintf(item->name, BUFFER_SIZE, "%s", (const char*)sqlite3_column_text(stmt, 1));
+    item->armor = sqlite3_column_int(stmt, 2);
+    item->health = sqlite3_column_int(stmt, 3);
+    item->mana = sqlite3_column_int(stmt, 4); // mana
+    item->sellPrice = sqlite3_column_int(stmt, 5); // sell price
+    item->damage = sqlite3_column_int(stmt, 6);
+    item->critChance = sqlite3_column_double(stmt, 7);
+    item->range = sqlite3_column_int(stmt, 8); // range
+    snprintf(item->description, BUFFER_SIZE, "%s", (const char*)sqlite3_column_text(stmt, 9));
+}
@@ -0,0 +1,141 @@
+#ifndef CS469_PROJECT_STATEMENTS_H
+#define CS469_PROJECT_STATEMENTS_H
+
+#include <stdio.h>
+#include <sqlite3.h>
+
+#include "../globals.h"
+
+#define DB_BUSY_TIMEOUT    5000 // ms to wait on a locked database before giving up
+
+/**
+ * Statements used on every request. They are compiled once per database
+ * connection instead of once per request.
+ */
+#define STMT_GET_ALL          0
+#define STMT_GET_ITEM         1
+#define STMT_INSERT_ITEM      2
+#define STMT_UPDATE_ITEM      3
+#define STMT_DELETE_ITEM      4
+#define STMT_USER_PASSWORD    5
+#define STMT_GET_ALL_AFTER    6
+#define STMT_INSERT_TOMBSTONE 7
+#define STMT_COUNT            8
+
+#define STMT_DYNAMIC_MAX   64   // Statements built at runtime, such as PAGE queries, kept per connection
+
+/**
+ * Item fields that requests may sort or filter by, every column but the
+ * description. Every one but id is backed by an index on (column, id).
+ */
+struct item_column {
+    const char *field;      // Name used in requests, as in Item
+    const char *column;     // Column of the items table
+    int type;               // SQLITE_INTEGER, SQLITE_FLOAT or SQLITE_TEXT
+};
+
+#define ITEM_COLUMN_COUNT 9
+
+// In the order of the items table, so an index here is also the column index of a row
+extern const struct item_column item_columns[ITEM_COLUMN_COUNT];
+
+struct dynamic_statement {
+    char *sql;
+    sqlite3_stmt *stmt;
+};
+
+/**
+ * Prepared statements belonging to one sqlite3 connection. Like the
+ * connection itself, a cache must only be used by one thread.
+ */
+struct db_statements {
+    sqlite3 *db;
+    sqlite3_stmt *stmt[STMT_COUNT];
+    struct dynamic_statement dynamic[STMT_DYNAMIC_MAX];
+    int next_evicted;
+};
+
+/**
+ * Prepares every cached statement against db.
+ *
+ * @param cache Cache to fill, any previous statements must have been finalized
+ * @param db Open database connection
+ * @return SQLITE_OK, or the error of the first statement that failed to prepare
+ */
+int db_statements_init(struct db_statements *cache, sqlite3 *db);
+
+/**
+ * Finalizes every cached statement. Must be called before the connection is
+ * closed, sqlite3_close() refuses to close a connection with live statements.
+ *
+ * @param cache
+ */
+void db_statements_finalize(struct db_statements *cache);
+
+/**
+ * Gets a cached statement, reset and with its bindings cleared. Callers bind
+ * their parameters, step it, and sqlite3_reset() it once done so that it
+ * doesn't hold a read transaction open between requests.
+ *
+ * @param cache
+ * @param which One of the STMT_ constants
+ * @return The statement, or NULL if it could not be prepared
+ */
+sqlite3_stmt *db_statement(struct db_statements *cache, int which);
+
+/**
+ * Same as db_statement() for SQL that is put together at runtime. Statements
+ * are looked up by their text, and once STMT_DYNAMIC_MAX are cached the
+ * oldest is finalized to make room.
+ *
+ * @param cache
+ * @param sql Statement text
+ * @return The statement, or NULL if it could not be prepared
+ */
+sqlite3_stmt *db_statement_sql(struct db_statements *cache, const char *sql);
+
+/**
+ * Looks a field name up in item_columns.
+ *
+ * @param field
+ * @return Its index, or -1 if requests can't use it
+ */
+int item_column_find(const char *field);
+
+/**
+ * Reads a numeric field of an item.
+ *
+ * @param item
+ * @param field Index into item_columns, not name
+ * @return Its value
+ */
+double item_number(const Item *item, int field);
+
+/**
+ * Writes an item in the same format as print_item_row().
+ *
+ * @param out
+ * @param item
+ * @return Number of bytes written
+ */
+int print_item(FILE *out, const Item *item);
+
+/**
+ * Writes a SQLITE_ROW of the items table in the wire format of an item,
+ * without a trailing separator.
+ *
+ * @param out
+ * @param stmt
+ * @return Number of bytes written
+ */
+int print_item_row(FILE *out, sqlite3_stmt *stmt);
+
+/**
+ * Given a SQLITE_ROW of the items table, convert all relevant fields into an Item struct
+ *
+ * @param stmt
+ * @param item
+ */
+void new_item_from_row(sqlite3_stmt * stmt, Item * item);
+
+#endif //CS469_PROJECT_STATEMENTS_H
@@ -0,0 +1,138 @@
+//
+// STATS command. Balancing needs aggregates and distributions of item fields,
+// which used to mean downloading every item with GET ALL. Only the aggregates
+// cross the wire now.
+//
+
+#define _GNU_SOURCE
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "columns.h"
+#include "stats.h"
+
+static int stats_from_database(struct db_statements *statements, const struct predicate *predicates, int count,
+                               int field, struct column_stats *stats);
+static char *format_stats(const struct column_stats *stats);
+
+char *stats_items(struct db_statements *statements, struct item_cache *cache, const char *request){
+    const char *newline = strchr(request, '\n');
+    size_t length = newline ? (size_t)(newline - request) : strlen(request);
+    char line[BUFFER_SIZE];
+    if(length >= sizeof(line))
+        return NULL;
+    memcpy(line, request, length);
+    line[length] = '\0';
+
+    // The histogram is optional, but all of it or nothing
+    char field[32];
+    int buckets = 0;
+    double low = 0;
+    double high = 0;
+    int field_end = -1;
+    int histogram_end = -1;
+    int fields = sscanf(line, "STATS %31s%n %d %lf %lf%n", field, &field_end, &buckets, &low, &high, &histogram_end);
+    int end = fields == 4 ? histogram_end : fields == 1 ? field_end : -1;
+    if(end < 0 || line[end + strspn(line + end, " ")] != '\0')
+        return NULL;
+    if(fields == 4 && (buckets <= 0 || buckets > STATS_MAX_BUCKETS || !isfinite(low) || !isfinite(high) || low >= high))
+        return NULL;
+
+    int column = item_column_find(field);
+    if(column < 0 || item_columns[column].type == SQLITE_TEXT)
+        return NULL;
+
+    struct predicate predicates[FIND_MAX_PREDICATES];
+    int count = parse_predicates(newline ? newline + 1 : "", predicates);
+    if(count < 0)
+        return NULL;
+
+    int in_columns = 1;
+    for(int i = 0; i < count; i++)
+        in_columns = in_columns && column_store_supports(&predicates[i]);
+
+    struct column_stats *stats = (struct column_stats*)malloc(sizeof(struct column_stats));
+    if(stats == NULL)
+        return NULL;
+    column_stats_init(stats, buckets, low, high);
+
+    int ret = -1;
+    if(in_columns)
+        ret = column_store_stats(cache->columns, predicates, count, column, stats);
+    if(ret != 0){
+        column_stats_init(stats, buckets, low, high);
+        ret = stats_from_database(statements, predicates, count, column, stats);
+    }
+
+    char *result = ret == 0 ? format_stats(stats) : NULL;
+    free(stats);
+    return result;
+}
+
+/**
+ * Computes the aggregates from the database, for filters on names or before
+ * the column store is loaded.
+ * @return 0 on success, -1 on error
+ */
+static int stats_from_database(struct db_statements *statements, const struct predicate *predicates, int count,
+                               int field, struct column_stats *stats){
+    char *sql = NULL;
+    size_t sql_length = 0;
+    FILE *out = open_memstream(&sql, &sql_length);
+    if(out == NULL)
+        return -1;
+
+    fprintf(out, "SELECT %s FROM items", item_columns[field].column);
+    if(count > 0){
+        fputs(" WHERE ", out);
+        append_predicates(out, predicates, count);
+    }
+    if(fclose(out) != 0){
+        free(sql);
+        return -1;
+    }
+
+    sqlite3_stmt *stmt = db_statement_sql(statements, sql);
+    free(sql);
+    if(stmt == NULL)
+        return -1;
+
+    bind_predicates(stmt, predicates, count);
+    int r;
+    while((r = sqlite3_step(stmt)) == SQLITE_ROW)
+        column_stats_add(stats, sqlite3_column_double(stmt, 0));
+    sqlite3_reset(stmt);
+
+    return r == SQLITE_DONE ? 0 : -1;
+}
+
+/**
+ * Formats aggregates as a STATS response.
+ */
+static char *format_stats(const struct column_stats *stats){
+    char *result = NULL;
+    size_t length = 0;
+    FILE *out = open_memstream(&result, &length);
+    if(out == NULL)
+        return NULL;
+
+    fprintf(out, "SUCCESS\ncount %lu", stats->count);
+    if(stats->count > 0)
+        fprintf(out, "\nmin %.15g\nmax %.15g\nsum %.15g\nmean %.15g",
+                stats->min, stats->max, stats->sum, stats->sum / (double)stats->count);
+    else
+        fputs("\nmin -\nmax -\nsum 0\nmean -", out);
+
+    if(stats->buckets > 0){
+        fprintf(out, "\nbelow %lu\nabove %lu\nbuckets", stats->below, stats->above);
+        for(int i = 0; i < stats->buckets; i++)
+            fprintf(out, " %lu", stats->histogram[i]);
+    }
+
+    if(fclose(out) != 0){
+        free(result);
+        return NULL;
+    }
+    return result;
+}
@@ -0,0 +1,31 @@
+#ifndef CS469_PROJECT_STATS_H
+#define CS469_PROJECT_STATS_H
+
+#include "cache.h"
+#include "statements.h"
+
+/**
+ * Answers a STATS request:
+ *
+ *   STATS <field> [<buckets> <low> <high>]\n<field> <op> <value>...
+ *
+ * `field` is any numeric item_columns field, the optional lines after the
+ * first filter the items like FIND does. With `buckets` (at most
+ * STATS_MAX_BUCKETS) a histogram of equal buckets spanning [low, high] is
+ * added. The response is
+ *
+ *   SUCCESS\ncount <n>\nmin <x>\nmax <x>\nsum <x>\nmean <x>[\nbelow <n>\nabove <n>\nbuckets <n> <n>...]
+ *
+ * where min, max and mean are "-" if no item matched, and below and above
+ * count the values outside the histogram. Everything is computed in one pass
+ * over the column store, or over the query result when the filter needs the
+ * database.
+ *
+ * @param statements Statement cache of the calling thread's connection
+ * @param cache
+ * @param request The STATS request
+ * @return The response to be freed by the caller, or NULL if the request is invalid or failed
+ */
+char *stats_items(struct db_statements *statements, struct item_cache *cache, const char *request);
+
+#endif //CS469_PROJECT_STATS_H
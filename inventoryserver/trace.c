@@ -0,0 +1,280 @@
+//
+// Slow request tracer, see trace.h. The I/O thread that finishes a slow
+// request formats its events and hands them to the trace thread on a queue,
+// so it never waits on the disk. Statement times come from SQLite's own trace
+// hooks, which fire when a statement starts running and when it is done,
+// instead of timing every sqlite3_step() call site.
+//
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include "metrics.h"
+#include "reactor.h"
+#include "trace.h"
+
+// Written by trace_start() before any thread starts, only read afterwards
+static int tracing;
+static uint64_t threshold;          // ns
+static unsigned int rate;
+static FILE *trace_file;
+static struct queue_root *trace_queue;
+
+static _Atomic long current_second;
+static _Atomic unsigned int dumped;         // In the current second
+static _Atomic unsigned long skipped;       // Since the last request dumped
+static _Atomic unsigned long sequence;      // Track of the next request dumped
+
+// SQL statements run by the calling worker for its current request
+static __thread uint64_t statement_started;
+static __thread int statement_depth;
+static __thread uint64_t statement_time;
+static __thread unsigned int statement_count;
+
+static int trace_statement(unsigned int type, void *context, void *statement, void *detail);
+static int may_dump();
+static void write_event(FILE *out, const char *name, unsigned long track, uint64_t start, uint64_t end, int pid);
+static void write_string(FILE *out, const char *value);
+static const char *queue_name(const struct queue_head *response);
+static void *trace_thread(void *data);
+
+int trace_start(const char *path, uint64_t threshold_us, unsigned int requests_per_second){
+    trace_file = fopen(path, "a");
+    if(trace_file == NULL)
+        return -1;
+
+    // Opening bracket of the array, unless an earlier run already wrote it
+    if(ftell(trace_file) == 0){
+        fputs("[\n", trace_file);
+        fflush(trace_file);
+    }
+
+    trace_queue = ALLOC_QUEUE_ROOT();
+    threshold = threshold_us * 1000;
+    rate = requests_per_second;
+    atomic_init(&current_second, 0);
+    atomic_init(&dumped, 0);
+    atomic_init(&skipped, 0);
+    atomic_init(&sequence, 1);
+
+    pthread_t thread;
+    if(pthread_create(&thread, NULL, trace_thread, NULL) != 0){
+        fclose(trace_file);
+        trace_file = NULL;
+        return -1;
+    }
+    pthread_detach(thread);
+    tracing = 1;
+    return 0;
+}
+
+uint64_t trace_now(){
+    return tracing ? metrics_now() : 0;
+}
+
+void trace_database(sqlite3 *db){
+    if(tracing)
+        sqlite3_trace_v2(db, SQLITE_TRACE_STMT | SQLITE_TRACE_PROFILE, trace_statement, NULL);
+}
+
+void trace_label(struct queue_head *msg, const char *payload, size_t length){
+    if(!tracing)
+        return;
+
+    size_t end = 0;
+    int words = 0;
+    int login = metrics_op(payload, length) == METRIC_OP_AUTH || metrics_op(payload, length) == METRIC_OP_RESUME;
+    while(end < length && end < QUEUE_LABEL_SIZE - 1 && payload[end] != '\n'){
+        // A login keeps its user name, never the password or token after it
+        if(payload[end] == ' ' && login && ++words == 2)
+            break;
+        end++;
+    }
+    memcpy(msg->stamps.label, payload, end);
+    msg->stamps.label[end] = '\0';
+}
+
+void trace_begin(struct queue_head *msg){
+    if(!tracing)
+        return;
+    msg->stamps.dequeued = metrics_now();
+    statement_started = 0;
+    statement_depth = 0;
+    statement_time = 0;
+    statement_count = 0;
+}
+
+void trace_end(struct queue_head *msg){
+    if(!tracing)
+        return;
+    msg->stamps.sqlite = statement_time;
+    msg->stamps.statements = statement_count;
+    msg->stamps.answered = metrics_now();
+}
+
+void trace_request(const struct queue_head *response, int io_thread, int socketfd){
+    const struct queue_stamps *stamps = &response->stamps;
+
+    if(!tracing || response->started == 0)
+        return;
+
+    uint64_t written = metrics_now();
+    uint64_t start = stamps->read != 0 ? stamps->read : response->started;
+    if(written - start < threshold || !may_dump())
+        return;
+
+    char *events = NULL;
+    size_t size = 0;
+    FILE *out = open_memstream(&events, &size);
+    if(out == NULL)
+        return;
+
+    unsigned long track = atomic_fetch_add_explicit(&sequence, 1, memory_order_relaxed);
+    int pid = (int)getpid();
+    uint64_t dequeued = stamps->dequeued, answered = stamps->answered;
+
+    fprintf(out, "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%d,\"tid\":%lu,\"args\":{\"name\":\"IO_THREAD_%d client %d\"}},\n",
+            pid, track, io_thread, socketfd);
+
+    // The whole request, with what it was and how long each stage took
+    fprintf(out, "{\"ph\":\"X\",\"cat\":\"request\",\"name\":");
+    write_string(out, stamps->label[0] != '\0' ? stamps->label : "request");
+    fprintf(out, ",\"pid\":%d,\"tid\":%lu,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"request_id\":%u,\"queue\":\"%s\","
+                 "\"statements\":%u,\"sqlite_us\":%.3f,\"response_bytes\":%zu,\"skipped\":%lu}},\n",
+            pid, track, start / 1e3, (written - start) / 1e3, response->request_id, queue_name(response),
+            stamps->statements, stamps->sqlite / 1e3, response->length,
+            atomic_exchange_explicit(&skipped, 0, memory_order_relaxed));
+
+    write_event(out, "ssl_read", track, stamps->read, stamps->decrypted, pid);
+    write_event(out, "parse", track, stamps->decrypted, response->started, pid);
+    write_event(out, "queue", track, response->queued, dequeued, pid);
+    // Statements are summed, not placed where they ran, so they are drawn first
+    if(dequeued != 0 && answered >= dequeued + stamps->sqlite){
+        write_event(out, "sqlite3_step", track, dequeued, dequeued + stamps->sqlite, pid);
+        write_event(out, "serialize", track, dequeued + stamps->sqlite, answered, pid);
+    }
+    write_event(out, "reply_queue", track, answered, stamps->received, pid);
+    write_event(out, "ssl_write", track, stamps->received, written, pid);
+
+    if(fclose(out) != 0){
+        free(events);
+        return;
+    }
+
+    struct queue_head *msg = alloc_queue_message();
+    INIT_QUEUE_HEAD_LEN(msg, events, size, NULL);
+    free(events);
+    queue_put(msg, trace_queue);
+}
+
+/**
+ * SQLite trace hook. A statement is timed from the first time it is stepped
+ * until it is done or reset.
+ * @param type SQLITE_TRACE_STMT or SQLITE_TRACE_PROFILE
+ * @param context
+ * @param statement
+ * @param detail The SQL for SQLITE_TRACE_STMT
+ * @return 0
+ */
+static int trace_statement(unsigned int type, void *context, void *statement, void *detail){
+    if(type == SQLITE_TRACE_STMT){
+        // Triggers report their start too, as a comment, they are part of their statement
+        const char *sql = (const char*)detail;
+        if(sql != NULL && strncmp(sql, "--", 2) == 0)
+            return 0;
+        if(statement_depth++ == 0)
+            statement_started = metrics_now();
+        statement_count++;
+    } else if(type == SQLITE_TRACE_PROFILE && statement_depth > 0){
+        if(--statement_depth == 0)
+            statement_time += metrics_now() - statement_started;
+    }
+    return 0;
+}
+
+/**
+ * Counts a dump against the rate limit.
+ * @return 1 if the request may be dumped, 0 if it has to be skipped
+ */
+static int may_dump(){
+    long now = (long)time(NULL);
+    long second = atomic_load_explicit(&current_second, memory_order_relaxed);
+
+    // Whoever moves the window on resets the count, a few extra dumps when threads race don't matter
+    if(second != now && atomic_compare_exchange_strong_explicit(&current_second, &second, now,
+                                                                 memory_order_relaxed, memory_order_relaxed))
+        atomic_store_explicit(&dumped, 0, memory_order_relaxed);
+
+    if(atomic_fetch_add_explicit(&dumped, 1, memory_order_relaxed) < rate)
+        return 1;
+    atomic_fetch_add_explicit(&skipped, 1, memory_order_relaxed);
+    return 0;
+}
+
+/**
+ * Writes a stage as a complete event, unless one of its ends is missing.
+ * @param out
+ * @param name
+ * @param track
+ * @param start ns
+ * @param end ns
+ * @param pid
+ */
+static void write_event(FILE *out, const char *name, unsigned long track, uint64_t start, uint64_t end, int pid){
+    if(start == 0 || end < start)
+        return;
+    fprintf(out, "{\"ph\":\"X\",\"cat\":\"stage\",\"name\":\"%s\",\"pid\":%d,\"tid\":%lu,\"ts\":%.3f,\"dur\":%.3f},\n",
+            name, pid, track, start / 1e3, (end - start) / 1e3);
+}
+
+/**
+ * Writes a JSON string.
+ * @param out
+ * @param value
+ */
+static void write_string(FILE *out, const char *value){
+    fputc('"', out);
+    for(const unsigned char *c = (const unsigned char*)value; *c != '\0'; c++){
+        if(*c == '"' || *c == '\\')
+            fprintf(out, "\\%c", *c);
+        else if(*c < 0x20 || *c >= 0x7f)
+            fprintf(out, "\\u%04x", *c);
+        else
+            fputc(*c, out);
+    }
+    fputc('"', out);
+}
+
+/**
+ * The kind of thread that answered a request.
+ * @param response
+ * @return writer, reader or auth
+ */
+static const char *queue_name(const struct queue_head *response){
+    if(response->flags & REQUEST_ON_WRITER)
+        return "writer";
+    return response->op == METRIC_OP_AUTH ? "auth" : "reader";
+}
+
+/**
+ * Appends the events of slow requests to the trace file.
+ * @param data unused
+ * @return NULL
+ */
+static void *trace_thread(void *data){
+    while(1){
+        struct queue_head *msg = queue_get_wait(trace_queue);
+        fwrite(queue_message_data(msg), 1, msg->length, trace_file);
+        // Flushed with every request, the trace is most useful right after something went wrong
+        fflush(trace_file);
+        free_queue_message(msg);
+    }
+
+    return NULL;
+}
@@ -0,0 +1,96 @@
+#ifndef CS469_PROJECT_TRACE_H
+#define CS469_PROJECT_TRACE_H
+
+#include <stdint.h>
+#include <sqlite3.h>
+
+#include "queue.h"
+
+/**
+ * Slow request tracing. While it is on, every request carries the time it
+ * reached each stage on its way through the server (see struct queue_stamps),
+ * and once its response has been written, a request that took longer than the
+ * threshold is dumped to the trace file as Chrome trace events:
+ *
+ *   ssl_read      the SSL_read that returned the request's last bytes
+ *   parse         framing, and waiting for a free slot in a full pipeline
+ *   queue         waiting for the writer, a reader or an auth worker
+ *   sqlite3_step  running SQL statements, summed over every statement
+ *   serialize     everything else the worker did, building the response mostly
+ *   reply_queue   waiting for the I/O thread to pick the response up
+ *   ssl_write     waiting behind earlier responses and writing this one
+ *
+ * The file is in the JSON array format, appended to across restarts and never
+ * closed with a ']', which chrome://tracing and ui.perfetto.dev accept as is.
+ * Every request gets a track of its own, named after the I/O thread and the
+ * client. At most the configured number of requests a second are dumped, the
+ * next one dumped says how many were skipped.
+ *
+ * Costs a few clock reads per request and two per SQL statement while on,
+ * and nothing but a branch while off.
+ */
+
+#define DEFAULT_TRACE_FILE "trace.json"
+#define DEFAULT_TRACE_RATE 100     // Requests dumped per second at most
+
+/**
+ * Turns tracing on and starts the thread writing the trace file. Must run
+ * before any other thread starts.
+ *
+ * @param path Trace file, created if needed and appended to
+ * @param threshold_us Requests taking longer than this are dumped
+ * @param requests_per_second Requests dumped per second at most
+ * @return 0 on success, -1 if the file can't be opened
+ */
+int trace_start(const char *path, uint64_t threshold_us, unsigned int requests_per_second);
+
+/**
+ * The time for a stamp.
+ *
+ * @return metrics_now() while tracing, 0 otherwise
+ */
+uint64_t trace_now();
+
+/**
+ * Times the SQL statements run on a connection, for the sqlite3_step stage.
+ * Does nothing unless tracing is on.
+ *
+ * @param db
+ */
+void trace_database(sqlite3 *db);
+
+/**
+ * Keeps the start of a request for the trace, up to the end of its first
+ * line, and only the user name of a login.
+ *
+ * @param msg
+ * @param payload
+ * @param length
+ */
+void trace_label(struct queue_head *msg, const char *payload, size_t length);
+
+/**
+ * Stamps a request taken off a queue by a worker thread, and starts timing
+ * its SQL statements.
+ *
+ * @param msg
+ */
+void trace_begin(struct queue_head *msg);
+
+/**
+ * Stamps a request about to be answered by the worker that took it.
+ *
+ * @param msg
+ */
+void trace_end(struct queue_head *msg);
+
+/**
+ * Dumps a request whose response has just been written, if it was slow.
+ *
+ * @param response The last response to the request
+ * @param io_thread Id of the reactor that wrote it
+ * @param socketfd Client socket
+ */
+void trace_request(const struct queue_head *response, int io_thread, int socketfd);
+
+#endif //CS469_PROJECT_TRACE_H
@@ -0,0 +1,161 @@
+//
+// GET SINCE command. Every write request the writer thread commits gets the
+// next version, stored in the rows it inserts or updates and in a tombstone
+// for each row it deletes. A client that kept the version of its last answer
+// then only downloads what changed since, instead of the whole table, and
+// learns that nothing did from the item cache without touching SQLite.
+//
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "versions.h"
+
+static int run_sql(sqlite3 *db, const char *sql);
+
+static const char *count_sql =
+        "SELECT (SELECT count(*) FROM (SELECT 1 FROM items WHERE version > ?1 LIMIT ?2))"
+        " + (SELECT count(*) FROM (SELECT 1 FROM tombstones WHERE version > ?1 LIMIT ?2))";
+static const char *items_sql = "SELECT * FROM items WHERE version > ? ORDER BY version";
+// An id deleted and then reused by an insert is sent as the new item alone
+static const char *tombstones_sql =
+        "SELECT id FROM tombstones WHERE version > ? "
+        "AND NOT EXISTS (SELECT 1 FROM items WHERE items.id = tombstones.id) ORDER BY version";
+
+int versions_migrate(const char *database){
+    sqlite3 *db = NULL;
+    int r = -1;
+
+    if(sqlite3_open(database, &db) != SQLITE_OK){
+        fprintf(stderr, "Database: Cannot open database to add versions: %s\n", sqlite3_errmsg(db));
+        sqlite3_close(db);
+        return -1;
+    }
+    sqlite3_busy_timeout(db, DB_BUSY_TIMEOUT);
+
+    // Adding the column only changes the schema, existing rows read as the default
+    sqlite3_stmt *stmt = NULL;
+    int versioned = sqlite3_prepare_v2(db, "SELECT version FROM items LIMIT 0", -1, &stmt, NULL) == SQLITE_OK;
+    sqlite3_finalize(stmt);
+
+    if((versioned || run_sql(db, "ALTER TABLE items ADD COLUMN version INTEGER NOT NULL DEFAULT 1") == 0)
+       && run_sql(db, "CREATE TABLE IF NOT EXISTS tombstones (id INTEGER PRIMARY KEY, version INTEGER NOT NULL)") == 0
+       && run_sql(db, "CREATE INDEX IF NOT EXISTS items_by_version ON items(version)") == 0
+       && run_sql(db, "CREATE INDEX IF NOT EXISTS tombstones_by_version ON tombstones(version)") == 0)
+        r = 0;
+
+    sqlite3_close(db);
+    return r;
+}
+
+int versions_latest(sqlite3 *db, sqlite3_int64 *version){
+    sqlite3_stmt *stmt = NULL;
+    int ret = sqlite3_prepare_v2(db, "SELECT max(coalesce((SELECT max(version) FROM items), 0),"
+                                     " coalesce((SELECT max(version) FROM tombstones), 0))", -1, &stmt, NULL);
+    if(ret != SQLITE_OK)
+        return ret;
+
+    ret = sqlite3_step(stmt);
+    if(ret == SQLITE_ROW){
+        *version = sqlite3_column_int64(stmt, 0);
+        ret = SQLITE_OK;
+    }
+    sqlite3_finalize(stmt);
+    return ret;
+}
+
+char *changes_since(struct db_statements *statements, struct item_cache *cache, const char *request){
+    long long since = 0;
+    int end = -1;
+    if(sscanf(request, "GET SINCE %lld%n", &since, &end) != 1 || end < 0 || request[end] != '\0' || since < 0)
+        return NULL;
+
+    // Read before the database, so nothing committed up to it can be missed below
+    sqlite3_int64 version = item_cache_version(cache);
+    if(version < 0)
+        return NULL;
+
+    char *result = NULL;
+    if(since == version){
+        if(asprintf(&result, "SUCCESS %lld\n%c", (long long)version, GROUP_SEPARATOR) < 0)
+            return NULL;
+        return result;
+    }
+    if(since > version){
+        if(asprintf(&result, "SUCCESS %lld ALL", (long long)version) < 0)
+            return NULL;
+        return result;
+    }
+
+    // One read transaction, so the items and tombstones agree with each other
+    sqlite3 *db = statements->db;
+    if(sqlite3_exec(db, "BEGIN", NULL, NULL, NULL) != SQLITE_OK)
+        return NULL;
+
+    sqlite3_stmt *stmt = db_statement_sql(statements, count_sql);
+    if(stmt == NULL){
+        sqlite3_exec(db, "ROLLBACK", NULL, NULL, NULL);
+        return NULL;
+    }
+    sqlite3_bind_int64(stmt, 1, since);
+    sqlite3_bind_int(stmt, 2, VERSIONS_MAX_CHANGES + 1);
+    long changes = sqlite3_step(stmt) == SQLITE_ROW ? sqlite3_column_int64(stmt, 0) : -1;
+    sqlite3_reset(stmt);
+
+    if(changes < 0 || changes > VERSIONS_MAX_CHANGES){
+        sqlite3_exec(db, "ROLLBACK", NULL, NULL, NULL);
+        if(changes < 0 || asprintf(&result, "SUCCESS %lld ALL", (long long)version) < 0)
+            return NULL;
+        return result;
+    }
+
+    size_t length = 0;
+    FILE *out = open_memstream(&result, &length);
+    if(out == NULL){
+        sqlite3_exec(db, "ROLLBACK", NULL, NULL, NULL);
+        return NULL;
+    }
+    fprintf(out, "SUCCESS %lld\n", (long long)version);
+
+    int ret = SQLITE_ERROR;
+    stmt = db_statement_sql(statements, items_sql);
+    if(stmt != NULL){
+        sqlite3_bind_int64(stmt, 1, since);
+        while((ret = sqlite3_step(stmt)) == SQLITE_ROW){
+            fputs("PUT ", out);
+            print_item_row(out, stmt);
+            fputc(RECORD_SEPARATOR, out);
+        }
+        sqlite3_reset(stmt);
+    }
+
+    stmt = ret == SQLITE_DONE ? db_statement_sql(statements, tombstones_sql) : NULL;
+    ret = SQLITE_ERROR;
+    if(stmt != NULL){
+        sqlite3_bind_int64(stmt, 1, since);
+        while((ret = sqlite3_step(stmt)) == SQLITE_ROW)
+            fprintf(out, "DEL %d%c", sqlite3_column_int(stmt, 0), RECORD_SEPARATOR);
+        sqlite3_reset(stmt);
+    }
+    if(ret != SQLITE_DONE)
+        fprintf(stderr, "Database: Could not read changes since %lld: %s\n", since, sqlite3_errmsg(db));
+    sqlite3_exec(db, "ROLLBACK", NULL, NULL, NULL);
+    fputc(GROUP_SEPARATOR, out);
+
+    if(fclose(out) != 0 || ret != SQLITE_DONE){
+        free(result);
+        return NULL;
+    }
+    return result;
+}
+
+static int run_sql(sqlite3 *db, const char *sql){
+    char *error = NULL;
+    if(sqlite3_exec(db, sql, NULL, NULL, &error) != SQLITE_OK){
+        fprintf(stderr, "Database: \"%s\" failed: %s\n", sql, error);
+        sqlite3_free(error);
+        return -1;
+    }
+    return 0;
+}
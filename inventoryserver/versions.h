@@ -0,0 +1,57 @@
+#ifndef CS469_PROJECT_VERSIONS_H
+#define CS469_PROJECT_VERSIONS_H
+
+#include <sqlite3.h>
+
+#include "cache.h"
+#include "statements.h"
+
+#define VERSIONS_MAX_CHANGES (50 * 1000)   // Past this GET SINCE asks for a full reload instead
+
+/**
+ * Adds what versioning needs to an existing database: the version column of
+ * the items table, the tombstones table and indexes on both versions. Rows
+ * that predate versioning are at version 1. Must run before any connection
+ * prepares its statements, since they refer to the new column.
+ *
+ * @param database Path to the database file
+ * @return 0 on success, -1 on error
+ */
+int versions_migrate(const char *database);
+
+/**
+ * Reads the version of the latest committed change, over items and tombstones.
+ *
+ * @param db
+ * @param version Receives the version
+ * @return SQLITE_OK, or an SQLite error code
+ */
+int versions_latest(sqlite3 *db, sqlite3_int64 *version);
+
+/**
+ * Answers a GET SINCE request:
+ *
+ *   GET SINCE <version>
+ *
+ * with every change committed after that version, and the version to ask
+ * from next time:
+ *
+ *   SUCCESS <version>\nPUT <item><RS>DEL <id><RS>...<GS>
+ *
+ * The records are those of WATCH events, with the item in the GET ALL format.
+ * An item changed several times is only sent once, as it is now. If nothing
+ * changed the answer has no records and the database isn't read. If more than
+ * VERSIONS_MAX_CHANGES changed, or the version is one this database never
+ * had, the client should reload with GET ALL and continue from the version
+ * given:
+ *
+ *   SUCCESS <version> ALL
+ *
+ * @param statements
+ * @param cache Holds the version of the latest committed change
+ * @param request The GET SINCE request
+ * @return The response to be freed by the caller, or NULL if the request is invalid or failed
+ */
+char *changes_since(struct db_statements *statements, struct item_cache *cache, const char *request);
+
+#endif //CS469_PROJECT_VERSIONS_H
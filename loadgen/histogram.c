@@ -0,0 +1,31 @@
+//
+// Latency histograms of the load generator, see histogram.h. The bucket
+// math is shared with the server's metrics in buckets.c.
+//
+
+#include "histogram.h"
+
+void histogram_record(struct histogram *histogram, uint64_t value){
+    histogram->buckets[bucket_index(value)]++;
+    histogram->count++;
+    histogram->sum += value;
+    if(value > histogram->max)
+        histogram->max = value;
+}
+
+void histogram_merge(struct histogram *into, const struct histogram *from){
+    for(int i = 0; i < BUCKET_COUNT; i++)
+        into->buckets[i] += from->buckets[i];
+    into->count += from->count;
+    into->sum += from->sum;
+    if(from->max > into->max)
+        into->max = from->max;
+}
+
+uint64_t histogram_percentile(const struct histogram *histogram, double quantile){
+    return bucket_percentile(histogram->buckets, histogram->count, histogram->max, quantile);
+}
+
+double histogram_mean(const struct histogram *histogram){
+    return histogram->count > 0 ? (double)histogram->sum / (double)histogram->count : 0;
+}
@@ -0,0 +1,54 @@
+#ifndef CS469_PROJECT_HISTOGRAM_H
+#define CS469_PROJECT_HISTOGRAM_H
+
+#include <stdint.h>
+
+#include "../buckets.h"
+
+/**
+ * Latency histograms of the load generator, with the same buckets as the
+ * server's metrics (see buckets.h), so a value is kept within 1/16 of its size.
+ * Each worker thread fills its own, and they are merged once the run is over.
+ */
+
+struct histogram {
+    uint64_t buckets[BUCKET_COUNT];
+    uint64_t count;
+    uint64_t sum;       // us
+    uint64_t max;       // us
+};
+
+/**
+ * Adds a value to a histogram.
+ *
+ * @param histogram
+ * @param value us
+ */
+void histogram_record(struct histogram *histogram, uint64_t value);
+
+/**
+ * Adds every value of one histogram to another.
+ *
+ * @param into
+ * @param from
+ */
+void histogram_merge(struct histogram *into, const struct histogram *from);
+
+/**
+ * The value below which a share of the values fall, to the resolution of the buckets.
+ *
+ * @param histogram
+ * @param quantile Between 0 and 1
+ * @return us, 0 if the histogram is empty
+ */
+uint64_t histogram_percentile(const struct histogram *histogram, double quantile);
+
+/**
+ * The mean of the values.
+ *
+ * @param histogram
+ * @return us, 0 if the histogram is empty
+ */
+double histogram_mean(const struct histogram *histogram);
+
+#endif //CS469_PROJECT_HISTOGRAM_H
@@ -0,0 +1,818 @@
+//
+// Load generator for the inventory server, see loadgen.h. Reads its
+// arguments, learns which items the server has, runs the worker threads and
+// reports what they measured as text, and as JSON for scripts comparing runs.
+//
+
+#define _GNU_SOURCE
+#include <argp.h>
+#include <errno.h>
+#include <netdb.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include <openssl/err.h>
+
+#include "../globals.h"
+#include "../protocol.h"
+#include "../tls.h"
+#include "loadgen.h"
+
+#define DEFAULT_CONNECTIONS  16
+#define DEFAULT_THREADS      2
+#define DEFAULT_DURATION     10
+#define DEFAULT_WARMUP       1
+#define DEFAULT_MIX          "get_all=1,get=80,put=7,mod=5,del=7"
+
+static const char *op_names[LOAD_OP_COUNT] = {"get_all", "get", "put", "mod", "del"};
+
+struct Arguments {
+    struct load_options load;
+    char *filename;
+    char *json;
+    struct tls_options tls;
+};
+
+static error_t parse_args(int key, char *arg, struct argp_state *state);
+int parse_conf_file(void *args);
+static int parse_number(const char *value, double min, double max, double *result);
+static int parse_mix(struct load_options *options, const char *mix);
+static int parse_users(struct load_options *options, const char *users);
+static int parse_login(struct load_options *options, const char *login);
+static int probe_server(const struct load_options *options, int **items, size_t *count);
+static int write_all(SSL *ssl, const void *buf, size_t len);
+static int read_exact(SSL *ssl, void *buf, size_t len);
+static char *exchange(SSL *ssl, const char *payload, uint32_t request_id, int *version);
+static void report_text(FILE *out, const struct load_options *options, const struct load_stats *stats);
+static void report_json(FILE *out, const struct load_options *options, const struct load_stats *stats);
+static void report_row(FILE *out, const char *name, const struct histogram *histogram, uint64_t failures, double duration);
+static void json_histogram(FILE *out, const char *name, const struct histogram *histogram, uint64_t failures,
+                           double duration, int last);
+
+static struct argp_option options[] = {
+        {"server", 's', "<server>", 0, "Server to load. Default: localhost"},
+        {"port", 'p', "<port>", 0, "Port of the server. Default: 4466"},
+        {"config", 'c', "<filename>", 0, "A config file that can be used in lieu of CLI arguments. This will override all CLI arguments."},
+        {"connections", 'n', "<n>", 0, "Concurrent connections. Default: 16"},
+        {"threads", 't', "<n>", 0, "Worker threads sharing the connections. Default: 2"},
+        {"rate", 'r', "<n>", 0, "Requests per second, paced open loop, or connections per second in handshake mode. 0 sends closed loop, a request as soon as one is answered. Default: 0"},
+        {"duration", 'd', "<s>", 0, "Seconds of load measured. Default: 10"},
+        {"warmup", 'w', "<s>", 0, "Seconds of load before anything is measured. Default: 1"},
+        {"pipeline", 'P', "<n>", 0, "Requests in flight per connection at most, up to 64. Default: 1"},
+        {"mix", 'x', "<op=weight,...>", 0, "Weights of get_all, get, put, mod and del. Default: " DEFAULT_MIX},
+        {"users", 'u', "<user:password,...>", 0, "Users the connections log in as, in turn."},
+        {"handshakes", 'H', 0, 0, "Every request is a new connection: connect, handshake, log in and hang up."},
+        {"no-resume", 'R', 0, 0, "Never resume a TLS session, every handshake is a full one."},
+        {"login", 'L', "<auth|resume>", 0, "How a connection logs in again in handshake mode, with its password or its token. Default: auth"},
+        {"json", 'j', "<filename>", 0, "Also write the results as JSON, - for stdout."},
+        {0}
+};
+
+struct argp argp = { options, parse_args, 0, "A program to load test the inventory server and measure its latency."};
+
+/**
+ * Main load generator method.
+ * * Reads arguments and config file
+ * * Learns the items on the server
+ * * Runs the worker threads and reports what they measured
+ */
+int main(int argc, char *argv[]){
+    struct Arguments arguments = {0};
+    struct load_options *load = &arguments.load;
+    int *items = NULL;
+    size_t item_count = 0;
+    _Atomic int failed = 0;
+    pthread_barrier_t start;
+
+    load->server = DEFAULT_SERVER;
+    load->port = DEFAULT_SERVER_PORT;
+    load->connections = DEFAULT_CONNECTIONS;
+    load->threads = DEFAULT_THREADS;
+    load->duration = DEFAULT_DURATION;
+    load->warmup = DEFAULT_WARMUP;
+    load->pipeline = 1;
+    load->resume_sessions = 1;
+    load->login = LOGIN_AUTH;
+    parse_mix(load, DEFAULT_MIX);
+
+    argp_parse(&argp, argc, argv, 0, 0, &arguments);
+    if(arguments.filename != NULL && parse_conf_file(&arguments) != 0)
+        return 1;
+
+    if(load->user_count == 0){
+        fprintf(stderr, "Load generator: No users to log in as, give some with -u or USERS\n");
+        return 1;
+    }
+    if(load->threads > load->connections)
+        load->threads = load->connections;
+
+    // The server may hang up on a connection we are writing to
+    signal(SIGPIPE, SIG_IGN);
+
+    SSL_library_init();
+    load->ssl_ctx = SSL_CTX_new(TLS_client_method());
+    if(load->ssl_ctx == NULL || tls_configure(load->ssl_ctx, &arguments.tls) != 0){
+        fprintf(stderr, "Load generator: Could not set up TLS\n");
+        return 1;
+    }
+    // Output grows and moves while a write waits for the socket
+    SSL_CTX_set_mode(load->ssl_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    if(load->resume_sessions)
+        tls_enable_client_sessions(load->ssl_ctx);
+
+    // GET needs ids that exist, or it only measures FAILURE
+    int want_items = !load->handshakes && load->mix[LOAD_OP_GET] > 0;
+    if(probe_server(load, want_items ? &items : NULL, &item_count) != 0){
+        fprintf(stderr, "Load generator: Could not use %s:%d\n", load->server, load->port);
+        return 1;
+    }
+    load->items = items;
+    load->item_count = item_count;
+
+    printf("Load generator: %d connections on %d threads to %s:%d, ", load->connections, load->threads,
+           load->server, load->port);
+    if(load->rate > 0)
+        printf("open loop at %g %s/s", load->rate, load->handshakes ? "connections" : "requests");
+    else
+        printf("closed loop");
+    if(load->handshakes)
+        printf(", %s handshakes, logging in with %s\n", load->resume_sessions ? "resumed" : "full",
+               load->login == LOGIN_RESUME ? "tokens" : "passwords");
+    else
+        printf(", pipeline %d, %zu items\n", load->pipeline, item_count);
+    printf("Measuring %g s after %g s of warmup...\n", load->duration, load->warmup);
+    fflush(stdout);
+
+    struct load_worker *workers = calloc(load->threads, sizeof(struct load_worker));
+    pthread_t *threads = calloc(load->threads, sizeof(pthread_t));
+    if(workers == NULL || threads == NULL || pthread_barrier_init(&start, NULL, load->threads) != 0){
+        fprintf(stderr, "Load generator: Out of memory\n");
+        return 1;
+    }
+
+    int first = 0;
+    for(int i = 0; i < load->threads; i++){
+        workers[i].id = i;
+        workers[i].options = load;
+        workers[i].start = &start;
+        workers[i].failed = &failed;
+        workers[i].first_connection = first;
+        workers[i].connection_count = load->connections / load->threads + (i < load->connections % load->threads);
+        first += workers[i].connection_count;
+        if(pthread_create(&threads[i], NULL, load_worker_run, &workers[i]) != 0){
+            fprintf(stderr, "Load generator: Could not start worker %d\n", i);
+            return 1;
+        }
+    }
+
+    struct load_stats total = {0};
+    for(int i = 0; i < load->threads; i++){
+        pthread_join(threads[i], NULL);
+
+        struct load_stats *stats = &workers[i].stats;
+        for(int op = 0; op < LOAD_OP_COUNT; op++){
+            histogram_merge(&total.latency[op], &stats->latency[op]);
+            total.failures[op] += stats->failures[op];
+        }
+        histogram_merge(&total.connect, &stats->connect);
+        histogram_merge(&total.handshake, &stats->handshake);
+        histogram_merge(&total.login, &stats->login);
+        total.completed += stats->completed;
+        total.resumed += stats->resumed;
+        total.login_failures += stats->login_failures;
+        total.errors += stats->errors;
+        total.lost += stats->lost;
+        total.unanswered += stats->unanswered;
+        total.behind += stats->behind;
+        total.bytes_in += stats->bytes_in;
+        total.bytes_out += stats->bytes_out;
+    }
+
+    if(atomic_load(&failed)){
+        fprintf(stderr, "Load generator: Gave up, not every connection could log in\n");
+        return 1;
+    }
+
+    report_text(stdout, load, &total);
+    if(arguments.json != NULL){
+        FILE *out = strcmp(arguments.json, "-") == 0 ? stdout : fopen(arguments.json, "w");
+        if(out == NULL){
+            fprintf(stderr, "Load generator: Could not write %s: %s\n", arguments.json, strerror(errno));
+            return 1;
+        }
+        report_json(out, load, &total);
+        if(out != stdout)
+            fclose(out);
+    }
+
+    pthread_barrier_destroy(&start);
+    SSL_CTX_free(load->ssl_ctx);
+    free(items);
+    free(workers);
+    free(threads);
+    for(int i = 0; i < load->user_count; i++){
+        free(load->users[i].name);
+        free(load->users[i].password);
+    }
+    return 0;
+}
+
+/**
+ * Parses command line arguments into their respective fields
+ * @param key The key of the arg to parse
+ * @param arg The argument data
+ * @param state
+ * @return
+ */
+static error_t parse_args(int key, char *arg, struct argp_state *state){
+    struct Arguments *arguments = state->input;
+    struct load_options *load = &arguments->load;
+    double value = 0;
+
+    switch(key){
+        case 's':
+            load->server = arg;
+            break;
+        case 'p':
+            if(parse_number(arg, 1, 65535, &value) != 0)
+                argp_error(state, "Invalid port %s", arg);
+            load->port = (int)value;
+            break;
+        case 'c':
+            arguments->filename = arg;
+            break;
+        case 'n':
+            if(parse_number(arg, 1, 1000000, &value) != 0)
+                argp_error(state, "Invalid connection count %s", arg);
+            load->connections = (int)value;
+            break;
+        case 't':
+            if(parse_number(arg, 1, 1024, &value) != 0)
+                argp_error(state, "Invalid thread count %s", arg);
+            load->threads = (int)value;
+            break;
+        case 'r':
+            if(parse_number(arg, 0, 1e9, &load->rate) != 0)
+                argp_error(state, "Invalid rate %s", arg);
+            break;
+        case 'd':
+            if(parse_number(arg, 0.001, 1e6, &load->duration) != 0)
+                argp_error(state, "Invalid duration %s", arg);
+            break;
+        case 'w':
+            if(parse_number(arg, 0, 1e6, &load->warmup) != 0)
+                argp_error(state, "Invalid warmup %s", arg);
+            break;
+        case 'P':
+            if(parse_number(arg, 1, LOAD_MAX_PIPELINE, &value) != 0)
+                argp_error(state, "Invalid pipeline depth %s, at most %d", arg, LOAD_MAX_PIPELINE);
+            load->pipeline = (int)value;
+            break;
+        case 'x':
+            if(parse_mix(load, arg) != 0)
+                argp_error(state, "Invalid mix %s", arg);
+            break;
+        case 'u':
+            if(parse_users(load, arg) != 0)
+                argp_error(state, "Invalid users %s", arg);
+            break;
+        case 'H':
+            load->handshakes = 1;
+            break;
+        case 'R':
+            load->resume_sessions = 0;
+            break;
+        case 'L':
+            if(parse_login(load, arg) != 0)
+                argp_error(state, "Invalid login %s, auth or resume", arg);
+            break;
+        case 'j':
+            arguments->json = arg;
+            break;
+        default:
+            return ARGP_ERR_UNKNOWN;
+    }
+
+    return 0;
+}
+
+/**
+ * Parses a config file, one FIELD=value per line: SERVER, PORT, CONNECTIONS,
+ * THREADS, RATE, DURATION, WARMUP, PIPELINE, MIX, USERS, HANDSHAKES,
+ * RESUME_SESSIONS, LOGIN, JSON and the TLS fields
+ * @param args struct Arguments
+ * @return 0 on success, -1 on error
+ */
+int parse_conf_file(void *args){
+    struct Arguments *arguments = (struct Arguments *)args;
+    struct load_options *load = &arguments->load;
+    char field[BUFFER_SIZE];
+    char value[4 * BUFFER_SIZE];
+    double number = 0;
+    int r = 0;
+
+    FILE *file = fopen(arguments->filename, "r");
+    if(file == NULL){
+        fprintf(stderr, "Error opening config file: %s\n", strerror(errno));
+        return -1;
+    }
+
+    while(r == 0 && fscanf(file, "%127[^=]=%1023[^\n]%*c", field, value) == 2){
+        if(strcmp(field, "SERVER") == 0){
+            load->server = strdup(value);
+        }
+
+        if(strcmp(field, "PORT") == 0){
+            r = parse_number(value, 1, 65535, &number);
+            load->port = (int)number;
+        }
+
+        if(strcmp(field, "CONNECTIONS") == 0){
+            r = parse_number(value, 1, 1000000, &number);
+            load->connections = (int)number;
+        }
+
+        if(strcmp(field, "THREADS") == 0){
+            r = parse_number(value, 1, 1024, &number);
+            load->threads = (int)number;
+        }
+
+        if(strcmp(field, "RATE") == 0){
+            r = parse_number(value, 0, 1e9, &load->rate);
+        }
+
+        if(strcmp(field, "DURATION") == 0){
+            r = parse_number(value, 0.001, 1e6, &load->duration);
+        }
+
+        if(strcmp(field, "WARMUP") == 0){
+            r = parse_number(value, 0, 1e6, &load->warmup);
+        }
+
+        if(strcmp(field, "PIPELINE") == 0){
+            r = parse_number(value, 1, LOAD_MAX_PIPELINE, &number);
+            load->pipeline = (int)number;
+        }
+
+        if(strcmp(field, "MIX") == 0){
+            r = parse_mix(load, value);
+        }
+
+        if(strcmp(field, "USERS") == 0){
+            r = parse_users(load, value);
+        }
+
+        if(strcmp(field, "HANDSHAKES") == 0){
+            r = parse_number(value, 0, 1, &number);
+            load->handshakes = (int)number;
+        }
+
+        if(strcmp(field, "RESUME_SESSIONS") == 0){
+            r = parse_number(value, 0, 1, &number);
+            load->resume_sessions = (int)number;
+        }
+
+        if(strcmp(field, "LOGIN") == 0){
+            r = parse_login(load, value);
+        }
+
+        if(strcmp(field, "JSON") == 0){
+            arguments->json = strdup(value);
+        }
+
+        // TLS_CIPHERS, TLS_CIPHERSUITES and TLS_GROUPS
+        tls_parse_option(&arguments->tls, field, value);
+
+        if(r != 0)
+            fprintf(stderr, "Error interpreting %s: %s\n", field, value);
+        bzero(field, sizeof(field));
+        bzero(value, sizeof(value));
+    }
+
+    fclose(file);
+    return r;
+}
+
+/**
+ * Parses a number within bounds.
+ * @param value
+ * @param min
+ * @param max
+ * @param result
+ * @return 0 on success, -1 if value isn't a number between min and max
+ */
+static int parse_number(const char *value, double min, double max, double *result){
+    char *stop = NULL;
+    double number = strtod(value, &stop);
+    if(stop == value || *stop != '\0' || number < min || number > max)
+        return -1;
+    *result = number;
+    return 0;
+}
+
+/**
+ * Parses the weights of the request types, such as get=90,put=10. Types left
+ * out get no requests.
+ * @param options
+ * @param mix
+ * @return 0 on success, -1 on error
+ */
+static int parse_mix(struct load_options *options, const char *mix){
+    unsigned int weights[LOAD_OP_COUNT] = {0};
+    unsigned int total = 0;
+    char *copy = strdup(mix);
+    char *saveptr = NULL;
+    int r = 0;
+
+    for(char *entry = strtok_r(copy, ",", &saveptr); entry != NULL && r == 0; entry = strtok_r(NULL, ",", &saveptr)){
+        char *weight = strchr(entry, '=');
+        double number;
+        int op;
+
+        r = -1;
+        if(weight == NULL)
+            break;
+        *weight++ = '\0';
+        for(op = 0; op < LOAD_OP_COUNT; op++)
+            if(strcmp(entry, op_names[op]) == 0)
+                break;
+        if(op == LOAD_OP_COUNT || parse_number(weight, 0, 1000000, &number) != 0)
+            break;
+
+        weights[op] = (unsigned int)number;
+        total += weights[op];
+        r = 0;
+    }
+    free(copy);
+
+    if(r != 0 || total == 0)
+        return -1;
+    memcpy(options->mix, weights, sizeof(weights));
+    return 0;
+}
+
+/**
+ * Parses the users to log in as, such as alice:secret,bob:hunter2.
+ * @param options
+ * @param users
+ * @return 0 on success, -1 on error
+ */
+static int parse_users(struct load_options *options, const char *users){
+    char *copy = strdup(users);
+    char *saveptr = NULL;
+    int count = 0;
+
+    for(char *entry = strtok_r(copy, ",", &saveptr); entry != NULL; entry = strtok_r(NULL, ",", &saveptr)){
+        char *password = strchr(entry, ':');
+        if(password == NULL || password == entry || count == LOAD_MAX_USERS){
+            free(copy);
+            return -1;
+        }
+        *password++ = '\0';
+        options->users[count].name = strdup(entry);
+        options->users[count].password = strdup(password);
+        count++;
+    }
+    free(copy);
+
+    if(count == 0)
+        return -1;
+    options->user_count = count;
+    return 0;
+}
+
+/**
+ * Parses how connections log in again.
+ * @param options
+ * @param login auth or resume
+ * @return 0 on success, -1 on error
+ */
+static int parse_login(struct load_options *options, const char *login){
+    if(strcmp(login, "auth") == 0)
+        options->login = LOGIN_AUTH;
+    else if(strcmp(login, "resume") == 0)
+        options->login = LOGIN_RESUME;
+    else
+        return -1;
+    return 0;
+}
+
+/**
+ * Logs in as the first user, so a server that is down or a wrong password
+ * show before the load starts, and reads the ids of every item with GET ALL,
+ * for GET to ask for.
+ * @param options
+ * @param items Receives the ids, to be freed by the caller, NULL if they aren't needed
+ * @param count Receives the number of ids
+ * @return 0 on success, -1 on error
+ */
+static int probe_server(const struct load_options *options, int **items, size_t *count){
+    struct addrinfo hints = {0};
+    struct addrinfo *address;
+    char port[16];
+    int version = PROTOCOL_VERSION;
+    int r = -1;
+
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(port, sizeof(port), "%d", options->port);
+    if(getaddrinfo(options->server, port, &hints, &address) != 0)
+        return -1;
+
+    int sockfd = socket(address->ai_family, SOCK_STREAM, 0);
+    if(sockfd < 0 || connect(sockfd, address->ai_addr, address->ai_addrlen) < 0){
+        fprintf(stderr, "Load generator: Could not connect: %s\n", strerror(errno));
+        freeaddrinfo(address);
+        if(sockfd >= 0)
+            close(sockfd);
+        return -1;
+    }
+    freeaddrinfo(address);
+    int nodelay = 1;
+    setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+    SSL *ssl = SSL_new(options->ssl_ctx);
+    char *login = NULL;
+    char *all = NULL;
+    if(ssl == NULL || SSL_set_fd(ssl, sockfd) != 1 || SSL_connect(ssl) != 1){
+        ERR_print_errors_fp(stderr);
+        goto done;
+    }
+
+    if(asprintf(&login, "AUTH %s %s", options->users[0].name, options->users[0].password) < 0)
+        goto done;
+    char *answer = exchange(ssl, login, 1, &version);
+    if(answer == NULL || strncmp(answer, "SUCCESS", 7) != 0){
+        fprintf(stderr, "Load generator: %s could not log in\n", options->users[0].name);
+        free(answer);
+        goto done;
+    }
+    free(answer);
+    if(items == NULL){
+        r = 0;
+        goto done;
+    }
+
+    all = exchange(ssl, "GET ALL", 2, &version);
+    if(all == NULL || strncmp(all, "SUCCESS", 7) != 0 || all[7] == '\0')
+        goto done;
+
+    // The items follow SUCCESS and a separator, separated by RECORD_SEPARATOR, each starts with its id
+    size_t size = 1024;
+    *count = 0;
+    *items = malloc(size * sizeof(int));
+    char separators[] = {RECORD_SEPARATOR, GROUP_SEPARATOR, '\0'};
+    char *saveptr = NULL;
+    for(char *item = strtok_r(all + 8, separators, &saveptr); item != NULL && *items != NULL;
+        item = strtok_r(NULL, separators, &saveptr)){
+        char *stop;
+        long id = strtol(item, &stop, 10);
+        if(stop == item || *stop != '\n')
+            continue;
+        if(*count == size){
+            size *= 2;
+            int *grown = realloc(*items, size * sizeof(int));
+            if(grown == NULL){
+                free(*items);
+                *items = NULL;
+                break;
+            }
+            *items = grown;
+        }
+        (*items)[(*count)++] = (int)id;
+    }
+    if(*items != NULL)
+        r = 0;
+
+done:
+    free(login);
+    free(all);
+    if(ssl != NULL){
+        SSL_shutdown(ssl);
+        SSL_free(ssl);
+    }
+    close(sockfd);
+    return r;
+}
+
+/**
+ * Writes a whole buffer, over as many records as it takes.
+ * @param ssl
+ * @param buf
+ * @param len
+ * @return 0 on success, -1 on error
+ */
+static int write_all(SSL *ssl, const void *buf, size_t len){
+    size_t total = 0;
+    while(total < len){
+        int wcount = SSL_write(ssl, (const char*)buf + total, (int)(len - total));
+        if(wcount <= 0)
+            return -1;
+        total += wcount;
+    }
+    return 0;
+}
+
+/**
+ * Reads exactly len bytes from the connection
+ * @param ssl
+ * @param buf
+ * @param len
+ * @return 0 on success, -1 on error or disconnect
+ */
+static int read_exact(SSL *ssl, void *buf, size_t len){
+    size_t total = 0;
+    while(total < len){
+        int rcount = SSL_read(ssl, (char*)buf + total, (int)(len - total));
+        if(rcount <= 0)
+            return -1;
+        total += rcount;
+    }
+    return 0;
+}
+
+/**
+ * Sends a request and reads its whole response, joining a streamed one back
+ * together.
+ * @param ssl
+ * @param payload
+ * @param request_id
+ * @param version Version to send with, receives the one the server answers with
+ * @return The NUL terminated response, to be freed by the caller, or NULL on error
+ */
+static char *exchange(SSL *ssl, const char *payload, uint32_t request_id, int *version){
+    unsigned char header[FRAME_HEADER_SIZE];
+    size_t length = strlen(payload);
+    size_t header_length = pack_frame_header(header, (uint8_t)*version, 0, (uint32_t)length, request_id);
+    if(write_all(ssl, header, header_length) != 0 || write_all(ssl, payload, length) != 0)
+        return NULL;
+
+    char *response = NULL;
+    size_t total = 0;
+    while(1){
+        FrameHeader frame;
+        // The version byte decides how long the rest of the header is
+        if(read_exact(ssl, header, FRAME_HEADER_SIZE_V1) != 0)
+            break;
+        int r = unpack_frame_header(header, FRAME_HEADER_SIZE_V1, &frame);
+        if(r == 0){
+            size_t full = frame_header_size(header[1]);
+            if(read_exact(ssl, header + FRAME_HEADER_SIZE_V1, full - FRAME_HEADER_SIZE_V1) != 0)
+                break;
+            r = unpack_frame_header(header, full, &frame);
+        }
+        if(r <= 0)
+            break;
+
+        char *grown = realloc(response, total + frame.length + 1);
+        if(grown == NULL)
+            break;
+        response = grown;
+        if(read_exact(ssl, response + total, frame.length) != 0)
+            break;
+        if(frame.flags & FRAME_FLAG_EVENT)
+            continue;
+        total += frame.length;
+        response[total] = '\0';
+
+        if(frame.version < 2 || !(frame.flags & FRAME_FLAG_MORE)){
+            *version = frame.version;
+            return response;
+        }
+    }
+
+    free(response);
+    return NULL;
+}
+
+/**
+ * Writes the results for people.
+ * @param out
+ * @param options
+ * @param stats
+ */
+static void report_text(FILE *out, const struct load_options *options, const struct load_stats *stats){
+    struct histogram total = {0};
+    uint64_t failures = 0;
+
+    fprintf(out, "\n%-10s %10s %10s %8s %9s %9s %9s %9s %9s %9s\n",
+            "", "count", "per s", "failed", "mean", "p50", "p90", "p99", "p999", "max");
+    if(options->handshakes){
+        report_row(out, "connect", &stats->connect, stats->login_failures, options->duration);
+    } else {
+        for(int op = 0; op < LOAD_OP_COUNT; op++){
+            if(options->mix[op] == 0 && stats->latency[op].count == 0)
+                continue;
+            report_row(out, op_names[op], &stats->latency[op], stats->failures[op], options->duration);
+            histogram_merge(&total, &stats->latency[op]);
+            failures += stats->failures[op];
+        }
+        report_row(out, "total", &total, failures, options->duration);
+    }
+    report_row(out, "handshake", &stats->handshake, 0, options->duration);
+    report_row(out, "login", &stats->login, stats->login_failures, options->duration);
+
+    fprintf(out, "\nLatencies in us, %s\n", options->rate > 0 ? "from when each request was due"
+                                                            : "from when each request was sent");
+    if(options->handshakes)
+        fprintf(out, "connect is a whole connection, handshake and login included\n");
+    // Behind an open loop schedule, the answers are to requests due earlier than the ones counted above
+    fprintf(out, "Throughput %.1f %s/s answered", stats->completed / options->duration,
+            options->handshakes ? "connections" : "requests");
+    if(options->rate > 0)
+        fprintf(out, ", %g due", options->rate);
+    fprintf(out, "\n");
+    fprintf(out, "%llu of %llu handshakes resumed a TLS session\n",
+            (unsigned long long)stats->resumed, (unsigned long long)stats->handshake.count);
+    fprintf(out, "Connection errors %llu, requests lost %llu, unanswered %llu, never sent %llu\n",
+            (unsigned long long)stats->errors, (unsigned long long)stats->lost,
+            (unsigned long long)stats->unanswered, (unsigned long long)stats->behind);
+    fprintf(out, "Read %.1f MB, wrote %.1f MB\n", stats->bytes_in / 1e6, stats->bytes_out / 1e6);
+}
+
+/**
+ * Writes a histogram as a line of the text report.
+ * @param out
+ * @param name
+ * @param histogram
+ * @param failures
+ * @param duration s
+ */
+static void report_row(FILE *out, const char *name, const struct histogram *histogram, uint64_t failures, double duration){
+    fprintf(out, "%-10s %10llu %10.1f %8llu %9.0f %9llu %9llu %9llu %9llu %9llu\n", name,
+            (unsigned long long)histogram->count, histogram->count / duration, (unsigned long long)failures,
+            histogram_mean(histogram),
+            (unsigned long long)histogram_percentile(histogram, 0.5),
+            (unsigned long long)histogram_percentile(histogram, 0.9),
+            (unsigned long long)histogram_percentile(histogram, 0.99),
+            (unsigned long long)histogram_percentile(histogram, 0.999),
+            (unsigned long long)histogram->max);
+}
+
+/**
+ * Writes the results for scripts.
+ * @param out
+ * @param options
+ * @param stats
+ */
+static void report_json(FILE *out, const struct load_options *options, const struct load_stats *stats){
+    struct histogram total = {0};
+    uint64_t failures = 0;
+
+    fprintf(out, "{\n  \"server\": \"%s:%d\",\n  \"connections\": %d,\n  \"threads\": %d,\n  \"rate\": %g,\n"
+                 "  \"duration\": %g,\n  \"warmup\": %g,\n  \"pipeline\": %d,\n  \"handshakes\": %s,\n"
+                 "  \"resume_sessions\": %s,\n  \"mix\": {",
+            options->server, options->port, options->connections, options->threads, options->rate,
+            options->duration, options->warmup, options->pipeline, options->handshakes ? "true" : "false",
+            options->resume_sessions ? "true" : "false");
+    for(int op = 0; op < LOAD_OP_COUNT; op++)
+        fprintf(out, "%s\"%s\": %u", op > 0 ? ", " : "", op_names[op], options->mix[op]);
+    fprintf(out, "},\n  \"requests\": {\n");
+
+    for(int op = 0; op < LOAD_OP_COUNT; op++){
+        json_histogram(out, op_names[op], &stats->latency[op], stats->failures[op], options->duration, 0);
+        histogram_merge(&total, &stats->latency[op]);
+        failures += stats->failures[op];
+    }
+    json_histogram(out, "total", &total, failures, options->duration, 1);
+    fprintf(out, "  },\n");
+
+    json_histogram(out, "connect", &stats->connect, options->handshakes ? stats->login_failures : 0,
+                   options->duration, 0);
+    json_histogram(out, "handshake", &stats->handshake, 0, options->duration, 0);
+    json_histogram(out, "login", &stats->login, stats->login_failures, options->duration, 0);
+    fprintf(out, "  \"throughput\": %.3f,\n", stats->completed / options->duration);
+    fprintf(out, "  \"resumed\": %llu,\n  \"errors\": %llu,\n  \"lost\": %llu,\n  \"unanswered\": %llu,\n"
+                 "  \"never_sent\": %llu,\n  \"bytes_in\": %llu,\n  \"bytes_out\": %llu\n}\n",
+            (unsigned long long)stats->resumed, (unsigned long long)stats->errors, (unsigned long long)stats->lost,
+            (unsigned long long)stats->unanswered, (unsigned long long)stats->behind,
+            (unsigned long long)stats->bytes_in, (unsigned long long)stats->bytes_out);
+}
+
+/**
+ * Writes a histogram as a JSON member.
+ * @param out
+ * @param name
+ * @param histogram
+ * @param failures
+ * @param duration s
+ * @param last Whether it is the last member of its object
+ */
+static void json_histogram(FILE *out, const char *name, const struct histogram *histogram, uint64_t failures,
+                           double duration, int last){
+    fprintf(out, "  \"%s\": {\"count\": %llu, \"per_second\": %.3f, \"failed\": %llu, \"mean_us\": %.1f, "
+                 "\"p50_us\": %llu, \"p90_us\": %llu, \"p99_us\": %llu, \"p999_us\": %llu, \"max_us\": %llu}%s\n",
+            name, (unsigned long long)histogram->count, histogram->count / duration, (unsigned long long)failures,
+            histogram_mean(histogram),
+            (unsigned long long)histogram_percentile(histogram, 0.5),
+            (unsigned long long)histogram_percentile(histogram, 0.9),
+            (unsigned long long)histogram_percentile(histogram, 0.99),
+            (unsigned long long)histogram_percentile(histogram, 0.999),
+            (unsigned long long)histogram->max, last ? "" : ",");
+}
@@ -0,0 +1,118 @@
+#ifndef CS469_PROJECT_LOADGEN_H
+#define CS469_PROJECT_LOADGEN_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include <openssl/ssl.h>
+
+#include "histogram.h"
+
+/**
+ * Load generator for the inventory server. Worker threads each drive a share
+ * of the connections from their own epoll loop, speaking the framed protocol
+ * over TLS like any other client.
+ *
+ * Requests are either paced open loop, at a fixed total rate no matter how
+ * fast the server answers, or sent closed loop, a new one as soon as one is
+ * answered. Open loop latencies are measured from the time a request was due
+ * rather than the time it went out, so a server falling behind shows in them
+ * instead of slowing the load down.
+ *
+ * In handshake mode every request is a whole connection instead: connect, TLS
+ * handshake, log in and hang up, to measure what logins cost the server.
+ */
+
+#define LOAD_OP_GET_ALL  0
+#define LOAD_OP_GET      1
+#define LOAD_OP_PUT      2
+#define LOAD_OP_MOD      3
+#define LOAD_OP_DEL      4
+#define LOAD_OP_COUNT    5
+
+#define LOAD_MAX_PIPELINE   64    // The server stops reading a connection with this many requests in flight
+#define LOAD_MAX_USERS      64
+#define LOAD_TOKEN_SIZE     128   // Longest RESUME token kept
+
+#define LOGIN_AUTH    0   // Log in with the password, hashed by the server every time
+#define LOGIN_RESUME  1   // Log in with the token of the connection's first AUTH
+
+struct load_user {
+    char *name;
+    char *password;
+};
+
+struct load_options {
+    char *server;
+    int port;
+    int connections;
+    int threads;
+    double rate;                // Requests, or connections in handshake mode, per second. 0 for closed loop
+    double duration;            // s
+    double warmup;              // s, before anything is counted
+    int pipeline;               // Requests in flight per connection at most
+    unsigned int mix[LOAD_OP_COUNT];    // Weight of each request type
+    struct load_user users[LOAD_MAX_USERS];
+    int user_count;
+    int handshakes;             // Handshake mode
+    int resume_sessions;        // Offer the last TLS session when connecting
+    int login;                  // LOGIN_*
+
+    // Filled in before the workers start
+    SSL_CTX *ssl_ctx;
+    const int *items;           // Ids of the items on the server when the run started
+    size_t item_count;
+};
+
+/**
+ * What a worker counted. Only requests due after the warmup are counted.
+ */
+struct load_stats {
+    struct histogram latency[LOAD_OP_COUNT];
+    uint64_t failures[LOAD_OP_COUNT];   // Answered with FAILURE
+    struct histogram connect;           // Handshake mode, connection due to logged in
+    struct histogram handshake;         // connect() to TLS handshake done
+    struct histogram login;             // AUTH or RESUME sent to answered
+    uint64_t completed;                 // Answered during the measured time, whenever they were due
+    uint64_t resumed;                   // Handshakes that resumed a TLS session
+    uint64_t login_failures;
+    uint64_t errors;                    // Connections that failed or were dropped
+    uint64_t lost;                      // Requests in flight on them
+    uint64_t unanswered;                // Still in flight when the run ended
+    uint64_t behind;                    // Due but not sent when the run ended, open loop only
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+};
+
+struct load_worker {
+    int id;
+    const struct load_options *options;
+    pthread_barrier_t *start;   // Passed once every worker's connections are logged in
+    int first_connection;
+    int connection_count;
+    _Atomic int *failed;        // Set when a connection can't log in, every worker then gives up
+    struct load_stats stats;
+};
+
+/**
+ * Monotonic clock, in nanoseconds.
+ */
+static inline uint64_t load_now(){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
+
+/**
+ * Worker thread. Connects and logs in its connections, waits on the start
+ * barrier for every other worker to do the same, then runs the load for the
+ * warmup and the duration.
+ *
+ * @param data struct load_worker
+ * @return NULL
+ */
+void *load_worker_run(void *data);
+
+#endif //CS469_PROJECT_LOADGEN_H
@@ -0,0 +1,968 @@
+//
+// Worker threads of the load generator, see loadgen.h. Every connection is
+// non-blocking, its TLS handshake and frames move along whenever epoll says
+// its socket is ready. Open loop requests are paced by a timerfd armed for
+// the next one due, and each goes to the next connection with room in its
+// pipeline, so a connection stuck behind a slow request doesn't hold the
+// schedule back. Only the start of a response is looked at, the rest of it is
+// read and dropped as it comes.
+//
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+
+#include <openssl/err.h>
+
+#include "../globals.h"
+#include "../protocol.h"
+#include "../tls.h"
+#include "loadgen.h"
+
+#define EVENTS_PER_WAIT   64
+#define INPUT_SIZE        (16 * 1024)
+#define RESPONSE_PREFIX   128         // Bytes of a response kept, enough for a login token or a new item's id
+#define DRAIN_TIMEOUT     2000000000ull   // ns the last requests are waited for once the run is over
+#define LOGIN_TIMEOUT     30000000000ull  // ns every connection has to log in before the run starts
+#define RECONNECT_DELAY   100000000ull    // ns between attempts to connect again after a failed one
+
+#define CONN_IDLE       0   // Waiting for its next turn in handshake mode, or to connect again
+#define CONN_HANDSHAKE  1
+#define CONN_LOGIN      2
+#define CONN_READY      3
+#define CONN_FAILED     4
+
+struct request {
+    uint32_t request_id;
+    int op;
+    uint64_t due;
+    int counted;            // Due after the warmup and before the end
+    int failed;
+    int answered;           // The first frame of the response came in
+};
+
+struct connection {
+    struct worker_state *worker;
+    int socketfd;
+    SSL *ssl;
+    int state;
+    int version;
+    int dropped;            // Was logged in, and has to be connected again
+    uint64_t retry_at;      // Not connected again before then
+    const struct load_user *user;
+    char token[LOAD_TOKEN_SIZE];
+
+    // The current connection in handshake mode
+    uint64_t due;
+    int counted;
+    uint64_t connect_started;
+    uint64_t login_started;
+
+    uint32_t next_request_id;
+    struct request requests[LOAD_MAX_PIPELINE];
+    int inflight;
+
+    // Frame being read
+    unsigned char input[INPUT_SIZE];
+    size_t input_length;
+    FrameHeader frame;
+    size_t skip;
+
+    char *output;
+    size_t output_length;
+    size_t output_size;
+    int dirty;
+
+    // Items created by this connection, the only ones it modifies and deletes
+    int *created;
+    size_t created_count;
+    size_t created_size;
+};
+
+struct worker_state {
+    struct load_worker *worker;
+    const struct load_options *options;
+    struct load_stats *stats;
+    struct sockaddr_storage address;
+    socklen_t address_length;
+    int epollfd;
+    int timerfd;
+    uint64_t armed;
+
+    struct connection *connections;
+    int count;
+    int cursor;
+    int logging_in;
+
+    uint64_t interval;      // ns between open loop requests of this worker, 0 for closed loop
+    uint64_t next_due;
+    uint64_t measure_from;
+    uint64_t end;
+    long outstanding;       // Counted requests not answered yet
+    unsigned int seed;
+    unsigned int mix_total;
+
+    struct connection **dirty;
+    int dirty_count;
+};
+
+static int resolve(struct worker_state *ws);
+static void start_connection(struct worker_state *ws, struct connection *c, uint64_t due);
+static void drive(struct worker_state *ws, struct connection *c);
+static void close_connection(struct connection *c);
+static void fail_connection(struct worker_state *ws, struct connection *c);
+static int read_input(struct worker_state *ws, struct connection *c);
+static int process_input(struct worker_state *ws, struct connection *c);
+static int handle_frame(struct worker_state *ws, struct connection *c, const FrameHeader *header,
+                        const char *payload, size_t length);
+static int handle_login(struct worker_state *ws, struct connection *c, const FrameHeader *header, const char *payload);
+static void handle_response(struct worker_state *ws, struct connection *c, const FrameHeader *header,
+                            const char *payload, size_t length);
+static int send_login(struct connection *c);
+static void send_request(struct worker_state *ws, struct connection *c, uint64_t due);
+static int queue_frame(struct connection *c, const char *payload, size_t length, uint32_t request_id);
+static int flush_output(struct worker_state *ws, struct connection *c);
+static void mark_dirty(struct worker_state *ws, struct connection *c);
+static void fill_pipeline(struct worker_state *ws, struct connection *c, uint64_t now);
+static void issue_due(struct worker_state *ws, uint64_t now);
+static struct connection *next_free(struct worker_state *ws, uint64_t now);
+static void arm_timer(struct worker_state *ws, uint64_t at);
+static int choose_op(struct worker_state *ws);
+static void add_created(struct connection *c, int id);
+static int take_created(struct worker_state *ws, struct connection *c, int remove);
+static int counted(struct worker_state *ws, uint64_t due);
+static void run(struct worker_state *ws);
+
+void *load_worker_run(void *data){
+    struct load_worker *worker = (struct load_worker*)data;
+    const struct load_options *options = worker->options;
+    struct worker_state ws = {0};
+    struct epoll_event timer_event = {0};
+
+    ws.worker = worker;
+    ws.options = options;
+    ws.stats = &worker->stats;
+    ws.count = worker->connection_count;
+    ws.seed = (unsigned int)load_now() ^ (unsigned int)worker->id;
+    for(int i = 0; i < LOAD_OP_COUNT; i++)
+        ws.mix_total += options->mix[i];
+
+    ws.connections = calloc(ws.count, sizeof(struct connection));
+    ws.dirty = calloc(2 * ws.count, sizeof(struct connection*));
+    ws.epollfd = epoll_create1(0);
+    ws.timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    timer_event.events = EPOLLIN;
+    timer_event.data.ptr = NULL;
+    if(ws.connections == NULL || ws.dirty == NULL || ws.epollfd < 0 || ws.timerfd < 0
+       || epoll_ctl(ws.epollfd, EPOLL_CTL_ADD, ws.timerfd, &timer_event) < 0 || resolve(&ws) != 0){
+        fprintf(stderr, "WORKER_%d: Could not start\n", worker->id);
+        atomic_store(worker->failed, 1);
+    }
+
+    for(int i = 0; ws.connections != NULL && i < ws.count; i++){
+        struct connection *c = &ws.connections[i];
+        c->worker = &ws;
+        c->socketfd = -1;
+        c->user = &options->users[(worker->first_connection + i) % options->user_count];
+    }
+
+    // Every connection logs in before the load starts, handshake mode connects as part of it
+    if(!atomic_load(worker->failed) && !options->handshakes){
+        ws.logging_in = ws.count;
+        for(int i = 0; i < ws.count; i++)
+            start_connection(&ws, &ws.connections[i], 0);
+
+        struct epoll_event events[EVENTS_PER_WAIT];
+        uint64_t deadline = load_now() + LOGIN_TIMEOUT;
+        while(ws.logging_in > 0 && !atomic_load(worker->failed)){
+            if(load_now() >= deadline){
+                fprintf(stderr, "WORKER_%d: %d connections did not log in\n", worker->id, ws.logging_in);
+                atomic_store(worker->failed, 1);
+                break;
+            }
+            int n = epoll_wait(ws.epollfd, events, EVENTS_PER_WAIT, 100);
+            for(int i = 0; i < n; i++)
+                if(events[i].data.ptr != NULL)
+                    drive(&ws, (struct connection*)events[i].data.ptr);
+        }
+    }
+
+    pthread_barrier_wait(worker->start);
+    if(!atomic_load(worker->failed))
+        run(&ws);
+
+    for(int i = 0; ws.connections != NULL && i < ws.count; i++){
+        close_connection(&ws.connections[i]);
+        free(ws.connections[i].output);
+        free(ws.connections[i].created);
+    }
+    free(ws.connections);
+    free(ws.dirty);
+    if(ws.timerfd >= 0)
+        close(ws.timerfd);
+    if(ws.epollfd >= 0)
+        close(ws.epollfd);
+    return NULL;
+}
+
+/**
+ * Runs the load from now until the warmup and the duration are over, then
+ * waits a little for the answers still missing.
+ * @param ws
+ */
+static void run(struct worker_state *ws){
+    const struct load_options *options = ws->options;
+    struct epoll_event events[EVENTS_PER_WAIT];
+    uint64_t started = load_now();
+    uint64_t drain_end = 0;
+
+    ws->measure_from = started + (uint64_t)(options->warmup * 1e9);
+    ws->end = ws->measure_from + (uint64_t)(options->duration * 1e9);
+    if(options->rate > 0){
+        ws->interval = (uint64_t)(1e9 * options->threads / options->rate);
+        if(ws->interval == 0)
+            ws->interval = 1;
+        // Workers take turns rather than all sending at once
+        ws->next_due = started + ws->interval * ws->worker->id / options->threads;
+    }
+
+    // Closed loop starts every connection right away, open loop waits for the first request due
+    uint64_t now = load_now();
+    if(ws->interval == 0){
+        for(int i = 0; i < ws->count; i++){
+            if(options->handshakes)
+                start_connection(ws, &ws->connections[i], now);
+            else
+                fill_pipeline(ws, &ws->connections[i], now);
+        }
+    }
+
+    while(1){
+        now = load_now();
+        if(now >= ws->end){
+            if(drain_end == 0)
+                drain_end = now + DRAIN_TIMEOUT;
+            if(ws->outstanding <= 0 || now >= drain_end)
+                break;
+        }
+
+        if(drain_end == 0)
+            issue_due(ws, now);
+
+        // Connections marked while these are handled wait for the next round
+        int dirty = ws->dirty_count;
+        for(int i = 0; i < dirty; i++){
+            struct connection *c = ws->dirty[i];
+            c->dirty = 0;
+            if(c->state == CONN_IDLE && drain_end == 0){
+                // Open loop handshakes wait for their turn instead, see issue_due()
+                if(now < c->retry_at)
+                    mark_dirty(ws, c);
+                else if(!ws->options->handshakes || ws->interval == 0)
+                    start_connection(ws, c, now);
+            } else if(c->state != CONN_IDLE && c->state != CONN_FAILED && flush_output(ws, c) != 0){
+                fail_connection(ws, c);
+            }
+        }
+        memmove(ws->dirty, ws->dirty + dirty, (ws->dirty_count - dirty) * sizeof(struct connection*));
+        ws->dirty_count -= dirty;
+
+        // The timer takes care of the next request due, this only has to catch the end of the run and retries
+        uint64_t until = drain_end != 0 ? drain_end : ws->end;
+        for(int i = 0; i < ws->dirty_count; i++){
+            uint64_t at = ws->dirty[i]->state == CONN_IDLE ? ws->dirty[i]->retry_at : now;
+            if(at < until)
+                until = at;
+        }
+        int timeout = until > now ? (int)((until - now + 999999) / 1000000) : 0;
+        int n = epoll_wait(ws->epollfd, events, EVENTS_PER_WAIT, timeout);
+        for(int i = 0; i < n; i++){
+            if(events[i].data.ptr == NULL){
+                uint64_t expirations;
+                if(read(ws->timerfd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+                    perror("WORKER: Timer");
+                ws->armed = 0;
+                continue;
+            }
+            drive(ws, (struct connection*)events[i].data.ptr);
+        }
+    }
+
+    // Whatever is still due was never sent, whatever is in flight was never answered
+    if(ws->interval > 0 && ws->next_due < ws->end){
+        uint64_t from = ws->next_due > ws->measure_from ? ws->next_due : ws->measure_from;
+        ws->stats->behind += (ws->end - from) / ws->interval;
+    }
+    if(ws->outstanding > 0)
+        ws->stats->unanswered += (uint64_t)ws->outstanding;
+}
+
+/**
+ * Looks the server up.
+ * @param ws
+ * @return 0 on success, -1 on error
+ */
+static int resolve(struct worker_state *ws){
+    struct addrinfo hints = {0};
+    struct addrinfo *result;
+    char port[16];
+
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(port, sizeof(port), "%d", ws->options->port);
+    int r = getaddrinfo(ws->options->server, port, &hints, &result);
+    if(r != 0){
+        fprintf(stderr, "WORKER_%d: Could not resolve %s: %s\n", ws->worker->id, ws->options->server, gai_strerror(r));
+        return -1;
+    }
+
+    memcpy(&ws->address, result->ai_addr, result->ai_addrlen);
+    ws->address_length = result->ai_addrlen;
+    freeaddrinfo(result);
+    return 0;
+}
+
+/**
+ * Opens a connection and starts its handshake.
+ * @param ws
+ * @param c
+ * @param due When it was due, in handshake mode
+ */
+static void start_connection(struct worker_state *ws, struct connection *c, uint64_t due){
+    int nodelay = 1;
+    struct epoll_event event = {0};
+
+    c->due = due;
+    c->counted = ws->options->handshakes && counted(ws, due);
+    if(c->counted)
+        ws->outstanding++;
+    c->connect_started = load_now();
+    c->input_length = 0;
+    c->skip = 0;
+    c->output_length = 0;
+    c->inflight = 0;
+    c->state = CONN_HANDSHAKE;
+
+    c->socketfd = socket(ws->address.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if(c->socketfd < 0){
+        fail_connection(ws, c);
+        return;
+    }
+    // Requests are small and pipelined, they must not wait for an ACK
+    setsockopt(c->socketfd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    if(connect(c->socketfd, (struct sockaddr*)&ws->address, ws->address_length) < 0 && errno != EINPROGRESS){
+        fail_connection(ws, c);
+        return;
+    }
+
+    c->ssl = SSL_new(ws->options->ssl_ctx);
+    if(c->ssl == NULL || SSL_set_fd(c->ssl, c->socketfd) != 1){
+        fail_connection(ws, c);
+        return;
+    }
+    if(ws->options->resume_sessions)
+        tls_resume_session(c->ssl);
+
+    // Edge triggered, so every step runs until OpenSSL wants to wait
+    event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    event.data.ptr = c;
+    if(epoll_ctl(ws->epollfd, EPOLL_CTL_ADD, c->socketfd, &event) < 0){
+        fail_connection(ws, c);
+        return;
+    }
+
+    drive(ws, c);
+}
+
+/**
+ * Moves a connection along after its socket became ready: the handshake,
+ * then whatever can be read and written.
+ * @param ws
+ * @param c
+ */
+static void drive(struct worker_state *ws, struct connection *c){
+    if(c->state == CONN_HANDSHAKE){
+        int r = SSL_connect(c->ssl);
+        if(r != 1){
+            int error = SSL_get_error(c->ssl, r);
+            if(error != SSL_ERROR_WANT_READ && error != SSL_ERROR_WANT_WRITE)
+                fail_connection(ws, c);
+            return;
+        }
+
+        if(!ws->options->handshakes || c->counted){
+            histogram_record(&ws->stats->handshake, (load_now() - c->connect_started) / 1000);
+            if(SSL_session_reused(c->ssl))
+                ws->stats->resumed++;
+        }
+        c->state = CONN_LOGIN;
+        if(send_login(c) != 0){
+            fail_connection(ws, c);
+            return;
+        }
+    }
+
+    if(c->state == CONN_IDLE || c->state == CONN_FAILED)
+        return;
+    if(read_input(ws, c) != 0 || (c->state != CONN_IDLE && c->state != CONN_FAILED && flush_output(ws, c) != 0))
+        fail_connection(ws, c);
+}
+
+/**
+ * Hangs up a connection, if it is open.
+ * @param c
+ */
+static void close_connection(struct connection *c){
+    if(c->ssl != NULL){
+        // A session that wasn't shut down is dropped by OpenSSL, and couldn't be resumed
+        if(c->state == CONN_READY || c->state == CONN_LOGIN)
+            SSL_shutdown(c->ssl);
+        SSL_free(c->ssl);
+        c->ssl = NULL;
+    }
+    if(c->socketfd >= 0){
+        close(c->socketfd);
+        c->socketfd = -1;
+    }
+}
+
+/**
+ * Gives up on a connection that failed or was dropped. A connection that was
+ * logged in connects again, in handshake mode it waits for its next turn.
+ * Either happens from the main loop, never under the caller.
+ * @param ws
+ * @param c
+ */
+static void fail_connection(struct worker_state *ws, struct connection *c){
+    int previous = c->state;
+    unsigned long error = ERR_get_error();
+
+    if(error != 0 && ws->stats->errors == 0)
+        fprintf(stderr, "WORKER_%d: %s\n", ws->worker->id, ERR_error_string(error, NULL));
+    ERR_clear_error();
+
+    ws->stats->errors++;
+    for(int i = 0; i < c->inflight; i++){
+        if(c->requests[i].counted){
+            ws->stats->lost++;
+            ws->outstanding--;
+        }
+    }
+    if(ws->options->handshakes && c->counted && previous != CONN_IDLE){
+        ws->stats->lost++;
+        ws->outstanding--;
+    }
+    c->inflight = 0;
+    c->state = CONN_FAILED;
+    close_connection(c);
+
+    // The first attempt is right away, one that failed to connect waits before the next
+    c->retry_at = previous == CONN_READY ? 0 : load_now() + RECONNECT_DELAY;
+    if(ws->options->handshakes){
+        c->state = CONN_IDLE;
+        c->counted = 0;
+        mark_dirty(ws, c);
+    } else if((previous == CONN_READY || c->dropped) && ws->end != 0){
+        c->state = CONN_IDLE;
+        c->dropped = 1;
+        mark_dirty(ws, c);
+    } else if(ws->end == 0){
+        // Still logging in, the run can't go on without every connection
+        ws->logging_in--;
+        atomic_store(ws->worker->failed, 1);
+    }
+}
+
+/**
+ * Reads until OpenSSL runs out of input, handling every frame that came in.
+ * @param ws
+ * @param c
+ * @return 0 on success, -1 if the connection failed or was closed
+ */
+static int read_input(struct worker_state *ws, struct connection *c){
+    while(c->state != CONN_IDLE && c->state != CONN_FAILED){
+        int r = SSL_read(c->ssl, c->input + c->input_length, (int)(INPUT_SIZE - c->input_length));
+        if(r <= 0){
+            int error = SSL_get_error(c->ssl, r);
+            if(error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE)
+                return 0;
+            return -1;
+        }
+
+        ws->stats->bytes_in += r;
+        c->input_length += r;
+        if(process_input(ws, c) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+/**
+ * Hands every complete frame header, with the start of its payload, to
+ * handle_frame(), and drops the rest of the payload.
+ * @param ws
+ * @param c
+ * @return 0 on success, -1 on a protocol error
+ */
+static int process_input(struct worker_state *ws, struct connection *c){
+    size_t used = 0;
+
+    while(used < c->input_length && c->state != CONN_IDLE && c->state != CONN_FAILED){
+        size_t available = c->input_length - used;
+
+        if(c->skip > 0){
+            size_t skipped = available < c->skip ? available : c->skip;
+            c->skip -= skipped;
+            used += skipped;
+            continue;
+        }
+
+        int header_length = unpack_frame_header(c->input + used, available, &c->frame);
+        if(header_length < 0){
+            fprintf(stderr, "WORKER_%d: Invalid frame from server\n", ws->worker->id);
+            return -1;
+        }
+        size_t kept = c->frame.length < RESPONSE_PREFIX ? c->frame.length : RESPONSE_PREFIX;
+        if(header_length == 0 || available < (size_t)header_length + kept)
+            break;
+
+        char payload[RESPONSE_PREFIX + 1];
+        memcpy(payload, c->input + used + header_length, kept);
+        payload[kept] = '\0';
+        used += header_length + kept;
+        c->skip = c->frame.length - kept;
+
+        FrameHeader header = c->frame;
+        if(handle_frame(ws, c, &header, payload, kept) != 0)
+            return -1;
+    }
+
+    // Nothing is left to keep of a connection that was just hung up
+    if(c->state == CONN_IDLE || c->state == CONN_FAILED)
+        return 0;
+    memmove(c->input, c->input + used, c->input_length - used);
+    c->input_length -= used;
+    return 0;
+}
+
+/**
+ * Handles the first bytes of a frame.
+ * @param ws
+ * @param c
+ * @param header
+ * @param payload At most RESPONSE_PREFIX bytes, NUL terminated
+ * @param length
+ * @return 0 on success, -1 if the connection has to be dropped
+ */
+static int handle_frame(struct worker_state *ws, struct connection *c, const FrameHeader *header,
+                        const char *payload, size_t length){
+    // Nothing here asks for events, but they would be harmless
+    if(header->flags & FRAME_FLAG_EVENT)
+        return 0;
+
+    if(c->state == CONN_LOGIN)
+        return handle_login(ws, c, header, payload);
+
+    handle_response(ws, c, header, payload, length);
+    return 0;
+}
+
+/**
+ * Handles the answer to a login. In handshake mode that is the end of the
+ * connection.
+ * @param ws
+ * @param c
+ * @param header
+ * @param payload
+ * @return 0 on success, -1 if the login failed
+ */
+static int handle_login(struct worker_state *ws, struct connection *c, const FrameHeader *header, const char *payload){
+    const struct load_options *options = ws->options;
+    uint64_t now = load_now();
+
+    if(strncmp(payload, "SUCCESS\n", 8) != 0){
+        fprintf(stderr, "WORKER_%d: %s could not log in\n", ws->worker->id, c->user->name);
+        ws->stats->login_failures++;
+        if(!options->handshakes)
+            atomic_store(ws->worker->failed, 1);
+        return -1;
+    }
+    if(header->version < 2){
+        fprintf(stderr, "WORKER_%d: Server only speaks protocol version %d\n", ws->worker->id, header->version);
+        atomic_store(ws->worker->failed, 1);
+        return -1;
+    }
+
+    c->version = header->version;
+    if(c->token[0] == '\0')
+        snprintf(c->token, sizeof(c->token), "%s", payload + 8);
+    if(!options->handshakes || c->counted)
+        histogram_record(&ws->stats->login, (now - c->login_started) / 1000);
+
+    if(!options->handshakes){
+        c->state = CONN_READY;
+        c->dropped = 0;
+        // Connected again after being dropped
+        if(ws->end != 0 && ws->interval == 0 && now < ws->end)
+            fill_pipeline(ws, c, now);
+        else if(ws->end == 0)
+            ws->logging_in--;
+        return 0;
+    }
+
+    // A whole connection was the request
+    if(now >= ws->measure_from && now < ws->end)
+        ws->stats->completed++;
+    if(c->counted){
+        histogram_record(&ws->stats->connect, (now - c->due) / 1000);
+        ws->outstanding--;
+    }
+    close_connection(c);
+    c->state = CONN_IDLE;
+    c->counted = 0;
+    if(ws->interval == 0 && now < ws->end)
+        mark_dirty(ws, c);
+    return 0;
+}
+
+/**
+ * Handles a frame of the response to a request. The first frame says whether
+ * it succeeded, the last one that it is complete.
+ * @param ws
+ * @param c
+ * @param header
+ * @param payload
+ * @param length
+ */
+static void handle_response(struct worker_state *ws, struct connection *c, const FrameHeader *header,
+                            const char *payload, size_t length){
+    int i;
+    for(i = 0; i < c->inflight; i++)
+        if(c->requests[i].request_id == header->request_id)
+            break;
+    if(i == c->inflight)
+        return;
+
+    struct request *request = &c->requests[i];
+    if(!request->answered){
+        request->answered = 1;
+        request->failed = strncmp(payload, "SUCCESS", 7) != 0;
+        if(request->op == LOAD_OP_PUT && !request->failed && length > 8)
+            add_created(c, atoi(payload + 8));
+    }
+    if(header->flags & FRAME_FLAG_MORE)
+        return;
+
+    uint64_t now = load_now();
+    if(now >= ws->measure_from && now < ws->end)
+        ws->stats->completed++;
+    if(request->counted){
+        histogram_record(&ws->stats->latency[request->op], (now - request->due) / 1000);
+        if(request->failed)
+            ws->stats->failures[request->op]++;
+        ws->outstanding--;
+    }
+    c->requests[i] = c->requests[--c->inflight];
+
+    if(ws->interval == 0 && now < ws->end)
+        fill_pipeline(ws, c, now);
+}
+
+/**
+ * Queues the login of a connection that just finished its handshake.
+ * @param c
+ * @return 0 on success, -1 on error
+ */
+static int send_login(struct connection *c){
+    const struct load_options *options = c->worker->options;
+    char login[3 * BUFFER_SIZE];
+    int length;
+
+    // Offer the newest version, the answer carries the one the server picked
+    c->version = PROTOCOL_VERSION;
+    if(options->login == LOGIN_RESUME && c->token[0] != '\0')
+        length = snprintf(login, sizeof(login), "RESUME %s %s", c->user->name, c->token);
+    else
+        length = snprintf(login, sizeof(login), "AUTH %s %s", c->user->name, c->user->password);
+
+    c->login_started = load_now();
+    if(length < 0 || (size_t)length >= sizeof(login))
+        return -1;
+    return queue_frame(c, login, (size_t)length, 0);
+}
+
+/**
+ * Queues a request of the mix on a connection.
+ * @param ws
+ * @param c
+ * @param due When it was due, or the time it is sent in closed loop
+ */
+static void send_request(struct worker_state *ws, struct connection *c, uint64_t due){
+    const struct load_options *options = ws->options;
+    char *payload = NULL;
+    char *serialized = NULL;
+    int length = -1;
+    int op = choose_op(ws);
+    Item item = {0};
+
+    // Only items this connection created are changed, so connections never race on one
+    if((op == LOAD_OP_MOD || op == LOAD_OP_DEL) && c->created_count == 0)
+        op = LOAD_OP_PUT;
+
+    switch(op){
+        case LOAD_OP_GET_ALL:
+            length = asprintf(&payload, "GET ALL");
+            break;
+        case LOAD_OP_GET:
+            if(options->item_count > 0)
+                item.id = options->items[rand_r(&ws->seed) % options->item_count];
+            else
+                item.id = c->created_count > 0 ? take_created(ws, c, 0) : 1;
+            length = asprintf(&payload, "GET %d", item.id);
+            break;
+        case LOAD_OP_PUT:
+        case LOAD_OP_MOD:
+            item.id = op == LOAD_OP_PUT ? -1 : take_created(ws, c, 0);
+            snprintf(item.name, sizeof(item.name), "loadgen %d", rand_r(&ws->seed));
+            snprintf(item.description, sizeof(item.description), "Created by loadgen");
+            item.armor = rand_r(&ws->seed) % 100;
+            item.health = rand_r(&ws->seed) % 100;
+            item.mana = rand_r(&ws->seed) % 100;
+            item.sellPrice = rand_r(&ws->seed) % 1000;
+            item.damage = rand_r(&ws->seed) % 100;
+            item.critChance = (rand_r(&ws->seed) % 100) / 100.0;
+            item.range = rand_r(&ws->seed) % 10;
+            serialized = serialize_item(&item, serialized);
+            if(serialized != NULL)
+                length = asprintf(&payload, "%s %s", op == LOAD_OP_PUT ? "PUT" : "MOD", serialized);
+            free(serialized);
+            break;
+        case LOAD_OP_DEL:
+            length = asprintf(&payload, "DEL %d", take_created(ws, c, 1));
+            break;
+    }
+    if(length < 0)
+        return;
+
+    if(++c->next_request_id == 0)
+        c->next_request_id = 1;
+    struct request *request = &c->requests[c->inflight++];
+    request->request_id = c->next_request_id;
+    request->op = op;
+    request->due = due;
+    request->counted = counted(ws, due);
+    request->failed = 0;
+    request->answered = 0;
+    if(request->counted)
+        ws->outstanding++;
+
+    if(queue_frame(c, payload, (size_t)length, request->request_id) != 0)
+        fail_connection(ws, c);
+    else
+        mark_dirty(ws, c);
+    free(payload);
+}
+
+/**
+ * Appends a frame to the output of a connection.
+ * @param c
+ * @param payload
+ * @param length
+ * @param request_id
+ * @return 0 on success, -1 if out of memory
+ */
+static int queue_frame(struct connection *c, const char *payload, size_t length, uint32_t request_id){
+    size_t needed = c->output_length + FRAME_HEADER_SIZE + length;
+    if(needed > c->output_size){
+        size_t size = c->output_size > 0 ? c->output_size : 4096;
+        while(size < needed)
+            size *= 2;
+        char *output = realloc(c->output, size);
+        if(output == NULL)
+            return -1;
+        c->output = output;
+        c->output_size = size;
+    }
+
+    size_t header_length = pack_frame_header((unsigned char*)c->output + c->output_length, (uint8_t)c->version, 0,
+                                             (uint32_t)length, request_id);
+    memcpy(c->output + c->output_length + header_length, payload, length);
+    c->output_length += header_length + length;
+    return 0;
+}
+
+/**
+ * Writes as much of a connection's output as the socket takes. The output
+ * may grow and move while a write is pending, the context allows both.
+ * @param ws
+ * @param c
+ * @return 0 on success, -1 on error
+ */
+static int flush_output(struct worker_state *ws, struct connection *c){
+    while(c->output_length > 0){
+        int r = SSL_write(c->ssl, c->output, (int)c->output_length);
+        if(r <= 0){
+            int error = SSL_get_error(c->ssl, r);
+            if(error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE)
+                return 0;
+            return -1;
+        }
+
+        ws->stats->bytes_out += r;
+        memmove(c->output, c->output + r, c->output_length - r);
+        c->output_length -= r;
+    }
+    return 0;
+}
+
+/**
+ * Remembers to flush a connection once every request due has been queued,
+ * so requests queued together go out together.
+ * @param ws
+ * @param c
+ */
+static void mark_dirty(struct worker_state *ws, struct connection *c){
+    if(!c->dirty){
+        c->dirty = 1;
+        ws->dirty[ws->dirty_count++] = c;
+    }
+}
+
+/**
+ * Closed loop, fills a connection's pipeline with requests.
+ * @param ws
+ * @param c
+ * @param now
+ */
+static void fill_pipeline(struct worker_state *ws, struct connection *c, uint64_t now){
+    while(c->state == CONN_READY && c->inflight < ws->options->pipeline)
+        send_request(ws, c, now);
+}
+
+/**
+ * Open loop, sends every request that is due and has a connection to go on.
+ * Requests for which there is none stay due, their latency keeps growing
+ * until one frees up.
+ * @param ws
+ * @param now
+ */
+static void issue_due(struct worker_state *ws, uint64_t now){
+    if(ws->interval == 0)
+        return;
+
+    while(ws->next_due <= now && ws->next_due < ws->end){
+        struct connection *c = next_free(ws, now);
+        if(c == NULL)
+            return;
+
+        if(ws->options->handshakes){
+            start_connection(ws, c, ws->next_due);
+        } else {
+            send_request(ws, c, ws->next_due);
+        }
+        ws->next_due += ws->interval;
+    }
+
+    if(ws->next_due < ws->end)
+        arm_timer(ws, ws->next_due);
+}
+
+/**
+ * Finds the next connection, round robin, that can take a request.
+ * @param ws
+ * @param now
+ * @return The connection, or NULL if all of them are busy
+ */
+static struct connection *next_free(struct worker_state *ws, uint64_t now){
+    for(int i = 0; i < ws->count; i++){
+        struct connection *c = &ws->connections[ws->cursor];
+        ws->cursor = (ws->cursor + 1) % ws->count;
+
+        if(ws->options->handshakes ? c->state == CONN_IDLE && now >= c->retry_at
+                                   : c->state == CONN_READY && c->inflight < ws->options->pipeline)
+            return c;
+    }
+    return NULL;
+}
+
+/**
+ * Makes the timer fire when the next request is due.
+ * @param ws
+ * @param at ns
+ */
+static void arm_timer(struct worker_state *ws, uint64_t at){
+    if(ws->armed == at)
+        return;
+
+    struct itimerspec spec = {0};
+    spec.it_value.tv_sec = (time_t)(at / 1000000000ull);
+    spec.it_value.tv_nsec = (long)(at % 1000000000ull);
+    if(timerfd_settime(ws->timerfd, TFD_TIMER_ABSTIME, &spec, NULL) == 0)
+        ws->armed = at;
+}
+
+/**
+ * Picks a request type by its weight in the mix.
+ * @param ws
+ * @return LOAD_OP_*
+ */
+static int choose_op(struct worker_state *ws){
+    unsigned int pick = (unsigned int)rand_r(&ws->seed) % ws->mix_total;
+    for(int op = 0; op < LOAD_OP_COUNT; op++){
+        if(pick < ws->options->mix[op])
+            return op;
+        pick -= ws->options->mix[op];
+    }
+    return LOAD_OP_GET;
+}
+
+/**
+ * Remembers an item this connection created.
+ * @param c
+ * @param id
+ */
+static void add_created(struct connection *c, int id){
+    if(c->created_count == c->created_size){
+        size_t size = c->created_size > 0 ? 2 * c->created_size : 64;
+        int *created = realloc(c->created, size * sizeof(int));
+        if(created == NULL)
+            return;
+        c->created = created;
+        c->created_size = size;
+    }
+    c->created[c->created_count++] = id;
+}
+
+/**
+ * Picks one of the items this connection created.
+ * @param ws
+ * @param c Must have created one
+ * @param remove Whether it is about to be deleted
+ * @return The item id
+ */
+static int take_created(struct worker_state *ws, struct connection *c, int remove){
+    size_t i = (size_t)rand_r(&ws->seed) % c->created_count;
+    int id = c->created[i];
+    if(remove)
+        c->created[i] = c->created[--c->created_count];
+    return id;
+}
+
+/**
+ * Whether a request due at a time counts towards the results.
+ * @param ws
+ * @param due
+ * @return 1 if it is due after the warmup and before the end of the run
+ */
+static int counted(struct worker_state *ws, uint64_t due){
+    return due >= ws->measure_from && due < ws->end;
+}
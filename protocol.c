@@ -0,0 +1,71 @@
+/**
+ * Documentation for the below functions is available in "protocol.h"
+ */
+#include <arpa/inet.h>
+#include <string.h>
+
+#include "protocol.h"
+
+size_t frame_header_size(int version){
+    return version >= 2 ? FRAME_HEADER_SIZE : FRAME_HEADER_SIZE_V1;
+}
+
+size_t pack_frame_header(unsigned char *buf, uint8_t version, uint16_t flags, uint32_t length, uint32_t request_id){
+    uint16_t nflags = htons(flags);
+    uint32_t nlength = htonl(length);
+
+    buf[0] = FRAME_MAGIC;
+    buf[1] = version;
+    memcpy(buf + 2, &nflags, sizeof(nflags));
+    memcpy(buf + 4, &nlength, sizeof(nlength));
+
+    if(version >= 2){
+        uint32_t nid = htonl(request_id);
+        memcpy(buf + 8, &nid, sizeof(nid));
+    }
+
+    return frame_header_size(version);
+}
+
+int unpack_frame_header(const unsigned char *buf, size_t available, FrameHeader *header){
+    uint16_t nflags;
+    uint32_t nlength;
+
+    if(available < FRAME_HEADER_SIZE_V1)
+        return 0;
+
+    header->magic = buf[0];
+    header->version = buf[1];
+    memcpy(&nflags, buf + 2, sizeof(nflags));
+    memcpy(&nlength, buf + 4, sizeof(nlength));
+    header->flags = ntohs(nflags);
+    header->length = ntohl(nlength);
+    header->request_id = 0;
+
+    if(header->magic != FRAME_MAGIC)
+        return -1;
+    if(header->version < PROTOCOL_MIN_VERSION)
+        return -1;
+    if(header->length > MAX_FRAME_SIZE)
+        return -1;
+
+    size_t size = frame_header_size(header->version);
+    if(available < size)
+        return 0;
+
+    if(header->version >= 2){
+        uint32_t nid;
+        memcpy(&nid, buf + 8, sizeof(nid));
+        header->request_id = ntohl(nid);
+    }
+
+    return (int)size;
+}
+
+int negotiate_version(int offered){
+    if(offered < PROTOCOL_MIN_VERSION)
+        return -1;
+    if(offered > PROTOCOL_VERSION)
+        return PROTOCOL_VERSION;
+    return offered;
+}
@@ -0,0 +1,97 @@
+#ifndef CS469_PROJECT_PROTOCOL_H
+#define CS469_PROJECT_PROTOCOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Wire format shared by the server and its clients.
+ *
+ * Every message is a single frame: a fixed header followed by exactly
+ * `length` bytes of payload. The payload is the same text used before
+ * framing (AUTH, GET, PUT, ... and their responses), it just no longer
+ * has to fit in one BUFFER_SIZE read.
+ *
+ *   byte 0      FRAME_MAGIC
+ *   byte 1      protocol version
+ *   bytes 2-3   flags, network byte order
+ *   bytes 4-7   payload length, network byte order
+ *   bytes 8-11  request id, network byte order (version 2 and up)
+ *
+ * The version is negotiated by the AUTH frame: the client sends the highest
+ * version it speaks, and the server answers with the version both sides will
+ * use for the rest of the connection.
+ *
+ * Version 2 tags every request with an id chosen by the client, and the
+ * response carries the same id. A version 2 client may have many requests in
+ * flight on one connection and must match responses by id, as they are not
+ * guaranteed to come back in order. Version 1 connections are served one
+ * request at a time.
+ *
+ * A version 2 response may also be split over several frames with the same
+ * request id. Every frame but the last has FRAME_FLAG_MORE set, and the
+ * payloads concatenate to the complete response. This lets the server stream
+ * large responses, such as GET ALL, without building them in memory first.
+ *
+ * After a WATCH request, a version 2 server also pushes frames the client
+ * didn't ask for, with the changes each committed write made (see
+ * inventoryserver/feed.h). They have FRAME_FLAG_EVENT set and carry the id
+ * of the WATCH request.
+ */
+#define FRAME_MAGIC          0x1c   // ASCII file separator, sits above GROUP/RECORD/UNIT
+#define PROTOCOL_VERSION     2
+#define PROTOCOL_MIN_VERSION 1
+#define FRAME_HEADER_SIZE_V1 8
+#define FRAME_HEADER_SIZE    12     // Largest header of any supported version
+#define MAX_FRAME_SIZE       (64 * 1024 * 1024)
+
+#define FRAME_FLAG_MORE      0x0001 // More frames of the same response follow, version 2 and up
+#define FRAME_FLAG_EVENT     0x0002 // Pushed to a watching client rather than answering a request
+
+typedef struct {
+    uint8_t magic;
+    uint8_t version;
+    uint16_t flags;
+    uint32_t length;
+    uint32_t request_id;
+} FrameHeader;
+
+/**
+ * Size of a frame header for the given protocol version.
+ *
+ * @param version
+ * @return header length in bytes
+ */
+size_t frame_header_size(int version);
+
+/**
+ * Writes a frame header for a payload of the given length.
+ *
+ * @param buf At least FRAME_HEADER_SIZE bytes
+ * @param version Protocol version of the frame
+ * @param flags Frame flags
+ * @param length Payload length
+ * @param request_id Correlation id, ignored by version 1
+ * @return Number of header bytes written
+ */
+size_t pack_frame_header(unsigned char *buf, uint8_t version, uint16_t flags, uint32_t length, uint32_t request_id);
+
+/**
+ * Parses and validates a frame header.
+ *
+ * @param buf Bytes read from the wire
+ * @param available Number of bytes in buf
+ * @param header Filled in with the decoded fields
+ * @return The header length, 0 if more bytes are needed, or -1 if the bytes are not a valid frame header
+ */
+int unpack_frame_header(const unsigned char *buf, size_t available, FrameHeader *header);
+
+/**
+ * Picks the version to use with a peer that offered `offered`.
+ *
+ * @param offered Highest version the peer speaks
+ * @return The negotiated version, or -1 if there is none in common
+ */
+int negotiate_version(int offered);
+
+#endif //CS469_PROJECT_PROTOCOL_H
@@ -0,0 +1,128 @@
+//
+// Session resumption and algorithm settings for every TLS context, see
+// tls.h. A client context keeps its latest session in the context's
+// ex_data, where the new session callback puts it as soon as the server's
+// ticket arrives.
+//
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <openssl/err.h>
+
+#include "tls.h"
+
+static pthread_once_t session_index_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t session_lock = PTHREAD_MUTEX_INITIALIZER;
+static int session_index = -1;
+
+static void create_session_index();
+static void free_session(void *parent, void *ptr, CRYPTO_EX_DATA *ad, int idx, long argl, void *argp);
+static int remember_session(SSL *ssl, SSL_SESSION *session);
+
+int tls_parse_option(struct tls_options *options, const char *field, const char *value){
+    const char **option;
+    if(strcmp(field, "TLS_CIPHERS") == 0)
+        option = &options->ciphers;
+    else if(strcmp(field, "TLS_CIPHERSUITES") == 0)
+        option = &options->ciphersuites;
+    else if(strcmp(field, "TLS_GROUPS") == 0)
+        option = &options->groups;
+    else
+        return 0;
+
+    *option = strdup(value);
+    return 1;
+}
+
+int tls_configure(SSL_CTX *ctx, const struct tls_options *options){
+    int r = 0;
+
+    if(SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION) != 1)
+        r = -1;
+    if(options == NULL)
+        return r;
+
+    if(options->ciphers != NULL && SSL_CTX_set_cipher_list(ctx, options->ciphers) != 1){
+        fprintf(stderr, "TLS: Invalid cipher list %s\n", options->ciphers);
+        r = -1;
+    }
+#ifdef TLS1_3_VERSION
+    if(options->ciphersuites != NULL && SSL_CTX_set_ciphersuites(ctx, options->ciphersuites) != 1){
+        fprintf(stderr, "TLS: Invalid TLS 1.3 ciphersuites %s\n", options->ciphersuites);
+        r = -1;
+    }
+#endif
+    if(options->groups != NULL && SSL_CTX_set1_groups_list(ctx, options->groups) != 1){
+        fprintf(stderr, "TLS: Invalid groups %s\n", options->groups);
+        r = -1;
+    }
+
+    if(r != 0)
+        ERR_print_errors_fp(stderr);
+    return r;
+}
+
+void tls_enable_server_sessions(SSL_CTX *ctx, const char *name){
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_set_session_id_context(ctx, (const unsigned char*)name, (unsigned int)strlen(name));
+    SSL_CTX_sess_set_cache_size(ctx, TLS_SESSION_CACHE_SIZE);
+    SSL_CTX_set_timeout(ctx, TLS_SESSION_TIMEOUT);
+#ifdef TLS1_3_VERSION
+    SSL_CTX_set_num_tickets(ctx, TLS_SESSION_TICKETS);
+#endif
+}
+
+int tls_enable_client_sessions(SSL_CTX *ctx){
+    pthread_once(&session_index_once, create_session_index);
+    if(session_index < 0)
+        return -1;
+
+    // The internal cache is keyed by session id only, the callback keeps the one session needed
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(ctx, remember_session);
+    return 0;
+}
+
+void tls_resume_session(SSL *ssl){
+    if(session_index < 0)
+        return;
+
+    pthread_mutex_lock(&session_lock);
+    SSL_SESSION *session = (SSL_SESSION*)SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), session_index);
+    if(session != NULL)
+        SSL_set_session(ssl, session);
+    pthread_mutex_unlock(&session_lock);
+}
+
+static void create_session_index(){
+    session_index = SSL_CTX_get_ex_new_index(0, NULL, NULL, NULL, free_session);
+}
+
+/**
+ * Releases the session kept by a context as the context is freed.
+ */
+static void free_session(void *parent, void *ptr, CRYPTO_EX_DATA *ad, int idx, long argl, void *argp){
+    SSL_SESSION_free((SSL_SESSION*)ptr);
+}
+
+/**
+ * New session callback. Keeps the session for the next connection, in place
+ * of the previous one.
+ * @return 1, the reference to the session is kept
+ */
+static int remember_session(SSL *ssl, SSL_SESSION *session){
+    if(!SSL_SESSION_is_resumable(session))
+        return 0;
+
+    SSL_CTX *ctx = SSL_get_SSL_CTX(ssl);
+    pthread_mutex_lock(&session_lock);
+    SSL_SESSION *previous = (SSL_SESSION*)SSL_CTX_get_ex_data(ctx, session_index);
+    SSL_CTX_set_ex_data(ctx, session_index, session);
+    pthread_mutex_unlock(&session_lock);
+
+    SSL_SESSION_free(previous);
+    return 1;
+}
@@ -0,0 +1,80 @@
+#ifndef CS469_PROJECT_TLS_H
+#define CS469_PROJECT_TLS_H
+
+#include <openssl/ssl.h>
+
+/**
+ * TLS settings shared by the server, the client and the datastore.
+ *
+ * A full handshake costs the server an RSA signature, which dominates the
+ * cost of a login. A client that connected before presents its session
+ * ticket instead and resumes without it. Servers remember sessions for
+ * TLS_SESSION_TIMEOUT, both as tickets and in their session cache for
+ * clients that can't use tickets, and clients keep the last session they
+ * were given for the next connection to the same server.
+ *
+ * Tickets are encrypted with keys generated when the server starts, so
+ * sessions don't survive a restart, clients then fall back to a full handshake.
+ */
+
+#define TLS_SESSION_CACHE_SIZE (20 * 1024)    // Sessions remembered by a server, about 1 KB each
+#define TLS_SESSION_TIMEOUT    (2 * 60 * 60)  // Seconds a session can be resumed for
+#define TLS_SESSION_TICKETS    1              // Tickets sent after a TLS 1.3 handshake, OpenSSL sends 2
+
+/**
+ * Algorithm choices, from the TLS_CIPHERS, TLS_CIPHERSUITES and TLS_GROUPS
+ * config file fields. NULL keeps OpenSSL's defaults.
+ */
+struct tls_options {
+    const char *ciphers;        // TLS 1.2 cipher list, such as ECDHE-RSA-AES128-GCM-SHA256
+    const char *ciphersuites;   // TLS 1.3 ciphersuites, such as TLS_AES_128_GCM_SHA256
+    const char *groups;         // Key exchange groups (curves) by preference, such as X25519:P-256
+};
+
+/**
+ * Reads a config file field into options if it is one of the TLS fields.
+ *
+ * @param options
+ * @param field
+ * @param value Copied
+ * @return 1 if the field was a TLS field, 0 otherwise
+ */
+int tls_parse_option(struct tls_options *options, const char *field, const char *value);
+
+/**
+ * Refuses anything older than TLS 1.2 and applies the algorithm choices.
+ *
+ * @param ctx
+ * @param options Algorithm choices, or NULL for the defaults
+ * @return 0 on success, -1 if OpenSSL rejected one of the choices
+ */
+int tls_configure(SSL_CTX *ctx, const struct tls_options *options);
+
+/**
+ * Lets clients of a server context resume their sessions, with a ticket or
+ * from the session cache.
+ *
+ * @param ctx
+ * @param name Identifies the server, sessions are only resumed by the server that issued them
+ */
+void tls_enable_server_sessions(SSL_CTX *ctx, const char *name);
+
+/**
+ * Makes a client context keep the latest session it was given, for
+ * tls_resume_session(). Meant for contexts that connect to a single server,
+ * the session of any other would be wasted.
+ *
+ * @param ctx
+ * @return 0 on success, -1 on error
+ */
+int tls_enable_client_sessions(SSL_CTX *ctx);
+
+/**
+ * Offers the session kept by the context of ssl, if there is one, before
+ * SSL_connect(). Whether it was accepted shows in SSL_session_reused().
+ *
+ * @param ssl
+ */
+void tls_resume_session(SSL *ssl);
+
+#endif //CS469_PROJECT_TLS_H